@@ -187,6 +187,63 @@ typedef struct _IMAGE_NT_HEADERS32
     IMAGE_OPTIONAL_HEADER32 OptionalHeader;
 } IMAGE_NT_HEADERS32;
 
+typedef struct _IMAGE_EXPORT_DIRECTORY
+{
+    uint32_t Characteristics;
+    uint32_t TimeDateStamp;
+    uint16_t MajorVersion;
+    uint16_t MinorVersion;
+    /** RVA to the name of the dll */
+    uint32_t Name;
+    /** Ordinal of the first entry of the export address table */
+    uint32_t Base;
+    uint32_t NumberOfFunctions;
+    uint32_t NumberOfNames;
+    /** RVA to the export address table, uint32_t[NumberOfFunctions] */
+    uint32_t AddressOfFunctions;
+    /** RVA to the name pointer table, uint32_t[NumberOfNames] sorted by name */
+    uint32_t AddressOfNames;
+    /** RVA to the export address table indexes of the names, uint16_t[NumberOfNames] */
+    uint32_t AddressOfNameOrdinals;
+} IMAGE_EXPORT_DIRECTORY;
+
+/** Attributes bit of IMAGE_DELAYLOAD_DESCRIPTOR, set if its addresses are RVAs instead of virtual addresses */
+#define IMAGE_DELAYLOAD_RVA_BASED 0x1
+
+typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR
+{
+    uint32_t Attributes;
+    /** RVA to the name of the dll, a virtual address unless IMAGE_DELAYLOAD_RVA_BASED is set */
+    uint32_t DllNameRVA;
+    /** RVA to the module handle */
+    uint32_t ModuleHandleRVA;
+    /** RVA to the delay load IAT */
+    uint32_t ImportAddressTableRVA;
+    /** RVA to the import name table, IMAGE_THUNK_DATA entries like OriginalFirstThunk */
+    uint32_t ImportNameTableRVA;
+    uint32_t BoundImportAddressTableRVA;
+    uint32_t UnloadInformationTableRVA;
+    /** 0 if not bound, otherwise the date/time stamp of the DLL bound to */
+    uint32_t TimeDateStamp;
+} IMAGE_DELAYLOAD_DESCRIPTOR;
+
+typedef struct _IMAGE_BOUND_IMPORT_DESCRIPTOR
+{
+    /** Date/time stamp of the DLL bound to */
+    uint32_t TimeDateStamp;
+    /** Offset of the name of the dll from the start of the bound import directory */
+    uint16_t OffsetModuleName;
+    /** Number of IMAGE_BOUND_FORWARDER_REF entries following this descriptor */
+    uint16_t NumberOfModuleForwarderRefs;
+} IMAGE_BOUND_IMPORT_DESCRIPTOR;
+
+typedef struct _IMAGE_BOUND_FORWARDER_REF
+{
+    uint32_t TimeDateStamp;
+    uint16_t OffsetModuleName;
+    uint16_t Reserved;
+} IMAGE_BOUND_FORWARDER_REF;
+
 typedef struct _IMAGE_THUNK_DATA32
 {
     union
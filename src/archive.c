@@ -0,0 +1,352 @@
+/*
+ * Iterate over the members of ZIP and tar archives without extracting them to disk.
+ *
+ * Stored ZIP members and tar members are handed out as slices of the mapped archive. Deflated ZIP members are
+ * decompressed into a buffer that is reused for all members of the archive.
+ */
+#include "archive.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inflate.h"
+#include "iso9660.h"
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE 0x06054b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE 0x06064b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGNATURE 0x07064b50
+#define ZIP64_EXTRA_FIELD_ID 0x0001
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIZE 22
+#define ZIP_MAX_COMMENT_SIZE 0xFFFF
+
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_OFFSET 345
+#define TAR_PREFIX_SIZE 155
+#define TAR_SIZE_OFFSET 124
+#define TAR_CHECKSUM_OFFSET 148
+#define TAR_TYPEFLAG_OFFSET 156
+#define TAR_MAGIC_OFFSET 257
+
+/** Archive member names are truncated to this many bytes */
+#define MAX_MEMBER_NAME 1024
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static bool isPE(const uint8_t *data, size_t size) {
+    return size >= 2 && data[0] == 'M' && data[1] == 'Z';
+}
+
+static void copyName(char *out, const uint8_t *name, size_t length) {
+    if (length >= MAX_MEMBER_NAME) length = MAX_MEMBER_NAME - 1;
+    memcpy(out, name, length);
+    out[length] = '\0';
+}
+
+/**
+ * @brief Parse an octal or base-256 number field of a tar header
+ */
+static uint64_t tarNumber(const uint8_t *field, size_t size) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        /* GNU base-256 encoding for sizes >= 8 GiB */
+        for (size_t i = 1; i < size; i++) value = (value << 8) | field[i];
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i]; i++) {
+        if (field[i] == ' ') continue;
+        if (field[i] < '0' || field[i] > '7') break;
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+static bool tarHeaderValid(const uint8_t *header) {
+    uint64_t expected = tarNumber(header + TAR_CHECKSUM_OFFSET, 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (i >= TAR_CHECKSUM_OFFSET && i < TAR_CHECKSUM_OFFSET + 8) ? ' ' : header[i];
+    }
+    return sum == expected;
+}
+
+/**
+ * @brief Detect whether a file is a ZIP or tar archive or an ISO 9660 image. Files starting with an MZ header are never treated as
+ * archives, so self-extracting archives are examined as executables.
+ */
+ARCHIVE_TYPE archiveType(PE_FILE *archive) {
+    const uint8_t *magic = pePtr(archive, 0, 4);
+    if (!magic || isPE(magic, 4)) return ARCHIVE_NONE;
+
+    uint32_t signature = le32(magic);
+    if (signature == ZIP_LOCAL_HEADER_SIGNATURE || signature == ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE) return ARCHIVE_ZIP;
+
+    const uint8_t *header = pePtr(archive, 0, TAR_BLOCK_SIZE);
+    if (header && tarHeaderValid(header)) return ARCHIVE_TAR;
+
+    if (isoDetect(archive)) return ARCHIVE_ISO9660;
+
+    return ARCHIVE_NONE;
+}
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+} MEMBER_BUFFER;
+
+static uint8_t *growBuffer(MEMBER_BUFFER *buffer, size_t size) {
+    if (size > buffer->size) {
+        uint8_t *grown = realloc(buffer->data, size);
+        if (!grown) return NULL;
+        buffer->data = grown;
+        buffer->size = size;
+    }
+    return buffer->data;
+}
+
+static int zipForEachMember(PE_FILE *archive, size_t maxMemberSize, ARCHIVE_MEMBER_CALLBACK callback, void *context) {
+    if (archive->size < ZIP_END_OF_CENTRAL_DIRECTORY_SIZE) return -1;
+
+    /* The end of central directory record is followed by a comment of up to 64 KiB */
+    size_t eocdOffset = archive->size - ZIP_END_OF_CENTRAL_DIRECTORY_SIZE;
+    size_t searchEnd = eocdOffset > ZIP_MAX_COMMENT_SIZE ? eocdOffset - ZIP_MAX_COMMENT_SIZE : 0;
+    const uint8_t *eocd = NULL;
+    for (;; eocdOffset--) {
+        const uint8_t *p = pePtr(archive, eocdOffset, ZIP_END_OF_CENTRAL_DIRECTORY_SIZE);
+        if (p && le32(p) == ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+            eocd = p;
+            break;
+        }
+        if (eocdOffset == searchEnd) break;
+    }
+    if (!eocd) return -1;
+
+    uint64_t numberOfEntries = le16(eocd + 10);
+    uint64_t centralDirectoryOffset = le32(eocd + 16);
+
+    /* ZIP64 archives store the real values in a separate record, located by the record before the EOCD */
+    if (centralDirectoryOffset == 0xFFFFFFFF || numberOfEntries == 0xFFFF) {
+        const uint8_t *locator = eocdOffset >= 20 ? pePtr(archive, eocdOffset - 20, 20) : NULL;
+        if (!locator || le32(locator) != ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGNATURE) return -1;
+        const uint8_t *eocd64 = pePtr(archive, le64(locator + 8), 56);
+        if (!eocd64 || le32(eocd64) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) return -1;
+        numberOfEntries = le64(eocd64 + 32);
+        centralDirectoryOffset = le64(eocd64 + 48);
+    }
+
+    MEMBER_BUFFER buffer = {NULL, 0};
+    char name[MAX_MEMBER_NAME];
+    uint64_t offset = centralDirectoryOffset;
+    int status = 0;
+
+    for (uint64_t i = 0; i < numberOfEntries; i++) {
+        const uint8_t *entry = pePtr(archive, offset, ZIP_CENTRAL_HEADER_SIZE);
+        if (!entry || le32(entry) != ZIP_CENTRAL_HEADER_SIGNATURE) {
+            status = -1;
+            break;
+        }
+        uint16_t flags = le16(entry + 8);
+        uint16_t method = le16(entry + 10);
+        uint64_t compressedSize = le32(entry + 20);
+        uint64_t uncompressedSize = le32(entry + 24);
+        uint16_t nameLength = le16(entry + 28);
+        uint16_t extraLength = le16(entry + 30);
+        uint16_t commentLength = le16(entry + 32);
+        uint64_t localHeaderOffset = le32(entry + 42);
+
+        const uint8_t *entryName = pePtr(archive, offset + ZIP_CENTRAL_HEADER_SIZE, nameLength);
+        const uint8_t *extra = pePtr(archive, offset + ZIP_CENTRAL_HEADER_SIZE + nameLength, extraLength);
+        offset += ZIP_CENTRAL_HEADER_SIZE + nameLength + extraLength + commentLength;
+        if (!entryName || !extra) {
+            status = -1;
+            break;
+        }
+        copyName(name, entryName, nameLength);
+
+        /* ZIP64 extra field holds the values that are 0xFFFFFFFF in the header, in this order */
+        for (const uint8_t *field = extra; field + 4 <= extra + extraLength; field += 4 + le16(field + 2)) {
+            if (le16(field) != ZIP64_EXTRA_FIELD_ID) continue;
+            const uint8_t *value = field + 4;
+            const uint8_t *end = value + le16(field + 2);
+            if (uncompressedSize == 0xFFFFFFFF && value + 8 <= end) {
+                uncompressedSize = le64(value);
+                value += 8;
+            }
+            if (compressedSize == 0xFFFFFFFF && value + 8 <= end) {
+                compressedSize = le64(value);
+                value += 8;
+            }
+            if (localHeaderOffset == 0xFFFFFFFF && value + 8 <= end) {
+                localHeaderOffset = le64(value);
+            }
+            break;
+        }
+
+        /* Directories */
+        if (nameLength && name[strlen(name) - 1] == '/') continue;
+        if (uncompressedSize < 2) continue;
+
+        if (flags & ZIP_FLAG_ENCRYPTED) {
+            fprintf(stderr, "Warning: %s: encrypted archive members are not supported\n", name);
+            continue;
+        }
+
+        const uint8_t *localHeader = pePtr(archive, localHeaderOffset, ZIP_LOCAL_HEADER_SIZE);
+        if (!localHeader || le32(localHeader) != ZIP_LOCAL_HEADER_SIGNATURE) {
+            fprintf(stderr, "Warning: %s: invalid local file header\n", name);
+            continue;
+        }
+        uint64_t dataOffset = localHeaderOffset + ZIP_LOCAL_HEADER_SIZE + le16(localHeader + 26) + le16(localHeader + 28);
+        const uint8_t *compressed = pePtr(archive, dataOffset, compressedSize);
+        if (!compressed) {
+            fprintf(stderr, "Warning: %s: member data is outside of the archive\n", name);
+            continue;
+        }
+
+        if (method == ZIP_METHOD_STORED) {
+            if (isPE(compressed, compressedSize)) callback(name, compressed, compressedSize, context);
+        } else if (method == ZIP_METHOD_DEFLATED) {
+            uint8_t magic[2];
+            size_t outLen;
+
+            /* Decompress only the first two bytes to find out if this is an executable at all */
+            if (inflateRaw(compressed, compressedSize, magic, sizeof(magic), &outLen) == INFLATE_ERROR || !isPE(magic, outLen)) continue;
+
+            /* The size comes from the central directory, a damaged one must not make us allocate gigabytes */
+            if (uncompressedSize > maxMemberSize) {
+                fprintf(stderr, "Warning: %s: member is larger than the maximum buffer size\n", name);
+                continue;
+            }
+            uint8_t *data = growBuffer(&buffer, uncompressedSize);
+            if (!data) {
+                fprintf(stderr, "Warning: %s: not enough memory to decompress member\n", name);
+                continue;
+            }
+            if (inflateRaw(compressed, compressedSize, data, uncompressedSize, &outLen) == INFLATE_ERROR) {
+                fprintf(stderr, "Warning: %s: invalid deflate data\n", name);
+                continue;
+            }
+            callback(name, data, outLen, context);
+        } else {
+            fprintf(stderr, "Warning: %s: unsupported compression method %u\n", name, method);
+        }
+    }
+
+    free(buffer.data);
+    return status;
+}
+
+/**
+ * @brief Get the value of the path record of a pax extended header
+ */
+static bool paxPath(const uint8_t *data, size_t size, char *out) {
+    size_t pos = 0;
+    while (pos < size) {
+        /* Records are "<length> <key>=<value>\n", length includes the whole record */
+        size_t length = 0, i = pos;
+        while (i < size && data[i] >= '0' && data[i] <= '9') length = length * 10 + (data[i++] - '0');
+        if (!length || pos + length > size) return false;
+        const uint8_t *record = data + i + 1;
+        const uint8_t *recordEnd = data + pos + length - 1;
+        if (recordEnd - record > 5 && memcmp(record, "path=", 5) == 0) {
+            copyName(out, record + 5, recordEnd - record - 5);
+            return true;
+        }
+        pos += length;
+    }
+    return false;
+}
+
+static int tarForEachMember(PE_FILE *archive, ARCHIVE_MEMBER_CALLBACK callback, void *context) {
+    char name[MAX_MEMBER_NAME];
+    bool haveLongName = false;
+    size_t offset = 0;
+
+    while (offset + TAR_BLOCK_SIZE <= archive->size) {
+        const uint8_t *header = pePtr(archive, offset, TAR_BLOCK_SIZE);
+        if (!header) return -1;
+
+        /* The archive ends with zero blocks */
+        if (header[0] == '\0' && tarNumber(header + TAR_CHECKSUM_OFFSET, 8) == 0) break;
+        if (!tarHeaderValid(header)) return -1;
+
+        uint64_t size = tarNumber(header + TAR_SIZE_OFFSET, 12);
+        char type = header[TAR_TYPEFLAG_OFFSET];
+        size_t dataOffset = offset + TAR_BLOCK_SIZE;
+        const uint8_t *data = pePtr(archive, dataOffset, size);
+        offset = dataOffset + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        if (!data) return -1;
+
+        if (type == 'L') {
+            /* GNU long name for the next member */
+            copyName(name, data, strnlen((const char *)data, size));
+            haveLongName = true;
+            continue;
+        }
+        if (type == 'x') {
+            haveLongName = paxPath(data, size, name);
+            continue;
+        }
+
+        if (!haveLongName) {
+            size_t prefixLength = 0;
+            if (memcmp(header + TAR_MAGIC_OFFSET, "ustar", 5) == 0) {
+                prefixLength = strnlen((const char *)header + TAR_PREFIX_OFFSET, TAR_PREFIX_SIZE);
+                copyName(name, header + TAR_PREFIX_OFFSET, prefixLength);
+                if (prefixLength) name[prefixLength++] = '/';
+            }
+            copyName(name + prefixLength, header, strnlen((const char *)header, TAR_NAME_SIZE));
+        }
+        haveLongName = false;
+
+        /* Regular files only */
+        if (type != '0' && type != '\0' && type != '7') continue;
+        if (isPE(data, size)) callback(name, data, size, context);
+    }
+    return 0;
+}
+
+/**
+ * @brief Call callback for every executable inside the archive
+ *
+ * @param archive Archive file, must be opened with peOpenFile or peOpenMemory
+ * @param type Archive type returned by archiveType
+ * @param maxMemberSize Compressed members larger than this many bytes are skipped with a warning
+ * @param callback Called for each member starting with an MZ header
+ * @param context Passed to callback
+ * @return int 0 on success, -1 if the archive is damaged or not completely available
+ */
+int archiveForEachMember(PE_FILE *archive, ARCHIVE_TYPE type, size_t maxMemberSize, ARCHIVE_MEMBER_CALLBACK callback, void *context) {
+    switch (type) {
+        case ARCHIVE_ZIP:
+            return zipForEachMember(archive, maxMemberSize, callback, context);
+        case ARCHIVE_TAR:
+            return tarForEachMember(archive, callback, context);
+        case ARCHIVE_ISO9660:
+            return isoForEachMember(archive, callback, context);
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peinput.h"
+
+typedef enum {
+    ARCHIVE_NONE,
+    ARCHIVE_ZIP,
+    ARCHIVE_TAR,
+    ARCHIVE_ISO9660
+} ARCHIVE_TYPE;
+
+/** Called for every archive member that starts with an MZ header. data is only valid until the callback returns. */
+typedef void (*ARCHIVE_MEMBER_CALLBACK)(const char *memberName, const uint8_t *data, size_t size, void *context);
+
+ARCHIVE_TYPE archiveType(PE_FILE *archive);
+int archiveForEachMember(PE_FILE *archive, ARCHIVE_TYPE type, size_t maxMemberSize, ARCHIVE_MEMBER_CALLBACK callback, void *context);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Journal of completed inputs, for --checkpoint and --resume.
+ *
+ * The journal is a header followed by fixed size records, each the hash of an input path and the size of the output
+ * once that input was written. Completed inputs are collected in memory and appended in one write per commit, after
+ * the output was flushed, followed by fdatasync. A record therefore never claims output that is not on disk, and a
+ * crash loses at most the inputs since the last commit. Torn records at the end of the journal are ignored.
+ *
+ * On resume, the hashes go into an open addressing set, and output written after the last commit is cut off, because
+ * its inputs are examined again.
+ */
+#include "checkpoint.h"
+
+#ifdef USE_CHECKPOINT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+    char magic[8];
+    uint64_t reserved;
+} CHECKPOINT_HEADER;
+
+typedef struct
+{
+    uint64_t pathHash;
+    /** Size of the output including this input */
+    uint64_t outputSize;
+} CHECKPOINT_RECORD;
+
+static int journal = -1;
+
+/** Hashes of the inputs completed before, 0 marks a free slot */
+static uint64_t *done = NULL;
+static size_t doneSize = 0;
+static size_t numberOfDone = 0;
+static uint64_t outputSize = 0;
+
+/** Inputs completed since the last commit */
+static uint64_t *pending = NULL;
+static size_t numberOfPending = 0;
+static size_t pendingCapacity = 0;
+static time_t lastCommit;
+
+/**
+ * @brief FNV-1a hash of a path, never 0
+ */
+static uint64_t hashPath(const char *path) {
+    uint64_t hash = 14695981039346656037u;
+    for (; *path; path++) hash = (hash ^ (uint8_t)*path) * 1099511628211u;
+    return hash ? hash : 1;
+}
+
+static int addDone(uint64_t hash) {
+    if ((numberOfDone + 1) * 2 > doneSize) {
+        size_t newSize = doneSize ? doneSize * 2 : 1024;
+        uint64_t *newDone = calloc(newSize, sizeof(uint64_t));
+        if (!newDone) return -1;
+        for (size_t i = 0; i < doneSize; i++) {
+            if (!done[i]) continue;
+            size_t slot = done[i] & (newSize - 1);
+            while (newDone[slot]) slot = (slot + 1) & (newSize - 1);
+            newDone[slot] = done[i];
+        }
+        free(done);
+        done = newDone;
+        doneSize = newSize;
+    }
+    size_t slot = hash & (doneSize - 1);
+    while (done[slot]) {
+        if (done[slot] == hash) return 0;
+        slot = (slot + 1) & (doneSize - 1);
+    }
+    done[slot] = hash;
+    numberOfDone++;
+    return 0;
+}
+
+/**
+ * @brief Read the completed inputs of an existing journal
+ *
+ * @return int 0 on success, -1 on error with errno set
+ */
+static int loadJournal(int fd) {
+    CHECKPOINT_HEADER header;
+    ssize_t headerSize = read(fd, &header, sizeof(header));
+    /* An empty journal was created but never committed to */
+    if (headerSize == 0) return 0;
+    if (headerSize != sizeof(header) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))) {
+        errno = EINVAL;
+        return -1;
+    }
+    CHECKPOINT_RECORD records[4096];
+    ssize_t bytes;
+    while ((bytes = read(fd, records, sizeof(records))) > 0) {
+        for (size_t i = 0; i < (size_t)bytes / sizeof(CHECKPOINT_RECORD); i++) {
+            if (addDone(records[i].pathHash)) return -1;
+            if (records[i].outputSize > outputSize) outputSize = records[i].outputSize;
+        }
+        /* A torn record can only be the last one */
+        if (bytes % sizeof(CHECKPOINT_RECORD)) break;
+    }
+    return bytes == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Open the journal. Without resume, a new journal replaces an existing one.
+ *
+ * @param path Path of the journal
+ * @param resume Load the inputs completed by an earlier run and append to the journal
+ * @return int 0 on success, -1 on error with errno set, EINVAL if the file is not a journal
+ */
+int checkpointOpen(const char *path, bool resume) {
+    journal = open(path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0666);
+    if (journal == -1) return -1;
+    if (resume && loadJournal(journal)) return -1;
+
+    /* Drop a torn record, so that appended records stay aligned */
+    off_t size = lseek(journal, 0, SEEK_END);
+    if (size == -1) return -1;
+    if (size < (off_t)sizeof(CHECKPOINT_HEADER)) {
+        CHECKPOINT_HEADER header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        if (ftruncate(journal, 0) || pwrite(journal, &header, sizeof(header), 0) != sizeof(header)) return -1;
+        size = sizeof(header);
+    }
+    size -= (size - sizeof(CHECKPOINT_HEADER)) % sizeof(CHECKPOINT_RECORD);
+    if (ftruncate(journal, size) || lseek(journal, size, SEEK_SET) == -1) return -1;
+    lastCommit = time(NULL);
+    return 0;
+}
+
+/**
+ * @brief Check whether an input was completed by an earlier run
+ */
+bool checkpointDone(const char *input) {
+    if (!doneSize) return false;
+    uint64_t hash = hashPath(input);
+    size_t slot = hash & (doneSize - 1);
+    while (done[slot]) {
+        if (done[slot] == hash) return true;
+        slot = (slot + 1) & (doneSize - 1);
+    }
+    return false;
+}
+
+/**
+ * @brief Size of the output at the last commit of an earlier run
+ */
+uint64_t checkpointOutputSize(void) {
+    return outputSize;
+}
+
+/**
+ * @brief Mark an input as completed, it is written to the journal with the next commit
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+int checkpointAdd(const char *input) {
+    if (numberOfPending == pendingCapacity) {
+        size_t newCapacity = pendingCapacity ? pendingCapacity * 2 : 1024;
+        uint64_t *newPending = realloc(pending, newCapacity * sizeof(uint64_t));
+        if (!newPending) return -1;
+        pending = newPending;
+        pendingCapacity = newCapacity;
+    }
+    pending[numberOfPending++] = hashPath(input);
+    return 0;
+}
+
+/**
+ * @brief Check whether inputs are waiting and the last commit is at least seconds ago
+ */
+bool checkpointDue(unsigned seconds) {
+    return numberOfPending && time(NULL) - lastCommit >= (time_t)seconds;
+}
+
+/**
+ * @brief Append the inputs completed since the last commit. The output has to be flushed before.
+ *
+ * @param size Size of the output, 0 if it is not a regular file
+ * @return int 0 on success, -1 on error with errno set
+ */
+int checkpointCommit(uint64_t size) {
+    lastCommit = time(NULL);
+    if (!numberOfPending) return 0;
+    CHECKPOINT_RECORD records[4096];
+    size_t committed = 0;
+    while (committed < numberOfPending) {
+        size_t n = numberOfPending - committed < 4096 ? numberOfPending - committed : 4096;
+        for (size_t i = 0; i < n; i++) {
+            records[i].pathHash = pending[committed + i];
+            records[i].outputSize = size;
+        }
+        size_t bytes = n * sizeof(CHECKPOINT_RECORD);
+        if (write(journal, records, bytes) != (ssize_t)bytes) return -1;
+        committed += n;
+    }
+    numberOfPending = 0;
+    return fdatasync(journal);
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if !defined _WIN32 && !defined UNDER_CE
+#define USE_CHECKPOINT
+#endif
+
+#define CHECKPOINT_MAGIC "WCECKP1"
+
+/** Seconds between commits, and with an index, which is saved as a whole on every commit */
+#define CHECKPOINT_INTERVAL 2
+#define CHECKPOINT_INDEX_INTERVAL 60
+
+#ifdef USE_CHECKPOINT
+int checkpointOpen(const char *path, bool resume);
+bool checkpointDone(const char *input);
+uint64_t checkpointOutputSize(void);
+int checkpointAdd(const char *input);
+bool checkpointDue(unsigned seconds);
+int checkpointCommit(uint64_t outputSize);
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * PE image checksum, as computed by CheckSumMappedFile.
+ *
+ * The file is summed as little endian 16-bit words with the carries added back, leaving out the CheckSum field, and
+ * the file size is added to the result. Because 0x10000 is 1 modulo 0xFFFF, a 32-bit word adds the same as its two
+ * halves, so whole 32-bit words are added to 64-bit accumulators and folded to 16 bits once at the end. With SSE2,
+ * 16 bytes are added per step.
+ */
+#include "checksum.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Sum of the 32-bit words of a buffer, size must be a multiple of 4
+ */
+static uint64_t sumWords(const uint8_t *data, size_t size) {
+    uint64_t sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i accumulator = zero;
+    for (; i + 16 <= size; i += 16) {
+        __m128i words = _mm_loadu_si128((const __m128i *)(data + i));
+        accumulator = _mm_add_epi64(accumulator, _mm_unpacklo_epi32(words, zero));
+        accumulator = _mm_add_epi64(accumulator, _mm_unpackhi_epi32(words, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, accumulator);
+    sum = lanes[0] + lanes[1];
+#else
+    /* Independent accumulators, so the additions don't wait for each other */
+    uint64_t sums[4] = {0, 0, 0, 0};
+    for (; i + 16 <= size; i += 16) {
+        for (int j = 0; j < 4; j++) {
+            uint32_t word;
+            memcpy(&word, data + i + j * 4, sizeof(word));
+            sums[j] += word;
+        }
+    }
+    sum = sums[0] + sums[1] + sums[2] + sums[3];
+#endif
+    for (; i < size; i += 4) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+/**
+ * @brief Sum of the 16-bit words of data[start..end), placed at their offsets from the start of the file
+ */
+static uint64_t sumRange(const uint8_t *data, size_t start, size_t end) {
+    uint64_t sum = 0;
+    if (start >= end) return 0;
+    /* A range starting at an odd offset starts with the high byte of a word */
+    if (start & 1) sum += (uint64_t)data[start++] << 8;
+    size_t words = (end - start) & ~(size_t)3;
+    sum += sumWords(data + start, words);
+    start += words;
+    for (; start < end; start++) sum += (uint64_t)data[start] << ((start & 1) * 8);
+    return sum;
+}
+
+/**
+ * @brief Compute the checksum of a PE image
+ *
+ * @param data Whole file
+ * @param size Size of the file in bytes
+ * @param checkSumOffset File offset of the CheckSum field of the optional header, which is left out
+ * @return uint32_t Checksum
+ */
+uint32_t peImageChecksum(const uint8_t *data, size_t size, size_t checkSumOffset) {
+    if (checkSumOffset > size) checkSumOffset = size;
+    size_t checkSumEnd = size - checkSumOffset < 4 ? size : checkSumOffset + 4;
+    uint64_t sum = sumRange(data, 0, checkSumOffset) + sumRange(data, checkSumEnd, size);
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint32_t)sum + (uint32_t)size;
+}
@@ -0,0 +1,9 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t peImageChecksum(const uint8_t *data, size_t size, size_t checkSumOffset);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Groups of files with the same import table fingerprint, for --cluster.
+ *
+ * Fingerprints are kept in an open addressing hash table. Each cluster links the files added to it through an array
+ * of next indexes, so adding a file is one lookup and no per-cluster allocation.
+ */
+#include "cluster.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cjson/cJSON.h"
+
+typedef struct
+{
+    char *key;
+    uint32_t numberOfFiles;
+    /** First and last file, indexes into files */
+    uint32_t first;
+    uint32_t last;
+} CLUSTER;
+
+typedef struct
+{
+    char *label;
+    /** Next file of the same cluster, UINT32_MAX for the last one */
+    uint32_t next;
+} CLUSTER_FILE;
+
+struct CLUSTER_MAP
+{
+    CLUSTER *clusters;
+    uint32_t numberOfClusters;
+    uint32_t clustersCapacity;
+    /** Cluster index + 1 by key, 0 marks a free slot */
+    uint32_t *table;
+    uint32_t tableSize;
+    CLUSTER_FILE *files;
+    uint32_t numberOfFiles;
+    uint32_t filesCapacity;
+};
+
+static int grow(void **array, uint32_t *capacity, uint32_t needed, size_t elementSize) {
+    if (needed <= *capacity) return 0;
+    uint32_t newCapacity = *capacity ? *capacity : 256;
+    while (newCapacity < needed) newCapacity *= 2;
+    void *newArray = realloc(*array, (size_t)newCapacity * elementSize);
+    if (!newArray) return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static uint32_t hashKey(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) hash = (hash ^ (uint8_t)*key) * 16777619u;
+    return hash;
+}
+
+static int rehash(CLUSTER_MAP *map) {
+    uint32_t size = map->tableSize ? map->tableSize * 2 : 1024;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t i = 0; i < map->numberOfClusters; i++) {
+        uint32_t slot = hashKey(map->clusters[i].key) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+    free(map->table);
+    map->table = table;
+    map->tableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Create an empty map
+ *
+ * @return CLUSTER_MAP* New map, NULL if out of memory
+ */
+CLUSTER_MAP *clusterCreate(void) {
+    return calloc(1, sizeof(CLUSTER_MAP));
+}
+
+/**
+ * @brief Add a file to the cluster of its fingerprint
+ *
+ * @param map Map
+ * @param key Fingerprint
+ * @param label Name of the file
+ * @return int 0 on success, -1 if out of memory
+ */
+int clusterAdd(CLUSTER_MAP *map, const char *key, const char *label) {
+    if ((map->numberOfClusters + 1) * 2 > map->tableSize && rehash(map)) return -1;
+    if (grow((void **)&map->files, &map->filesCapacity, map->numberOfFiles + 1, sizeof(CLUSTER_FILE))) return -1;
+
+    uint32_t mask = map->tableSize - 1;
+    uint32_t slot = hashKey(key) & mask;
+    while (map->table[slot] && strcmp(map->clusters[map->table[slot] - 1].key, key)) slot = (slot + 1) & mask;
+
+    CLUSTER_FILE *file = &map->files[map->numberOfFiles];
+    file->label = strdup(label);
+    file->next = UINT32_MAX;
+    if (!file->label) return -1;
+
+    CLUSTER *cluster;
+    if (map->table[slot]) {
+        cluster = &map->clusters[map->table[slot] - 1];
+        map->files[cluster->last].next = map->numberOfFiles;
+    } else {
+        if (grow((void **)&map->clusters, &map->clustersCapacity, map->numberOfClusters + 1, sizeof(CLUSTER))) {
+            free(file->label);
+            return -1;
+        }
+        cluster = &map->clusters[map->numberOfClusters];
+        cluster->key = strdup(key);
+        if (!cluster->key) {
+            free(file->label);
+            return -1;
+        }
+        cluster->numberOfFiles = 0;
+        cluster->first = map->numberOfFiles;
+        map->table[slot] = ++map->numberOfClusters;
+    }
+    cluster->last = map->numberOfFiles++;
+    cluster->numberOfFiles++;
+    return 0;
+}
+
+/** Largest cluster first, then by fingerprint so the order doesn't depend on the order of the files */
+static int compareClusters(const void *a, const void *b) {
+    const CLUSTER *cluster1 = a, *cluster2 = b;
+    if (cluster1->numberOfFiles != cluster2->numberOfFiles) return cluster1->numberOfFiles < cluster2->numberOfFiles ? 1 : -1;
+    return strcmp(cluster1->key, cluster2->key);
+}
+
+/**
+ * @brief Print all clusters, largest first. The text output is the fingerprint and the number of files, followed by
+ * the files indented by two spaces. With printJson every cluster is a line of JSON.
+ *
+ * The hash table is not valid afterwards, only clusterFree can be used.
+ *
+ * @param map Map
+ * @param printJson Print one line of JSON per cluster
+ * @return int Number of clusters with more than one file, -1 if out of memory
+ */
+int clusterPrint(CLUSTER_MAP *map, bool printJson) {
+    qsort(map->clusters, map->numberOfClusters, sizeof(CLUSTER), compareClusters);
+    int shared = 0;
+    for (uint32_t i = 0; i < map->numberOfClusters; i++) {
+        CLUSTER *cluster = &map->clusters[i];
+        if (cluster->numberOfFiles > 1) shared++;
+        if (!printJson) {
+            printf("%s %u\n", cluster->key, cluster->numberOfFiles);
+            for (uint32_t file = cluster->first; file != UINT32_MAX; file = map->files[file].next) printf("  %s\n", map->files[file].label);
+            continue;
+        }
+
+        cJSON *json = cJSON_CreateObject();
+        if (!json) return -1;
+        cJSON_AddStringToObject(json, "ImpHash", cluster->key);
+        cJSON_AddNumberToObject(json, "Count", cluster->numberOfFiles);
+        cJSON *files = cJSON_AddArrayToObject(json, "Files");
+        for (uint32_t file = cluster->first; file != UINT32_MAX; file = map->files[file].next) {
+            cJSON_AddItemToArray(files, cJSON_CreateString(map->files[file].label));
+        }
+        char *line = cJSON_PrintUnformatted(json);
+        cJSON_Delete(json);
+        if (!line) return -1;
+        puts(line);
+        free(line);
+    }
+    return shared;
+}
+
+void clusterFree(CLUSTER_MAP *map) {
+    if (!map) return;
+    for (uint32_t i = 0; i < map->numberOfClusters; i++) free(map->clusters[i].key);
+    for (uint32_t i = 0; i < map->numberOfFiles; i++) free(map->files[i].label);
+    free(map->clusters);
+    free(map->table);
+    free(map->files);
+    free(map);
+}
@@ -0,0 +1,13 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+
+typedef struct CLUSTER_MAP CLUSTER_MAP;
+
+CLUSTER_MAP *clusterCreate(void);
+int clusterAdd(CLUSTER_MAP *map, const char *key, const char *label);
+int clusterPrint(CLUSTER_MAP *map, bool printJson);
+void clusterFree(CLUSTER_MAP *map);
+
+#endif
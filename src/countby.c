@@ -0,0 +1,544 @@
+/*
+ * Number of files by the values of a list of fields, for --count-by.
+ *
+ * The values of the fields are collected while a file is parsed. At the end of the file every combination of them is
+ * counted in an open addressing hash table keyed by the values joined with tabs; a field with several values, like
+ * DLLImports, counts the file once for each of them. Worker processes flush their table as "COUNT\tKEY" lines and
+ * the number of files as a line without tab after every input, which the parent adds to its own table.
+ *
+ * For --sample the counts come from a uniform sample of a larger population of files. Every group is then printed
+ * with its proportion, a 95% Wilson score interval and the estimated number of files in the population.
+ */
+#include "countby.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cjson/cJSON.h"
+
+typedef struct
+{
+    char *name;
+    /** Only the first prefixLength characters of the value are used, 0 for all */
+    size_t prefixLength;
+    /** Values of the current file */
+    char **values;
+    uint32_t numberOfValues;
+    uint32_t valuesCapacity;
+} COUNT_BY_FIELD;
+
+typedef struct
+{
+    char *key;
+    uint64_t count;
+} COUNT_BY_GROUP;
+
+struct COUNT_BY
+{
+    COUNT_BY_FIELD *fields;
+    int numberOfFields;
+    COUNT_BY_GROUP *groups;
+    uint32_t numberOfGroups;
+    uint32_t groupsCapacity;
+    /** Group index + 1 by key, 0 marks a free slot */
+    uint32_t *table;
+    uint32_t tableSize;
+    /** Key of the combination being added */
+    char *key;
+    size_t keyCapacity;
+    /** Number of files counted */
+    uint64_t numberOfFiles;
+    /** Number of files the counted files were sampled from, 0 if all files were counted */
+    uint64_t population;
+};
+
+static int grow(void **array, uint32_t *capacity, uint32_t needed, size_t elementSize) {
+    if (needed <= *capacity) return 0;
+    uint32_t newCapacity = *capacity ? *capacity : 16;
+    while (newCapacity < needed) newCapacity *= 2;
+    void *newArray = realloc(*array, (size_t)newCapacity * elementSize);
+    if (!newArray) return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static uint32_t hashKey(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) hash = (hash ^ (uint8_t)*key) * 16777619u;
+    return hash;
+}
+
+static int rehash(COUNT_BY *counts) {
+    uint32_t size = counts->tableSize ? counts->tableSize * 2 : 1024;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t i = 0; i < counts->numberOfGroups; i++) {
+        uint32_t slot = hashKey(counts->groups[i].key) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+    free(counts->table);
+    counts->table = table;
+    counts->tableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Create empty counts
+ *
+ * @param list Comma separated field names, a name may be followed by :N to only use the first N characters
+ * @param error Set to the reason if the list is invalid
+ * @param errorSize Size of error
+ * @return COUNT_BY* New counts, NULL if the list is invalid or out of memory
+ */
+COUNT_BY *countByCreate(const char *list, char *error, size_t errorSize) {
+    COUNT_BY *counts = calloc(1, sizeof(COUNT_BY));
+    if (!counts || !(counts->fields = calloc(strlen(list) / 2 + 1, sizeof(COUNT_BY_FIELD)))) {
+        snprintf(error, errorSize, "Out of memory");
+        countByFree(counts);
+        return NULL;
+    }
+
+    for (const char *start = list;; start++) {
+        size_t length = strcspn(start, ",");
+        const char *colon = memchr(start, ':', length);
+        size_t nameLength = colon ? (size_t)(colon - start) : length;
+        COUNT_BY_FIELD *field = &counts->fields[counts->numberOfFields];
+        if (!nameLength) {
+            snprintf(error, errorSize, "Empty field name in \"%s\"", list);
+            countByFree(counts);
+            return NULL;
+        }
+        if (colon) {
+            char *end;
+            long prefixLength = strtol(colon + 1, &end, 10);
+            if (end != start + length || prefixLength <= 0) {
+                snprintf(error, errorSize, "Expected a length after %.*s:", (int)nameLength, start);
+                countByFree(counts);
+                return NULL;
+            }
+            field->prefixLength = prefixLength;
+        }
+        if (!(field->name = malloc(nameLength + 1))) {
+            snprintf(error, errorSize, "Out of memory");
+            countByFree(counts);
+            return NULL;
+        }
+        memcpy(field->name, start, nameLength);
+        field->name[nameLength] = '\0';
+        counts->numberOfFields++;
+        start += length;
+        if (!*start) break;
+    }
+    return counts;
+}
+
+/**
+ * @brief Forget the values of the previous file
+ */
+void countByStartFile(COUNT_BY *counts) {
+    for (int i = 0; i < counts->numberOfFields; i++) {
+        COUNT_BY_FIELD *field = &counts->fields[i];
+        for (uint32_t j = 0; j < field->numberOfValues; j++) free(field->values[j]);
+        field->numberOfValues = 0;
+    }
+}
+
+/**
+ * @brief Pass a printed field of the current file
+ *
+ * @param counts Counts
+ * @param name Field name
+ * @param value Value as printed
+ */
+void countByField(COUNT_BY *counts, const char *name, const char *value) {
+    for (int i = 0; i < counts->numberOfFields; i++) {
+        COUNT_BY_FIELD *field = &counts->fields[i];
+        if (strcmp(field->name, name)) continue;
+
+        size_t length = strlen(value);
+        if (field->prefixLength && length > field->prefixLength) length = field->prefixLength;
+        /* The same DLL may be imported by more than one descriptor, count the file once */
+        bool known = false;
+        for (uint32_t j = 0; j < field->numberOfValues && !known; j++) {
+            known = !strncmp(field->values[j], value, length) && !field->values[j][length];
+        }
+        if (known || grow((void **)&field->values, &field->valuesCapacity, field->numberOfValues + 1, sizeof(char *))) continue;
+
+        char *copy = malloc(length + 1);
+        if (!copy) continue;
+        /* Tabs and line breaks separate fields and groups */
+        for (size_t j = 0; j < length; j++) copy[j] = value[j] == '\t' || value[j] == '\n' || value[j] == '\r' ? ' ' : value[j];
+        copy[length] = '\0';
+        field->values[field->numberOfValues++] = copy;
+    }
+}
+
+/**
+ * @brief Check whether every field was seen. Each field is printed in a single part of the file, so at the end of a
+ * part the rest of the file is not needed anymore.
+ */
+bool countByComplete(const COUNT_BY *counts) {
+    for (int i = 0; i < counts->numberOfFields; i++) {
+        if (!counts->fields[i].numberOfValues) return false;
+    }
+    return true;
+}
+
+static int addGroup(COUNT_BY *counts, const char *key, uint64_t count) {
+    if ((counts->numberOfGroups + 1) * 2 > counts->tableSize && rehash(counts)) return -1;
+
+    uint32_t mask = counts->tableSize - 1;
+    uint32_t slot = hashKey(key) & mask;
+    while (counts->table[slot] && strcmp(counts->groups[counts->table[slot] - 1].key, key)) slot = (slot + 1) & mask;
+    if (counts->table[slot]) {
+        counts->groups[counts->table[slot] - 1].count += count;
+        return 0;
+    }
+
+    if (grow((void **)&counts->groups, &counts->groupsCapacity, counts->numberOfGroups + 1, sizeof(COUNT_BY_GROUP))) return -1;
+    COUNT_BY_GROUP *group = &counts->groups[counts->numberOfGroups];
+    if (!(group->key = strdup(key))) return -1;
+    group->count = count;
+    counts->table[slot] = ++counts->numberOfGroups;
+    return 0;
+}
+
+/**
+ * @brief Count the current file once for every combination of the values of its fields. Missing fields count as
+ * an empty value.
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+int countByEndFile(COUNT_BY *counts) {
+    uint32_t index[counts->numberOfFields];
+    memset(index, 0, sizeof(index));
+
+    for (;;) {
+        size_t length = 0;
+        for (int i = 0; i < counts->numberOfFields; i++) {
+            const COUNT_BY_FIELD *field = &counts->fields[i];
+            const char *value = field->numberOfValues ? field->values[index[i]] : "";
+            size_t valueLength = strlen(value);
+            if (length + valueLength + 2 > counts->keyCapacity) {
+                size_t capacity = (length + valueLength + 2) * 2;
+                char *key = realloc(counts->key, capacity);
+                if (!key) return -1;
+                counts->key = key;
+                counts->keyCapacity = capacity;
+            }
+            if (i) counts->key[length++] = '\t';
+            memcpy(counts->key + length, value, valueLength);
+            length += valueLength;
+        }
+        counts->key[length] = '\0';
+        if (addGroup(counts, counts->key, 1)) return -1;
+
+        /* Next combination, the last field changes fastest */
+        int i = counts->numberOfFields - 1;
+        for (; i >= 0; i--) {
+            if (++index[i] < counts->fields[i].numberOfValues) break;
+            index[i] = 0;
+        }
+        if (i < 0) {
+            counts->numberOfFiles++;
+            return 0;
+        }
+    }
+}
+
+static void clearGroups(COUNT_BY *counts) {
+    for (uint32_t i = 0; i < counts->numberOfGroups; i++) free(counts->groups[i].key);
+    counts->numberOfGroups = 0;
+    if (counts->table) memset(counts->table, 0, counts->tableSize * sizeof(uint32_t));
+}
+
+/**
+ * @brief Print the counts as COUNT\tKEY lines for countByAddLines and clear them. Used by worker processes after
+ * every input.
+ *
+ * @return int 0 on success, -1 on write error
+ */
+int countByFlush(COUNT_BY *counts) {
+    if (counts->numberOfFiles && printf("%llu\n", (unsigned long long)counts->numberOfFiles) < 0) return -1;
+    counts->numberOfFiles = 0;
+    for (uint32_t i = 0; i < counts->numberOfGroups; i++) {
+        if (printf("%llu\t%s\n", (unsigned long long)counts->groups[i].count, counts->groups[i].key) < 0) return -1;
+    }
+    clearGroups(counts);
+    return 0;
+}
+
+/**
+ * @brief Add the lines of countByFlush to the counts
+ *
+ * @param counts Counts
+ * @param data Lines
+ * @param length Length of data
+ * @return int 0 on success, -1 if out of memory or a line is damaged
+ */
+int countByAddLines(COUNT_BY *counts, const char *data, size_t length) {
+    const char *end = data + length;
+    while (data < end) {
+        const char *lineEnd = memchr(data, '\n', end - data);
+        if (!lineEnd) return -1;
+        const char *tab = memchr(data, '\t', lineEnd - data);
+        uint64_t count = strtoull(data, NULL, 10);
+        if (!tab) {
+            counts->numberOfFiles += count;
+            data = lineEnd + 1;
+            continue;
+        }
+
+        size_t keyLength = lineEnd - tab - 1;
+        if (keyLength + 1 > counts->keyCapacity) {
+            char *key = realloc(counts->key, keyLength + 1);
+            if (!key) return -1;
+            counts->key = key;
+            counts->keyCapacity = keyLength + 1;
+        }
+        memcpy(counts->key, tab + 1, keyLength);
+        counts->key[keyLength] = '\0';
+        if (addGroup(counts, counts->key, count)) return -1;
+        data = lineEnd + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Mark the counted files as a uniform sample
+ *
+ * @param counts Counts
+ * @param population Number of files the sample was taken from
+ */
+void countBySetPopulation(COUNT_BY *counts, uint64_t population) {
+    counts->population = population;
+}
+
+/** Proportion of a group in the sample, with its 95% confidence interval and the estimate for the population */
+typedef struct
+{
+    double proportion;
+    double low;
+    double high;
+    uint64_t estimate;
+} COUNT_BY_ESTIMATE;
+
+/**
+ * @brief Wilson score interval of a proportion. When a large part of the population was sampled, the interval is
+ * narrowed by the finite population correction.
+ */
+static COUNT_BY_ESTIMATE estimate(const COUNT_BY *counts, uint64_t count) {
+    COUNT_BY_ESTIMATE result = {0, 0, 0, 0};
+    double n = counts->numberOfFiles;
+    if (!n) return result;
+    const double z = 1.959964;
+    double p = count / n;
+    double denominator = 1 + z * z / n;
+    double center = (p + z * z / (2 * n)) / denominator;
+    double halfWidth = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / denominator;
+    double low = center - halfWidth < 0 ? 0 : center - halfWidth;
+    double high = center + halfWidth > 1 ? 1 : center + halfWidth;
+    double population = counts->population;
+    if (population > 1 && population >= n) {
+        /* Shrinks the interval towards the proportion, to nothing when every file was sampled */
+        double correction = sqrt((population - n) / (population - 1));
+        low = p - (p - low) * correction;
+        high = p + (high - p) * correction;
+    }
+    result.proportion = p;
+    result.low = low;
+    result.high = high;
+    result.estimate = (uint64_t)(p * population + 0.5);
+    return result;
+}
+
+/** Largest group first, then by key so the order doesn't depend on the order of the files */
+static int compareGroups(const void *a, const void *b) {
+    const COUNT_BY_GROUP *group1 = a, *group2 = b;
+    if (group1->count != group2->count) return group1->count < group2->count ? 1 : -1;
+    return strcmp(group1->key, group2->key);
+}
+
+/**
+ * @brief Split a key into the values of the fields, in place
+ */
+static void splitKey(char *key, char **values, int numberOfFields) {
+    for (int i = 0; i < numberOfFields; i++) {
+        values[i] = key;
+        char *tab = strchr(key, '\t');
+        if (tab) {
+            *tab = '\0';
+            key = tab + 1;
+        } else {
+            key += strlen(key);
+        }
+    }
+}
+
+static void printCsvValue(const char *value) {
+    if (!strpbrk(value, ",\"")) {
+        fputs(value, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *value; value++) {
+        if (*value == '"') putchar('"');
+        putchar(*value);
+    }
+    putchar('"');
+}
+
+/**
+ * @brief Print all groups, largest first. The table has a column for every field and the number of files, missing
+ * values are shown as -. CSV starts with a header line. With JSON every group is a line with the fields and Count,
+ * missing values are null. For a sample Proportion, Low, High and Estimate are added.
+ *
+ * @param counts Counts
+ * @param format Output format
+ * @return int 0 on success, -1 if out of memory
+ */
+int countByPrint(COUNT_BY *counts, COUNT_BY_FORMAT format) {
+    qsort(counts->groups, counts->numberOfGroups, sizeof(COUNT_BY_GROUP), compareGroups);
+    int numberOfFields = counts->numberOfFields;
+    char *values[numberOfFields];
+
+    /* Names as given, including the length of a prefix */
+    char *names[numberOfFields];
+    for (int i = 0; i < numberOfFields; i++) {
+        char name[256];
+        if (counts->fields[i].prefixLength) {
+            snprintf(name, sizeof(name), "%s:%zu", counts->fields[i].name, counts->fields[i].prefixLength);
+        } else {
+            snprintf(name, sizeof(name), "%s", counts->fields[i].name);
+        }
+        if (!(names[i] = strdup(name))) {
+            while (i--) free(names[i]);
+            return -1;
+        }
+    }
+
+    int status = 0;
+    if (format == COUNT_BY_TABLE) {
+        int widths[numberOfFields];
+        for (int i = 0; i < numberOfFields; i++) widths[i] = strlen(names[i]);
+        for (uint32_t group = 0; group < counts->numberOfGroups; group++) {
+            char *key = counts->groups[group].key;
+            for (int i = 0; i < numberOfFields; i++) {
+                int length = strcspn(key, "\t");
+                if (length > widths[i]) widths[i] = length;
+                key += length + (key[length] == '\t');
+            }
+        }
+        for (int i = 0; i < numberOfFields; i++) printf("%-*s  ", widths[i], names[i]);
+        if (counts->population) {
+            printf("%10s  %7s  %15s  %10s\n", "Count", "Percent", "95% CI", "Estimate");
+        } else {
+            printf("%10s\n", "Count");
+        }
+        for (uint32_t group = 0; group < counts->numberOfGroups; group++) {
+            splitKey(counts->groups[group].key, values, numberOfFields);
+            for (int i = 0; i < numberOfFields; i++) printf("%-*s  ", widths[i], values[i][0] ? values[i] : "-");
+            printf("%10llu", (unsigned long long)counts->groups[group].count);
+            if (counts->population) {
+                COUNT_BY_ESTIMATE e = estimate(counts, counts->groups[group].count);
+                char interval[32];
+                snprintf(interval, sizeof(interval), "%.1f%%-%.1f%%", e.low * 100, e.high * 100);
+                printf("  %6.1f%%  %15s  %10llu", e.proportion * 100, interval, (unsigned long long)e.estimate);
+            }
+            putchar('\n');
+        }
+        if (counts->population) {
+            printf("Sample of %llu of %llu files\n", (unsigned long long)counts->numberOfFiles, (unsigned long long)counts->population);
+        }
+    } else if (format == COUNT_BY_CSV) {
+        for (int i = 0; i < numberOfFields; i++) {
+            printCsvValue(names[i]);
+            putchar(',');
+        }
+        puts(counts->population ? "Count,Proportion,Low,High,Estimate" : "Count");
+        for (uint32_t group = 0; group < counts->numberOfGroups; group++) {
+            splitKey(counts->groups[group].key, values, numberOfFields);
+            for (int i = 0; i < numberOfFields; i++) {
+                printCsvValue(values[i]);
+                putchar(',');
+            }
+            printf("%llu", (unsigned long long)counts->groups[group].count);
+            if (counts->population) {
+                COUNT_BY_ESTIMATE e = estimate(counts, counts->groups[group].count);
+                printf(",%.4f,%.4f,%.4f,%llu", e.proportion, e.low, e.high, (unsigned long long)e.estimate);
+            }
+            putchar('\n');
+        }
+    } else {
+        for (uint32_t group = 0; group < counts->numberOfGroups && !status; group++) {
+            splitKey(counts->groups[group].key, values, numberOfFields);
+            cJSON *json = cJSON_CreateObject();
+            if (!json) {
+                status = -1;
+                break;
+            }
+            for (int i = 0; i < numberOfFields; i++) {
+                if (values[i][0]) {
+                    cJSON_AddStringToObject(json, names[i], values[i]);
+                } else {
+                    cJSON_AddNullToObject(json, names[i]);
+                }
+            }
+            cJSON_AddNumberToObject(json, "Count", counts->groups[group].count);
+            if (counts->population) {
+                COUNT_BY_ESTIMATE e = estimate(counts, counts->groups[group].count);
+                /* Rounded like the table, more digits are noise for a sample */
+                cJSON_AddNumberToObject(json, "Proportion", round(e.proportion * 10000) / 10000);
+                cJSON_AddNumberToObject(json, "Low", round(e.low * 10000) / 10000);
+                cJSON_AddNumberToObject(json, "High", round(e.high * 10000) / 10000);
+                cJSON_AddNumberToObject(json, "Estimate", e.estimate);
+            }
+            char *line = cJSON_PrintUnformatted(json);
+            cJSON_Delete(json);
+            if (!line) {
+                status = -1;
+                break;
+            }
+            puts(line);
+            free(line);
+        }
+    }
+
+    /* The keys were split, they can't be looked up anymore */
+    clearGroups(counts);
+    for (int i = 0; i < numberOfFields; i++) free(names[i]);
+    return status;
+}
+
+/**
+ * @brief Get the name of a counted field
+ *
+ * @param counts Counts
+ * @param index Index of the field
+ * @return const char* Field name, NULL if index is past the last field
+ */
+const char *countByFieldName(const COUNT_BY *counts, int index) {
+    return index < counts->numberOfFields ? counts->fields[index].name : NULL;
+}
+
+void countByFree(COUNT_BY *counts) {
+    if (!counts) return;
+    if (counts->fields) {
+        countByStartFile(counts);
+        for (int i = 0; i < counts->numberOfFields; i++) {
+            free(counts->fields[i].name);
+            free(counts->fields[i].values);
+        }
+    }
+    clearGroups(counts);
+    free(counts->fields);
+    free(counts->groups);
+    free(counts->table);
+    free(counts->key);
+    free(counts);
+}
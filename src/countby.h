@@ -0,0 +1,30 @@
+#ifndef COUNTBY_H
+#define COUNTBY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    COUNT_BY_TABLE,
+    COUNT_BY_CSV,
+    COUNT_BY_JSON
+} COUNT_BY_FORMAT;
+
+/** Number of files by the values of a list of fields, for --count-by */
+typedef struct COUNT_BY COUNT_BY;
+
+COUNT_BY *countByCreate(const char *list, char *error, size_t errorSize);
+void countByStartFile(COUNT_BY *counts);
+void countByField(COUNT_BY *counts, const char *name, const char *value);
+bool countByComplete(const COUNT_BY *counts);
+int countByEndFile(COUNT_BY *counts);
+int countByFlush(COUNT_BY *counts);
+int countByAddLines(COUNT_BY *counts, const char *data, size_t length);
+void countBySetPopulation(COUNT_BY *counts, uint64_t population);
+int countByPrint(COUNT_BY *counts, COUNT_BY_FORMAT format);
+const char *countByFieldName(const COUNT_BY *counts, int index);
+void countByFree(COUNT_BY *counts);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+ * Graph of the imports of all examined files, resolved against the exports of ROM DLLs and of the examined DLLs.
+ *
+ * While scanning, the imports and exports of every file are collected with interned DLL and function names. Once all
+ * files are known, every import is looked up first in the export tables loaded with --export-db, which describe the
+ * DLLs in ROM, and then in the exports of the examined DLLs with the same file name, which are private to the
+ * application. A file is resolved if all of its imports and the imports of all private DLLs it depends on, directly
+ * or through other private DLLs, are found.
+ */
+#include "depgraph.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cjson/cJSON.h"
+#include "exportdb.h"
+
+#define DEP_MAX_NAME 256
+
+typedef struct
+{
+    /** Interned string offsets, name is 0 if imported by ordinal */
+    uint32_t dll;
+    uint32_t name;
+    uint16_t ordinal;
+} DEP_IMPORT;
+
+typedef struct
+{
+    /** Interned string offset, 0 if only exported by ordinal */
+    uint32_t name;
+    uint16_t ordinal;
+} DEP_EXPORT;
+
+/** Key of the export hash table, an export is added once by name and once by ordinal */
+typedef struct
+{
+    uint32_t file;
+    /** Interned name, or the ordinal if byOrdinal */
+    uint32_t value;
+    bool byOrdinal;
+} DEP_EXPORT_KEY;
+
+typedef struct
+{
+    uint32_t label;
+    /** Interned lower case file name, which is how importers refer to it */
+    uint32_t baseName;
+    uint32_t firstImport;
+    uint32_t numberOfImports;
+    /** Private DLLs imported directly, filled in by depGraphResolve */
+    uint32_t firstDependency;
+    uint32_t numberOfDependencies;
+    bool missing;
+} DEP_FILE;
+
+typedef enum {
+    DEP_RESOLVED,
+    DEP_RESOLVED_PRIVATE,
+    DEP_MISSING_DLL,
+    DEP_MISSING_FUNCTION
+} DEP_STATUS;
+
+struct DEP_GRAPH
+{
+    char *strings;
+    size_t stringsSize;
+    size_t stringsCapacity;
+    /** Open addressing table of interned string offsets, 0 marks a free slot */
+    uint32_t *stringTable;
+    uint32_t stringTableSize;
+    uint32_t numberOfInterned;
+
+    DEP_FILE *files;
+    uint32_t numberOfFiles;
+    uint32_t filesCapacity;
+
+    /** Imports of all committed files, followed by those of the file being examined */
+    DEP_IMPORT *imports;
+    uint32_t numberOfImports;
+    uint32_t importsCapacity;
+    uint32_t committedImports;
+
+    /** Exports of the file being examined */
+    DEP_EXPORT *pendingExports;
+    uint32_t numberOfPendingExports;
+    uint32_t pendingExportsCapacity;
+
+    /** Open addressing table of export keys, keys are indexes + 1 into exportKeys */
+    DEP_EXPORT_KEY *exportKeys;
+    uint32_t numberOfExportKeys;
+    uint32_t exportKeysCapacity;
+    uint32_t *exportTable;
+    uint32_t exportTableSize;
+
+    /** Open addressing table of file id + 1 by baseName */
+    uint32_t *fileTable;
+    uint32_t fileTableSize;
+
+    uint32_t *dependencies;
+    uint32_t numberOfDependencies;
+    uint32_t dependenciesCapacity;
+};
+
+static int grow(void **array, uint32_t *capacity, uint32_t needed, size_t elementSize) {
+    if (needed <= *capacity) return 0;
+    uint32_t newCapacity = *capacity ? *capacity : 256;
+    while (newCapacity < needed) newCapacity *= 2;
+    void *newArray = realloc(*array, (size_t)newCapacity * elementSize);
+    if (!newArray) return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+static uint32_t hashKey(uint32_t file, uint32_t value, bool byOrdinal) {
+    return ((file * 16777619u) ^ value ^ (byOrdinal ? 0x9E3779B9u : 0)) * 2654435761u;
+}
+
+/**
+ * @brief Append a string to the string pool
+ *
+ * @return uint32_t Offset of the string, 0 if out of memory
+ */
+static uint32_t addString(DEP_GRAPH *graph, const char *string) {
+    size_t length = strlen(string) + 1;
+    if (graph->stringsSize + length > UINT32_MAX) return 0;
+    if (graph->stringsSize + length > graph->stringsCapacity) {
+        size_t capacity = graph->stringsCapacity * 2;
+        while (capacity < graph->stringsSize + length) capacity *= 2;
+        char *strings = realloc(graph->strings, capacity);
+        if (!strings) return 0;
+        graph->strings = strings;
+        graph->stringsCapacity = capacity;
+    }
+    uint32_t offset = graph->stringsSize;
+    memcpy(graph->strings + offset, string, length);
+    graph->stringsSize += length;
+    return offset;
+}
+
+static int rehashStrings(DEP_GRAPH *graph) {
+    uint32_t size = graph->stringTableSize ? graph->stringTableSize * 2 : 4096;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t i = 0; i < graph->stringTableSize; i++) {
+        if (!graph->stringTable[i]) continue;
+        uint32_t slot = hashName(graph->strings + graph->stringTable[i]) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = graph->stringTable[i];
+    }
+    free(graph->stringTable);
+    graph->stringTable = table;
+    graph->stringTableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Find or add a string, so equal strings have equal offsets
+ *
+ * @return uint32_t Offset of the string, 0 if out of memory
+ */
+static uint32_t intern(DEP_GRAPH *graph, const char *string) {
+    if ((graph->numberOfInterned + 1) * 2 > graph->stringTableSize && rehashStrings(graph)) return 0;
+    uint32_t mask = graph->stringTableSize - 1;
+    uint32_t slot = hashName(string) & mask;
+    for (; graph->stringTable[slot]; slot = (slot + 1) & mask) {
+        if (!strcmp(graph->strings + graph->stringTable[slot], string)) return graph->stringTable[slot];
+    }
+    uint32_t offset = addString(graph, string);
+    if (!offset) return 0;
+    graph->stringTable[slot] = offset;
+    graph->numberOfInterned++;
+    return offset;
+}
+
+static uint32_t internLowerCase(DEP_GRAPH *graph, const char *string) {
+    char name[DEP_MAX_NAME];
+    size_t i = 0;
+    for (; string[i] && i < sizeof(name) - 1; i++) name[i] = tolower((unsigned char)string[i]);
+    name[i] = '\0';
+    return intern(graph, name);
+}
+
+static int rehashExports(DEP_GRAPH *graph) {
+    uint32_t size = graph->exportTableSize ? graph->exportTableSize * 2 : 4096;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t i = 0; i < graph->numberOfExportKeys; i++) {
+        DEP_EXPORT_KEY *key = &graph->exportKeys[i];
+        uint32_t slot = hashKey(key->file, key->value, key->byOrdinal) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+    free(graph->exportTable);
+    graph->exportTable = table;
+    graph->exportTableSize = size;
+    return 0;
+}
+
+static int addExportKey(DEP_GRAPH *graph, uint32_t file, uint32_t value, bool byOrdinal) {
+    if ((graph->numberOfExportKeys + 1) * 2 > graph->exportTableSize && rehashExports(graph)) return -1;
+    if (grow((void **)&graph->exportKeys, &graph->exportKeysCapacity, graph->numberOfExportKeys + 1, sizeof(DEP_EXPORT_KEY))) return -1;
+    uint32_t mask = graph->exportTableSize - 1;
+    uint32_t slot = hashKey(file, value, byOrdinal) & mask;
+    while (graph->exportTable[slot]) slot = (slot + 1) & mask;
+    DEP_EXPORT_KEY *key = &graph->exportKeys[graph->numberOfExportKeys];
+    key->file = file;
+    key->value = value;
+    key->byOrdinal = byOrdinal;
+    graph->exportTable[slot] = ++graph->numberOfExportKeys;
+    return 0;
+}
+
+static bool hasExportKey(const DEP_GRAPH *graph, uint32_t file, uint32_t value, bool byOrdinal) {
+    if (!graph->exportTableSize) return false;
+    uint32_t mask = graph->exportTableSize - 1;
+    for (uint32_t slot = hashKey(file, value, byOrdinal) & mask; graph->exportTable[slot]; slot = (slot + 1) & mask) {
+        DEP_EXPORT_KEY *key = &graph->exportKeys[graph->exportTable[slot] - 1];
+        if (key->file == file && key->value == value && key->byOrdinal == byOrdinal) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Create an empty graph
+ *
+ * @return DEP_GRAPH* New graph, NULL if out of memory
+ */
+DEP_GRAPH *depGraphCreate(void) {
+    DEP_GRAPH *graph = calloc(1, sizeof(DEP_GRAPH));
+    if (!graph) return NULL;
+    graph->stringsCapacity = 65536;
+    graph->strings = malloc(graph->stringsCapacity);
+    if (!graph->strings) {
+        free(graph);
+        return NULL;
+    }
+    /* Offset 0 is the empty string, which stands for no name */
+    graph->strings[0] = '\0';
+    graph->stringsSize = 1;
+    return graph;
+}
+
+/**
+ * @brief Start collecting the imports and exports of a new file, discarding those of a file that was not completed
+ */
+void depGraphStartFile(DEP_GRAPH *graph) {
+    graph->numberOfImports = graph->committedImports;
+    graph->numberOfPendingExports = 0;
+}
+
+/**
+ * @brief Record a function imported by the current file
+ *
+ * @param graph Graph
+ * @param dllName DLL the function is imported from
+ * @param function Name of the function, NULL if imported by ordinal
+ * @param ordinal Ordinal if function is NULL
+ * @return int 0 on success, -1 if out of memory
+ */
+int depGraphAddImport(DEP_GRAPH *graph, const char *dllName, const char *function, uint16_t ordinal) {
+    if (grow((void **)&graph->imports, &graph->importsCapacity, graph->numberOfImports + 1, sizeof(DEP_IMPORT))) return -1;
+    DEP_IMPORT *import = &graph->imports[graph->numberOfImports];
+    import->dll = internLowerCase(graph, dllName);
+    import->name = function ? intern(graph, function) : 0;
+    import->ordinal = function ? 0 : ordinal;
+    if (!import->dll || (function && !import->name)) return -1;
+    graph->numberOfImports++;
+    return 0;
+}
+
+/**
+ * @brief Record a function exported by the current file
+ *
+ * @param graph Graph
+ * @param function Name of the function, NULL if only exported by ordinal
+ * @param ordinal Ordinal of the function
+ * @return int 0 on success, -1 if out of memory
+ */
+int depGraphAddExport(DEP_GRAPH *graph, const char *function, uint16_t ordinal) {
+    if (grow((void **)&graph->pendingExports, &graph->pendingExportsCapacity, graph->numberOfPendingExports + 1, sizeof(DEP_EXPORT))) return -1;
+    DEP_EXPORT *export = &graph->pendingExports[graph->numberOfPendingExports];
+    export->name = function ? intern(graph, function) : 0;
+    export->ordinal = ordinal;
+    if (function && !export->name) return -1;
+    graph->numberOfPendingExports++;
+    return 0;
+}
+
+/**
+ * @brief Add the current file to the graph
+ *
+ * @param graph Graph
+ * @param label Name of the file. The part after the last / or ! is the name importers use.
+ * @return int 0 on success, -1 if out of memory
+ */
+int depGraphEndFile(DEP_GRAPH *graph, const char *label) {
+    if (grow((void **)&graph->files, &graph->filesCapacity, graph->numberOfFiles + 1, sizeof(DEP_FILE))) return -1;
+    uint32_t id = graph->numberOfFiles;
+    DEP_FILE *file = &graph->files[id];
+    memset(file, 0, sizeof(DEP_FILE));
+
+    const char *baseName = label;
+    for (const char *p = label; *p; p++) {
+        if (*p == '/' || *p == '\\' || *p == '!') baseName = p + 1;
+    }
+    file->label = addString(graph, label);
+    file->baseName = internLowerCase(graph, baseName);
+    if (!file->label || !file->baseName) return -1;
+    file->firstImport = graph->committedImports;
+    file->numberOfImports = graph->numberOfImports - graph->committedImports;
+
+    for (uint32_t i = 0; i < graph->numberOfPendingExports; i++) {
+        DEP_EXPORT *export = &graph->pendingExports[i];
+        if (export->name && addExportKey(graph, id, export->name, false)) return -1;
+        if (addExportKey(graph, id, export->ordinal, true)) return -1;
+    }
+
+    graph->numberOfFiles++;
+    graph->committedImports = graph->numberOfImports;
+    graph->numberOfPendingExports = 0;
+    return 0;
+}
+
+static int64_t findFile(const DEP_GRAPH *graph, uint32_t baseName) {
+    uint32_t mask = graph->fileTableSize - 1;
+    for (uint32_t slot = hashName(graph->strings + baseName) & mask; graph->fileTable[slot]; slot = (slot + 1) & mask) {
+        if (graph->files[graph->fileTable[slot] - 1].baseName == baseName) return graph->fileTable[slot] - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Look up an import, first in the ROM export tables, then in the examined DLLs
+ *
+ * @param graph Graph
+ * @param import Import
+ * @param provider Set to the examined DLL that provides the import if the result is DEP_RESOLVED_PRIVATE
+ * @return DEP_STATUS Result
+ */
+static DEP_STATUS resolveImport(const DEP_GRAPH *graph, const DEP_IMPORT *import, uint32_t *provider) {
+    const char *name = graph->strings + import->name;
+    const EXPORT_TABLE *rom = exportDbFind(graph->strings + import->dll);
+    /* The compiled-in tables only name some exports, they don't tell what is missing */
+    if (rom && exportDbIsComplete(rom)) {
+        bool found = import->name ? exportDbHasName(rom, name) : exportDbName(rom, import->ordinal) != NULL;
+        return found ? DEP_RESOLVED : DEP_MISSING_FUNCTION;
+    }
+
+    int64_t file = findFile(graph, import->dll);
+    if (file < 0) return DEP_MISSING_DLL;
+    *provider = file;
+    bool found = import->name ? hasExportKey(graph, file, import->name, false) : hasExportKey(graph, file, import->ordinal, true);
+    return found ? DEP_RESOLVED_PRIVATE : DEP_MISSING_FUNCTION;
+}
+
+static void formatImport(const DEP_GRAPH *graph, const DEP_IMPORT *import, char *buffer, size_t size) {
+    if (import->name) {
+        snprintf(buffer, size, "%s!%s", graph->strings + import->dll, graph->strings + import->name);
+    } else {
+        snprintf(buffer, size, "%s!#%u", graph->strings + import->dll, import->ordinal);
+    }
+}
+
+/**
+ * @brief Print the result of one file
+ *
+ * @param graph Graph
+ * @param id File id
+ * @param closure Private DLLs the file depends on, directly or indirectly
+ * @param closureSize Number of entries in closure
+ * @param printJson Print a line of JSON instead of text
+ */
+static void printFile(const DEP_GRAPH *graph, uint32_t id, const uint32_t *closure, uint32_t closureSize, bool printJson) {
+    const DEP_FILE *file = &graph->files[id];
+    const char *label = graph->strings + file->label;
+    char buffer[2 * DEP_MAX_NAME + 8];
+
+    bool resolved = !file->missing;
+    for (uint32_t i = 0; i < closureSize; i++) resolved = resolved && !graph->files[closure[i]].missing;
+
+    cJSON *json = NULL, *missingDlls = NULL, *missingFunctions = NULL, *privateDlls = NULL, *unresolvedDlls = NULL;
+    if (printJson) {
+        json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "File", label);
+        cJSON_AddBoolToObject(json, "Resolved", resolved);
+        missingDlls = cJSON_AddArrayToObject(json, "MissingDLLs");
+        missingFunctions = cJSON_AddArrayToObject(json, "MissingFunctions");
+        privateDlls = cJSON_AddArrayToObject(json, "PrivateDLLs");
+        unresolvedDlls = cJSON_AddArrayToObject(json, "UnresolvedPrivateDLLs");
+    } else if (resolved) {
+        printf("%s: resolved\n", label);
+    }
+
+    uint32_t lastMissingDll = 0;
+    for (uint32_t i = 0; i < file->numberOfImports && file->missing; i++) {
+        const DEP_IMPORT *import = &graph->imports[file->firstImport + i];
+        uint32_t provider;
+        DEP_STATUS status = resolveImport(graph, import, &provider);
+        if (status == DEP_MISSING_DLL) {
+            /* The imports of a DLL are next to each other */
+            if (import->dll == lastMissingDll) continue;
+            lastMissingDll = import->dll;
+            if (printJson) {
+                cJSON_AddItemToArray(missingDlls, cJSON_CreateString(graph->strings + import->dll));
+            } else {
+                printf("%s: missing DLL %s\n", label, graph->strings + import->dll);
+            }
+        } else if (status == DEP_MISSING_FUNCTION) {
+            formatImport(graph, import, buffer, sizeof(buffer));
+            if (printJson) {
+                cJSON_AddItemToArray(missingFunctions, cJSON_CreateString(buffer));
+            } else {
+                printf("%s: missing %s\n", label, buffer);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < closureSize; i++) {
+        const DEP_FILE *dll = &graph->files[closure[i]];
+        if (printJson) {
+            cJSON_AddItemToArray(privateDlls, cJSON_CreateString(graph->strings + dll->label));
+            if (dll->missing) cJSON_AddItemToArray(unresolvedDlls, cJSON_CreateString(graph->strings + dll->label));
+        } else if (dll->missing) {
+            printf("%s: unresolved private DLL %s\n", label, graph->strings + dll->label);
+        }
+    }
+
+    if (json) {
+        char *line = cJSON_PrintUnformatted(json);
+        if (line) puts(line);
+        free(line);
+        cJSON_Delete(json);
+    }
+}
+
+/**
+ * @brief Resolve the imports of all files and print the result of every file
+ *
+ * @param graph Graph
+ * @param printJson Print one line of JSON per file instead of text
+ * @return int Number of files with unresolved imports, -1 if out of memory
+ */
+int depGraphResolve(DEP_GRAPH *graph, bool printJson) {
+    uint32_t size = 16;
+    while (size < graph->numberOfFiles * 2) size *= 2;
+    graph->fileTable = calloc(size, sizeof(uint32_t));
+    if (!graph->fileTable) return -1;
+    graph->fileTableSize = size;
+    /* With several DLLs of the same name, the first one examined is used */
+    for (uint32_t id = 0; id < graph->numberOfFiles; id++) {
+        if (findFile(graph, graph->files[id].baseName) >= 0) continue;
+        uint32_t slot = hashName(graph->strings + graph->files[id].baseName) & (size - 1);
+        while (graph->fileTable[slot]) slot = (slot + 1) & (size - 1);
+        graph->fileTable[slot] = id + 1;
+    }
+
+    /* Direct dependencies and missing imports of every file */
+    for (uint32_t id = 0; id < graph->numberOfFiles; id++) {
+        DEP_FILE *file = &graph->files[id];
+        file->firstDependency = graph->numberOfDependencies;
+        for (uint32_t i = 0; i < file->numberOfImports; i++) {
+            uint32_t provider = UINT32_MAX;
+            DEP_STATUS status = resolveImport(graph, &graph->imports[file->firstImport + i], &provider);
+            if (status == DEP_MISSING_DLL || status == DEP_MISSING_FUNCTION) file->missing = true;
+            /* Only examined DLLs are followed, a DLL importing from itself is not a dependency */
+            if (provider == UINT32_MAX || provider == id) continue;
+            if (graph->numberOfDependencies > file->firstDependency && graph->dependencies[graph->numberOfDependencies - 1] == provider) continue;
+            if (grow((void **)&graph->dependencies, &graph->dependenciesCapacity, graph->numberOfDependencies + 1, sizeof(uint32_t))) return -1;
+            graph->dependencies[graph->numberOfDependencies++] = provider;
+        }
+        file->numberOfDependencies = graph->numberOfDependencies - file->firstDependency;
+    }
+
+    /* Transitive closure of every file by depth first search, marking visited files with the id of the start + 1 */
+    uint32_t *visited = calloc(graph->numberOfFiles + 1, sizeof(uint32_t));
+    uint32_t *stack = malloc((graph->numberOfFiles + 1) * sizeof(uint32_t));
+    uint32_t *closure = malloc((graph->numberOfFiles + 1) * sizeof(uint32_t));
+    if (!visited || !stack || !closure) {
+        free(visited);
+        free(stack);
+        free(closure);
+        return -1;
+    }
+    int unresolved = 0;
+    for (uint32_t id = 0; id < graph->numberOfFiles; id++) {
+        uint32_t stackSize = 0, closureSize = 0;
+        visited[id] = id + 1;
+        stack[stackSize++] = id;
+        bool missing = graph->files[id].missing;
+        while (stackSize) {
+            const DEP_FILE *file = &graph->files[stack[--stackSize]];
+            for (uint32_t i = 0; i < file->numberOfDependencies; i++) {
+                uint32_t dependency = graph->dependencies[file->firstDependency + i];
+                if (visited[dependency] == id + 1) continue;
+                visited[dependency] = id + 1;
+                stack[stackSize++] = dependency;
+                closure[closureSize++] = dependency;
+                missing = missing || graph->files[dependency].missing;
+            }
+        }
+        if (missing) unresolved++;
+        printFile(graph, id, closure, closureSize, printJson);
+    }
+    free(visited);
+    free(stack);
+    free(closure);
+    return unresolved;
+}
+
+void depGraphFree(DEP_GRAPH *graph) {
+    if (!graph) return;
+    free(graph->strings);
+    free(graph->stringTable);
+    free(graph->files);
+    free(graph->imports);
+    free(graph->pendingExports);
+    free(graph->exportKeys);
+    free(graph->exportTable);
+    free(graph->fileTable);
+    free(graph->dependencies);
+    free(graph);
+}
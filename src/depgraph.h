@@ -0,0 +1,17 @@
+#ifndef DEPGRAPH_H
+#define DEPGRAPH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct DEP_GRAPH DEP_GRAPH;
+
+DEP_GRAPH *depGraphCreate(void);
+void depGraphStartFile(DEP_GRAPH *graph);
+int depGraphAddImport(DEP_GRAPH *graph, const char *dllName, const char *function, uint16_t ordinal);
+int depGraphAddExport(DEP_GRAPH *graph, const char *function, uint16_t ordinal);
+int depGraphEndFile(DEP_GRAPH *graph, const char *label);
+int depGraphResolve(DEP_GRAPH *graph, bool printJson);
+void depGraphFree(DEP_GRAPH *graph);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Shannon entropy of byte data, in bits per byte, for --entropy.
+ *
+ * The byte histogram is counted into four tables, one for each byte of a 32-bit word. Runs of equal bytes, which are
+ * common in padding and data sections, then increment different counters instead of waiting for the previous
+ * increment of the same counter to be stored.
+ */
+#include "entropy.h"
+
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Add the bytes of a buffer to a histogram
+ *
+ * @param counts Histogram, initialized to zero before the first call
+ * @param data Data
+ * @param size Size of data in bytes
+ */
+void entropyCount(uint64_t counts[256], const uint8_t *data, size_t size) {
+    /* 32-bit counters are flushed before they can overflow */
+    uint32_t tables[4][256];
+    while (size) {
+        size_t chunk = size < 0x40000000 ? size : 0x40000000;
+        memset(tables, 0, sizeof(tables));
+        size_t i = 0;
+        for (; i + 4 <= chunk; i += 4) {
+            tables[0][data[i]]++;
+            tables[1][data[i + 1]]++;
+            tables[2][data[i + 2]]++;
+            tables[3][data[i + 3]]++;
+        }
+        for (; i < chunk; i++) tables[0][data[i]]++;
+        for (int b = 0; b < 256; b++) counts[b] += (uint64_t)tables[0][b] + tables[1][b] + tables[2][b] + tables[3][b];
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+/**
+ * @brief Entropy of a histogram
+ *
+ * @return double Entropy between 0 and 8 bits per byte, 0 for no data
+ */
+double entropyOf(const uint64_t counts[256]) {
+    uint64_t total = 0;
+    for (int b = 0; b < 256; b++) total += counts[b];
+    if (!total) return 0;
+    double entropy = 0;
+    for (int b = 0; b < 256; b++) {
+        if (!counts[b]) continue;
+        double p = (double)counts[b] / total;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
@@ -0,0 +1,10 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void entropyCount(uint64_t counts[256], const uint8_t *data, size_t size);
+double entropyOf(const uint64_t counts[256]);
+
+#endif
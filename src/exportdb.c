@@ -0,0 +1,449 @@
+/*
+ * Names of functions exported by ordinal, so imports by ordinal can be printed by name.
+ *
+ * A few tables are compiled in, more can be loaded from a text file with one "DLL ORDINAL NAME" line per export, as
+ * written by --build-export-db. For every DLL the names are kept in an array indexed by ordinal, so resolving an
+ * ordinal is a single array access, and in a hash table of ordinals to check whether a name is exported.
+ *
+ * Export files of different Windows CE versions can be loaded as API versions. Every exported function then has a bit
+ * mask of the versions exporting it, indexed the same way, and the versions a file can run on are the intersection of
+ * the masks of its imports.
+ */
+#include "exportdb.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXPORT_DB_MAX_DLL_NAME 64
+#define EXPORT_DB_MAX_VERSIONS 32
+
+struct EXPORT_TABLE
+{
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    /** Name of every ordinal below numberOfOrdinals, NULL if unknown */
+    const char **names;
+    uint32_t numberOfOrdinals;
+    /** Open addressing table of ordinal + 1 by name, 0 marks a free slot */
+    uint32_t *nameTable;
+    uint32_t nameTableSize;
+    /** Loaded from a file built from the DLL, so names that are not listed are not exported */
+    bool complete;
+};
+
+typedef struct
+{
+    const char *dll;
+    uint16_t ordinal;
+    const char *name;
+} EXPORT_ENTRY;
+
+/** Ordinals fixed by the Windows Sockets 1.1 specification */
+#define WINSOCK_EXPORTS(dll)                                                                                            \
+    {dll, 1, "accept"}, {dll, 2, "bind"}, {dll, 3, "closesocket"}, {dll, 4, "connect"}, {dll, 5, "getpeername"},       \
+        {dll, 6, "getsockname"}, {dll, 7, "getsockopt"}, {dll, 8, "htonl"}, {dll, 9, "htons"}, {dll, 10, "inet_addr"}, \
+        {dll, 11, "inet_ntoa"}, {dll, 12, "ioctlsocket"}, {dll, 13, "listen"}, {dll, 14, "ntohl"},                     \
+        {dll, 15, "ntohs"}, {dll, 16, "recv"}, {dll, 17, "recvfrom"}, {dll, 18, "select"}, {dll, 19, "send"},          \
+        {dll, 20, "sendto"}, {dll, 21, "setsockopt"}, {dll, 22, "shutdown"}, {dll, 23, "socket"},                      \
+        {dll, 51, "gethostbyaddr"}, {dll, 52, "gethostbyname"}, {dll, 53, "getprotobyname"},                           \
+        {dll, 54, "getprotobynumber"}, {dll, 55, "getservbyname"}, {dll, 56, "getservbyport"},                         \
+        {dll, 57, "gethostname"}, {dll, 101, "WSAAsyncSelect"}, {dll, 102, "WSAAsyncGetHostByAddr"},                  \
+        {dll, 103, "WSAAsyncGetHostByName"}, {dll, 104, "WSAAsyncGetProtoByNumber"},                                   \
+        {dll, 105, "WSAAsyncGetProtoByName"}, {dll, 106, "WSAAsyncGetServByPort"},                                     \
+        {dll, 107, "WSAAsyncGetServByName"}, {dll, 108, "WSACancelAsyncRequest"}, {dll, 109, "WSASetBlockingHook"},    \
+        {dll, 110, "WSAUnhookBlockingHook"}, {dll, 111, "WSAGetLastError"}, {dll, 112, "WSASetLastError"},             \
+        {dll, 113, "WSACancelBlockingCall"}, {dll, 114, "WSAIsBlocking"}, {dll, 115, "WSAStartup"},                    \
+        {dll, 116, "WSACleanup"}, {dll, 151, "__WSAFDIsSet"}
+
+static const EXPORT_ENTRY builtinExports[] = {
+    WINSOCK_EXPORTS("winsock.dll"),
+    WINSOCK_EXPORTS("wsock32.dll"),
+};
+
+static EXPORT_TABLE *tables = NULL;
+static int numberOfTables = 0;
+static int builtinsLoaded = 0;
+
+struct EXPORT_VERSIONS
+{
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    /** Versions exporting every ordinal below numberOfOrdinals, a bit per entry of versions */
+    uint32_t *ordinalMasks;
+    uint32_t numberOfOrdinals;
+    /** Open addressing table of names, a NULL name marks a free slot */
+    const char **names;
+    uint32_t *nameMasks;
+    uint32_t nameTableSize;
+    uint32_t numberOfNames;
+};
+
+typedef struct
+{
+    char name[16];
+    double number;
+} API_VERSION;
+
+static EXPORT_VERSIONS *versionTables = NULL;
+static int numberOfVersionTables = 0;
+static API_VERSION versions[EXPORT_DB_MAX_VERSIONS];
+static int numberOfVersions = 0;
+
+static void lowerCase(char *out, const char *in, size_t size) {
+    size_t i = 0;
+    for (; in[i] && i < size - 1; i++) out[i] = tolower((unsigned char)in[i]);
+    out[i] = '\0';
+}
+
+static EXPORT_TABLE *findTable(const char *lowerCaseName) {
+    for (int i = 0; i < numberOfTables; i++) {
+        if (!strcmp(tables[i].dll, lowerCaseName)) return &tables[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Set the name of an ordinal, replacing a name that is already known
+ *
+ * @param dllName Name of the DLL
+ * @param ordinal Ordinal
+ * @param name Name of the function
+ * @param complete true if all names of the DLL are added
+ * @return int 0 on success, -1 if out of memory
+ */
+static int addExport(const char *dllName, uint16_t ordinal, const char *name, bool complete) {
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    lowerCase(dll, dllName, sizeof(dll));
+
+    EXPORT_TABLE *table = findTable(dll);
+    if (!table) {
+        EXPORT_TABLE *newTables = realloc(tables, (numberOfTables + 1) * sizeof(EXPORT_TABLE));
+        if (!newTables) return -1;
+        tables = newTables;
+        table = &tables[numberOfTables++];
+        memset(table, 0, sizeof(EXPORT_TABLE));
+        strcpy(table->dll, dll);
+    }
+
+    if (ordinal >= table->numberOfOrdinals) {
+        uint32_t numberOfOrdinals = table->numberOfOrdinals ? table->numberOfOrdinals : 256;
+        while (numberOfOrdinals <= ordinal) numberOfOrdinals *= 2;
+        const char **names = realloc(table->names, numberOfOrdinals * sizeof(const char *));
+        if (!names) return -1;
+        memset(names + table->numberOfOrdinals, 0, (numberOfOrdinals - table->numberOfOrdinals) * sizeof(const char *));
+        table->names = names;
+        table->numberOfOrdinals = numberOfOrdinals;
+    }
+    table->names[ordinal] = name;
+    if (complete) table->complete = true;
+    return 0;
+}
+
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+/**
+ * @brief Rebuild the name hash table of a DLL after names were added
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+static int indexNames(EXPORT_TABLE *table) {
+    uint32_t numberOfNames = 0;
+    for (uint32_t ordinal = 0; ordinal < table->numberOfOrdinals; ordinal++) {
+        if (table->names[ordinal]) numberOfNames++;
+    }
+    uint32_t size = 16;
+    while (size < numberOfNames * 2) size *= 2;
+    uint32_t *nameTable = calloc(size, sizeof(uint32_t));
+    if (!nameTable) return -1;
+    for (uint32_t ordinal = 0; ordinal < table->numberOfOrdinals; ordinal++) {
+        if (!table->names[ordinal]) continue;
+        uint32_t slot = hashName(table->names[ordinal]) & (size - 1);
+        while (nameTable[slot]) slot = (slot + 1) & (size - 1);
+        nameTable[slot] = ordinal + 1;
+    }
+    free(table->nameTable);
+    table->nameTable = nameTable;
+    table->nameTableSize = size;
+    return 0;
+}
+
+static int indexAllNames(void) {
+    for (int i = 0; i < numberOfTables; i++) {
+        if (indexNames(&tables[i])) return -1;
+    }
+    return 0;
+}
+
+static int loadBuiltins(void) {
+    if (builtinsLoaded) return 0;
+    builtinsLoaded = 1;
+    for (size_t i = 0; i < sizeof(builtinExports) / sizeof(builtinExports[0]); i++) {
+        if (addExport(builtinExports[i].dll, builtinExports[i].ordinal, builtinExports[i].name, false)) return -1;
+    }
+    return indexAllNames();
+}
+
+/**
+ * @brief Read a text file with one "DLL ORDINAL NAME" line per export. Empty lines and lines starting with # are
+ * ignored.
+ *
+ * @param path Path of the file
+ * @param add Called for every export, the name stays valid for the rest of the run
+ * @param context Passed to add
+ * @return int 0 on success, -1 on error with errno set. Errors in the file are also printed.
+ */
+static int readExportFile(const char *path, int (*add)(const char *dll, uint16_t ordinal, const char *name, void *context), void *context) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    size_t size = 0, capacity = 65536;
+    char *data = malloc(capacity + 1);
+    size_t n;
+    while (data && (n = fread(data + size, 1, capacity - size, fp)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            char *newData = realloc(data, capacity + 1);
+            if (!newData) free(data);
+            data = newData;
+        }
+    }
+    int failed = !data || ferror(fp);
+    fclose(fp);
+    if (failed) {
+        free(data);
+        return -1;
+    }
+    data[size] = '\0';
+
+    /* The names point into data, which is kept for the rest of the run */
+    int lineNumber = 0;
+    char *next = data;
+    while (*next) {
+        char *line = next;
+        lineNumber++;
+        next = line + strcspn(line, "\n");
+        if (*next) *next++ = '\0';
+        line[strcspn(line, "\r")] = '\0';
+
+        char *dll = strtok(line, " \t");
+        if (!dll || dll[0] == '#') continue;
+        char *ordinal = strtok(NULL, " \t");
+        char *name = strtok(NULL, " \t");
+        char *end = NULL;
+        unsigned long value = ordinal ? strtoul(ordinal, &end, 10) : 0;
+        if (!name || *end || value > UINT16_MAX) {
+            fprintf(stderr, "Error: %s:%d: expected DLL ORDINAL NAME\n", path, lineNumber);
+            errno = EINVAL;
+            return -1;
+        }
+        if (add(dll, value, name, context)) return -1;
+    }
+    return 0;
+}
+
+static int addLoadedExport(const char *dll, uint16_t ordinal, const char *name, void *context) {
+    (void)context;
+    return addExport(dll, ordinal, name, true);
+}
+
+/**
+ * @brief Load export names from a text file with one "DLL ORDINAL NAME" line per export. Empty lines and lines
+ * starting with # are ignored. Names from the file replace compiled-in names.
+ *
+ * @param path Path of the file
+ * @return int 0 on success, -1 on error with errno set. Errors in the file are also printed.
+ */
+int exportDbLoad(const char *path) {
+    if (loadBuiltins()) return -1;
+    if (readExportFile(path, addLoadedExport, NULL)) return -1;
+    return indexAllNames();
+}
+
+/**
+ * @brief Find the export names of a DLL
+ *
+ * @param dllName Name of the DLL as imported, case is ignored
+ * @return const EXPORT_TABLE* Export names, NULL if none are known
+ */
+const EXPORT_TABLE *exportDbFind(const char *dllName) {
+    if (loadBuiltins()) return NULL;
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    lowerCase(dll, dllName, sizeof(dll));
+    return findTable(dll);
+}
+
+/**
+ * @brief Name of an ordinal
+ *
+ * @return const char* Name, NULL if unknown
+ */
+const char *exportDbName(const EXPORT_TABLE *table, uint16_t ordinal) {
+    return ordinal < table->numberOfOrdinals ? table->names[ordinal] : NULL;
+}
+
+/**
+ * @brief Check whether a function is exported by name
+ */
+bool exportDbHasName(const EXPORT_TABLE *table, const char *name) {
+    uint32_t mask = table->nameTableSize - 1;
+    for (uint32_t slot = hashName(name) & mask; table->nameTable[slot]; slot = (slot + 1) & mask) {
+        if (!strcmp(table->names[table->nameTable[slot] - 1], name)) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Check whether the names of a DLL were loaded from a file built from the DLL. Only then a name that is not
+ * known is known not to be exported; the compiled-in tables only hold some of the exports.
+ */
+bool exportDbIsComplete(const EXPORT_TABLE *table) {
+    return table->complete;
+}
+
+static EXPORT_VERSIONS *findVersions(const char *lowerCaseName) {
+    for (int i = 0; i < numberOfVersionTables; i++) {
+        if (!strcmp(versionTables[i].dll, lowerCaseName)) return &versionTables[i];
+    }
+    return NULL;
+}
+
+static int growNameMasks(EXPORT_VERSIONS *table) {
+    uint32_t size = table->nameTableSize ? table->nameTableSize * 2 : 256;
+    const char **names = calloc(size, sizeof(const char *));
+    uint32_t *nameMasks = calloc(size, sizeof(uint32_t));
+    if (!names || !nameMasks) {
+        free(names);
+        free(nameMasks);
+        return -1;
+    }
+    for (uint32_t i = 0; i < table->nameTableSize; i++) {
+        if (!table->names[i]) continue;
+        uint32_t slot = hashName(table->names[i]) & (size - 1);
+        while (names[slot]) slot = (slot + 1) & (size - 1);
+        names[slot] = table->names[i];
+        nameMasks[slot] = table->nameMasks[i];
+    }
+    free(table->names);
+    free(table->nameMasks);
+    table->names = names;
+    table->nameMasks = nameMasks;
+    table->nameTableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Mark an export as exported by a version
+ *
+ * @param context Points to the index of the version
+ * @return int 0 on success, -1 if out of memory
+ */
+static int addVersionExport(const char *dllName, uint16_t ordinal, const char *name, void *context) {
+    uint32_t bit = 1u << *(int *)context;
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    lowerCase(dll, dllName, sizeof(dll));
+
+    EXPORT_VERSIONS *table = findVersions(dll);
+    if (!table) {
+        EXPORT_VERSIONS *newTables = realloc(versionTables, (numberOfVersionTables + 1) * sizeof(EXPORT_VERSIONS));
+        if (!newTables) return -1;
+        versionTables = newTables;
+        table = &versionTables[numberOfVersionTables++];
+        memset(table, 0, sizeof(EXPORT_VERSIONS));
+        strcpy(table->dll, dll);
+    }
+
+    if (ordinal >= table->numberOfOrdinals) {
+        uint32_t numberOfOrdinals = table->numberOfOrdinals ? table->numberOfOrdinals : 256;
+        while (numberOfOrdinals <= ordinal) numberOfOrdinals *= 2;
+        uint32_t *ordinalMasks = realloc(table->ordinalMasks, numberOfOrdinals * sizeof(uint32_t));
+        if (!ordinalMasks) return -1;
+        memset(ordinalMasks + table->numberOfOrdinals, 0, (numberOfOrdinals - table->numberOfOrdinals) * sizeof(uint32_t));
+        table->ordinalMasks = ordinalMasks;
+        table->numberOfOrdinals = numberOfOrdinals;
+    }
+    table->ordinalMasks[ordinal] |= bit;
+
+    if ((table->numberOfNames + 1) * 2 > table->nameTableSize && growNameMasks(table)) return -1;
+    uint32_t mask = table->nameTableSize - 1;
+    uint32_t slot = hashName(name) & mask;
+    while (table->names[slot] && strcmp(table->names[slot], name)) slot = (slot + 1) & mask;
+    if (!table->names[slot]) {
+        table->names[slot] = name;
+        table->numberOfNames++;
+    }
+    table->nameMasks[slot] |= bit;
+    return 0;
+}
+
+/**
+ * @brief Load the exports of a Windows CE version from a text file with one "DLL ORDINAL NAME" line per export, as
+ * written by --build-export-db from the DLLs in ROM of that version
+ *
+ * @param version Version number, such as 4.20
+ * @param path Path of the file
+ * @return int 0 on success, -1 on error with errno set. Errors in the file are also printed.
+ */
+int exportDbLoadVersion(const char *version, const char *path) {
+    char *end;
+    double number = strtod(version, &end);
+    if (end == version || *end || strlen(version) >= sizeof(versions[0].name) || numberOfVersions == EXPORT_DB_MAX_VERSIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+    int index = numberOfVersions;
+    strcpy(versions[index].name, version);
+    versions[index].number = number;
+    numberOfVersions++;
+    return readExportFile(path, addVersionExport, &index);
+}
+
+/**
+ * @brief Find the versions exporting the functions of a DLL
+ *
+ * @param dllName Name of the DLL as imported, case is ignored
+ * @return const EXPORT_VERSIONS* Versions, NULL if the DLL is not in any loaded version
+ */
+const EXPORT_VERSIONS *exportDbFindVersions(const char *dllName) {
+    char dll[EXPORT_DB_MAX_DLL_NAME];
+    lowerCase(dll, dllName, sizeof(dll));
+    return findVersions(dll);
+}
+
+/**
+ * @brief Versions exporting a function
+ *
+ * @param table Versions of the DLL
+ * @param name Name of the function, NULL if imported by ordinal
+ * @param ordinal Ordinal if name is NULL
+ * @return uint32_t Bit mask of versions, 0 if no loaded version exports it
+ */
+uint32_t exportDbVersionMask(const EXPORT_VERSIONS *table, const char *name, uint16_t ordinal) {
+    if (!name) return ordinal < table->numberOfOrdinals ? table->ordinalMasks[ordinal] : 0;
+    uint32_t mask = table->nameTableSize - 1;
+    for (uint32_t slot = hashName(name) & mask; table->names[slot]; slot = (slot + 1) & mask) {
+        if (!strcmp(table->names[slot], name)) return table->nameMasks[slot];
+    }
+    return 0;
+}
+
+/**
+ * @brief Lowest version in a mask of versions
+ *
+ * @return const char* Version number as loaded, NULL if the mask is empty
+ */
+const char *exportDbMinVersion(uint32_t versionMask) {
+    const char *minVersion = NULL;
+    double minNumber = 0;
+    for (int i = 0; i < numberOfVersions; i++) {
+        if (!(versionMask & (1u << i)) || (minVersion && versions[i].number >= minNumber)) continue;
+        minVersion = versions[i].name;
+        minNumber = versions[i].number;
+    }
+    return minVersion;
+}
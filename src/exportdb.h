@@ -0,0 +1,23 @@
+#ifndef EXPORTDB_H
+#define EXPORTDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Export names of one DLL, indexed by ordinal */
+typedef struct EXPORT_TABLE EXPORT_TABLE;
+/** Windows CE versions exporting the functions of one DLL */
+typedef struct EXPORT_VERSIONS EXPORT_VERSIONS;
+
+int exportDbLoad(const char *path);
+const EXPORT_TABLE *exportDbFind(const char *dllName);
+const char *exportDbName(const EXPORT_TABLE *table, uint16_t ordinal);
+bool exportDbHasName(const EXPORT_TABLE *table, const char *name);
+bool exportDbIsComplete(const EXPORT_TABLE *table);
+
+int exportDbLoadVersion(const char *version, const char *path);
+const EXPORT_VERSIONS *exportDbFindVersions(const char *dllName);
+uint32_t exportDbVersionMask(const EXPORT_VERSIONS *table, const char *name, uint16_t ordinal);
+const char *exportDbMinVersion(uint32_t versionMask);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_MD5 0x1
+#define HASH_SHA1 0x2
+#define HASH_SHA256 0x4
+#define HASH_ALL (HASH_MD5 | HASH_SHA1 | HASH_SHA256)
+
+/** Size of a buffer for the longest digest as hex string, including the terminator */
+#define HASH_MAX_HEX 65
+
+/** State of one algorithm */
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+} HASH_STATE;
+
+/** States of all selected algorithms, so data is passed over once for all of them */
+typedef struct
+{
+    unsigned algorithms;
+    HASH_STATE md5;
+    HASH_STATE sha1;
+    HASH_STATE sha256;
+} HASH_CONTEXT;
+
+unsigned hashParseAlgorithms(const char *list);
+const char *hashAlgorithmName(unsigned algorithm);
+void hashInit(HASH_CONTEXT *context, unsigned algorithms);
+void hashUpdate(HASH_CONTEXT *context, const uint8_t *data, size_t size);
+void hashFinal(HASH_CONTEXT *context, unsigned algorithm, char *hex);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * Minimal raw deflate (RFC 1951) decoder for ZIP members.
+ *
+ * Decodes into a caller supplied buffer in one call. Huffman codes up to FAST_BITS long are decoded with a lookup
+ * table, longer codes fall back to canonical bit by bit decoding.
+ */
+#include "inflate.h"
+
+#include <string.h>
+
+#define MAX_BITS 15
+#define MAX_LITERAL_CODES 288
+#define MAX_DISTANCE_CODES 30
+#define FAST_BITS 9
+
+/** Reading past the end of the input returns zero bits, but only this many bytes before failing */
+#define MAX_INPUT_PADDING 4
+
+typedef struct
+{
+    uint16_t count[MAX_BITS + 1];
+    uint16_t symbol[MAX_LITERAL_CODES];
+    /** Symbol in the lower 9 bits and code length above, 0 if the code is longer than FAST_BITS */
+    uint16_t fast[1 << FAST_BITS];
+} HUFFMAN;
+
+typedef struct
+{
+    const uint8_t *in;
+    size_t inSize;
+    size_t inPos;
+    uint32_t bitBuffer;
+    int bitCount;
+    int padding;
+    uint8_t *out;
+    size_t outSize;
+    size_t outPos;
+} INFLATE_STATE;
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t codeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static int fillBits(INFLATE_STATE *s, int need) {
+    while (s->bitCount < need) {
+        uint32_t byte = 0;
+        if (s->inPos < s->inSize) {
+            byte = s->in[s->inPos++];
+        } else if (++s->padding > MAX_INPUT_PADDING) {
+            return -1;
+        }
+        s->bitBuffer |= byte << s->bitCount;
+        s->bitCount += 8;
+    }
+    return 0;
+}
+
+static int bits(INFLATE_STATE *s, int need) {
+    if (fillBits(s, need)) return -1;
+    int value = s->bitBuffer & ((1u << need) - 1);
+    s->bitBuffer >>= need;
+    s->bitCount -= need;
+    return value;
+}
+
+/**
+ * @brief Build decoding tables from code lengths
+ *
+ * @return int 0 on success, -1 if the lengths are over-subscribed
+ */
+static int buildHuffman(HUFFMAN *h, const uint8_t *lengths, int n) {
+    uint16_t offsets[MAX_BITS + 1];
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < n; i++) h->count[lengths[i]]++;
+    if (h->count[0] == n) return 0;
+
+    int left = 1;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) return -1;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++) offsets[len + 1] = offsets[len] + h->count[len];
+    for (int i = 0; i < n; i++) {
+        if (lengths[i]) h->symbol[offsets[lengths[i]]++] = i;
+    }
+
+    /* Canonical codes are assigned in symbol order within each length. Deflate sends them MSB first, so the table
+     * is indexed by the bit-reversed code. */
+    int code = 0, index = 0;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        for (int i = 0; i < h->count[len]; i++, code++) {
+            uint16_t symbol = h->symbol[index++];
+            if (len > FAST_BITS) continue;
+            int reversed = 0;
+            for (int b = 0; b < len; b++) reversed |= ((code >> b) & 1) << (len - 1 - b);
+            for (int k = reversed; k < (1 << FAST_BITS); k += 1 << len) h->fast[k] = symbol | (len << 9);
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+static int decode(INFLATE_STATE *s, const HUFFMAN *h) {
+    if (fillBits(s, FAST_BITS) == 0) {
+        uint16_t entry = h->fast[s->bitBuffer & ((1 << FAST_BITS) - 1)];
+        if (entry) {
+            s->bitBuffer >>= entry >> 9;
+            s->bitCount -= entry >> 9;
+            return entry & 0x1FF;
+        }
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= MAX_BITS; len++) {
+        int bit = bits(s, 1);
+        if (bit < 0) return -1;
+        code |= bit;
+        int count = h->count[len];
+        if (code - count < first) return h->symbol[index + (code - first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int inflateStored(INFLATE_STATE *s) {
+    /* Discard the remaining bits of the current byte */
+    s->bitBuffer >>= s->bitCount & 7;
+    s->bitCount -= s->bitCount & 7;
+
+    int len = bits(s, 16);
+    int nlen = bits(s, 16);
+    if (len < 0 || nlen < 0 || len != (~nlen & 0xFFFF)) return INFLATE_ERROR;
+
+    size_t remaining = len;
+    while (remaining && s->bitCount) {
+        if (s->outPos == s->outSize) return INFLATE_OUTPUT_FULL;
+        s->out[s->outPos++] = bits(s, 8);
+        remaining--;
+    }
+    if (s->inSize - s->inPos < remaining) return INFLATE_ERROR;
+    size_t copy = remaining;
+    if (copy > s->outSize - s->outPos) copy = s->outSize - s->outPos;
+    memcpy(s->out + s->outPos, s->in + s->inPos, copy);
+    s->outPos += copy;
+    s->inPos += copy;
+    return copy == remaining ? INFLATE_OK : INFLATE_OUTPUT_FULL;
+}
+
+static int inflateCodes(INFLATE_STATE *s, const HUFFMAN *literals, const HUFFMAN *distances) {
+    for (;;) {
+        int symbol = decode(s, literals);
+        if (symbol < 0) return INFLATE_ERROR;
+        if (symbol < 256) {
+            if (s->outPos == s->outSize) return INFLATE_OUTPUT_FULL;
+            s->out[s->outPos++] = symbol;
+        } else if (symbol == 256) {
+            return INFLATE_OK;
+        } else {
+            symbol -= 257;
+            if (symbol >= 29) return INFLATE_ERROR;
+            int extra = bits(s, lengthExtra[symbol]);
+            if (extra < 0) return INFLATE_ERROR;
+            size_t length = lengthBase[symbol] + extra;
+
+            symbol = decode(s, distances);
+            if (symbol < 0 || symbol >= MAX_DISTANCE_CODES) return INFLATE_ERROR;
+            extra = bits(s, distanceExtra[symbol]);
+            if (extra < 0) return INFLATE_ERROR;
+            size_t distance = distanceBase[symbol] + extra;
+            if (distance > s->outPos) return INFLATE_ERROR;
+
+            int full = 0;
+            if (length > s->outSize - s->outPos) {
+                length = s->outSize - s->outPos;
+                full = 1;
+            }
+            uint8_t *dst = s->out + s->outPos;
+            const uint8_t *src = dst - distance;
+            for (size_t i = 0; i < length; i++) dst[i] = src[i];
+            s->outPos += length;
+            if (full) return INFLATE_OUTPUT_FULL;
+        }
+    }
+}
+
+static int inflateFixed(INFLATE_STATE *s) {
+    HUFFMAN literals, distances;
+    uint8_t lengths[MAX_LITERAL_CODES];
+    int i;
+    for (i = 0; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < MAX_LITERAL_CODES; i++) lengths[i] = 8;
+    buildHuffman(&literals, lengths, MAX_LITERAL_CODES);
+    for (i = 0; i < MAX_DISTANCE_CODES; i++) lengths[i] = 5;
+    buildHuffman(&distances, lengths, MAX_DISTANCE_CODES);
+    return inflateCodes(s, &literals, &distances);
+}
+
+static int inflateDynamic(INFLATE_STATE *s) {
+    HUFFMAN literals, distances;
+    uint8_t lengths[MAX_LITERAL_CODES + MAX_DISTANCE_CODES];
+
+    int nlen = bits(s, 5) + 257;
+    int ndist = bits(s, 5) + 1;
+    int ncode = bits(s, 4) + 4;
+    if (nlen < 257 || nlen > MAX_LITERAL_CODES || ndist < 1 || ndist > MAX_DISTANCE_CODES || ncode < 4) return INFLATE_ERROR;
+
+    memset(lengths, 0, sizeof(lengths));
+    for (int i = 0; i < ncode; i++) {
+        int len = bits(s, 3);
+        if (len < 0) return INFLATE_ERROR;
+        lengths[codeLengthOrder[i]] = len;
+    }
+    if (buildHuffman(&literals, lengths, 19)) return INFLATE_ERROR;
+
+    int index = 0;
+    while (index < nlen + ndist) {
+        int symbol = decode(s, &literals);
+        if (symbol < 0) return INFLATE_ERROR;
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+        int len = 0, repeat;
+        if (symbol == 16) {
+            if (index == 0) return INFLATE_ERROR;
+            len = lengths[index - 1];
+            repeat = 3 + bits(s, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + bits(s, 3);
+        } else {
+            repeat = 11 + bits(s, 7);
+        }
+        if (repeat < 3 || index + repeat > nlen + ndist) return INFLATE_ERROR;
+        while (repeat--) lengths[index++] = len;
+    }
+    if (lengths[256] == 0) return INFLATE_ERROR;
+
+    if (buildHuffman(&literals, lengths, nlen)) return INFLATE_ERROR;
+    if (buildHuffman(&distances, lengths + nlen, ndist)) return INFLATE_ERROR;
+    return inflateCodes(s, &literals, &distances);
+}
+
+/**
+ * @brief Decompress a raw deflate stream
+ *
+ * @param in Compressed data
+ * @param inSize Size of compressed data
+ * @param out Output buffer
+ * @param outSize Size of output buffer
+ * @param outLen Number of bytes written to out
+ * @return int INFLATE_OK, INFLATE_OUTPUT_FULL if out is too small for the whole stream, or INFLATE_ERROR
+ */
+int inflateRaw(const uint8_t *in, size_t inSize, uint8_t *out, size_t outSize, size_t *outLen) {
+    INFLATE_STATE s;
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.inSize = inSize;
+    s.out = out;
+    s.outSize = outSize;
+
+    int last, status;
+    do {
+        last = bits(&s, 1);
+        int type = bits(&s, 2);
+        if (last < 0 || type < 0) {
+            status = INFLATE_ERROR;
+            break;
+        }
+        switch (type) {
+            case 0:
+                status = inflateStored(&s);
+                break;
+            case 1:
+                status = inflateFixed(&s);
+                break;
+            case 2:
+                status = inflateDynamic(&s);
+                break;
+            default:
+                status = INFLATE_ERROR;
+        }
+    } while (!last && status == INFLATE_OK);
+
+    *outLen = s.outPos;
+    return status;
+}
@@ -0,0 +1,14 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INFLATE_OK 0
+/** The output buffer was filled before the end of the deflate stream */
+#define INFLATE_OUTPUT_FULL 1
+#define INFLATE_ERROR -1
+
+int inflateRaw(const uint8_t *in, size_t inSize, uint8_t *out, size_t outSize, size_t *outLen);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Walk the directory tree of ISO 9660 images, using the Joliet tree for long names when it is present.
+ *
+ * Files are never copied: every file extent is handed out as a slice of the mapped image. All directories are read
+ * first and the files are then visited in the order of their position on the disc, so a whole image is read front to
+ * back.
+ */
+#include "iso9660.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ISO_SECTOR_SIZE 2048
+#define ISO_FIRST_VOLUME_DESCRIPTOR 16
+#define ISO_MAX_VOLUME_DESCRIPTORS 64
+
+#define ISO_VD_PRIMARY 1
+#define ISO_VD_SUPPLEMENTARY 2
+#define ISO_VD_TERMINATOR 255
+#define ISO_VD_ROOT_RECORD_OFFSET 156
+#define ISO_VD_ESCAPE_SEQUENCES_OFFSET 88
+
+#define ISO_RECORD_MIN_SIZE 33
+#define ISO_RECORD_EXTENT_OFFSET 2
+#define ISO_RECORD_SIZE_OFFSET 10
+#define ISO_RECORD_FLAGS_OFFSET 25
+#define ISO_RECORD_NAME_LENGTH_OFFSET 32
+#define ISO_RECORD_NAME_OFFSET 33
+
+#define ISO_FLAG_DIRECTORY 0x02
+#define ISO_FLAG_MULTI_EXTENT 0x80
+
+/** Directories nested deeper than this are ignored */
+#define ISO_MAX_DEPTH 64
+
+#define ISO_MAX_NAME 1024
+
+typedef struct
+{
+    char *path;
+    uint32_t extent;
+    uint32_t size;
+} ISO_ENTRY;
+
+typedef struct
+{
+    ISO_ENTRY *entries;
+    size_t count;
+    size_t capacity;
+} ISO_ENTRY_LIST;
+
+/** Open addressing table of the directories read so far, keyed by extent */
+typedef struct
+{
+    /** Directory index + 1 by extent, 0 marks a free slot */
+    uint32_t *slots;
+    uint32_t size;
+} ISO_DIRECTORY_TABLE;
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const uint8_t *volumeDescriptor(PE_FILE *image, int index) {
+    const uint8_t *descriptor = pePtr(image, (size_t)(ISO_FIRST_VOLUME_DESCRIPTOR + index) * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE);
+    if (!descriptor || memcmp(descriptor + 1, "CD001", 5)) return NULL;
+    return descriptor;
+}
+
+bool isoDetect(PE_FILE *image) {
+    return volumeDescriptor(image, 0) != NULL;
+}
+
+static bool isJoliet(const uint8_t *descriptor) {
+    const uint8_t *escape = descriptor + ISO_VD_ESCAPE_SEQUENCES_OFFSET;
+    return escape[0] == '%' && escape[1] == '/' && (escape[2] == '@' || escape[2] == 'C' || escape[2] == 'E');
+}
+
+static int appendEntry(ISO_ENTRY_LIST *list, char *path, uint32_t extent, uint32_t size) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        ISO_ENTRY *entries = realloc(list->entries, capacity * sizeof(ISO_ENTRY));
+        if (!entries) return -1;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    ISO_ENTRY *entry = &(list->entries[list->count++]);
+    entry->path = path;
+    entry->extent = extent;
+    entry->size = size;
+    return 0;
+}
+
+static void freeEntries(ISO_ENTRY_LIST *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->entries[i].path);
+    free(list->entries);
+}
+
+/**
+ * @brief Convert a directory record name to UTF-8 and strip the ";1" version suffix
+ */
+static void recordName(char *out, const uint8_t *name, int length, bool joliet) {
+    char *p = out;
+    if (joliet) {
+        /* UCS-2 big endian */
+        for (int i = 0; i + 1 < length && p < out + ISO_MAX_NAME - 4; i += 2) {
+            uint16_t c = (name[i] << 8) | name[i + 1];
+            if (c < 0x80) {
+                *p++ = c;
+            } else if (c < 0x800) {
+                *p++ = 0xC0 | (c >> 6);
+                *p++ = 0x80 | (c & 0x3F);
+            } else {
+                *p++ = 0xE0 | (c >> 12);
+                *p++ = 0x80 | ((c >> 6) & 0x3F);
+                *p++ = 0x80 | (c & 0x3F);
+            }
+        }
+    } else {
+        for (int i = 0; i < length && p < out + ISO_MAX_NAME - 1; i++) *p++ = name[i];
+    }
+    *p = '\0';
+
+    char *version = strrchr(out, ';');
+    if (version) *version = '\0';
+    size_t len = strlen(out);
+    if (len > 1 && out[len - 1] == '.') out[len - 1] = '\0';
+}
+
+static char *joinPath(const char *directory, const char *name) {
+    char *path = malloc(strlen(directory) + strlen(name) + 2);
+    if (!path) return NULL;
+    sprintf(path, "%s%s%s", directory, *directory ? "/" : "", name);
+    return path;
+}
+
+static uint32_t hashExtent(uint32_t extent) {
+    return extent * 2654435761u;
+}
+
+static uint32_t *directorySlot(const ISO_DIRECTORY_TABLE *table, const ISO_ENTRY_LIST *directories, uint32_t extent) {
+    uint32_t mask = table->size - 1;
+    uint32_t slot = hashExtent(extent) & mask;
+    while (table->slots[slot] && directories->entries[table->slots[slot] - 1].extent != extent) slot = (slot + 1) & mask;
+    return &(table->slots[slot]);
+}
+
+static bool knownDirectory(const ISO_DIRECTORY_TABLE *table, const ISO_ENTRY_LIST *directories, uint32_t extent) {
+    return *directorySlot(table, directories, extent) != 0;
+}
+
+/**
+ * @brief Add the last directory of `directories` to the table, growing it to stay at most half full
+ */
+static int addDirectory(ISO_DIRECTORY_TABLE *table, const ISO_ENTRY_LIST *directories) {
+    if (directories->count * 2 > table->size) {
+        uint32_t size = table->size ? table->size * 2 : 256;
+        uint32_t *slots = calloc(size, sizeof(uint32_t));
+        if (!slots) return -1;
+        free(table->slots);
+        table->slots = slots;
+        table->size = size;
+        for (size_t i = 0; i + 1 < directories->count; i++) {
+            *directorySlot(table, directories, directories->entries[i].extent) = i + 1;
+        }
+    }
+    *directorySlot(table, directories, directories->entries[directories->count - 1].extent) = directories->count;
+    return 0;
+}
+
+static int pathDepth(const char *path) {
+    int depth = 1;
+    for (; *path; path++) depth += *path == '/';
+    return depth;
+}
+
+/**
+ * @brief Read all directories breadth first, collecting files in `files`
+ */
+static int readTree(PE_FILE *image, const uint8_t *rootRecord, bool joliet, ISO_ENTRY_LIST *files) {
+    ISO_ENTRY_LIST directories = {NULL, 0, 0};
+    ISO_DIRECTORY_TABLE directoryTable = {NULL, 0};
+    char name[ISO_MAX_NAME];
+    int status = 0;
+
+    char *rootPath = calloc(1, 1);
+    if (!rootPath || appendEntry(&directories, rootPath, le32(rootRecord + ISO_RECORD_EXTENT_OFFSET), le32(rootRecord + ISO_RECORD_SIZE_OFFSET))) {
+        free(rootPath);
+        return -1;
+    }
+    if (addDirectory(&directoryTable, &directories)) {
+        freeEntries(&directories);
+        return -1;
+    }
+
+    for (size_t d = 0; d < directories.count; d++) {
+        ISO_ENTRY directory = directories.entries[d];
+        size_t start = (size_t)directory.extent * ISO_SECTOR_SIZE;
+        const uint8_t *data = pePtr(image, start, directory.size);
+        if (!data) {
+            /* Without the root directory there is nothing to examine */
+            if (d == 0) {
+                status = -1;
+                break;
+            }
+            fprintf(stderr, "Warning: %s: directory is outside of the image\n", directory.path);
+            continue;
+        }
+
+        uint32_t pos = 0;
+        while (pos + ISO_RECORD_MIN_SIZE <= directory.size) {
+            const uint8_t *record = data + pos;
+            uint8_t length = record[0];
+            if (length == 0) {
+                /* Records don't cross sector boundaries, the rest of the sector is padding */
+                pos = (pos / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+                continue;
+            }
+            if (length < ISO_RECORD_MIN_SIZE || pos + length > directory.size) break;
+            pos += length;
+
+            uint8_t nameLength = record[ISO_RECORD_NAME_LENGTH_OFFSET];
+            if (ISO_RECORD_NAME_OFFSET + nameLength > length) continue;
+            const uint8_t *recordNameData = record + ISO_RECORD_NAME_OFFSET;
+
+            /* "." and ".." */
+            if (nameLength == 1 && (recordNameData[0] == 0 || recordNameData[0] == 1)) continue;
+
+            uint8_t flags = record[ISO_RECORD_FLAGS_OFFSET];
+            uint32_t extent = le32(record + ISO_RECORD_EXTENT_OFFSET);
+            uint32_t size = le32(record + ISO_RECORD_SIZE_OFFSET);
+
+            if (flags & ISO_FLAG_DIRECTORY) {
+                /* Damaged or crafted images can link back to a parent directory */
+                if (knownDirectory(&directoryTable, &directories, extent) || pathDepth(directory.path) > ISO_MAX_DEPTH) continue;
+            } else if (flags & ISO_FLAG_MULTI_EXTENT) {
+                /* Only files > 4 GiB are split into several extents, those are not executables */
+                continue;
+            }
+
+            recordName(name, recordNameData, nameLength, joliet);
+            char *path = joinPath(directory.path, name);
+            ISO_ENTRY_LIST *list = (flags & ISO_FLAG_DIRECTORY) ? &directories : files;
+            if (!path || appendEntry(list, path, extent, size)) {
+                free(path);
+                status = -1;
+                goto done;
+            }
+            if (list == &directories && addDirectory(&directoryTable, &directories)) {
+                status = -1;
+                goto done;
+            }
+        }
+    }
+
+done:
+    free(directoryTable.slots);
+    freeEntries(&directories);
+    return status;
+}
+
+static int compareExtents(const void *a, const void *b) {
+    const ISO_ENTRY *e1 = a, *e2 = b;
+    return (e1->extent > e2->extent) - (e1->extent < e2->extent);
+}
+
+/**
+ * @brief Call callback for every executable in an ISO 9660 image
+ *
+ * @param image Mapped image
+ * @param callback Called for every file starting with an MZ header, with a slice of the image
+ * @param context Passed to callback
+ * @return int 0 on success, -1 if the image is damaged
+ */
+int isoForEachMember(PE_FILE *image, ARCHIVE_MEMBER_CALLBACK callback, void *context) {
+    const uint8_t *primary = NULL, *joliet = NULL;
+    for (int i = 0; i < ISO_MAX_VOLUME_DESCRIPTORS; i++) {
+        const uint8_t *descriptor = volumeDescriptor(image, i);
+        if (!descriptor || descriptor[0] == ISO_VD_TERMINATOR) break;
+        if (descriptor[0] == ISO_VD_PRIMARY && !primary) primary = descriptor;
+        if (descriptor[0] == ISO_VD_SUPPLEMENTARY && isJoliet(descriptor) && !joliet) joliet = descriptor;
+    }
+    if (!primary && !joliet) return -1;
+
+    ISO_ENTRY_LIST files = {NULL, 0, 0};
+    const uint8_t *descriptor = joliet ? joliet : primary;
+    if (readTree(image, descriptor + ISO_VD_ROOT_RECORD_OFFSET, joliet != NULL, &files)) {
+        freeEntries(&files);
+        return -1;
+    }
+
+    /* Visit files in disc order so the image is read sequentially */
+    qsort(files.entries, files.count, sizeof(ISO_ENTRY), compareExtents);
+
+    for (size_t i = 0; i < files.count; i++) {
+        ISO_ENTRY *file = &(files.entries[i]);
+        if (file->size < 2) continue;
+        const uint8_t *data = pePtr(image, (size_t)file->extent * ISO_SECTOR_SIZE, file->size);
+        if (!data) {
+            fprintf(stderr, "Warning: %s: file is outside of the image\n", file->path);
+            continue;
+        }
+        if (data[0] == 'M' && data[1] == 'Z') callback(file->path, data, file->size, context);
+    }
+
+    freeEntries(&files);
+    return 0;
+}
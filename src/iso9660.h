@@ -0,0 +1,12 @@
+#ifndef ISO9660_H
+#define ISO9660_H
+
+#include <stdbool.h>
+
+#include "archive.h"
+#include "peinput.h"
+
+bool isoDetect(PE_FILE *image);
+int isoForEachMember(PE_FILE *image, ARCHIVE_MEMBER_CALLBACK callback, void *context);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Throughput of long scans, as --progress lines on stderr and as a Prometheus textfile for --metrics-file.
+ *
+ * Every process counts into its own slot of a shared mapping, one slot per process and aligned to cache lines, so the
+ * worker processes of --workers never write to the same line. Only the main process reads the slots, when it reports.
+ * Latencies of inputs go into a log bucketed histogram in the style of HdrHistogram: four linear sub-buckets per
+ * power of two microseconds, which keeps the relative error below 25% over the whole range.
+ */
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined _WIN32 && !defined UNDER_CE
+#define USE_SHARED_SLOTS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/** Sub-buckets per power of two, the histogram covers 1 us to 2^32 us */
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS + 30 * METRICS_SUB_BUCKETS)
+/** Slots for the main process and for workers, including replacements of crashed ones */
+#define METRICS_SLOTS 1024
+
+typedef struct
+{
+    uint64_t inputs;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t nanoseconds;
+    uint64_t histogram[METRICS_BUCKETS];
+} __attribute__((aligned(64))) METRICS_SLOT;
+
+typedef struct
+{
+    /** Next free slot, taken atomically by new processes */
+    uint32_t nextSlot;
+    METRICS_SLOT slots[METRICS_SLOTS];
+} METRICS_SHARED;
+
+static METRICS_SHARED *shared = NULL;
+static METRICS_SLOT *slot = NULL;
+static long slotPid = 0;
+
+static bool progress = false;
+static const char *metricsPath = NULL;
+static int totalInputs = 0;
+static uint64_t scanStart;
+static uint64_t lastReport;
+static uint64_t inputStart;
+
+static uint64_t now(void) {
+#if !defined _WIN32 && !defined UNDER_CE
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+/**
+ * @brief Histogram bucket of a latency
+ *
+ * @param microseconds Latency
+ * @return int Bucket index
+ */
+static int bucketOf(uint64_t microseconds) {
+    if (microseconds < METRICS_SUB_BUCKETS) return microseconds;
+    int exponent = 63 - __builtin_clzll(microseconds);
+    if (exponent > 31) return METRICS_BUCKETS - 1;
+    int subBucket = (microseconds >> (exponent - 2)) & (METRICS_SUB_BUCKETS - 1);
+    return METRICS_SUB_BUCKETS + (exponent - 2) * METRICS_SUB_BUCKETS + subBucket;
+}
+
+/**
+ * @brief Largest latency in microseconds that falls into a bucket
+ */
+static uint64_t bucketLimit(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) return bucket;
+    int exponent = (bucket - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS + 2;
+    int subBucket = (bucket - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+    return ((uint64_t)(METRICS_SUB_BUCKETS + subBucket + 1) << (exponent - 2)) - 1;
+}
+
+/**
+ * @brief Enable --progress and --metrics-file. Call before worker processes are started.
+ *
+ * @param printProgress Print progress lines to stderr
+ * @param metricsFile Path of the Prometheus textfile, or NULL
+ * @param numberOfInputs Number of inputs for the queue depth and ETA, 0 if unknown
+ * @return int 0 on success, -1 on error with errno set
+ */
+int metricsInit(bool printProgress, const char *metricsFile, int numberOfInputs) {
+#ifdef USE_SHARED_SLOTS
+    shared = mmap(NULL, sizeof(METRICS_SHARED), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        shared = NULL;
+        return -1;
+    }
+    slotPid = getpid();
+#else
+    shared = calloc(1, sizeof(METRICS_SHARED));
+    if (!shared) return -1;
+#endif
+    slot = &shared->slots[0];
+    shared->nextSlot = 1;
+    progress = printProgress;
+    metricsPath = metricsFile;
+    totalInputs = numberOfInputs;
+    scanStart = lastReport = now();
+    return 0;
+}
+
+/**
+ * @brief Start timing an input
+ */
+void metricsStartInput(void) {
+    if (!shared) return;
+#ifdef USE_SHARED_SLOTS
+    /* A worker process takes its own slot with the first input it examines */
+    long pid = getpid();
+    if (pid != slotPid) {
+        uint32_t index = __atomic_fetch_add(&shared->nextSlot, 1, __ATOMIC_RELAXED);
+        /* Beyond the last slot, workers share it and their counts may be lost */
+        slot = &shared->slots[index < METRICS_SLOTS ? index : METRICS_SLOTS - 1];
+        slotPid = pid;
+    }
+#endif
+    inputStart = now();
+}
+
+/**
+ * @brief Count an examined input
+ *
+ * @param bytes Size of the input
+ * @param failures Number of files of the input that could not be examined
+ */
+void metricsEndInput(uint64_t bytes, int failures) {
+    if (!shared) return;
+    uint64_t nanoseconds = now() - inputStart;
+    slot->inputs++;
+    slot->bytes += bytes;
+    slot->errors += failures;
+    slot->nanoseconds += nanoseconds;
+    slot->histogram[bucketOf(nanoseconds / 1000)]++;
+}
+
+/**
+ * @brief Count an input as failed from the main process, for inputs whose worker crashed or timed out before it could
+ * count the input itself
+ */
+void metricsFailedInput(void) {
+    if (!shared) return;
+    shared->slots[0].inputs++;
+    shared->slots[0].errors++;
+}
+
+/**
+ * @brief Sum up the slots of all processes
+ */
+static void collect(METRICS_SLOT *total) {
+    memset(total, 0, sizeof(METRICS_SLOT));
+    uint32_t used = __atomic_load_n(&shared->nextSlot, __ATOMIC_RELAXED);
+    if (used > METRICS_SLOTS) used = METRICS_SLOTS;
+    for (uint32_t i = 0; i < used; i++) {
+        const METRICS_SLOT *s = &shared->slots[i];
+        total->inputs += s->inputs;
+        total->bytes += s->bytes;
+        total->errors += s->errors;
+        total->nanoseconds += s->nanoseconds;
+        for (int b = 0; b < METRICS_BUCKETS; b++) total->histogram[b] += s->histogram[b];
+    }
+}
+
+static void printProgress(const METRICS_SLOT *total, double seconds) {
+    double filesPerSecond = seconds > 0 ? total->inputs / seconds : 0;
+    fprintf(stderr, "Progress: %llu", (unsigned long long)total->inputs);
+    if (totalInputs) fprintf(stderr, "/%d", totalInputs);
+    fprintf(stderr, " files, %.1f files/s, %.1f MB/s, %llu errors", filesPerSecond, seconds > 0 ? total->bytes / seconds / 1e6 : 0,
+            (unsigned long long)total->errors);
+    if (totalInputs) {
+        uint64_t queued = totalInputs > (int)total->inputs ? totalInputs - total->inputs : 0;
+        fprintf(stderr, ", %llu queued", (unsigned long long)queued);
+        if (filesPerSecond > 0) {
+            unsigned long eta = queued / filesPerSecond + 0.5;
+            fprintf(stderr, ", ETA %lu:%02lu:%02lu", eta / 3600, eta / 60 % 60, eta % 60);
+        }
+    }
+    fputc('\n', stderr);
+}
+
+/**
+ * @brief Replace the metrics file, by writing a temporary file and renaming it, so the collector never reads half of it
+ */
+static void writeMetricsFile(const METRICS_SLOT *total) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", metricsPath);
+    FILE *fp = fopen(temporary, "w");
+    if (!fp) {
+        perror("Failed to write metrics file");
+        return;
+    }
+    fprintf(fp, "# HELP wcepeinfo_files_total Inputs examined.\n# TYPE wcepeinfo_files_total counter\nwcepeinfo_files_total %llu\n",
+            (unsigned long long)total->inputs);
+    fprintf(fp, "# HELP wcepeinfo_bytes_total Bytes of the inputs examined.\n# TYPE wcepeinfo_bytes_total counter\nwcepeinfo_bytes_total %llu\n",
+            (unsigned long long)total->bytes);
+    fprintf(fp, "# HELP wcepeinfo_errors_total Files that could not be examined.\n# TYPE wcepeinfo_errors_total counter\nwcepeinfo_errors_total %llu\n",
+            (unsigned long long)total->errors);
+    if (totalInputs) {
+        fprintf(fp, "# HELP wcepeinfo_queue_depth Inputs not examined yet.\n# TYPE wcepeinfo_queue_depth gauge\nwcepeinfo_queue_depth %llu\n",
+                (unsigned long long)(totalInputs > (int)total->inputs ? totalInputs - total->inputs : 0));
+    }
+
+    fprintf(fp, "# HELP wcepeinfo_file_duration_seconds Time to examine an input.\n# TYPE wcepeinfo_file_duration_seconds histogram\n");
+    /* Buckets above the largest latency seen would all repeat the count */
+    int last = METRICS_BUCKETS - 1;
+    while (last > 0 && !total->histogram[last]) last--;
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= last; b++) {
+        cumulative += total->histogram[b];
+        fprintf(fp, "wcepeinfo_file_duration_seconds_bucket{le=\"%.6f\"} %llu\n", (bucketLimit(b) + 1) / 1e6, (unsigned long long)cumulative);
+    }
+    fprintf(fp, "wcepeinfo_file_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)total->inputs);
+    fprintf(fp, "wcepeinfo_file_duration_seconds_sum %.6f\n", total->nanoseconds / 1e9);
+    fprintf(fp, "wcepeinfo_file_duration_seconds_count %llu\n", (unsigned long long)total->inputs);
+
+    if (fclose(fp)) {
+        perror("Failed to write metrics file");
+        remove(temporary);
+        return;
+    }
+#ifdef _WIN32
+    /* rename does not replace files on Windows */
+    remove(metricsPath);
+#endif
+    if (rename(temporary, metricsPath)) perror("Failed to write metrics file");
+}
+
+static void report(void) {
+    METRICS_SLOT total;
+    collect(&total);
+    lastReport = now();
+    if (progress) printProgress(&total, (lastReport - scanStart) / 1e9);
+    if (metricsPath) writeMetricsFile(&total);
+}
+
+/**
+ * @brief Report if METRICS_INTERVAL passed since the last report. Only the main process reports.
+ */
+void metricsTick(void) {
+    if (!shared) return;
+#ifdef USE_SHARED_SLOTS
+    if (slot != &shared->slots[0]) return;
+#endif
+    if (now() - lastReport >= (uint64_t)METRICS_INTERVAL * 1000000000u) report();
+}
+
+/**
+ * @brief Report the final numbers
+ */
+void metricsFinish(void) {
+    if (shared) report();
+}
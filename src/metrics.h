@@ -0,0 +1,17 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Seconds between progress lines and rewrites of the metrics file */
+#define METRICS_INTERVAL 2
+
+int metricsInit(bool printProgress, const char *metricsFile, int numberOfInputs);
+void metricsStartInput(void);
+void metricsEndInput(uint64_t bytes, int failures);
+void metricsFailedInput(void);
+void metricsTick(void);
+void metricsFinish(void);
+
+#endif
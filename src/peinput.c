@@ -0,0 +1,486 @@
+#include "peinput.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined _WIN32 && !defined UNDER_CE
+#define USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "WinCePEHeader.h"
+#include "profile.h"
+
+/** Data directories whose containing sections are buffered when reading from a stream */
+static const int streamDirectories[] = {
+    IMAGE_DIRECTORY_ENTRY_EXPORT,
+    IMAGE_DIRECTORY_ENTRY_IMPORT,
+    IMAGE_DIRECTORY_ENTRY_RESOURCE,
+    IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT,
+    IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT,
+};
+
+#define STREAM_SKIP_BUFFER_SIZE 16384
+
+static void addRegion(PE_FILE *pe, size_t offset, size_t size, const uint8_t *data, bool owned) {
+    PE_REGION *region = &(pe->regions[pe->numberOfRegions++]);
+    region->offset = offset;
+    region->size = size;
+    region->data = data;
+    region->owned = owned;
+}
+
+#ifdef USE_MMAP
+/**
+ * @brief Map an open regular file into memory. Files that can't be mapped are read into memory, other files are read
+ * as a stream. The descriptor stays open and is still owned by the caller.
+ *
+ * @param pe PE_FILE to initialize
+ * @param fd Open file descriptor
+ * @param maxBuffer Maximum number of bytes buffered when reading a stream
+ * @param whole Keep every byte of a stream, not only the parts needed by the parser
+ * @return int 0 on success, -1 on error with errno set. errno is EFBIG if a stream needs more than maxBuffer bytes.
+ */
+int peOpenDescriptor(PE_FILE *pe, int fd, size_t maxBuffer, bool whole) {
+    memset(pe, 0, sizeof(PE_FILE));
+
+    struct stat st;
+    PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+    if (fstat(fd, &st) == -1) return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    /* Pipes, FIFOs and character devices can only be read front to back */
+    if (!S_ISREG(st.st_mode)) {
+        int streamFd = dup(fd);
+        if (streamFd == -1) return -1;
+        FILE *fp = fdopen(streamFd, "rb");
+        if (!fp) {
+            close(streamFd);
+            return -1;
+        }
+        int status = whole ? peOpenStreamWhole(pe, fp, maxBuffer) : peOpenStream(pe, fp, maxBuffer);
+        int savedErrno = errno;
+        fclose(fp);
+        errno = savedErrno;
+        return status;
+    }
+
+    pe->size = st.st_size;
+    if (pe->size) {
+        PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+        void *mapping = mmap(NULL, pe->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            pe->mapping = mapping;
+            pe->mappingSize = pe->size;
+            addRegion(pe, 0, pe->size, mapping, false);
+            return 0;
+        }
+
+        /* Some file systems don't support mmap */
+        PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+        uint8_t *data = malloc(pe->size);
+        if (!data) return -1;
+        size_t size = 0;
+        while (size < pe->size) {
+            PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+            ssize_t bytesRead = pread(fd, data + size, pe->size - size, size);
+            if (bytesRead == -1 && errno == EINTR) continue;
+            if (bytesRead == -1) {
+                int savedErrno = errno;
+                free(data);
+                errno = savedErrno;
+                return -1;
+            }
+            if (!bytesRead) break;
+            size += bytesRead;
+        }
+        /* The file may have shrunk since fstat */
+        pe->size = size;
+        addRegion(pe, 0, size, data, true);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * @brief Map a regular file into memory. Files that can't be mapped are read into memory, other files are read as a
+ * stream.
+ *
+ * @param pe PE_FILE to initialize
+ * @param path Path of the file
+ * @param maxBuffer Maximum number of bytes buffered when reading a stream
+ * @param whole Keep every byte of a stream, not only the parts needed by the parser
+ * @return int 0 on success, -1 on error with errno set. errno is EFBIG if a stream needs more than maxBuffer bytes.
+ */
+int peOpenFile(PE_FILE *pe, const char *path, size_t maxBuffer, bool whole) {
+    memset(pe, 0, sizeof(PE_FILE));
+#ifdef USE_MMAP
+    /* open, close and the calls of peOpenDescriptor */
+    PROFILE_COUNT(PROFILE_SYSCALLS, 2);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    int status = peOpenDescriptor(pe, fd, maxBuffer, whole);
+    int savedErrno = errno;
+    close(fd);
+    errno = savedErrno;
+    return status;
+#else
+    /* Without mmap every file is read as a whole */
+    (void)whole;
+    PROFILE_COUNT(PROFILE_SYSCALLS, 3);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(fp);
+        return -1;
+    }
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    uint8_t *data = malloc(size ? size : 1);
+    if (!data) {
+        fclose(fp);
+        return -1;
+    }
+    pe->size = fread(data, 1, size, fp);
+    fclose(fp);
+    addRegion(pe, 0, pe->size, data, true);
+    return 0;
+#endif
+}
+
+/**
+ * @brief Use a memory buffer as PE file. The buffer is not copied and must outlive the PE_FILE.
+ *
+ * @param pe PE_FILE to initialize
+ * @param data File contents
+ * @param size Size of data in bytes
+ */
+void peOpenMemory(PE_FILE *pe, const uint8_t *data, size_t size) {
+    memset(pe, 0, sizeof(PE_FILE));
+    pe->size = size;
+    addRegion(pe, 0, size, data, false);
+}
+
+/**
+ * @brief Read from fp until buffer holds `wanted` bytes or the stream ends
+ *
+ * @return size_t number of bytes in buffer
+ */
+static size_t streamFill(FILE *fp, uint8_t *buffer, size_t have, size_t wanted) {
+    if (wanted > have) {
+        PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+        have += fread(buffer + have, 1, wanted - have, fp);
+    }
+    return have;
+}
+
+/**
+ * @brief Discard bytes from fp
+ *
+ * @return size_t number of bytes actually skipped
+ */
+static size_t streamSkip(FILE *fp, size_t amount) {
+    uint8_t scratch[STREAM_SKIP_BUFFER_SIZE];
+    size_t skipped = 0;
+    while (skipped < amount) {
+        size_t chunk = amount - skipped < sizeof(scratch) ? amount - skipped : sizeof(scratch);
+        PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+        size_t bytes_read = fread(scratch, 1, chunk, fp);
+        skipped += bytes_read;
+        if (bytes_read != chunk) break;
+    }
+    return skipped;
+}
+
+static int growHead(uint8_t **head, size_t size) {
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    uint8_t *grown = realloc(*head, size);
+    if (!grown) {
+        free(*head);
+        return -1;
+    }
+    *head = grown;
+    return 0;
+}
+
+typedef struct
+{
+    size_t start;
+    size_t end;
+} STREAM_RANGE;
+
+static int compareStreamRanges(const void *a, const void *b) {
+    const STREAM_RANGE *r1 = a, *r2 = b;
+    return (r1->start > r2->start) - (r1->start < r2->start);
+}
+
+/**
+ * @brief Read a PE file from a stream that can't seek.
+ *
+ * The headers and the section table are read first. From them the file ranges of all sections that hold one of the
+ * streamDirectories are calculated. The rest of the stream is then read forward once, keeping only these ranges.
+ *
+ * @param pe PE_FILE to initialize
+ * @param fp Stream positioned at the start of the PE file
+ * @param maxBuffer Maximum number of bytes kept in memory
+ * @return int 0 on success, -1 on error with errno set. errno is EFBIG if more than maxBuffer bytes would be needed.
+ */
+int peOpenStream(PE_FILE *pe, FILE *fp, size_t maxBuffer) {
+    memset(pe, 0, sizeof(PE_FILE));
+
+    /* Headers: DOS header, NT headers, section table and whatever else is covered by SizeOfHeaders */
+    size_t headSize = COFF_OFFSET + sizeof(uint16_t);
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    uint8_t *head = malloc(headSize);
+    if (!head) return -1;
+    size_t have = streamFill(fp, head, 0, headSize);
+
+    STREAM_RANGE ranges[PE_MAX_REGIONS];
+    int numberOfRanges = 0;
+
+    if (have == headSize) {
+        uint16_t coff_start = head[COFF_OFFSET] | (head[COFF_OFFSET + 1] << 8);
+        size_t ntHeadersEnd = coff_start + sizeof(IMAGE_NT_HEADERS32);
+
+        headSize = ntHeadersEnd;
+        if (headSize > maxBuffer) goto too_large;
+        if (growHead(&head, headSize)) return -1;
+        have = streamFill(fp, head, have, headSize);
+
+        IMAGE_NT_HEADERS32 imageHeaders;
+        if (have == headSize) {
+            memcpy(&imageHeaders, head + coff_start, sizeof(IMAGE_NT_HEADERS32));
+        }
+
+        /* Only plan ahead if this looks like a PE32 file. Otherwise keep what was read so the caller can report the error. */
+        if (have == headSize && imageHeaders.Signature == PE_MAGIC && imageHeaders.FileHeader.SizeOfOptionalHeader == sizeof(IMAGE_OPTIONAL_HEADER)) {
+            uint16_t numberOfSections = imageHeaders.FileHeader.NumberOfSections;
+            headSize = ntHeadersEnd + numberOfSections * sizeof(IMAGE_SECTION_HEADER);
+            if (imageHeaders.OptionalHeader.SizeOfHeaders > headSize) headSize = imageHeaders.OptionalHeader.SizeOfHeaders;
+            if (headSize > maxBuffer) goto too_large;
+            if (growHead(&head, headSize)) return -1;
+            have = streamFill(fp, head, have, headSize);
+
+            IMAGE_SECTION_HEADER *sectionHeaders = (IMAGE_SECTION_HEADER *)(head + ntHeadersEnd);
+            if (have >= ntHeadersEnd + numberOfSections * sizeof(IMAGE_SECTION_HEADER)) {
+                for (size_t d = 0; d < sizeof(streamDirectories) / sizeof(streamDirectories[0]); d++) {
+                    uint32_t RVA = imageHeaders.OptionalHeader.DataDirectory[streamDirectories[d]].VirtualAddress;
+                    if (!RVA) continue;
+                    for (uint16_t i = 0; i < numberOfSections; i++) {
+                        IMAGE_SECTION_HEADER section;
+                        memcpy(&section, &(sectionHeaders[i]), sizeof(IMAGE_SECTION_HEADER));
+                        if (RVA >= section.VirtualAddress && RVA < section.VirtualAddress + section.Misc.VirtualSize) {
+                            ranges[numberOfRanges].start = section.PointerToRawData;
+                            ranges[numberOfRanges].end = (size_t)section.PointerToRawData + section.SizeOfRawData;
+                            numberOfRanges++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    addRegion(pe, 0, have, head, true);
+    head = NULL;
+    size_t consumed = have;
+
+    /* Sort and merge the planned ranges, dropping everything that is already part of the headers */
+    qsort(ranges, numberOfRanges, sizeof(STREAM_RANGE), compareStreamRanges);
+    int merged = 0;
+    for (int i = 0; i < numberOfRanges; i++) {
+        if (ranges[i].start < consumed) ranges[i].start = consumed;
+        if (ranges[i].end <= ranges[i].start) continue;
+        if (merged && ranges[i].start <= ranges[merged - 1].end) {
+            if (ranges[i].end > ranges[merged - 1].end) ranges[merged - 1].end = ranges[i].end;
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+
+    size_t total = have;
+    for (int i = 0; i < merged; i++) total += ranges[i].end - ranges[i].start;
+    if (total > maxBuffer) goto too_large;
+
+    /* Consume the stream forward, keeping only the planned ranges */
+    for (int i = 0; i < merged; i++) {
+        size_t skip = ranges[i].start - consumed;
+        size_t skipped = streamSkip(fp, skip);
+        consumed += skipped;
+        if (skipped != skip) break;
+
+        size_t size = ranges[i].end - ranges[i].start;
+        PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+        uint8_t *data = malloc(size);
+        if (!data) {
+            peClose(pe);
+            return -1;
+        }
+        size_t bytes_read = streamFill(fp, data, 0, size);
+        addRegion(pe, ranges[i].start, bytes_read, data, true);
+        consumed += bytes_read;
+        if (bytes_read != size) break;
+    }
+
+    /* Drain the remainder so the producer doesn't see a broken pipe, and to learn the file size */
+    consumed += streamSkip(fp, SIZE_MAX);
+    pe->size = consumed;
+
+    if (ferror(fp)) {
+        peClose(pe);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+
+too_large:
+    free(head);
+    peClose(pe);
+    errno = EFBIG;
+    return -1;
+}
+
+/**
+ * @brief Read a whole PE file from a stream that can't seek, for callers that need every byte of it
+ *
+ * @param pe PE_FILE to initialize
+ * @param fp Stream positioned at the start of the PE file
+ * @param maxBuffer Maximum number of bytes kept in memory
+ * @return int 0 on success, -1 on error with errno set. errno is EFBIG if the file is larger than maxBuffer.
+ */
+int peOpenStreamWhole(PE_FILE *pe, FILE *fp, size_t maxBuffer) {
+    memset(pe, 0, sizeof(PE_FILE));
+    size_t capacity = 65536, size = 0;
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    uint8_t *data = malloc(capacity);
+    while (data) {
+        size = streamFill(fp, data, size, capacity);
+        if (size < capacity) break;
+        if (capacity >= maxBuffer) {
+            if (fgetc(fp) == EOF) break;
+            free(data);
+            streamSkip(fp, SIZE_MAX);
+            errno = EFBIG;
+            return -1;
+        }
+        capacity = capacity * 2 < maxBuffer ? capacity * 2 : maxBuffer;
+        PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+        uint8_t *grown = realloc(data, capacity);
+        if (!grown) free(data);
+        data = grown;
+    }
+    if (!data) return -1;
+    if (ferror(fp)) {
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    pe->size = size;
+    addRegion(pe, 0, size, data, true);
+    return 0;
+}
+
+void peClose(PE_FILE *pe) {
+    for (int i = 0; i < pe->numberOfRegions; i++) {
+        if (pe->regions[i].owned) free((void *)pe->regions[i].data);
+    }
+#ifdef USE_MMAP
+    if (pe->mapping) {
+        PROFILE_COUNT(PROFILE_SYSCALLS, 1);
+        munmap(pe->mapping, pe->mappingSize);
+    }
+#endif
+    memset(pe, 0, sizeof(PE_FILE));
+}
+
+/**
+ * @brief Get a pointer to a range of the file without copying it
+ *
+ * @param pe PE file
+ * @param offset File offset
+ * @param size Number of bytes that have to be available
+ * @return const uint8_t* Pointer to the data or NULL if the range is not available in a single region
+ */
+const uint8_t *pePtr(PE_FILE *pe, size_t offset, size_t size) {
+    for (int i = 0; i < pe->numberOfRegions; i++) {
+        PE_REGION *region = &(pe->regions[i]);
+        if (offset >= region->offset && offset - region->offset <= region->size && size <= region->size - (offset - region->offset)) {
+            PROFILE_COUNT(PROFILE_BYTES_READ, size);
+            return region->data + (offset - region->offset);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Read n items of size bytes at the current position, like fread. Missing bytes are filled with zeroes.
+ *
+ * @return size_t Number of complete items read
+ */
+size_t peRead(void *ptr, size_t size, size_t n, PE_FILE *pe) {
+    size_t total = size * n;
+    size_t copied = 0;
+    uint8_t *out = ptr;
+
+    while (copied < total) {
+        size_t offset = pe->pos + copied;
+        PE_REGION *region = NULL;
+        for (int i = 0; i < pe->numberOfRegions; i++) {
+            if (offset >= pe->regions[i].offset && offset < pe->regions[i].offset + pe->regions[i].size) {
+                region = &(pe->regions[i]);
+                break;
+            }
+        }
+        if (!region) break;
+        size_t available = region->size - (offset - region->offset);
+        size_t chunk = total - copied < available ? total - copied : available;
+        memcpy(out + copied, region->data + (offset - region->offset), chunk);
+        copied += chunk;
+    }
+
+    if (copied < total) {
+        memset(out + copied, 0, total - copied);
+        pe->eof = true;
+    }
+    PROFILE_COUNT(PROFILE_BYTES_READ, copied);
+    pe->pos += copied;
+    return size ? copied / size : 0;
+}
+
+int peGetc(PE_FILE *pe) {
+    uint8_t c;
+    if (peRead(&c, 1, 1, pe) != 1) return EOF;
+    return c;
+}
+
+int peSeek(PE_FILE *pe, long offset, int whence) {
+    long base = 0;
+    if (whence == SEEK_CUR) base = pe->pos;
+    else if (whence == SEEK_END) base = pe->size;
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pe->pos = base + offset;
+    pe->eof = false;
+    return 0;
+}
+
+long peTell(PE_FILE *pe) {
+    return pe->pos;
+}
+
+bool peEof(PE_FILE *pe) {
+    return pe->eof;
+}
@@ -0,0 +1,65 @@
+#ifndef PEINPUT_H
+#define PEINPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Default upper limit of bytes buffered when reading a PE file from a non-seekable stream */
+#define PE_STREAM_DEFAULT_MAX_BUFFER (64 * 1024 * 1024)
+
+/** Maximum number of disjoint file regions a PE_FILE can hold */
+#define PE_MAX_REGIONS 16
+
+/** A contiguous range of the PE file that is available in memory */
+typedef struct
+{
+    /** File offset of the first byte of the region */
+    size_t offset;
+    /** Number of bytes in the region */
+    size_t size;
+    /** Region data */
+    const uint8_t *data;
+    /** True if data was allocated by the PE_FILE and has to be freed on close */
+    bool owned;
+} PE_REGION;
+
+/** Random access view over a PE file.
+ *
+ * Regular files are mapped as a whole. Non-seekable streams are consumed once, front to back, and only the regions
+ * needed by the parser are kept in memory. Reads outside of the available regions return zeroes and set the eof flag,
+ * just like reading past the end of a FILE. */
+typedef struct
+{
+    /** Available regions, sorted by offset and non-overlapping */
+    PE_REGION regions[PE_MAX_REGIONS];
+    int numberOfRegions;
+    /** Size of the underlying file in bytes */
+    size_t size;
+    /** Current read position */
+    size_t pos;
+    /** Set when a read touched bytes that are not available */
+    bool eof;
+    /** Mapping created by peOpenFile, if any */
+    void *mapping;
+    size_t mappingSize;
+} PE_FILE;
+
+int peOpenFile(PE_FILE *pe, const char *path, size_t maxBuffer, bool whole);
+#if !defined _WIN32 && !defined UNDER_CE
+int peOpenDescriptor(PE_FILE *pe, int fd, size_t maxBuffer, bool whole);
+#endif
+int peOpenStream(PE_FILE *pe, FILE *fp, size_t maxBuffer);
+int peOpenStreamWhole(PE_FILE *pe, FILE *fp, size_t maxBuffer);
+void peOpenMemory(PE_FILE *pe, const uint8_t *data, size_t size);
+void peClose(PE_FILE *pe);
+
+const uint8_t *pePtr(PE_FILE *pe, size_t offset, size_t size);
+size_t peRead(void *ptr, size_t size, size_t n, PE_FILE *pe);
+int peGetc(PE_FILE *pe);
+int peSeek(PE_FILE *pe, long offset, int whence);
+long peTell(PE_FILE *pe);
+bool peEof(PE_FILE *pe);
+
+#endif
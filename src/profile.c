@@ -0,0 +1,488 @@
+/*
+ * Time per phase and hot path counters of every examined file, for --profile, and a timeline of the phases for
+ * --trace.
+ *
+ * The parser enters phases one after the other; the time since the last phase change is added to the phase that was
+ * active, so a file that fails half way still accounts for all of its time. Counters are incremented unconditionally,
+ * which is cheaper than testing whether profiling is enabled, and the difference over a file is reported. Tables are
+ * printed to stderr, leaving the normal output untouched. With more than one file, all samples are kept for the
+ * minimum, median and 99th percentile of the summary.
+ *
+ * On Linux, cycles, instructions, cache misses and branch misses are read from a perf_event group at the same phase
+ * boundaries. Without permission for perf events, or on hardware without some of the events, the missing values are
+ * left out of the tables.
+ *
+ * --trace writes the phases of every file as Chrome trace events. Events are formatted into a buffer of the process
+ * and written when it is full or the process ends. The trace file is opened for appending and unbuffered, so the
+ * worker processes of --workers, which inherit it, add their events without locking and each buffer lands in one
+ * piece.
+ */
+#include "profile.h"
+
+#ifdef USE_PROFILE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#define USE_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "cjson/cJSON.h"
+
+typedef enum
+{
+    HARDWARE_CYCLES,
+    HARDWARE_INSTRUCTIONS,
+    HARDWARE_CACHE_MISSES,
+    HARDWARE_BRANCH_MISSES,
+    HARDWARE_NUMBER_OF_EVENTS
+} HARDWARE_EVENT;
+
+typedef struct
+{
+    uint64_t phases[PROFILE_NUMBER_OF_PHASES];
+    uint64_t counters[PROFILE_NUMBER_OF_COUNTERS];
+    /** Bytes read and hardware events by phase */
+    uint64_t phaseBytes[PROFILE_NUMBER_OF_PHASES];
+    uint64_t hardware[PROFILE_NUMBER_OF_PHASES][HARDWARE_NUMBER_OF_EVENTS];
+} PROFILE_SAMPLE;
+
+static const char *const phaseNames[PROFILE_NUMBER_OF_PHASES] = {
+    "open", "headers", "section table", "directories", "digests", "resources", "imports", "version info", "JSON print",
+    "output"};
+
+static const char *const counterNames[PROFILE_NUMBER_OF_COUNTERS] = {"syscalls", "bytes read", "allocations",
+                                                                     "strings transcoded"};
+
+bool profileEnabled = false;
+uint64_t profileCounters[PROFILE_NUMBER_OF_COUNTERS];
+
+static PROFILE_SAMPLE current;
+static PROFILE_PHASE currentPhase;
+static uint64_t phaseStart;
+static uint64_t bytesAtPhaseStart;
+static uint64_t hardwareAtPhaseStart[HARDWARE_NUMBER_OF_EVENTS];
+static uint64_t countersAtStart[PROFILE_NUMBER_OF_COUNTERS];
+
+static PROFILE_SAMPLE *samples = NULL;
+static size_t numberOfSamples = 0;
+static size_t samplesCapacity = 0;
+
+/** Leader of the perf_event group, -1 without hardware counters */
+static int hardwareGroup = -1;
+/** Position of every event in a read of the group, -1 if the event could not be opened */
+static int hardwareSlots[HARDWARE_NUMBER_OF_EVENTS] = {-1, -1, -1, -1};
+static int numberOfHardwareEvents = 0;
+
+/** Set by --profile, the tables are printed */
+static bool printTables = false;
+
+#define TRACE_BUFFER_SIZE (256 * 1024)
+/** Longest event, with a label escaped in full */
+#define TRACE_MAX_EVENT 4096
+
+static FILE *traceFile = NULL;
+static char *traceBuffer = NULL;
+static size_t traceLength = 0;
+/** Process the buffer belongs to, a worker drops the events it inherited from its parent */
+static long tracePid = 0;
+static long mainPid = 0;
+/** Start of the current file */
+static uint64_t fileStart;
+
+/**
+ * @brief Monotonic time in nanoseconds
+ */
+static uint64_t now(void) {
+#if !defined _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+/**
+ * @brief Open the hardware events of this process as one group, so they are counted over the same time
+ */
+static void openHardwareCounters(void) {
+#ifdef USE_PERF_EVENTS
+    static const uint64_t configs[HARDWARE_NUMBER_OF_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < HARDWARE_NUMBER_OF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = hardwareGroup == -1;
+        /* User space only, which is permitted with the default perf_event_paranoid of 2 */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, hardwareGroup, 0);
+        if (fd == -1) {
+            /* Without cycles there is nothing to relate the other events to */
+            if (hardwareGroup == -1) {
+                fprintf(stderr, "Profile: hardware counters are not available: %s\n", strerror(errno));
+                return;
+            }
+            continue;
+        }
+        if (hardwareGroup == -1) hardwareGroup = fd;
+        hardwareSlots[i] = numberOfHardwareEvents++;
+    }
+    ioctl(hardwareGroup, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(hardwareGroup, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/**
+ * @brief Read the current values of the hardware events, 0 for events that are not available
+ */
+static void readHardwareCounters(uint64_t values[HARDWARE_NUMBER_OF_EVENTS]) {
+    memset(values, 0, HARDWARE_NUMBER_OF_EVENTS * sizeof(uint64_t));
+#ifdef USE_PERF_EVENTS
+    if (hardwareGroup == -1) return;
+    /* Number of events, followed by their values */
+    uint64_t group[1 + HARDWARE_NUMBER_OF_EVENTS];
+    if (read(hardwareGroup, group, sizeof(group)) < (ssize_t)((1 + numberOfHardwareEvents) * sizeof(uint64_t))) return;
+    for (int i = 0; i < HARDWARE_NUMBER_OF_EVENTS; i++) {
+        if (hardwareSlots[i] != -1) values[i] = group[1 + hardwareSlots[i]];
+    }
+#endif
+}
+
+static void *countingMalloc(size_t size) {
+    profileCounters[PROFILE_ALLOCATIONS]++;
+    return malloc(size);
+}
+
+static void printSummary(void);
+
+/**
+ * @brief Print the summary and write the rest of the trace when the main process exits
+ */
+static void profileExit(void) {
+    if ((long)getpid() != mainPid) return;
+    if (printTables) printSummary();
+    if (traceFile) {
+        profileTraceFlush();
+        /* The last event has no trailing comma, so the file is valid JSON */
+        fprintf(traceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":\"wcepeinfo\"}}\n]\n", mainPid);
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+}
+
+static void enable(void) {
+    if (profileEnabled) return;
+    mainPid = getpid();
+    atexit(profileExit);
+    profileEnabled = true;
+}
+
+/**
+ * @brief Enable profiling and the tables of --profile. Allocations of cJSON are counted from here on.
+ */
+void profileEnable(void) {
+    /* cJSON reallocates its print buffer only with the standard allocator, so this is left out of --trace */
+    cJSON_Hooks hooks = {countingMalloc, free};
+    cJSON_InitHooks(&hooks);
+    enable();
+    openHardwareCounters();
+    printTables = true;
+}
+
+/**
+ * @brief Start writing trace events to a file
+ *
+ * @param path Path of the trace file, it is replaced
+ * @return int 0 on success, -1 on error with errno set
+ */
+int profileTraceOpen(const char *path) {
+    traceBuffer = malloc(TRACE_BUFFER_SIZE);
+    if (!traceBuffer) return -1;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fputs("[\n", fp);
+    if (fclose(fp)) return -1;
+    traceFile = fopen(path, "a");
+    if (!traceFile) return -1;
+    setvbuf(traceFile, NULL, _IONBF, 0);
+    enable();
+    tracePid = mainPid;
+    return 0;
+}
+
+/**
+ * @brief Write the buffered trace events of this process
+ */
+void profileTraceFlush(void) {
+    if (!traceFile || !traceLength || (long)getpid() != tracePid) return;
+    fwrite(traceBuffer, 1, traceLength, traceFile);
+    traceLength = 0;
+}
+
+/**
+ * @brief Add a complete event to the trace
+ *
+ * @param name Name of the event, escaped for JSON
+ * @param category Category of the event
+ * @param start Start in nanoseconds
+ * @param end End in nanoseconds
+ */
+static char *appendText(char *out, const char *text) {
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+}
+
+static char *appendNumber(char *out, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n) *out++ = digits[--n];
+    return out;
+}
+
+/** Nanoseconds as microseconds, which Chrome expects */
+static char *appendMicroseconds(char *out, uint64_t nanoseconds) {
+    out = appendNumber(out, nanoseconds / 1000);
+    unsigned fraction = nanoseconds % 1000;
+    *out++ = '.';
+    *out++ = '0' + fraction / 100;
+    *out++ = '0' + fraction / 10 % 10;
+    *out++ = '0' + fraction % 10;
+    return out;
+}
+
+static void traceEvent(const char *name, const char *category, uint64_t start, uint64_t end) {
+    if (TRACE_BUFFER_SIZE - traceLength < TRACE_MAX_EVENT) profileTraceFlush();
+    /* Formatted by hand, snprintf would cost more than the phases being traced */
+    char *out = traceBuffer + traceLength;
+    out = appendText(out, "{\"name\":\"");
+    out = appendText(out, name);
+    out = appendText(out, "\",\"cat\":\"");
+    out = appendText(out, category);
+    out = appendText(out, "\",\"ph\":\"X\",\"ts\":");
+    out = appendMicroseconds(out, start);
+    out = appendText(out, ",\"dur\":");
+    out = appendMicroseconds(out, end - start);
+    out = appendText(out, ",\"pid\":");
+    out = appendNumber(out, tracePid);
+    out = appendText(out, ",\"tid\":");
+    out = appendNumber(out, tracePid);
+    out = appendText(out, "},\n");
+    traceLength = out - traceBuffer;
+}
+
+/**
+ * @brief Escape a string for JSON, cutting it to fit the buffer
+ */
+static void escapeJson(char *out, size_t size, const char *in) {
+    size_t length = 0;
+    for (; *in && length + 7 < size; in++) {
+        unsigned char c = *in;
+        if (c == '"' || c == '\\') {
+            out[length++] = '\\';
+            out[length++] = c;
+        } else if (c < 0x20) {
+            length += sprintf(out + length, "\\u%04x", c);
+        } else {
+            out[length++] = c;
+        }
+    }
+    out[length] = '\0';
+}
+
+/**
+ * @brief Start timing a file in the open phase
+ */
+void profileStartFile(void) {
+    memset(&current, 0, sizeof(current));
+    memcpy(countersAtStart, profileCounters, sizeof(countersAtStart));
+    currentPhase = PROFILE_OPEN;
+    bytesAtPhaseStart = profileCounters[PROFILE_BYTES_READ];
+    readHardwareCounters(hardwareAtPhaseStart);
+    phaseStart = now();
+    fileStart = phaseStart;
+
+    /* Files are examined in the process they started in, a new process is noticed here */
+    if (traceFile && (long)getpid() != tracePid) {
+        traceLength = 0;
+        tracePid = getpid();
+    }
+}
+
+/**
+ * @brief Add the time and events since the last phase change to the current phase and continue with another one
+ */
+void profileEnter(PROFILE_PHASE phase) {
+    uint64_t time = now();
+    uint64_t hardware[HARDWARE_NUMBER_OF_EVENTS];
+    readHardwareCounters(hardware);
+
+    if (traceFile) traceEvent(phaseNames[currentPhase], "phase", phaseStart, time);
+    current.phases[currentPhase] += time - phaseStart;
+    current.phaseBytes[currentPhase] += profileCounters[PROFILE_BYTES_READ] - bytesAtPhaseStart;
+    for (int i = 0; i < HARDWARE_NUMBER_OF_EVENTS; i++) {
+        current.hardware[currentPhase][i] += hardware[i] - hardwareAtPhaseStart[i];
+        hardwareAtPhaseStart[i] = hardware[i];
+    }
+    currentPhase = phase;
+    phaseStart = time;
+    bytesAtPhaseStart = profileCounters[PROFILE_BYTES_READ];
+}
+
+static void printHardwareHeader(void) {
+    if (hardwareGroup == -1) {
+        fputc('\n', stderr);
+        return;
+    }
+    fprintf(stderr, " %14s %14s %6s %12s %14s\n", "Cycles", "Instructions", "IPC", "Misses/KB", "Branch misses");
+}
+
+/**
+ * @brief Print the hardware events of a phase, IPC and cache misses per KB read, ending the line
+ */
+static void printHardware(const uint64_t hardware[HARDWARE_NUMBER_OF_EVENTS], uint64_t bytes) {
+    if (hardwareGroup == -1) {
+        fputc('\n', stderr);
+        return;
+    }
+    char values[HARDWARE_NUMBER_OF_EVENTS][24];
+    for (int i = 0; i < HARDWARE_NUMBER_OF_EVENTS; i++) {
+        if (hardwareSlots[i] == -1) strcpy(values[i], "-");
+        else snprintf(values[i], sizeof(values[i]), "%llu", (unsigned long long)hardware[i]);
+    }
+    char ipc[16] = "-";
+    if (hardwareSlots[HARDWARE_INSTRUCTIONS] != -1 && hardware[HARDWARE_CYCLES]) {
+        snprintf(ipc, sizeof(ipc), "%.2f", (double)hardware[HARDWARE_INSTRUCTIONS] / hardware[HARDWARE_CYCLES]);
+    }
+    char missesPerKb[24] = "-";
+    if (hardwareSlots[HARDWARE_CACHE_MISSES] != -1 && bytes) {
+        snprintf(missesPerKb, sizeof(missesPerKb), "%.2f", hardware[HARDWARE_CACHE_MISSES] * 1024.0 / bytes);
+    }
+    fprintf(stderr, " %14s %14s %6s %12s %14s\n", values[HARDWARE_CYCLES], values[HARDWARE_INSTRUCTIONS], ipc, missesPerKb,
+            values[HARDWARE_BRANCH_MISSES]);
+}
+
+/**
+ * @brief Finish the current file, print its table and start timing the next one
+ *
+ * @param label Name of the file
+ */
+void profileEndFile(const char *label) {
+    if (!profileEnabled) return;
+    profileEnter(PROFILE_OPEN);
+    if (traceFile) {
+        char name[TRACE_MAX_EVENT - 256];
+        escapeJson(name, sizeof(name), label);
+        traceEvent(name, "file", fileStart, phaseStart);
+    }
+    if (!printTables) {
+        profileStartFile();
+        return;
+    }
+    for (int i = 0; i < PROFILE_NUMBER_OF_COUNTERS; i++) current.counters[i] = profileCounters[i] - countersAtStart[i];
+
+    fprintf(stderr, "Profile: %s\n", label);
+    fprintf(stderr, "  %-20s %12s", "Phase", "ms");
+    printHardwareHeader();
+    for (int i = 0; i < PROFILE_NUMBER_OF_PHASES; i++) {
+        fprintf(stderr, "  %-20s %12.3f", phaseNames[i], current.phases[i] / 1e6);
+        printHardware(current.hardware[i], current.phaseBytes[i]);
+    }
+    for (int i = 0; i < PROFILE_NUMBER_OF_COUNTERS; i++) fprintf(stderr, "  %-20s %12llu\n", counterNames[i], (unsigned long long)current.counters[i]);
+
+    if (numberOfSamples == samplesCapacity) {
+        size_t newCapacity = samplesCapacity ? samplesCapacity * 2 : 256;
+        PROFILE_SAMPLE *newSamples = realloc(samples, newCapacity * sizeof(PROFILE_SAMPLE));
+        /* Without memory only the summary is incomplete */
+        if (newSamples) {
+            samples = newSamples;
+            samplesCapacity = newCapacity;
+        }
+    }
+    if (numberOfSamples < samplesCapacity) samples[numberOfSamples++] = current;
+
+    profileStartFile();
+}
+
+static int compareValues(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Print total, minimum, median and 99th percentile of one value over all samples
+ *
+ * @param name Name of the value
+ * @param offset Offset of the value in PROFILE_SAMPLE
+ * @param scale Divisor for printing, 1e6 for nanoseconds as milliseconds
+ * @param values Scratch space for numberOfSamples values
+ */
+static void printStatistics(const char *name, size_t offset, double scale, uint64_t *values) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < numberOfSamples; i++) {
+        memcpy(&values[i], (const uint8_t *)&samples[i] + offset, sizeof(uint64_t));
+        total += values[i];
+    }
+    qsort(values, numberOfSamples, sizeof(uint64_t), compareValues);
+    /* Nearest rank percentiles */
+    size_t median = (numberOfSamples + 1) / 2 - 1;
+    size_t p99 = (numberOfSamples * 99 + 99) / 100 - 1;
+    const char *format = scale == 1 ? "  %-20s %14.0f %12.0f %12.0f %12.0f\n" : "  %-20s %14.3f %12.3f %12.3f %12.3f\n";
+    fprintf(stderr, format, name, total / scale, values[0] / scale, values[median] / scale, values[p99] / scale);
+}
+
+/**
+ * @brief Print the totals and distribution over all files, when more than one file was examined
+ */
+static void printSummary(void) {
+    if (numberOfSamples < 2) return;
+    uint64_t *values = malloc(numberOfSamples * sizeof(uint64_t));
+    if (!values) return;
+
+    fprintf(stderr, "Profile: %zu files\n", numberOfSamples);
+    fprintf(stderr, "  %-20s %14s %12s %12s %12s\n", "Phase (ms)", "Total", "Min", "Median", "P99");
+    for (int i = 0; i < PROFILE_NUMBER_OF_PHASES; i++) {
+        printStatistics(phaseNames[i], offsetof(PROFILE_SAMPLE, phases) + i * sizeof(uint64_t), 1e6, values);
+    }
+    fprintf(stderr, "  %-20s %14s %12s %12s %12s\n", "Counter", "Total", "Min", "Median", "P99");
+    for (int i = 0; i < PROFILE_NUMBER_OF_COUNTERS; i++) {
+        printStatistics(counterNames[i], offsetof(PROFILE_SAMPLE, counters) + i * sizeof(uint64_t), 1, values);
+    }
+    free(values);
+
+    if (hardwareGroup == -1) return;
+    fprintf(stderr, "  %-20s", "Phase (total)");
+    printHardwareHeader();
+    for (int i = 0; i < PROFILE_NUMBER_OF_PHASES; i++) {
+        uint64_t hardware[HARDWARE_NUMBER_OF_EVENTS] = {0};
+        uint64_t bytes = 0;
+        for (size_t j = 0; j < numberOfSamples; j++) {
+            for (int k = 0; k < HARDWARE_NUMBER_OF_EVENTS; k++) hardware[k] += samples[j].hardware[i][k];
+            bytes += samples[j].phaseBytes[i];
+        }
+        fprintf(stderr, "  %-20s", phaseNames[i]);
+        printHardware(hardware, bytes);
+    }
+}
+
+#endif
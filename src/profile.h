@@ -0,0 +1,70 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Release builds define NO_PROFILE, then the instrumentation compiles to nothing */
+#if !defined NO_PROFILE && !defined UNDER_CE
+#define USE_PROFILE
+#endif
+
+/** Phases of examining a file, time is attributed to the phase entered last */
+typedef enum
+{
+    PROFILE_OPEN,
+    PROFILE_HEADERS,
+    PROFILE_SECTIONS,
+    PROFILE_DIRECTORIES,
+    PROFILE_DIGESTS,
+    PROFILE_RESOURCES,
+    PROFILE_IMPORTS,
+    PROFILE_VERSION_INFO,
+    PROFILE_JSON,
+    PROFILE_OUTPUT,
+    PROFILE_NUMBER_OF_PHASES
+} PROFILE_PHASE;
+
+typedef enum
+{
+    /** Calls into the operating system to open, map and read input */
+    PROFILE_SYSCALLS,
+    /** Bytes read by the parser */
+    PROFILE_BYTES_READ,
+    PROFILE_ALLOCATIONS,
+    /** UTF-16 strings converted to UTF-8 */
+    PROFILE_STRINGS_TRANSCODED,
+    PROFILE_NUMBER_OF_COUNTERS
+} PROFILE_COUNTER;
+
+#ifdef USE_PROFILE
+extern bool profileEnabled;
+extern uint64_t profileCounters[PROFILE_NUMBER_OF_COUNTERS];
+
+void profileEnable(void);
+int profileTraceOpen(const char *path);
+void profileTraceFlush(void);
+void profileStartFile(void);
+void profileEnter(PROFILE_PHASE phase);
+void profileEndFile(const char *label);
+
+#define PROFILE_PHASE(phase)                 \
+    do {                                     \
+        if (profileEnabled) profileEnter(phase); \
+    } while (0)
+#define PROFILE_COUNT(counter, amount) (profileCounters[counter] += (amount))
+#define PROFILE_START_FILE()                \
+    do {                                    \
+        if (profileEnabled) profileStartFile(); \
+    } while (0)
+#define PROFILE_END_FILE(label) profileEndFile(label)
+#define PROFILE_TRACE_FLUSH() profileTraceFlush()
+#else
+#define PROFILE_PHASE(phase) ((void)0)
+#define PROFILE_COUNT(counter, amount) ((void)0)
+#define PROFILE_START_FILE() ((void)0)
+#define PROFILE_END_FILE(label) ((void)0)
+#define PROFILE_TRACE_FLUSH() ((void)0)
+#endif
+
+#endif
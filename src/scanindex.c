@@ -0,0 +1,1224 @@
+/*
+ * Compact binary index of a scan, and queries on it.
+ *
+ * The index holds one fixed size record per examined file, a pool of NUL terminated strings (paths and version
+ * strings) and for every file the sorted ids of the DLLs it imports. DLL names are stored lower case and sorted, so the
+ * id of a DLL can be found with a binary search. The file is used in place after mapping it, nothing is parsed or
+ * copied when it is opened.
+ *
+ * Imported functions are indexed the other way round: every (DLL, function or ordinal) pair has a delta encoded list
+ * of the ids of the files that import it. While scanning, (symbol, file) pairs are appended to a single buffer, which
+ * is sorted and encoded when the index is saved.
+ */
+#include "scanindex.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cjson/cJSON.h"
+#include "peinput.h"
+
+#define SCAN_INDEX_MAX_NAME 256
+
+typedef struct
+{
+    uint32_t symbol;
+    uint32_t file;
+} SCAN_INDEX_POSTING;
+
+struct SCAN_INDEX_WRITER
+{
+    char *strings;
+    size_t stringsSize;
+    size_t stringsCapacity;
+
+    SCAN_INDEX_RECORD *records;
+    uint32_t numberOfRecords;
+    uint32_t recordsCapacity;
+
+    /** String offset of every DLL id, in order of first appearance */
+    uint32_t *dllNames;
+    uint32_t numberOfDlls;
+    uint32_t dllsCapacity;
+    /** Open addressing table of DLL id + 1, 0 marks a free slot */
+    uint32_t *dllTable;
+    uint32_t dllTableSize;
+
+    /** DLL ids of all committed files, followed by those of the file being examined */
+    uint32_t *imports;
+    uint32_t numberOfImports;
+    uint32_t importsCapacity;
+    uint32_t committedImports;
+
+    /** Imported functions, see SCAN_INDEX_SYMBOL, DLL ids are those of dllNames */
+    SCAN_INDEX_SYMBOL *symbols;
+    uint32_t numberOfSymbols;
+    uint32_t symbolsCapacity;
+    /** Open addressing table of symbol id + 1, 0 marks a free slot */
+    uint32_t *symbolTable;
+    uint32_t symbolTableSize;
+
+    /** Symbols imported by all committed files, followed by those of the file being examined */
+    SCAN_INDEX_POSTING *postings;
+    uint32_t numberOfPostings;
+    uint32_t postingsCapacity;
+    uint32_t committedPostings;
+
+    uint32_t fileVersion;
+};
+
+static int grow(void **array, uint32_t *capacity, uint32_t needed, size_t elementSize) {
+    if (needed <= *capacity) return 0;
+    uint32_t newCapacity = *capacity ? *capacity : 256;
+    while (newCapacity < needed) newCapacity *= 2;
+    void *newArray = realloc(*array, (size_t)newCapacity * elementSize);
+    if (!newArray) return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+/**
+ * @brief Append a string to the string pool
+ *
+ * @return uint32_t Offset of the string, SCAN_INDEX_NO_STRING if it could not be added
+ */
+static uint32_t addString(SCAN_INDEX_WRITER *index, const char *string) {
+    size_t length = strlen(string) + 1;
+    if (length == 1) return SCAN_INDEX_NO_STRING;
+    if (index->stringsSize + length > UINT32_MAX) return SCAN_INDEX_NO_STRING;
+    if (index->stringsSize + length > index->stringsCapacity) {
+        size_t capacity = index->stringsCapacity * 2;
+        while (capacity < index->stringsSize + length) capacity *= 2;
+        char *strings = realloc(index->strings, capacity);
+        if (!strings) return SCAN_INDEX_NO_STRING;
+        index->strings = strings;
+        index->stringsCapacity = capacity;
+    }
+    uint32_t offset = index->stringsSize;
+    memcpy(index->strings + offset, string, length);
+    index->stringsSize += length;
+    return offset;
+}
+
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+static void lowerCase(char *out, const char *in, size_t size) {
+    size_t i = 0;
+    for (; in[i] && i < size - 1; i++) out[i] = tolower((unsigned char)in[i]);
+    out[i] = '\0';
+}
+
+static int rehashDlls(SCAN_INDEX_WRITER *index) {
+    uint32_t size = index->dllTableSize ? index->dllTableSize * 2 : 1024;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t id = 0; id < index->numberOfDlls; id++) {
+        uint32_t slot = hashName(index->strings + index->dllNames[id]) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = id + 1;
+    }
+    free(index->dllTable);
+    index->dllTable = table;
+    index->dllTableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Find the id of a DLL, adding it if it is new
+ *
+ * @return int64_t DLL id, -1 if out of memory
+ */
+static int64_t internDll(SCAN_INDEX_WRITER *index, const char *dllName) {
+    char name[SCAN_INDEX_MAX_NAME];
+    lowerCase(name, dllName, sizeof(name));
+
+    /* Keep the table at most half full */
+    if ((index->numberOfDlls + 1) * 2 > index->dllTableSize && rehashDlls(index)) return -1;
+
+    uint32_t mask = index->dllTableSize - 1;
+    uint32_t slot = hashName(name) & mask;
+    for (; index->dllTable[slot]; slot = (slot + 1) & mask) {
+        uint32_t id = index->dllTable[slot] - 1;
+        if (!strcmp(index->strings + index->dllNames[id], name)) return id;
+    }
+
+    if (grow((void **)&index->dllNames, &index->dllsCapacity, index->numberOfDlls + 1, sizeof(uint32_t))) return -1;
+    uint32_t offset = addString(index, name);
+    if (offset == SCAN_INDEX_NO_STRING) return -1;
+    index->dllNames[index->numberOfDlls] = offset;
+    index->dllTable[slot] = ++index->numberOfDlls;
+    return index->numberOfDlls - 1;
+}
+
+static uint32_t hashSymbol(uint32_t dll, const char *function, uint16_t ordinal) {
+    uint32_t hash = function ? hashName(function) : ordinal;
+    return (hash ^ dll) * 16777619u;
+}
+
+static int rehashSymbols(SCAN_INDEX_WRITER *index) {
+    uint32_t size = index->symbolTableSize ? index->symbolTableSize * 2 : 4096;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint32_t id = 0; id < index->numberOfSymbols; id++) {
+        SCAN_INDEX_SYMBOL *symbol = &index->symbols[id];
+        uint32_t slot = hashSymbol(symbol->dll, symbol->name ? index->strings + symbol->name : NULL, symbol->ordinal) & (size - 1);
+        while (table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = id + 1;
+    }
+    free(index->symbolTable);
+    index->symbolTable = table;
+    index->symbolTableSize = size;
+    return 0;
+}
+
+/**
+ * @brief Find the id of an imported function, adding it if it is new
+ *
+ * @return int64_t Symbol id, -1 if out of memory
+ */
+static int64_t internSymbol(SCAN_INDEX_WRITER *index, uint32_t dll, const char *function, uint16_t ordinal) {
+    if ((index->numberOfSymbols + 1) * 2 > index->symbolTableSize && rehashSymbols(index)) return -1;
+
+    uint32_t mask = index->symbolTableSize - 1;
+    uint32_t slot = hashSymbol(dll, function, ordinal) & mask;
+    for (; index->symbolTable[slot]; slot = (slot + 1) & mask) {
+        SCAN_INDEX_SYMBOL *symbol = &index->symbols[index->symbolTable[slot] - 1];
+        if (symbol->dll != dll) continue;
+        if (function ? symbol->name && !strcmp(index->strings + symbol->name, function) : !symbol->name && symbol->ordinal == ordinal) {
+            return index->symbolTable[slot] - 1;
+        }
+    }
+
+    if (grow((void **)&index->symbols, &index->symbolsCapacity, index->numberOfSymbols + 1, sizeof(SCAN_INDEX_SYMBOL))) return -1;
+    SCAN_INDEX_SYMBOL *symbol = &index->symbols[index->numberOfSymbols];
+    memset(symbol, 0, sizeof(SCAN_INDEX_SYMBOL));
+    symbol->dll = dll;
+    symbol->ordinal = function ? 0 : ordinal;
+    if (function) {
+        symbol->name = addString(index, function);
+        if (symbol->name == SCAN_INDEX_NO_STRING) return -1;
+    }
+    index->symbolTable[slot] = ++index->numberOfSymbols;
+    return index->numberOfSymbols - 1;
+}
+
+/**
+ * @brief Create an empty index
+ *
+ * @return SCAN_INDEX_WRITER* New index, NULL if out of memory
+ */
+SCAN_INDEX_WRITER *scanIndexCreate(void) {
+    SCAN_INDEX_WRITER *index = calloc(1, sizeof(SCAN_INDEX_WRITER));
+    if (!index) return NULL;
+    index->stringsCapacity = 65536;
+    index->strings = malloc(index->stringsCapacity);
+    if (!index->strings) {
+        free(index);
+        return NULL;
+    }
+    /* Offset 0 is the empty string */
+    index->strings[0] = '\0';
+    index->stringsSize = 1;
+    return index;
+}
+
+/**
+ * @brief Start collecting the imports of a new file, discarding those of a file that was not completed
+ */
+void scanIndexStartFile(SCAN_INDEX_WRITER *index) {
+    index->numberOfImports = index->committedImports;
+    index->numberOfPostings = index->committedPostings;
+    index->fileVersion = SCAN_INDEX_NO_STRING;
+}
+
+/**
+ * @brief Record a DLL imported by the current file
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+int scanIndexAddImport(SCAN_INDEX_WRITER *index, const char *dllName) {
+    int64_t id = internDll(index, dllName);
+    if (id < 0) return -1;
+    for (uint32_t i = index->committedImports; i < index->numberOfImports; i++) {
+        if (index->imports[i] == id) return 0;
+    }
+    if (grow((void **)&index->imports, &index->importsCapacity, index->numberOfImports + 1, sizeof(uint32_t))) return -1;
+    index->imports[index->numberOfImports++] = id;
+    return 0;
+}
+
+/**
+ * @brief Record a function imported by the current file
+ *
+ * @param index Index
+ * @param dllName DLL the function is imported from
+ * @param function Name of the function, NULL if imported by ordinal
+ * @param ordinal Ordinal of the function if function is NULL
+ * @return int 0 on success, -1 if out of memory
+ */
+int scanIndexAddFunction(SCAN_INDEX_WRITER *index, const char *dllName, const char *function, uint16_t ordinal) {
+    int64_t dll = internDll(index, dllName);
+    if (dll < 0) return -1;
+    int64_t symbol = internSymbol(index, dll, function, ordinal);
+    if (symbol < 0) return -1;
+    if (grow((void **)&index->postings, &index->postingsCapacity, index->numberOfPostings + 1, sizeof(SCAN_INDEX_POSTING))) return -1;
+    index->postings[index->numberOfPostings].symbol = symbol;
+    index->postings[index->numberOfPostings].file = index->numberOfRecords;
+    index->numberOfPostings++;
+    return 0;
+}
+
+/**
+ * @brief Record the FileVersion string of the version resource of the current file
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+int scanIndexSetFileVersion(SCAN_INDEX_WRITER *index, const char *fileVersion) {
+    index->fileVersion = addString(index, fileVersion);
+    return *fileVersion && index->fileVersion == SCAN_INDEX_NO_STRING ? -1 : 0;
+}
+
+/**
+ * @brief Add a record for the current file
+ *
+ * @param index Index
+ * @param path Name of the file
+ * @param file Header values of the file
+ * @return int 0 on success, -1 if out of memory
+ */
+int scanIndexEndFile(SCAN_INDEX_WRITER *index, const char *path, const SCAN_INDEX_FILE *file) {
+    if (grow((void **)&index->records, &index->recordsCapacity, index->numberOfRecords + 1, sizeof(SCAN_INDEX_RECORD))) return -1;
+
+    SCAN_INDEX_RECORD *record = &index->records[index->numberOfRecords];
+    memset(record, 0, sizeof(SCAN_INDEX_RECORD));
+    record->path = addString(index, path);
+    if (record->path == SCAN_INDEX_NO_STRING) return -1;
+    record->fileVersion = index->fileVersion;
+    record->timestamp = file->timestamp;
+    record->firstImport = index->committedImports;
+    record->numberOfImports = index->numberOfImports - index->committedImports;
+    record->machine = file->machine;
+    record->subsystem = file->subsystem;
+    record->majorSubsystemVersion = file->majorSubsystemVersion;
+    record->minorSubsystemVersion = file->minorSubsystemVersion;
+    record->characteristics = file->characteristics;
+    if (file->wceApp) record->flags |= SCAN_INDEX_FLAG_WCE_APP;
+    if (file->wceVersion) {
+        unsigned major = 0, minor = 0;
+        sscanf(file->wceVersion, "%u.%u", &major, &minor);
+        record->wceVersion = (major << 8) | (minor & 0xFF);
+        record->wceVersionString = addString(index, file->wceVersion);
+        record->flags |= SCAN_INDEX_FLAG_WCE_VERSION;
+    }
+
+    index->numberOfRecords++;
+    index->committedImports = index->numberOfImports;
+    index->committedPostings = index->numberOfPostings;
+    index->fileVersion = SCAN_INDEX_NO_STRING;
+    return 0;
+}
+
+static const char *sortStrings;
+static const SCAN_INDEX_SYMBOL *sortSymbols;
+
+static int compareDllIds(const void *a, const void *b) {
+    return strcmp(sortStrings + *(const uint32_t *)a, sortStrings + *(const uint32_t *)b);
+}
+
+static int compareIds(const void *a, const void *b) {
+    uint32_t id1 = *(const uint32_t *)a, id2 = *(const uint32_t *)b;
+    return (id1 > id2) - (id1 < id2);
+}
+
+/**
+ * @brief Order of symbols in the index: by DLL id, then by name, with ordinals first sorted by ordinal
+ */
+static int compareSymbols(const SCAN_INDEX_SYMBOL *symbol1, const SCAN_INDEX_SYMBOL *symbol2, const char *strings) {
+    if (symbol1->dll != symbol2->dll) return symbol1->dll < symbol2->dll ? -1 : 1;
+    int cmp = strcmp(strings + symbol1->name, strings + symbol2->name);
+    if (cmp) return cmp;
+    return (symbol1->ordinal > symbol2->ordinal) - (symbol1->ordinal < symbol2->ordinal);
+}
+
+static int compareSymbolIds(const void *a, const void *b) {
+    return compareSymbols(&sortSymbols[*(const uint32_t *)a], &sortSymbols[*(const uint32_t *)b], sortStrings);
+}
+
+static int comparePostings(const void *a, const void *b) {
+    const SCAN_INDEX_POSTING *posting1 = a, *posting2 = b;
+    if (posting1->symbol != posting2->symbol) return posting1->symbol < posting2->symbol ? -1 : 1;
+    return (posting1->file > posting2->file) - (posting1->file < posting2->file);
+}
+
+static size_t padding(size_t offset) {
+    return (8 - (offset & 7)) & 7;
+}
+
+/**
+ * @brief Sort the symbols and encode the file ids of each of them
+ *
+ * @param index Index, the DLL ids of its symbols are already renumbered
+ * @param sortedSymbols Set to the symbols in index order
+ * @param encoded Set to the encoded file ids
+ * @param encodedSize Set to the size of encoded
+ * @return int 0 on success, -1 if out of memory
+ */
+static int encodePostings(SCAN_INDEX_WRITER *index, SCAN_INDEX_SYMBOL **sortedSymbols, uint8_t **encoded, size_t *encodedSize) {
+    uint32_t *order = malloc((index->numberOfSymbols + 1) * sizeof(uint32_t));
+    uint32_t *newIds = malloc((index->numberOfSymbols + 1) * sizeof(uint32_t));
+    SCAN_INDEX_SYMBOL *symbols = malloc((index->numberOfSymbols + 1) * sizeof(SCAN_INDEX_SYMBOL));
+    /* Every file id takes at most 5 bytes */
+    size_t capacity = (size_t)index->committedPostings * 5 + 1;
+    uint8_t *out = malloc(capacity);
+    if (!order || !newIds || !symbols || !out) {
+        free(order);
+        free(newIds);
+        free(symbols);
+        free(out);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < index->numberOfSymbols; i++) order[i] = i;
+    sortStrings = index->strings;
+    sortSymbols = index->symbols;
+    qsort(order, index->numberOfSymbols, sizeof(uint32_t), compareSymbolIds);
+    for (uint32_t i = 0; i < index->numberOfSymbols; i++) {
+        newIds[order[i]] = i;
+        symbols[i] = index->symbols[order[i]];
+    }
+    for (uint32_t i = 0; i < index->committedPostings; i++) index->postings[i].symbol = newIds[index->postings[i].symbol];
+    qsort(index->postings, index->committedPostings, sizeof(SCAN_INDEX_POSTING), comparePostings);
+    free(newIds);
+
+    size_t size = 0;
+    uint32_t i = 0;
+    for (uint32_t id = 0; id < index->numberOfSymbols; id++) {
+        SCAN_INDEX_SYMBOL *symbol = &symbols[id];
+        symbol->postings = size;
+        symbol->numberOfFiles = 0;
+        uint32_t previous = 0;
+        for (; i < index->committedPostings && index->postings[i].symbol == id; i++) {
+            uint32_t file = index->postings[i].file;
+            /* A file that imports a function twice is listed once */
+            if (symbol->numberOfFiles && file == previous) continue;
+            uint32_t delta = file - previous;
+            do {
+                out[size++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+                delta >>= 7;
+            } while (delta);
+            previous = file;
+            symbol->numberOfFiles++;
+        }
+    }
+
+    /* Back to the ids of the writer, files can still be added after the index was saved */
+    for (uint32_t i = 0; i < index->committedPostings; i++) index->postings[i].symbol = order[index->postings[i].symbol];
+    free(order);
+    *sortedSymbols = symbols;
+    *encoded = out;
+    *encodedSize = size;
+    return 0;
+}
+
+/**
+ * @brief Write the index to a file. The file is replaced as a whole, and files can still be added to the index
+ * afterwards, so it can be saved again.
+ *
+ * @return int 0 on success, -1 on error with errno set
+ */
+int scanIndexSave(SCAN_INDEX_WRITER *index, const char *path) {
+    /* Renumber DLLs in name order, in copies of the DLL ids of the writer */
+    uint32_t *sortedNames = malloc((index->numberOfDlls + 1) * sizeof(uint32_t));
+    uint32_t *newIds = malloc((index->numberOfDlls + 1) * sizeof(uint32_t));
+    uint32_t *imports = malloc((index->committedImports + 1) * sizeof(uint32_t));
+    uint32_t *symbolDlls = malloc((index->numberOfSymbols + 1) * sizeof(uint32_t));
+    char *temporary = malloc(strlen(path) + 5);
+    if (!sortedNames || !newIds || !imports || !symbolDlls || !temporary) {
+        free(sortedNames);
+        free(newIds);
+        free(imports);
+        free(symbolDlls);
+        free(temporary);
+        return -1;
+    }
+    memcpy(sortedNames, index->dllNames, index->numberOfDlls * sizeof(uint32_t));
+    sortStrings = index->strings;
+    qsort(sortedNames, index->numberOfDlls, sizeof(uint32_t), compareDllIds);
+    for (uint32_t newId = 0; newId < index->numberOfDlls; newId++) {
+        uint32_t slot = hashName(index->strings + sortedNames[newId]) & (index->dllTableSize - 1);
+        while (index->dllNames[index->dllTable[slot] - 1] != sortedNames[newId]) slot = (slot + 1) & (index->dllTableSize - 1);
+        newIds[index->dllTable[slot] - 1] = newId;
+    }
+    for (uint32_t i = 0; i < index->committedImports; i++) imports[i] = newIds[index->imports[i]];
+    for (uint32_t i = 0; i < index->numberOfRecords; i++) {
+        SCAN_INDEX_RECORD *record = &index->records[i];
+        qsort(imports + record->firstImport, record->numberOfImports, sizeof(uint32_t), compareIds);
+    }
+    for (uint32_t i = 0; i < index->numberOfSymbols; i++) {
+        symbolDlls[i] = index->symbols[i].dll;
+        index->symbols[i].dll = newIds[index->symbols[i].dll];
+    }
+    free(newIds);
+
+    SCAN_INDEX_SYMBOL *symbols;
+    uint8_t *postings;
+    size_t postingsSize;
+    int encodeFailed = encodePostings(index, &symbols, &postings, &postingsSize);
+    for (uint32_t i = 0; i < index->numberOfSymbols; i++) index->symbols[i].dll = symbolDlls[i];
+    free(symbolDlls);
+    if (encodeFailed) {
+        free(sortedNames);
+        free(imports);
+        free(temporary);
+        return -1;
+    }
+
+    SCAN_INDEX_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC));
+    header.version = SCAN_INDEX_VERSION;
+    header.recordSize = sizeof(SCAN_INDEX_RECORD);
+    header.numberOfFiles = index->numberOfRecords;
+    header.numberOfDlls = index->numberOfDlls;
+    header.numberOfImports = index->committedImports;
+    header.numberOfSymbols = index->numberOfSymbols;
+    header.recordsOffset = sizeof(header);
+    header.dllsOffset = header.recordsOffset + (uint64_t)index->numberOfRecords * sizeof(SCAN_INDEX_RECORD);
+    header.dllsOffset += padding(header.dllsOffset);
+    header.importsOffset = header.dllsOffset + (uint64_t)index->numberOfDlls * sizeof(uint32_t);
+    header.importsOffset += padding(header.importsOffset);
+    header.stringsOffset = header.importsOffset + (uint64_t)index->committedImports * sizeof(uint32_t);
+    header.stringsOffset += padding(header.stringsOffset);
+    header.stringsSize = index->stringsSize;
+    header.symbolsOffset = header.stringsOffset + header.stringsSize;
+    header.symbolsOffset += padding(header.symbolsOffset);
+    header.postingsOffset = header.symbolsOffset + (uint64_t)index->numberOfSymbols * sizeof(SCAN_INDEX_SYMBOL);
+    header.postingsSize = postingsSize;
+
+    static const uint8_t zeroes[8] = {0};
+    /* Written next to the index and renamed, a query never sees half of it */
+    sprintf(temporary, "%s.tmp", path);
+    FILE *fp = fopen(temporary, "wb");
+    if (!fp) {
+        free(sortedNames);
+        free(imports);
+        free(symbols);
+        free(postings);
+        free(temporary);
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(index->records, sizeof(SCAN_INDEX_RECORD), index->numberOfRecords, fp);
+    fwrite(zeroes, 1, header.dllsOffset - ftell(fp), fp);
+    fwrite(sortedNames, sizeof(uint32_t), index->numberOfDlls, fp);
+    fwrite(zeroes, 1, header.importsOffset - ftell(fp), fp);
+    fwrite(imports, sizeof(uint32_t), index->committedImports, fp);
+    fwrite(zeroes, 1, header.stringsOffset - ftell(fp), fp);
+    fwrite(index->strings, 1, index->stringsSize, fp);
+    fwrite(zeroes, 1, header.symbolsOffset - ftell(fp), fp);
+    fwrite(symbols, sizeof(SCAN_INDEX_SYMBOL), index->numberOfSymbols, fp);
+    fwrite(postings, 1, postingsSize, fp);
+    free(sortedNames);
+    free(imports);
+    free(symbols);
+    free(postings);
+
+    int failed = ferror(fp);
+    if (fclose(fp) || failed) {
+        remove(temporary);
+        free(temporary);
+        return -1;
+    }
+#ifdef _WIN32
+    /* rename does not replace files on Windows */
+    remove(path);
+#endif
+    failed = rename(temporary, path);
+    free(temporary);
+    return failed ? -1 : 0;
+}
+
+void scanIndexFree(SCAN_INDEX_WRITER *index) {
+    if (!index) return;
+    free(index->strings);
+    free(index->records);
+    free(index->dllNames);
+    free(index->dllTable);
+    free(index->imports);
+    free(index->symbols);
+    free(index->symbolTable);
+    free(index->postings);
+    free(index);
+}
+
+/* Queries */
+
+typedef enum {
+    FIELD_FILE,
+    FIELD_WCE_APP,
+    FIELD_WCE_ARCH,
+    FIELD_WCE_VERSION,
+    FIELD_MACHINE,
+    FIELD_SUBSYSTEM,
+    FIELD_TIMESTAMP,
+    FIELD_DATE,
+    FIELD_FILE_VERSION,
+    FIELD_IMPORT
+} QUERY_FIELD;
+
+typedef enum {
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE
+} QUERY_OP;
+
+typedef struct
+{
+    QUERY_FIELD field;
+    QUERY_OP op;
+    const char *text;
+    uint32_t number;
+    /** DLL id of an Import predicate, -1 if the DLL is not in the index */
+    int64_t dll;
+} QUERY_PREDICATE;
+
+typedef struct
+{
+    const char *name;
+    QUERY_FIELD field;
+    bool numeric;
+} QUERY_FIELD_NAME;
+
+static const QUERY_FIELD_NAME queryFields[] = {
+    {"File", FIELD_FILE, false},
+    {"WCEApp", FIELD_WCE_APP, true},
+    {"WCEArch", FIELD_WCE_ARCH, false},
+    {"WCEVersion", FIELD_WCE_VERSION, true},
+    {"Machine", FIELD_MACHINE, true},
+    {"Subsystem", FIELD_SUBSYSTEM, true},
+    {"Timestamp", FIELD_TIMESTAMP, true},
+    {"Date", FIELD_DATE, false},
+    {"FileVersion", FIELD_FILE_VERSION, false},
+    {"Import", FIELD_IMPORT, false},
+};
+
+typedef struct
+{
+    PE_FILE file;
+    const SCAN_INDEX_HEADER *header;
+    const SCAN_INDEX_RECORD *records;
+    const uint32_t *dlls;
+    const uint32_t *imports;
+    const char *strings;
+    const SCAN_INDEX_SYMBOL *symbols;
+    const uint8_t *postings;
+} SCAN_INDEX_READER;
+
+static int openIndex(SCAN_INDEX_READER *reader, const char *path) {
+    if (peOpenFile(&reader->file, path, PE_STREAM_DEFAULT_MAX_BUFFER, true)) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    const SCAN_INDEX_HEADER *header = (const SCAN_INDEX_HEADER *)pePtr(&reader->file, 0, sizeof(SCAN_INDEX_HEADER));
+    if (!header || memcmp(header->magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC)) || header->version != SCAN_INDEX_VERSION ||
+        header->recordSize != sizeof(SCAN_INDEX_RECORD)) {
+        fprintf(stderr, "Error: %s: not a " SCAN_INDEX_MAGIC " index\n", path);
+        peClose(&reader->file);
+        return -1;
+    }
+    reader->header = header;
+    reader->records = (const SCAN_INDEX_RECORD *)pePtr(&reader->file, header->recordsOffset, (size_t)header->numberOfFiles * sizeof(SCAN_INDEX_RECORD));
+    reader->dlls = (const uint32_t *)pePtr(&reader->file, header->dllsOffset, (size_t)header->numberOfDlls * sizeof(uint32_t));
+    reader->imports = (const uint32_t *)pePtr(&reader->file, header->importsOffset, (size_t)header->numberOfImports * sizeof(uint32_t));
+    reader->strings = (const char *)pePtr(&reader->file, header->stringsOffset, header->stringsSize);
+    reader->symbols = (const SCAN_INDEX_SYMBOL *)pePtr(&reader->file, header->symbolsOffset, (size_t)header->numberOfSymbols * sizeof(SCAN_INDEX_SYMBOL));
+    reader->postings = pePtr(&reader->file, header->postingsOffset, header->postingsSize);
+    if ((!reader->records && header->numberOfFiles) || (!reader->dlls && header->numberOfDlls) ||
+        (!reader->imports && header->numberOfImports) || !reader->strings || reader->strings[header->stringsSize - 1] ||
+        (!reader->symbols && header->numberOfSymbols) || (!reader->postings && header->postingsSize)) {
+        fprintf(stderr, "Error: %s: index is truncated\n", path);
+        peClose(&reader->file);
+        return -1;
+    }
+    /* DLL names are looked up by every query, the other offsets are checked when they are used */
+    for (uint32_t dll = 0; dll < header->numberOfDlls; dll++) {
+        if (reader->dlls[dll] >= header->stringsSize) {
+            fprintf(stderr, "Error: %s: index is damaged\n", path);
+            peClose(&reader->file);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Check that the strings and imports a record refers to are inside the index
+ */
+static bool recordValid(const SCAN_INDEX_READER *reader, const SCAN_INDEX_RECORD *record) {
+    const SCAN_INDEX_HEADER *header = reader->header;
+    if (record->path >= header->stringsSize || record->fileVersion >= header->stringsSize ||
+        record->wceVersionString >= header->stringsSize || (uint64_t)record->firstImport + record->numberOfImports > header->numberOfImports) {
+        return false;
+    }
+    for (uint32_t i = 0; i < record->numberOfImports; i++) {
+        if (reader->imports[record->firstImport + i] >= header->numberOfDlls) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Check that the DLL and name of a symbol are inside the index
+ */
+static bool symbolValid(const SCAN_INDEX_READER *reader, const SCAN_INDEX_SYMBOL *symbol) {
+    return symbol->dll < reader->header->numberOfDlls && symbol->name < reader->header->stringsSize;
+}
+
+/**
+ * @brief Find the id of a DLL by name. Names without an extension match NAME.dll.
+ *
+ * @return int64_t DLL id, -1 if no file imports it
+ */
+static int64_t findDll(const SCAN_INDEX_READER *reader, const char *dllName) {
+    char name[SCAN_INDEX_MAX_NAME];
+    lowerCase(name, dllName, sizeof(name) - 4);
+    if (!strchr(name, '.')) strcat(name, ".dll");
+
+    int64_t low = 0, high = (int64_t)reader->header->numberOfDlls - 1;
+    while (low <= high) {
+        int64_t middle = (low + high) / 2;
+        int cmp = strcmp(reader->strings + reader->dlls[middle], name);
+        if (cmp == 0) return middle;
+        if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Match a string against a pattern with * and ? wildcards
+ */
+static bool wildcardMatch(const char *pattern, const char *string, bool ignoreCase) {
+    const char *starPattern = NULL, *starString = NULL;
+    while (*string) {
+        if (*pattern == '*') {
+            starPattern = ++pattern;
+            starString = string;
+        } else if (*pattern == '?' || *pattern == *string || (ignoreCase && tolower((unsigned char)*pattern) == tolower((unsigned char)*string))) {
+            pattern++;
+            string++;
+        } else if (starPattern) {
+            pattern = starPattern;
+            string = ++starString;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return !*pattern;
+}
+
+static bool compareNumbers(uint32_t value, QUERY_OP op, uint32_t expected) {
+    switch (op) {
+        case OP_EQ:
+            return value == expected;
+        case OP_NE:
+            return value != expected;
+        case OP_LT:
+            return value < expected;
+        case OP_LE:
+            return value <= expected;
+        case OP_GT:
+            return value > expected;
+        default:
+            return value >= expected;
+    }
+}
+
+static bool compareStrings(const char *value, QUERY_OP op, const char *expected, bool ignoreCase) {
+    if (op == OP_EQ || op == OP_NE) return wildcardMatch(expected, value, ignoreCase) == (op == OP_EQ);
+    /* strcmp only promises the sign of its result */
+    int cmp = strcmp(value, expected);
+    return compareNumbers((cmp > 0) - (cmp < 0) + 1, op, 1);
+}
+
+static bool importsDll(const SCAN_INDEX_READER *reader, const SCAN_INDEX_RECORD *record, int64_t dll) {
+    const uint32_t *imports = reader->imports + record->firstImport;
+    for (uint16_t i = 0; i < record->numberOfImports && imports[i] <= dll; i++) {
+        if (imports[i] == dll) return true;
+    }
+    return false;
+}
+
+static void recordDate(char *out, size_t size, uint32_t timestamp) {
+    time_t time = timestamp;
+    struct tm *tm = localtime(&time);
+    if (!tm || !strftime(out, size, "%Y-%m-%d", tm)) snprintf(out, size, "INVALID TIME");
+}
+
+static bool matches(const SCAN_INDEX_READER *reader, const SCAN_INDEX_RECORD *record, const QUERY_PREDICATE *predicate, const char *(*archName)(uint16_t)) {
+    char date[32];
+    switch (predicate->field) {
+        case FIELD_FILE:
+            return compareStrings(reader->strings + record->path, predicate->op, predicate->text, false);
+        case FIELD_WCE_APP:
+            return compareNumbers((record->flags & SCAN_INDEX_FLAG_WCE_APP) != 0, predicate->op, predicate->number);
+        case FIELD_WCE_ARCH:
+            return compareStrings(archName(record->machine), predicate->op, predicate->text, true);
+        case FIELD_WCE_VERSION:
+            /* Files with an unknown version only match != */
+            if (!(record->flags & SCAN_INDEX_FLAG_WCE_VERSION)) return predicate->op == OP_NE;
+            return compareNumbers(record->wceVersion, predicate->op, predicate->number);
+        case FIELD_MACHINE:
+            return compareNumbers(record->machine, predicate->op, predicate->number);
+        case FIELD_SUBSYSTEM:
+            return compareNumbers(record->subsystem, predicate->op, predicate->number);
+        case FIELD_TIMESTAMP:
+            return compareNumbers(record->timestamp, predicate->op, predicate->number);
+        case FIELD_DATE:
+            recordDate(date, sizeof(date), record->timestamp);
+            return compareStrings(date, predicate->op, predicate->text, false);
+        case FIELD_FILE_VERSION:
+            return compareStrings(reader->strings + record->fileVersion, predicate->op, predicate->text, false);
+        case FIELD_IMPORT:
+            return (predicate->dll >= 0 && importsDll(reader, record, predicate->dll)) == (predicate->op == OP_EQ);
+    }
+    return false;
+}
+
+/**
+ * @brief Parse a predicate of the form FIELD OP VALUE
+ *
+ * @return int 0 on success, -1 if the predicate is invalid
+ */
+static int parsePredicate(const SCAN_INDEX_READER *reader, const char *text, QUERY_PREDICATE *predicate) {
+    size_t nameLength = strcspn(text, "!<>=");
+    const char *op = text + nameLength;
+    const char *value;
+    if (!strncmp(op, "!=", 2)) {
+        predicate->op = OP_NE;
+        value = op + 2;
+    } else if (!strncmp(op, "<=", 2)) {
+        predicate->op = OP_LE;
+        value = op + 2;
+    } else if (!strncmp(op, ">=", 2)) {
+        predicate->op = OP_GE;
+        value = op + 2;
+    } else if (*op == '<') {
+        predicate->op = OP_LT;
+        value = op + 1;
+    } else if (*op == '>') {
+        predicate->op = OP_GT;
+        value = op + 1;
+    } else if (*op == '=') {
+        predicate->op = OP_EQ;
+        value = op + 1;
+    } else {
+        fprintf(stderr, "Error: %s: predicates have the form FIELD=VALUE, with = != < <= > or >=\n", text);
+        return -1;
+    }
+
+    const QUERY_FIELD_NAME *field = NULL;
+    for (size_t i = 0; i < sizeof(queryFields) / sizeof(queryFields[0]) && !field; i++) {
+        if (strlen(queryFields[i].name) == nameLength && !strncmp(queryFields[i].name, text, nameLength)) field = &queryFields[i];
+    }
+    if (!field) {
+        fprintf(stderr, "Error: %.*s: unknown field\n", (int)nameLength, text);
+        return -1;
+    }
+
+    predicate->field = field->field;
+    predicate->text = value;
+    predicate->dll = -1;
+    if (field->field == FIELD_IMPORT) {
+        if (predicate->op != OP_EQ && predicate->op != OP_NE) {
+            fprintf(stderr, "Error: %s: Import only supports = and !=\n", text);
+            return -1;
+        }
+        predicate->dll = findDll(reader, value);
+    } else if (field->field == FIELD_WCE_APP) {
+        predicate->number = !strcmp(value, "true") || !strcmp(value, "1");
+    } else if (field->field == FIELD_WCE_VERSION) {
+        unsigned major = 0, minor = 0;
+        sscanf(value, "%u.%u", &major, &minor);
+        predicate->number = (major << 8) | (minor & 0xFF);
+    } else if (field->numeric) {
+        predicate->number = strtoul(value, NULL, 0);
+    }
+    return 0;
+}
+
+static void printRecordJson(const SCAN_INDEX_READER *reader, const SCAN_INDEX_RECORD *record, const char *(*archName)(uint16_t)) {
+    char buffer[32];
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "File", reader->strings + record->path);
+    cJSON_AddBoolToObject(json, "WCEApp", record->flags & SCAN_INDEX_FLAG_WCE_APP);
+    if (record->flags & SCAN_INDEX_FLAG_WCE_VERSION) cJSON_AddStringToObject(json, "WCEVersion", reader->strings + record->wceVersionString);
+    cJSON_AddStringToObject(json, "WCEArch", archName(record->machine));
+    sprintf(buffer, "0x%04X", record->machine);
+    cJSON_AddStringToObject(json, "Machine", buffer);
+    cJSON_AddNumberToObject(json, "Timestamp", record->timestamp);
+    recordDate(buffer, sizeof(buffer), record->timestamp);
+    cJSON_AddStringToObject(json, "Date", buffer);
+    cJSON_AddNumberToObject(json, "Subsystem", record->subsystem);
+    if (record->fileVersion != SCAN_INDEX_NO_STRING) cJSON_AddStringToObject(json, "FileVersion", reader->strings + record->fileVersion);
+    cJSON *dlls = cJSON_AddArrayToObject(json, "ImportedDLLs");
+    for (uint16_t i = 0; i < record->numberOfImports; i++) {
+        cJSON_AddItemToArray(dlls, cJSON_CreateString(reader->strings + reader->dlls[reader->imports[record->firstImport + i]]));
+    }
+    char *line = cJSON_PrintUnformatted(json);
+    if (line) puts(line);
+    free(line);
+    cJSON_Delete(json);
+}
+
+/**
+ * @brief Implementation of `wcepeinfo query [-j|-c] INDEX PREDICATE...`
+ *
+ * @param argc Number of arguments after "query"
+ * @param argv Arguments after "query"
+ * @param archName Returns the WCEArch name of a machine code
+ * @return int Exit status
+ */
+int scanIndexQuery(int argc, char **argv, const char *(*archName)(uint16_t machine)) {
+    bool printJson = false, onlyCount = false;
+    while (argc && argv[0][0] == '-' && argv[0][1]) {
+        if (!strcmp(argv[0], "-j") || !strcmp(argv[0], "--json")) {
+            printJson = true;
+        } else if (!strcmp(argv[0], "-c") || !strcmp(argv[0], "--count")) {
+            onlyCount = true;
+        } else {
+            fprintf(stderr, "Error: %s: unknown query option\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        argc--;
+        argv++;
+    }
+    if (!argc) {
+        fprintf(stderr, "Usage: wcepeinfo query [-j|-c] INDEX [FIELD=VALUE]...\n");
+        return EXIT_FAILURE;
+    }
+
+    SCAN_INDEX_READER reader;
+    if (openIndex(&reader, argv[0])) return EXIT_FAILURE;
+
+    int numberOfPredicates = argc - 1;
+    QUERY_PREDICATE *predicates = calloc(numberOfPredicates + 1, sizeof(QUERY_PREDICATE));
+    if (!predicates) {
+        peClose(&reader.file);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < numberOfPredicates; i++) {
+        if (parsePredicate(&reader, argv[i + 1], &predicates[i])) {
+            free(predicates);
+            peClose(&reader.file);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t count = 0;
+    int status = EXIT_SUCCESS;
+    for (uint32_t id = 0; id < reader.header->numberOfFiles; id++) {
+        const SCAN_INDEX_RECORD *record = &reader.records[id];
+        if (!recordValid(&reader, record)) {
+            fprintf(stderr, "Error: %s: index is damaged\n", argv[0]);
+            status = EXIT_FAILURE;
+            break;
+        }
+        bool match = true;
+        for (int i = 0; i < numberOfPredicates && match; i++) match = matches(&reader, record, &predicates[i], archName);
+        if (!match) continue;
+        count++;
+        if (onlyCount) continue;
+        if (printJson) {
+            printRecordJson(&reader, record, archName);
+        } else {
+            puts(reader.strings + record->path);
+        }
+    }
+    if (onlyCount && status == EXIT_SUCCESS) printf("%u\n", count);
+
+    free(predicates);
+    peClose(&reader.file);
+    return status;
+}
+
+/**
+ * @brief Mark the files importing a symbol
+ *
+ * @param reader Index
+ * @param symbol Symbol
+ * @param files Bitmap of file ids
+ * @return int 0 on success, -1 if the file ids are damaged
+ */
+static int markFiles(const SCAN_INDEX_READER *reader, const SCAN_INDEX_SYMBOL *symbol, uint8_t *files) {
+    uint64_t position = symbol->postings;
+    uint32_t file = 0;
+    for (uint32_t i = 0; i < symbol->numberOfFiles; i++) {
+        uint32_t delta = 0;
+        for (int shift = 0;; shift += 7) {
+            if (position >= reader->header->postingsSize || shift > 28) return -1;
+            uint8_t byte = reader->postings[position++];
+            delta |= (uint32_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        file += delta;
+        if (file >= reader->header->numberOfFiles) return -1;
+        files[file / 8] |= 1 << (file % 8);
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the symbols of a DLL
+ *
+ * @param reader Index
+ * @param dll DLL id
+ * @param first Set to the first symbol of the DLL
+ * @return uint32_t Number of symbols of the DLL
+ */
+static uint32_t findDllSymbols(const SCAN_INDEX_READER *reader, uint32_t dll, uint32_t *first) {
+    uint32_t low = 0, high = reader->header->numberOfSymbols;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (reader->symbols[middle].dll < dll) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *first = low;
+    while (high < reader->header->numberOfSymbols && reader->symbols[high].dll == dll) high++;
+    return high - low;
+}
+
+/**
+ * @brief Check whether a symbol is selected by a FUNCTION argument of lookup
+ *
+ * @param symbolName Name of the symbol, empty if imported by ordinal
+ * @param ordinal Ordinal of the symbol
+ * @param function Name with * and ? wildcards, or an ordinal as NUMBER or #NUMBER
+ */
+static bool symbolMatches(const char *symbolName, uint16_t ordinal, const char *function) {
+    const char *number = function[0] == '#' ? function + 1 : function;
+    if (isdigit((unsigned char)number[0])) {
+        char *end;
+        unsigned long value = strtoul(number, &end, 0);
+        return !*end && !symbolName[0] && value == ordinal;
+    }
+    return symbolName[0] && wildcardMatch(function, symbolName, false);
+}
+
+/**
+ * @brief Implementation of `wcepeinfo lookup [-c] INDEX DLL [FUNCTION]...`
+ *
+ * Without FUNCTION, the imported functions of DLL are listed with the number of files importing them. Otherwise the
+ * files importing any of the functions are printed.
+ *
+ * @param argc Number of arguments after "lookup"
+ * @param argv Arguments after "lookup"
+ * @return int Exit status
+ */
+int scanIndexLookup(int argc, char **argv) {
+    bool onlyCount = false;
+    if (argc && (!strcmp(argv[0], "-c") || !strcmp(argv[0], "--count"))) {
+        onlyCount = true;
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: wcepeinfo lookup [-c] INDEX DLL [FUNCTION|ORDINAL]...\n");
+        return EXIT_FAILURE;
+    }
+
+    SCAN_INDEX_READER reader;
+    if (openIndex(&reader, argv[0])) return EXIT_FAILURE;
+
+    uint32_t first = 0, numberOfSymbols = 0;
+    int64_t dll = findDll(&reader, argv[1]);
+    if (dll >= 0) numberOfSymbols = findDllSymbols(&reader, dll, &first);
+
+    if (argc == 2) {
+        int status = EXIT_SUCCESS;
+        for (uint32_t i = first; i < first + numberOfSymbols; i++) {
+            const SCAN_INDEX_SYMBOL *symbol = &reader.symbols[i];
+            if (!symbolValid(&reader, symbol)) {
+                fprintf(stderr, "Error: %s: index is damaged\n", argv[0]);
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (symbol->name) {
+                printf("%s: %u\n", reader.strings + symbol->name, symbol->numberOfFiles);
+            } else {
+                printf("#%u: %u\n", symbol->ordinal, symbol->numberOfFiles);
+            }
+        }
+        peClose(&reader.file);
+        return status;
+    }
+
+    uint8_t *files = calloc(reader.header->numberOfFiles / 8 + 1, 1);
+    if (!files) {
+        peClose(&reader.file);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (uint32_t i = first; i < first + numberOfSymbols && status == EXIT_SUCCESS; i++) {
+        const SCAN_INDEX_SYMBOL *symbol = &reader.symbols[i];
+        if (!symbolValid(&reader, symbol)) {
+            fprintf(stderr, "Error: %s: index is damaged\n", argv[0]);
+            status = EXIT_FAILURE;
+            break;
+        }
+        const char *symbolName = reader.strings + symbol->name;
+        for (int j = 2; j < argc; j++) {
+            if (!symbolMatches(symbolName, symbol->ordinal, argv[j])) continue;
+            if (markFiles(&reader, symbol, files)) {
+                fprintf(stderr, "Error: %s: index is damaged\n", argv[0]);
+                status = EXIT_FAILURE;
+            }
+            break;
+        }
+    }
+
+    uint32_t count = 0;
+    for (uint32_t file = 0; file < reader.header->numberOfFiles && status == EXIT_SUCCESS; file++) {
+        if (!(files[file / 8] & (1 << (file % 8)))) continue;
+        if (!recordValid(&reader, &reader.records[file])) {
+            fprintf(stderr, "Error: %s: index is damaged\n", argv[0]);
+            status = EXIT_FAILURE;
+            break;
+        }
+        count++;
+        if (!onlyCount) puts(reader.strings + reader.records[file].path);
+    }
+    if (onlyCount && status == EXIT_SUCCESS) printf("%u\n", count);
+
+    free(files);
+    peClose(&reader.file);
+    return status;
+}
+
+/* Resume */
+
+static int compareFilePostings(const void *a, const void *b) {
+    const SCAN_INDEX_POSTING *posting1 = a, *posting2 = b;
+    if (posting1->file != posting2->file) return posting1->file < posting2->file ? -1 : 1;
+    return (posting1->symbol > posting2->symbol) - (posting1->symbol < posting2->symbol);
+}
+
+/**
+ * @brief Decode the file ids of all symbols into (symbol, file) pairs
+ *
+ * @return int 0 on success, -1 if the file ids are damaged
+ */
+static int decodePostings(const SCAN_INDEX_READER *reader, SCAN_INDEX_POSTING *pairs, size_t capacity, size_t *numberOfPairs) {
+    size_t n = 0;
+    for (uint32_t id = 0; id < reader->header->numberOfSymbols; id++) {
+        const SCAN_INDEX_SYMBOL *symbol = &reader->symbols[id];
+        uint64_t position = symbol->postings;
+        uint32_t file = 0;
+        for (uint32_t i = 0; i < symbol->numberOfFiles; i++) {
+            uint32_t delta = 0;
+            for (int shift = 0;; shift += 7) {
+                if (position >= reader->header->postingsSize || shift > 28) return -1;
+                uint8_t byte = reader->postings[position++];
+                delta |= (uint32_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) break;
+            }
+            file += delta;
+            if (file >= reader->header->numberOfFiles || n == capacity) return -1;
+            pairs[n].symbol = id;
+            pairs[n].file = file;
+            n++;
+        }
+    }
+    *numberOfPairs = n;
+    return 0;
+}
+
+/**
+ * @brief Add the files of an existing index to the index being built, for --resume
+ *
+ * @param index Index
+ * @param path Path of the existing index
+ * @param keep Called with the path of every file, files it returns false for are left out
+ * @return int 0 on success, -1 if the index could not be read, after printing why
+ */
+int scanIndexLoad(SCAN_INDEX_WRITER *index, const char *path, bool (*keep)(const char *path)) {
+    SCAN_INDEX_READER reader;
+    if (openIndex(&reader, path)) return -1;
+    const SCAN_INDEX_HEADER *header = reader.header;
+
+    size_t capacity = 0;
+    for (uint32_t id = 0; id < header->numberOfSymbols; id++) capacity += reader.symbols[id].numberOfFiles;
+    SCAN_INDEX_POSTING *pairs = malloc((capacity + 1) * sizeof(SCAN_INDEX_POSTING));
+    size_t numberOfPairs = 0;
+    int status = 0;
+    if (!pairs) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        status = -1;
+    } else if (decodePostings(&reader, pairs, capacity, &numberOfPairs)) {
+        fprintf(stderr, "Error: %s: index is damaged\n", path);
+        status = -1;
+    }
+    if (!status) qsort(pairs, numberOfPairs, sizeof(SCAN_INDEX_POSTING), compareFilePostings);
+
+    size_t pair = 0;
+    for (uint32_t file = 0; file < header->numberOfFiles && !status; file++) {
+        const SCAN_INDEX_RECORD *record = &reader.records[file];
+        if (!recordValid(&reader, record)) {
+            fprintf(stderr, "Error: %s: index is damaged\n", path);
+            status = -1;
+            break;
+        }
+        const char *filePath = reader.strings + record->path;
+        size_t firstPair = pair;
+        while (pair < numberOfPairs && pairs[pair].file == file) pair++;
+        if (keep && !keep(filePath)) continue;
+
+        scanIndexStartFile(index);
+        for (uint32_t i = 0; i < record->numberOfImports && !status; i++) {
+            if (scanIndexAddImport(index, reader.strings + reader.dlls[reader.imports[record->firstImport + i]])) status = -1;
+        }
+        for (size_t i = firstPair; i < pair && !status; i++) {
+            const SCAN_INDEX_SYMBOL *symbol = &reader.symbols[pairs[i].symbol];
+            if (!symbolValid(&reader, symbol)) status = -2;
+            else if (scanIndexAddFunction(index, reader.strings + reader.dlls[symbol->dll], symbol->name ? reader.strings + symbol->name : NULL, symbol->ordinal)) status = -1;
+        }
+        if (!status && record->fileVersion && scanIndexSetFileVersion(index, reader.strings + record->fileVersion)) status = -1;
+        if (!status) {
+            SCAN_INDEX_FILE values = {
+                record->machine,
+                record->subsystem,
+                record->majorSubsystemVersion,
+                record->minorSubsystemVersion,
+                record->characteristics,
+                record->timestamp,
+                record->flags & SCAN_INDEX_FLAG_WCE_APP,
+                record->flags & SCAN_INDEX_FLAG_WCE_VERSION ? reader.strings + record->wceVersionString : NULL};
+            if (scanIndexEndFile(index, filePath, &values)) status = -1;
+        }
+        if (status == -2) fprintf(stderr, "Error: %s: index is damaged\n", path);
+        else if (status) fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+    }
+    if (status) status = -1;
+
+    free(pairs);
+    peClose(&reader.file);
+    return status;
+}
@@ -0,0 +1,109 @@
+#ifndef SCANINDEX_H
+#define SCANINDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCAN_INDEX_MAGIC "WCEIDX1"
+#define SCAN_INDEX_VERSION 2
+
+#define SCAN_INDEX_FLAG_WCE_APP 0x0001
+/** WCEVersion could be determined */
+#define SCAN_INDEX_FLAG_WCE_VERSION 0x0002
+
+/** No string, offset of the empty string at the start of the string pool */
+#define SCAN_INDEX_NO_STRING 0
+
+/** Index file header. All offsets are from the start of the file, the file is written in host byte order. */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t numberOfFiles;
+    uint32_t numberOfDlls;
+    uint32_t numberOfImports;
+    uint32_t numberOfSymbols;
+    /** SCAN_INDEX_RECORD[numberOfFiles] */
+    uint64_t recordsOffset;
+    /** uint32_t[numberOfDlls], string offset of every DLL name, sorted by name */
+    uint64_t dllsOffset;
+    /** uint32_t[numberOfImports], DLL ids imported by every file, sorted per file */
+    uint64_t importsOffset;
+    /** NUL terminated strings */
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    /** SCAN_INDEX_SYMBOL[numberOfSymbols], sorted by DLL id, name and ordinal */
+    uint64_t symbolsOffset;
+    /** File ids of every symbol, see SCAN_INDEX_SYMBOL */
+    uint64_t postingsOffset;
+    uint64_t postingsSize;
+} SCAN_INDEX_HEADER;
+
+/** Fixed size record of one examined file. The file id is the index of its record. */
+typedef struct
+{
+    /** String offsets */
+    uint32_t path;
+    uint32_t wceVersionString;
+    uint32_t fileVersion;
+    uint32_t timestamp;
+    /** Index of the first DLL id of this file in the import list */
+    uint32_t firstImport;
+    uint16_t numberOfImports;
+    uint16_t machine;
+    uint16_t subsystem;
+    uint16_t majorSubsystemVersion;
+    uint16_t minorSubsystemVersion;
+    uint16_t characteristics;
+    /** major << 8 | minor, valid if SCAN_INDEX_FLAG_WCE_VERSION is set */
+    uint16_t wceVersion;
+    uint16_t flags;
+} SCAN_INDEX_RECORD;
+
+/**
+ * Imported function, with the files importing it. The file ids are sorted and stored as the differences between
+ * consecutive ids (the first one from 0), each as an unsigned LEB128 number.
+ */
+typedef struct
+{
+    uint32_t dll;
+    /** String offset of the name, SCAN_INDEX_NO_STRING if imported by ordinal */
+    uint32_t name;
+    /** Offset of the file ids from the start of the postings */
+    uint32_t postings;
+    uint32_t numberOfFiles;
+    uint16_t ordinal;
+    uint16_t reserved;
+} SCAN_INDEX_SYMBOL;
+
+/** Header values of a file added to the index */
+typedef struct
+{
+    uint16_t machine;
+    uint16_t subsystem;
+    uint16_t majorSubsystemVersion;
+    uint16_t minorSubsystemVersion;
+    uint16_t characteristics;
+    uint32_t timestamp;
+    bool wceApp;
+    /** WCEVersion as printed, NULL if unknown */
+    const char *wceVersion;
+} SCAN_INDEX_FILE;
+
+typedef struct SCAN_INDEX_WRITER SCAN_INDEX_WRITER;
+
+SCAN_INDEX_WRITER *scanIndexCreate(void);
+void scanIndexStartFile(SCAN_INDEX_WRITER *index);
+int scanIndexAddImport(SCAN_INDEX_WRITER *index, const char *dllName);
+int scanIndexAddFunction(SCAN_INDEX_WRITER *index, const char *dllName, const char *function, uint16_t ordinal);
+int scanIndexSetFileVersion(SCAN_INDEX_WRITER *index, const char *fileVersion);
+int scanIndexEndFile(SCAN_INDEX_WRITER *index, const char *path, const SCAN_INDEX_FILE *file);
+int scanIndexSave(SCAN_INDEX_WRITER *index, const char *path);
+int scanIndexLoad(SCAN_INDEX_WRITER *index, const char *path, bool (*keep)(const char *path));
+void scanIndexFree(SCAN_INDEX_WRITER *index);
+
+int scanIndexQuery(int argc, char **argv, const char *(*archName)(uint16_t machine));
+int scanIndexLookup(int argc, char **argv);
+
+#endif
@@ -0,0 +1,753 @@
+/*
+ * Long running server answering requests on a Unix socket.
+ *
+ * Every request is one line of JSON, and may be pipelined:
+ *
+ *     {"id": 1, "path": "/cdrom/htmledit.exe", "fields": ["WCEArch", "WCEVersion"]}
+ *
+ * Instead of a path, a client can pass an open file descriptor with SCM_RIGHTS and send "fd": true. Descriptors are
+ * used by fd requests in the order they were received, "path" is then only the label. Every request is answered with
+ * exactly one line of JSON carrying the same id, in request order. "fields" selects top-level keys, without it the
+ * whole object is returned. Failures are answered with an "Error" key.
+ *
+ * Requests of all clients go through one bounded queue. While it is full no more input is read, so clients block once
+ * the socket buffers are full. Requests are processed in batches and the responses of a batch are sent with one write
+ * per client. Results are cached by device, inode, size and modification time of the file.
+ *
+ * Files that are not cached are examined by the worker pool, so a file that crashes the parser or exceeds the timeout
+ * only fails its own request. The pool is started with the server and kept warm, only workers that died are forked
+ * again. The open file is passed to the worker together with the request.
+ */
+#include "serve.h"
+
+#include "workerpool.h"
+
+#ifdef USE_SERVE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_QUEUE_SIZE 256
+#define SERVE_BATCH_SIZE 32
+#define SERVE_CACHE_SIZE 4096
+#define SERVE_MAX_PASSED_FDS 16
+#define SERVE_MAX_REQUEST_SIZE (64 * 1024)
+#define SERVE_READ_SIZE 16384
+
+/** No more requests of a client are read while this many response bytes wait to be sent to it */
+#define SERVE_MAX_PENDING_OUTPUT (1024 * 1024)
+
+#ifdef MSG_CMSG_CLOEXEC
+#define SERVE_RECV_FLAGS MSG_CMSG_CLOEXEC
+#else
+#define SERVE_RECV_FLAGS 0
+#endif
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} SERVE_BUFFER;
+
+typedef struct
+{
+    /** -1 if the slot is unused */
+    int socket;
+    /** Incremented whenever the slot is reused, so queued requests of a disconnected client are dropped */
+    unsigned generation;
+    SERVE_BUFFER in;
+    SERVE_BUFFER out;
+    /** Received descriptors not yet used by a request */
+    int passedFds[SERVE_MAX_PASSED_FDS];
+    int numberOfPassedFds;
+    /** Number of requests in the queue */
+    int pending;
+    /** The client shut down its side, close after the remaining requests are answered */
+    bool closing;
+} SERVE_CLIENT;
+
+typedef struct
+{
+    int client;
+    unsigned generation;
+    /** Parsed request, NULL if error is set */
+    cJSON *request;
+    const char *error;
+    /** Passed descriptor or -1 */
+    int fd;
+} SERVE_REQUEST;
+
+typedef struct
+{
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    cJSON *result;
+} SERVE_CACHE_ENTRY;
+
+typedef struct
+{
+    int listenSocket;
+    SERVE_EXAMINE_CALLBACK examine;
+    /** Maximum number of bytes buffered when a file is read as a stream, and whether streams are kept as a whole */
+    size_t maxBuffer;
+    bool whole;
+    /** Worker processes examining the files that are not cached */
+    WORKER_POOL *pool;
+    SERVE_CLIENT clients[SERVE_MAX_CLIENTS];
+    int numberOfClients;
+    /** Ring buffer of requests */
+    SERVE_REQUEST queue[SERVE_QUEUE_SIZE];
+    int queueHead;
+    int queueCount;
+    /** Direct mapped result cache */
+    SERVE_CACHE_ENTRY cache[SERVE_CACHE_SIZE];
+} SERVER;
+
+/** A request of the batch being answered */
+typedef struct
+{
+    SERVE_REQUEST entry;
+    /** The client disconnected, nothing is answered */
+    bool dropped;
+    /** File name of the response, NULL if the request has none */
+    const char *label;
+    /** Result, either cached or uncached */
+    cJSON *result;
+    /** Result that is not in the cache yet, owned by the task */
+    cJSON *uncached;
+    const char *error;
+    char errorBuffer[256];
+    /** The file has to be examined by a worker */
+    bool examine;
+    struct stat st;
+    /** Cache slot the result is stored in, NULL if it is not cached */
+    SERVE_CACHE_ENTRY *slot;
+} SERVE_TASK;
+
+/** The server, whose settings are used by the worker processes */
+static SERVER *activeServer = NULL;
+/** Tasks of the batch being examined, and the same tasks by input index of the worker pool */
+static SERVE_TASK *activeTasks = NULL;
+static int activeNumberOfTasks = 0;
+static SERVE_TASK **activeWorkerTasks = NULL;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int signal) {
+    (void)signal;
+    stopRequested = 1;
+}
+
+static int bufferReserve(SERVE_BUFFER *buffer, size_t extra) {
+    if (buffer->capacity - buffer->length >= extra) return 0;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->length < extra) capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (!data) return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int bufferAppend(SERVE_BUFFER *buffer, const char *data, size_t size) {
+    if (bufferReserve(buffer, size)) return -1;
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+    return 0;
+}
+
+static void bufferConsume(SERVE_BUFFER *buffer, size_t size) {
+    memmove(buffer->data, buffer->data + size, buffer->length - size);
+    buffer->length -= size;
+}
+
+static void bufferFree(SERVE_BUFFER *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(SERVE_BUFFER));
+}
+
+/**
+ * @brief Check whether a socket file is left over from a server that did not exit cleanly
+ */
+static bool staleSocket(const struct sockaddr_un *address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1) return false;
+    bool stale = connect(probe, (const struct sockaddr *)address, sizeof(struct sockaddr_un)) == -1 && errno == ECONNREFUSED;
+    close(probe);
+    errno = EADDRINUSE;
+    return stale;
+}
+
+static int openListenSocket(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket == -1) return -1;
+
+    int status = bind(listenSocket, (struct sockaddr *)&address, sizeof(address));
+    if (status == -1 && errno == EADDRINUSE && staleSocket(&address)) {
+        unlink(path);
+        status = bind(listenSocket, (struct sockaddr *)&address, sizeof(address));
+    }
+    if (status == -1 || listen(listenSocket, SOMAXCONN) == -1 || fcntl(listenSocket, F_SETFL, O_NONBLOCK) == -1) {
+        int savedErrno = errno;
+        close(listenSocket);
+        errno = savedErrno;
+        return -1;
+    }
+    return listenSocket;
+}
+
+static void acceptClient(SERVER *server) {
+    int clientSocket = accept(server->listenSocket, NULL, NULL);
+    if (clientSocket == -1) return;
+
+    SERVE_CLIENT *client = NULL;
+    for (int i = 0; i < SERVE_MAX_CLIENTS && !client; i++) {
+        if (server->clients[i].socket == -1) client = &(server->clients[i]);
+    }
+    if (!client || fcntl(clientSocket, F_SETFL, O_NONBLOCK) == -1) {
+        close(clientSocket);
+        return;
+    }
+    fcntl(clientSocket, F_SETFD, FD_CLOEXEC);
+
+    client->socket = clientSocket;
+    client->generation++;
+    client->numberOfPassedFds = 0;
+    client->pending = 0;
+    client->closing = false;
+    server->numberOfClients++;
+}
+
+static void dropClient(SERVER *server, SERVE_CLIENT *client) {
+    close(client->socket);
+    for (int i = 0; i < client->numberOfPassedFds; i++) close(client->passedFds[i]);
+    bufferFree(&client->in);
+    bufferFree(&client->out);
+    client->socket = -1;
+    client->generation++;
+    client->numberOfPassedFds = 0;
+    client->pending = 0;
+    server->numberOfClients--;
+}
+
+/**
+ * @brief Read available request data and passed descriptors of a client
+ */
+static void receiveFromClient(SERVER *server, SERVE_CLIENT *client) {
+    if (bufferReserve(&client->in, SERVE_READ_SIZE)) {
+        dropClient(server, client);
+        return;
+    }
+
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(SERVE_MAX_PASSED_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = {client->in.data + client->in.length, SERVE_READ_SIZE};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    ssize_t received = recvmsg(client->socket, &message, SERVE_RECV_FLAGS);
+    if (received == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) dropClient(server, client);
+        return;
+    }
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+        int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (client->numberOfPassedFds < SERVE_MAX_PASSED_FDS) {
+                client->passedFds[client->numberOfPassedFds++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    if (received == 0) client->closing = true;
+    client->in.length += received;
+}
+
+static void enqueue(SERVER *server, int clientIndex, cJSON *request, const char *error, int fd) {
+    SERVE_CLIENT *client = &(server->clients[clientIndex]);
+    SERVE_REQUEST *entry = &(server->queue[(server->queueHead + server->queueCount++) % SERVE_QUEUE_SIZE]);
+    entry->client = clientIndex;
+    entry->generation = client->generation;
+    entry->request = request;
+    entry->error = error;
+    entry->fd = fd;
+    client->pending++;
+}
+
+/**
+ * @brief Move the next complete request line of a client to the queue
+ *
+ * @return bool true if a request was queued
+ */
+static bool queueNextRequest(SERVER *server, int clientIndex) {
+    SERVE_CLIENT *client = &(server->clients[clientIndex]);
+    if (server->queueCount == SERVE_QUEUE_SIZE || client->out.length >= SERVE_MAX_PENDING_OUTPUT) return false;
+
+    char *end = client->in.length ? memchr(client->in.data, '\n', client->in.length) : NULL;
+    if (!end) {
+        if (client->in.length > SERVE_MAX_REQUEST_SIZE) {
+            /* Can't find the start of the next request, answer and hang up */
+            enqueue(server, clientIndex, NULL, "request is too long", -1);
+            client->in.length = 0;
+            client->closing = true;
+            return true;
+        }
+        return false;
+    }
+
+    size_t length = end - client->in.data;
+    cJSON *request = cJSON_ParseWithLength(client->in.data, length);
+    bufferConsume(&client->in, length + 1);
+
+    if (!cJSON_IsObject(request)) {
+        cJSON_Delete(request);
+        enqueue(server, clientIndex, NULL, "request is not a JSON object", -1);
+        return true;
+    }
+
+    int fd = -1;
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(request, "fd")) && client->numberOfPassedFds) {
+        fd = client->passedFds[0];
+        memmove(client->passedFds, client->passedFds + 1, --client->numberOfPassedFds * sizeof(int));
+    }
+    enqueue(server, clientIndex, request, NULL, fd);
+    return true;
+}
+
+/**
+ * @brief Queue complete requests of all clients, taking one request per client in turn
+ */
+static void fillQueue(SERVER *server) {
+    bool progress = true;
+    while (progress && server->queueCount < SERVE_QUEUE_SIZE) {
+        progress = false;
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            if (server->clients[i].socket != -1 && queueNextRequest(server, i)) progress = true;
+        }
+    }
+}
+
+static SERVE_CACHE_ENTRY *cacheSlot(SERVER *server, const struct stat *st) {
+    uint64_t hash = ((uint64_t)st->st_dev * 0x9E3779B97F4A7C15ull) ^ ((uint64_t)st->st_ino * 0xC2B2AE3D27D4EB4Full);
+    return &(server->cache[(hash >> 32) % SERVE_CACHE_SIZE]);
+}
+
+static bool cacheMatches(const SERVE_CACHE_ENTRY *entry, const struct stat *st) {
+    return entry->result && entry->device == st->st_dev && entry->inode == st->st_ino && entry->size == st->st_size &&
+           entry->modified.tv_sec == st->st_mtim.tv_sec && entry->modified.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Validate a request, open its file and take the result from the cache if it is there. Requests that are not
+ * answered yet are examined by the workers.
+ */
+static void prepareTask(SERVER *server, SERVE_TASK *task) {
+    SERVE_REQUEST *entry = &task->entry;
+    SERVE_CLIENT *client = &(server->clients[entry->client]);
+    /* The client may have disconnected since the request was queued */
+    if (client->socket == -1 || client->generation != entry->generation) {
+        task->dropped = true;
+        return;
+    }
+    if (entry->error) {
+        task->error = entry->error;
+        return;
+    }
+
+    cJSON *path = cJSON_GetObjectItemCaseSensitive(entry->request, "path");
+    bool passedFd = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(entry->request, "fd"));
+    if (!passedFd && !cJSON_IsString(path)) {
+        task->error = "request needs a path or a file descriptor";
+        return;
+    }
+    task->label = cJSON_IsString(path) ? path->valuestring : "-";
+
+    if (passedFd && entry->fd == -1) {
+        task->error = "no file descriptor was passed with the request";
+        return;
+    }
+    if (!passedFd) {
+        entry->fd = open(task->label, O_RDONLY);
+        if (entry->fd == -1) {
+            task->error = strerror(errno);
+            return;
+        }
+        fcntl(entry->fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    if (fstat(entry->fd, &task->st) == -1) {
+        task->error = strerror(errno);
+        return;
+    }
+    /* Only regular files can be identified by their inode */
+    task->slot = S_ISREG(task->st.st_mode) ? cacheSlot(server, &task->st) : NULL;
+    if (task->slot && cacheMatches(task->slot, &task->st)) {
+        task->result = task->slot->result;
+        task->slot = NULL;
+        return;
+    }
+    task->examine = true;
+}
+
+/**
+ * @brief Close the sockets and files of the server in a new worker process. A client is only disconnected once no
+ * worker holds its socket open any more.
+ */
+static void closeServerDescriptors(void) {
+    SERVER *server = activeServer;
+    close(server->listenSocket);
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        SERVE_CLIENT *client = &(server->clients[i]);
+        if (client->socket == -1) continue;
+        close(client->socket);
+        for (int j = 0; j < client->numberOfPassedFds; j++) close(client->passedFds[j]);
+    }
+    for (int i = 0; i < server->queueCount; i++) {
+        SERVE_REQUEST *entry = &(server->queue[(server->queueHead + i) % SERVE_QUEUE_SIZE]);
+        if (entry->fd != -1) close(entry->fd);
+    }
+    for (int i = 0; i < activeNumberOfTasks; i++) {
+        if (activeTasks[i].entry.fd != -1) close(activeTasks[i].entry.fd);
+    }
+}
+
+/**
+ * @brief Examine the file passed with a request in a worker process and print the result as one line of JSON
+ *
+ * @param input Label of the file
+ * @return int 1 if the file could not be examined
+ */
+static int examineInWorker(const char *input) {
+    workerSetLabel(input);
+
+    PE_FILE pe;
+    const char *error = NULL;
+    cJSON *result = NULL;
+    if (peOpenDescriptor(&pe, workerInputDescriptor(), activeServer->maxBuffer, activeServer->whole)) {
+        error = strerror(errno);
+    } else {
+        result = activeServer->examine(&pe, input, &error);
+        peClose(&pe);
+    }
+
+    cJSON *line = cJSON_CreateObject();
+    if (result) {
+        cJSON_AddItemToObject(line, "result", result);
+    } else {
+        cJSON_AddStringToObject(line, "error", error ? error : "File could not be examined");
+    }
+    char *text = cJSON_PrintUnformatted(line);
+    if (text) printf("%s\n", text);
+    free(text);
+    cJSON_Delete(line);
+    return result ? 0 : 1;
+}
+
+/** Line printed by the worker of the input that is finished next */
+static cJSON *workerLine = NULL;
+
+static void receiveWorkerOutput(const char *data, size_t length) {
+    cJSON_Delete(workerLine);
+    workerLine = length ? cJSON_ParseWithLength(data, length) : NULL;
+}
+
+static void workerInputDone(int input, bool reaped) {
+    SERVE_TASK *task = activeWorkerTasks[input];
+    cJSON *result = cJSON_DetachItemFromObjectCaseSensitive(workerLine, "result");
+    cJSON *error = cJSON_GetObjectItemCaseSensitive(workerLine, "error");
+    if (reaped) {
+        task->error = "examining the file crashed or timed out";
+    } else if (!result && !cJSON_IsString(error)) {
+        task->error = "invalid output of the worker process";
+    } else if (result) {
+        task->uncached = result;
+        task->result = result;
+    } else {
+        /* Copied, the line is freed before the response is written */
+        snprintf(task->errorBuffer, sizeof(task->errorBuffer), "%s", error->valuestring);
+        task->error = task->errorBuffer;
+    }
+    if (reaped) cJSON_Delete(result);
+    cJSON_Delete(workerLine);
+    workerLine = NULL;
+}
+
+/**
+ * @brief Examine the files of the tasks that were not cached in the worker pool, so a file that crashes the parser or
+ * makes it hang only fails its own request
+ */
+static void examineTasks(SERVER *server, SERVE_TASK *tasks, int numberOfTasks) {
+    SERVE_TASK *workerTasks[SERVE_BATCH_SIZE];
+    char *inputs[SERVE_BATCH_SIZE];
+    int fds[SERVE_BATCH_SIZE];
+    int numberOfInputs = 0;
+    for (int i = 0; i < numberOfTasks; i++) {
+        if (!tasks[i].examine) continue;
+        workerTasks[numberOfInputs] = &tasks[i];
+        /* Only read by the worker pool */
+        inputs[numberOfInputs] = (char *)tasks[i].label;
+        fds[numberOfInputs++] = tasks[i].entry.fd;
+    }
+    if (!numberOfInputs) return;
+
+    activeTasks = tasks;
+    activeNumberOfTasks = numberOfTasks;
+    activeWorkerTasks = workerTasks;
+    if (workerPoolExamine(server->pool, inputs, fds, numberOfInputs, NULL, workerInputDone, receiveWorkerOutput) == -1) {
+        for (int i = 0; i < numberOfInputs; i++) {
+            if (!workerTasks[i]->result && !workerTasks[i]->error) workerTasks[i]->error = "could not start a worker process";
+        }
+    }
+    activeTasks = NULL;
+    activeNumberOfTasks = 0;
+    activeWorkerTasks = NULL;
+}
+
+/**
+ * @brief Append the response to a request to the output of its client
+ */
+static void answerTask(SERVER *server, SERVE_TASK *task) {
+    SERVE_CLIENT *client = &(server->clients[task->entry.client]);
+    if (task->dropped || client->socket == -1 || client->generation != task->entry.generation) return;
+    client->pending--;
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON *id = cJSON_GetObjectItemCaseSensitive(task->entry.request, "id");
+    if (id) cJSON_AddItemToObject(response, "id", cJSON_Duplicate(id, true));
+    if (task->label) cJSON_AddStringToObject(response, "File", task->label);
+
+    if (task->result) {
+        /* The response only references the result, so cached results are not copied */
+        cJSON *fields = cJSON_GetObjectItemCaseSensitive(task->entry.request, "fields");
+        cJSON *item;
+        if (cJSON_IsArray(fields)) {
+            cJSON *field;
+            cJSON_ArrayForEach(field, fields) {
+                if (!cJSON_IsString(field)) continue;
+                item = cJSON_GetObjectItemCaseSensitive(task->result, field->valuestring);
+                if (item) cJSON_AddItemReferenceToObject(response, item->string, item);
+            }
+        } else {
+            cJSON_ArrayForEach(item, task->result) {
+                cJSON_AddItemReferenceToObject(response, item->string, item);
+            }
+        }
+    } else {
+        cJSON_AddStringToObject(response, "Error", task->error ? task->error : "File could not be examined");
+    }
+
+    char *line = cJSON_PrintUnformatted(response);
+    if (!line || bufferAppend(&client->out, line, strlen(line)) || bufferAppend(&client->out, "\n", 1)) {
+        dropClient(server, client);
+    }
+    free(line);
+    cJSON_Delete(response);
+}
+
+/**
+ * @brief Answer a batch of requests. Cached results are taken first, the other files are examined by the workers
+ * together, and the responses are written in request order.
+ */
+static void processBatch(SERVER *server) {
+    SERVE_TASK tasks[SERVE_BATCH_SIZE];
+    int numberOfTasks = 0;
+    while (numberOfTasks < SERVE_BATCH_SIZE && server->queueCount) {
+        SERVE_TASK *task = &tasks[numberOfTasks++];
+        memset(task, 0, sizeof(SERVE_TASK));
+        task->entry = server->queue[server->queueHead];
+        server->queueHead = (server->queueHead + 1) % SERVE_QUEUE_SIZE;
+        server->queueCount--;
+        prepareTask(server, task);
+    }
+
+    examineTasks(server, tasks, numberOfTasks);
+    for (int i = 0; i < numberOfTasks; i++) answerTask(server, &tasks[i]);
+
+    /* Responses may reference cached results, so the cache is only updated once all of them were written */
+    for (int i = 0; i < numberOfTasks; i++) {
+        SERVE_TASK *task = &tasks[i];
+        SERVE_CACHE_ENTRY *slot = task->slot;
+        if (slot && task->uncached) {
+            cJSON_Delete(slot->result);
+            slot->device = task->st.st_dev;
+            slot->inode = task->st.st_ino;
+            slot->size = task->st.st_size;
+            slot->modified = task->st.st_mtim;
+            slot->result = task->uncached;
+        } else {
+            cJSON_Delete(task->uncached);
+        }
+        if (task->entry.fd != -1) close(task->entry.fd);
+        cJSON_Delete(task->entry.request);
+    }
+}
+
+static void flushClient(SERVER *server, SERVE_CLIENT *client) {
+    size_t sent = 0;
+    while (sent < client->out.length) {
+        ssize_t written = send(client->socket, client->out.data + sent, client->out.length - sent, 0);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            dropClient(server, client);
+            return;
+        }
+        sent += written;
+    }
+    bufferConsume(&client->out, sent);
+}
+
+static void shutdownServer(SERVER *server, const char *socketPath) {
+    while (server->queueCount) {
+        SERVE_REQUEST *entry = &(server->queue[server->queueHead]);
+        if (entry->fd != -1) close(entry->fd);
+        cJSON_Delete(entry->request);
+        server->queueHead = (server->queueHead + 1) % SERVE_QUEUE_SIZE;
+        server->queueCount--;
+    }
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        if (server->clients[i].socket != -1) dropClient(server, &(server->clients[i]));
+    }
+    for (int i = 0; i < SERVE_CACHE_SIZE; i++) cJSON_Delete(server->cache[i].result);
+    workerPoolStop(server->pool);
+    activeServer = NULL;
+    close(server->listenSocket);
+    unlink(socketPath);
+    free(server);
+}
+
+/**
+ * @brief Answer requests on a Unix socket until SIGINT or SIGTERM is received
+ *
+ * @param socketPath Path of the socket to create
+ * @param numberOfWorkers Number of worker processes that examine the files
+ * @param timeout Seconds a worker may spend on one file, 0 for no limit
+ * @param maxBuffer Maximum number of bytes buffered when a file is read as a stream
+ * @param whole Keep every byte of files read as a stream, for examinations that need all of them
+ * @param examine Called to examine a file that is not in the cache
+ * @return int 0 after a clean shutdown, -1 on error with errno set
+ */
+int serve(const char *socketPath, int numberOfWorkers, unsigned timeout, size_t maxBuffer, bool whole, SERVE_EXAMINE_CALLBACK examine) {
+    SERVER *server = calloc(1, sizeof(SERVER));
+    if (!server) return -1;
+    server->examine = examine;
+    server->maxBuffer = maxBuffer;
+    server->whole = whole;
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) server->clients[i].socket = -1;
+
+    server->listenSocket = openListenSocket(socketPath);
+    if (server->listenSocket == -1) {
+        free(server);
+        return -1;
+    }
+
+    activeServer = server;
+    server->pool = workerPoolStart(numberOfWorkers, timeout, examineInWorker, closeServerDescriptors);
+    if (!server->pool) {
+        int savedErrno = errno;
+        close(server->listenSocket);
+        unlink(socketPath);
+        free(server);
+        activeServer = NULL;
+        errno = savedErrno;
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    /* A client hanging up while we write must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+    int owners[SERVE_MAX_CLIENTS + 1];
+    int status = 0;
+
+    while (!stopRequested) {
+        bool queueFull = server->queueCount == SERVE_QUEUE_SIZE;
+        int n = 0;
+        fds[n].fd = server->listenSocket;
+        fds[n].events = server->numberOfClients < SERVE_MAX_CLIENTS ? POLLIN : 0;
+        n++;
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            SERVE_CLIENT *client = &(server->clients[i]);
+            if (client->socket == -1) continue;
+            fds[n].fd = client->socket;
+            fds[n].events = 0;
+            if (!queueFull && !client->closing && client->out.length < SERVE_MAX_PENDING_OUTPUT) fds[n].events |= POLLIN;
+            if (client->out.length) fds[n].events |= POLLOUT;
+            owners[n++] = i;
+        }
+
+        /* Don't wait while there is work in the queue */
+        if (poll(fds, n, server->queueCount ? 0 : -1) == -1) {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+
+        for (int i = 1; i < n; i++) {
+            SERVE_CLIENT *client = &(server->clients[owners[i]]);
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !client->closing) receiveFromClient(server, client);
+            if ((fds[i].revents & POLLOUT) && client->socket != -1) flushClient(server, client);
+        }
+        if (fds[0].revents & POLLIN) acceptClient(server);
+
+        fillQueue(server);
+        processBatch(server);
+
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            SERVE_CLIENT *client = &(server->clients[i]);
+            if (client->socket == -1) continue;
+            if (client->out.length) flushClient(server, client);
+            if (client->socket != -1 && client->closing && !client->pending && !client->out.length &&
+                !(client->in.length && memchr(client->in.data, '\n', client->in.length))) {
+                dropClient(server, client);
+            }
+        }
+    }
+
+    int savedErrno = errno;
+    shutdownServer(server, socketPath);
+    errno = savedErrno;
+    return status;
+}
+
+#endif
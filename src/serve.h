@@ -0,0 +1,18 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "cjson/cJSON.h"
+#include "peinput.h"
+
+#if !defined _WIN32 && !defined UNDER_CE
+#define USE_SERVE
+#endif
+
+/** Examine a PE file. Returns its JSON description, which the server takes ownership of, or NULL with error set. */
+typedef cJSON *(*SERVE_EXAMINE_CALLBACK)(PE_FILE *pe, const char *label, const char **error);
+
+#ifdef USE_SERVE
+int serve(const char *socketPath, int numberOfWorkers, unsigned timeout, size_t maxBuffer, bool whole, SERVE_EXAMINE_CALLBACK examine);
+#endif
+
+#endif
@@ -1,5 +1,9 @@
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -9,8 +13,30 @@
 #include <time.h>
 #include <unistd.h>
 
+#if !defined _WIN32 && !defined UNDER_CE
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#endif
+
 #include "WinCePEHeader.h"
+#include "archive.h"
+#include "checkpoint.h"
+#include "where.h"
+#include "countby.h"
+#include "checksum.h"
 #include "cjson/cJSON.h"
+#include "cluster.h"
+#include "depgraph.h"
+#include "entropy.h"
+#include "exportdb.h"
+#include "hash.h"
+#include "metrics.h"
+#include "peinput.h"
+#include "profile.h"
+#include "scanindex.h"
+#include "serve.h"
+#include "workerpool.h"
 // Define USE_ICONV unless the program is compiles for Windows CE
 #if !defined USE_ICONV && !defined UNDER_CE
 #define USE_ICONV
@@ -32,9 +58,74 @@
 // Variables set by get_opts
 static int printJson = 0;
 static int onlyBasicInfo = 0;
-static char *infile;
+static char **infiles;
+static int numberOfInfiles = 0;
 static bool verbose_enabled = false;
 static char *filterField = NULL;
+static size_t maxStreamBuffer = PE_STREAM_DEFAULT_MAX_BUFFER;
+static int numberOfWorkers = 0;
+static unsigned workerTimeout = 0;
+static char *exportDbFile = NULL;
+static char *buildExportDbDirectory = NULL;
+/** Set when exports of Windows CE versions were loaded with --api-version */
+static bool apiVersionsLoaded = false;
+/** HASH_* bits of --hash, and whether every section is hashed too */
+static unsigned hashAlgorithms = 0;
+static bool hashSections = false;
+/** Set by --verify-checksum */
+static bool verifyChecksum = false;
+/** Set by --entropy */
+static bool sectionEntropy = false;
+/** Set by --profile */
+static bool printProfile = false;
+/** Path of --trace */
+static char *traceOutFile = NULL;
+/** Set by --progress, and path of --metrics-file */
+static bool printProgress = false;
+static char *metricsFile = NULL;
+/** Journal of --checkpoint, and whether the inputs recorded in it are skipped */
+static char *checkpointFile = NULL;
+static bool resumeScan = false;
+/** Compiled --where expression */
+static WHERE_EXPR *whereExpr = NULL;
+/** Counts of --count-by, and whether they are printed as CSV or JSON instead of a table */
+static COUNT_BY *countBy = NULL;
+static bool countByCsv = false;
+static bool countByJson = false;
+/** --sample as a number of files, or as the fraction of files to keep */
+static uint32_t sampleSize = 0;
+static double sampleFraction = 0;
+
+/** Keys of the version info that are printed, encoded as UTF-16LE like the keys in the resource */
+typedef struct
+{
+    uint8_t **keys;
+    /** Size of each key in bytes, without the terminator */
+    size_t *sizes;
+    int numberOfKeys;
+} VERSION_KEYS;
+/** Version info keys of --field, NULL if all keys are printed */
+static VERSION_KEYS *outputVersionKeys = NULL;
+/** Version info keys used by --where and --count-by */
+static VERSION_KEYS *whereVersionKeys = NULL;
+static VERSION_KEYS *countByVersionKeys = NULL;
+/** Digest and entropy fields used by --where and --count-by */
+static bool whereUsesDigests = false, whereUsesEntropy = false;
+static bool countByUsesDigests = false, countByUsesEntropy = false;
+
+/** Receives the printed fields while a file is examined without output, for --where and --count-by */
+typedef struct
+{
+    void (*field)(const char *name, const char *value);
+    /** Called at the end of each part of the file, true if the rest of the file is not needed */
+    bool (*endStage)(void);
+    /** Version info keys the capture uses */
+    VERSION_KEYS *const *versionKeys;
+    /** Whether the capture uses the digests of --hash and the entropy of --entropy, which are costly to compute */
+    const bool *usesDigests;
+    const bool *usesEntropy;
+} FIELD_CAPTURE;
+static const FIELD_CAPTURE *fieldCapture = NULL;
 
 static int jsonIndent = 0;
 static int objCount = 0;
@@ -47,13 +138,54 @@ static IMAGE_SECTION_HEADER *imageSectionHeaders;
 static size_t versionInfoSectionStart = 0;
 static size_t versionInfoSize;
 
+/* Set when more than one file is examined. Every result is then labeled with the name of its file. */
+static bool batchMode = false;
+static const char *currentFile = NULL;
+/* Set while a file is parsed, errors in the file jump here instead of exiting */
+static jmp_buf *fileErrorHandler = NULL;
+
+/** Socket path of --serve */
+static char *serveSocket = NULL;
+
+/** In server mode, errors about a file are sent to the client instead of being printed */
+static char fileErrorMessage[256];
+
+/** With --build-export-db, lower case file name of the DLL being examined */
+static const char *exportDbDllName = NULL;
+
+/** Path and contents of --index-out */
+static char *indexOutFile = NULL;
+static SCAN_INDEX_WRITER *scanIndex = NULL;
+
+/** With --resolve, imports and exports of all files are collected and resolved against each other after the scan */
+static bool resolveImports = false;
+static bool resolveJson = false;
+static DEP_GRAPH *depGraph = NULL;
+
+/** With --cluster, files are grouped by ImpHash after the scan */
+static bool clusterImports = false;
+static bool clusterJson = false;
+static CLUSTER_MAP *clusterMap = NULL;
+/** ImpHash of the file being examined, empty if it has no imports */
+static char fileImpHash[HASH_MAX_HEX];
+
 void usage(int status) {
     puts(
         "\
 Usage: " PROGRAM_NAME
-        " [-j] [-n] [-f FIELDNAME] FILE\
+        " [-j] [-n] [-f FIELDNAME] FILE...\
 \n\
+  or:  " PROGRAM_NAME " --serve SOCKET\n\
+  or:  " PROGRAM_NAME " [-j] [--export-db FILE] --resolve FILE|DIR...\n\
+  or:  " PROGRAM_NAME " [-j] --cluster FILE|DIR...\n\
+  or:  " PROGRAM_NAME " [-w N] --build-export-db DIR > FILE\n\
+  or:  " PROGRAM_NAME " query [-j|-c] INDEX [FIELD=VALUE]...\n\
+  or:  " PROGRAM_NAME " lookup [-c] INDEX DLL [FUNCTION|ORDINAL]...\n\
 Print information from a Windows CE PE header.\n\
+With FILE -, read from standard input.\n\
+ZIP and tar archives and ISO 9660 images are searched for executables, which are\n\
+labeled ARCHIVE!MEMBER.\n\
+With more than one file, JSON output is printed as one object per line.\n\
 \n\
   -j, --json               print output as JSON\n\
   -f, --field FIELDNAME    only print the value of the field with key FIELDNAME\n\
@@ -61,28 +193,121 @@ Print information from a Windows CE PE header.\n\
   -h, --help               print help\n\
   -v, --version            print version information\n\
   -b, --basic              print only WCEApp, WCEArch and WCEVersion\n\
+  -M, --max-buffer MIB     maximum MiB buffered when reading from standard input\n\
+                           or a pipe, or decompressing a ZIP member (default 64)\n\
+  -w, --workers N          examine files in N worker processes, a file that\n\
+                           crashes the parser only fails that file\n\
+  -t, --timeout SECONDS    with --workers or --serve, give up on a file after\n\
+                           SECONDS\n\
+      --where EXPR         only print the files matching EXPR, see below\n\
+      --count-by FIELDS    only print the number of files by the values of the\n\
+                           comma separated FIELDS, as a table, with --csv as\n\
+                           CSV or with --json as JSON, FIELD:N uses the first\n\
+                           N characters of the value, for example Date:4\n\
+      --sample N|P%        only examine a uniform sample of N files or P percent\n\
+                           of the files and directories, and print the share of\n\
+                           every group of --count-by (default WCEArch,WCEVersion)\n\
+                           with a 95% confidence interval and an estimate for\n\
+                           all files\n\
+      --serve SOCKET       answer JSON requests on the Unix socket SOCKET, files\n\
+                           are examined in --workers processes (default 1)\n\
+      --export-db FILE     resolve imports by ordinal with the DLL ORDINAL NAME\n\
+                           lines in FILE\n\
+      --hash LIST          print digests of the whole file, LIST is a comma\n\
+                           separated list of md5, sha1 and sha256\n\
+      --hash-sections      with --hash, also print digests of every section\n\
+      --verify-checksum    compute the image checksum and compare it with\n\
+                           CheckSum\n\
+      --profile            print the time spent in every phase and counters of\n\
+                           syscalls, bytes read, allocations and transcoded\n\
+                           strings to stderr, with more than one file also a\n\
+                           summary\n\
+      --progress           print files/s, MB/s, errors, queued files and ETA to\n\
+                           stderr every 2 seconds\n\
+      --metrics-file FILE  keep the counters and a latency histogram in FILE in\n\
+                           Prometheus text format, rewritten every 2 seconds\n\
+      --checkpoint FILE    record completed inputs in FILE, every 2 seconds, with\n\
+                           --index-out every 60 seconds\n\
+      --resume             with --checkpoint, skip the inputs recorded in FILE,\n\
+                           cut the output appended to with >> back to the last\n\
+                           checkpoint and add to the index of --index-out\n\
+      --trace FILE         write the phases of every file as Chrome trace events\n\
+                           to FILE, for chrome://tracing or Perfetto\n\
+      --entropy            print the entropy of the raw data of every section\n\
+                           in bits per byte\n\
+      --api-version VERSION=FILE\n\
+                           add WCEMinVersionByImports, the lowest VERSION that\n\
+                           exports all imports, using the DLL ORDINAL NAME\n\
+                           lines in FILE, can be repeated\n\
+      --build-export-db DIR\n\
+                           print the named exports of all DLLs below DIR as\n\
+                           DLL ORDINAL NAME lines for --export-db\n\
+      --index-out FILE     also write a binary index of all files to FILE,\n\
+                           which can be searched with query\n\
+      --resolve            check that the imports of all files are exported by\n\
+                           the ROM DLLs of --export-db or by the examined DLLs,\n\
+                           directories are searched for .exe, .dll and .cpl\n\
+      --cluster            group the files by ImpHash, largest group first,\n\
+                           directories are searched like with --resolve\n\
+\n\
+Query predicates compare FIELD with VALUE using = != < <= > or >=. Fields are\n\
+File, WCEApp, WCEArch, WCEVersion, Machine, Subsystem, Timestamp, Date,\n\
+FileVersion and Import (a DLL name, = and != only). Strings may contain * and ?.\n\
+Query prints the paths of matching files, with -j their indexed fields as JSON\n\
+and with -c only their number.\n\
+Where expressions compare fields with == != < <= > >= or ~ (contains) and\n\
+combine them with && || ! and parentheses, a bare field is true unless it is\n\
+0 or false. Numbers are compared as numbers, strings ignoring case. Imports\n\
+are the names of the imported DLLs, != and !~ are true if none matches.\n\
+Only as much of a file is parsed as is needed to decide, headers first.\n\
+Lookup prints the files importing any of the functions from DLL, or without\n\
+FUNCTION the imported functions of DLL and how many files import them.\n\
 \n\
 Examples:\n\
   " PROGRAM_NAME
         " f.exe     Print information about file f.exe.\n\
-  " PROGRAM_NAME " -j f.exe  Print JSON formatted information about file f.exe.");
+  " PROGRAM_NAME " -j f.exe  Print JSON formatted information about file f.exe.\n\
+  unzip -p a.zip f.exe | " PROGRAM_NAME " -  Print information about f.exe inside a.zip.\n\
+  " PROGRAM_NAME " -b a.zip  Print basic information about all executables in a.zip.");
 
     exit(status);
 }
 
 /**
- * @brief Exit with EXIT_FAILURE code and print perror
+ * @brief Stop processing the current file. While a file is parsed, continue with the next one, otherwise exit.
+ */
+void exit_file() {
+    if (fileErrorHandler) longjmp(*fileErrorHandler, 1);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Print perror, prefixed with the current file in batch mode
  *
  * @param message Additional message
  */
-void exit_perror(const char *message) {
+void print_perror(const char *message) {
+    if (serveSocket && fileErrorHandler) {
+        snprintf(fileErrorMessage, sizeof(fileErrorMessage), "%s: %s", message, strerror(errno));
+        return;
+    }
 #ifdef UNDER_CE
     // mingw32ce does not support perror
     fputs(message, stdout);
 #else
+    if (batchMode && currentFile) fprintf(stderr, "%s: ", currentFile);
     perror(message);
 #endif
-    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Exit with EXIT_FAILURE code and print perror
+ *
+ * @param message Additional message
+ */
+void exit_perror(const char *message) {
+    print_perror(message);
+    exit_file();
 }
 
 /**
@@ -91,8 +316,35 @@ void exit_perror(const char *message) {
  * @param message Message to print
  */
 void exit_error(const char *message) {
-    fprintf(stderr, "Error: %s\n", message);
-    exit(EXIT_FAILURE);
+    if (serveSocket && fileErrorHandler) {
+        snprintf(fileErrorMessage, sizeof(fileErrorMessage), "%s", message);
+    } else if (batchMode && currentFile) {
+        fprintf(stderr, "Error: %s: %s\n", currentFile, message);
+    } else {
+        fprintf(stderr, "Error: %s\n", message);
+    }
+    exit_file();
+}
+
+/**
+ * @brief Print a formatted error about the current file and stop processing it
+ *
+ * @param format Format string
+ * @param ... varargs
+ */
+void exit_file_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (serveSocket && fileErrorHandler) {
+        vsnprintf(fileErrorMessage, sizeof(fileErrorMessage), format, args);
+        /* Messages are written for the terminal, strip the line break */
+        fileErrorMessage[strcspn(fileErrorMessage, "\n")] = '\0';
+    } else {
+        if (batchMode && currentFile) fprintf(stderr, "%s: ", currentFile);
+        vfprintf(stderr, format, args);
+    }
+    va_end(args);
+    exit_file();
 }
 
 /**
@@ -118,12 +370,36 @@ static void get_opts(int argc, char **argv) {
             {"verbose", no_argument, NULL, 'V'},
             {"basic", no_argument, NULL, 'b'},
             {"field", required_argument, NULL, 'f'},
+            {"max-buffer", required_argument, NULL, 'M'},
+            {"workers", required_argument, NULL, 'w'},
+            {"timeout", required_argument, NULL, 't'},
+            {"serve", required_argument, NULL, 'S'},
+            {"index-out", required_argument, NULL, 'I'},
+            {"export-db", required_argument, NULL, 'E'},
+            {"build-export-db", required_argument, NULL, 'X'},
+            {"resolve", no_argument, NULL, 'R'},
+            {"cluster", no_argument, NULL, 'K'},
+            {"api-version", required_argument, NULL, 'A'},
+            {"hash", required_argument, NULL, 'H'},
+            {"hash-sections", no_argument, NULL, 'G'},
+            {"verify-checksum", no_argument, NULL, 'C'},
+            {"entropy", no_argument, NULL, 'N'},
+            {"profile", no_argument, NULL, 'P'},
+            {"trace", required_argument, NULL, 'T'},
+            {"progress", no_argument, NULL, 'O'},
+            {"metrics-file", required_argument, NULL, 'F'},
+            {"checkpoint", required_argument, NULL, 'Q'},
+            {"resume", no_argument, NULL, 'U'},
+            {"where", required_argument, NULL, 'W'},
+            {"count-by", required_argument, NULL, 'B'},
+            {"csv", no_argument, NULL, 'L'},
+            {"sample", required_argument, NULL, 'D'},
             {NULL, 0, NULL, 0}};
     /* getopt_long stores the option index here. */
     int option_index = 0;
     char c;
 
-    while ((c = getopt_long(argc, argv, "jbhvVf:", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "jbhvVf:M:w:t:", long_options, &option_index)) != -1) {
         switch (c) {
             case 'j':
                 printJson = 1;
@@ -143,11 +419,205 @@ static void get_opts(int argc, char **argv) {
             case 'V':
                 verbose_enabled = true;
                 break;
+            case 'M':
+                maxStreamBuffer = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                if (!maxStreamBuffer) exit_error("--max-buffer must be a positive number of MiB");
+                break;
+            case 'w':
+                numberOfWorkers = atoi(optarg);
+                if (numberOfWorkers <= 0) exit_error("--workers must be a positive number");
+                break;
+            case 't':
+                workerTimeout = strtoul(optarg, NULL, 10);
+                if (!workerTimeout) exit_error("--timeout must be a positive number of seconds");
+                break;
+            case 'S':
+                serveSocket = optarg;
+                break;
+            case 'I':
+                indexOutFile = optarg;
+                break;
+            case 'E':
+                exportDbFile = optarg;
+                break;
+            case 'X':
+                buildExportDbDirectory = optarg;
+                break;
+            case 'R':
+                resolveImports = true;
+                break;
+            case 'K':
+                clusterImports = true;
+                break;
+            case 'H':
+                hashAlgorithms = hashParseAlgorithms(optarg);
+                if (!hashAlgorithms) exit_error("--hash expects a comma separated list of md5, sha1 and sha256");
+                break;
+            case 'G':
+                hashSections = true;
+                break;
+            case 'C':
+                verifyChecksum = true;
+                break;
+            case 'N':
+                sectionEntropy = true;
+                break;
+            case 'P':
+#ifdef USE_PROFILE
+                printProfile = true;
+#else
+                exit_error("--profile is not available in this build");
+#endif
+                break;
+            case 'O':
+                printProgress = true;
+                break;
+            case 'F':
+                metricsFile = optarg;
+                break;
+            case 'Q':
+#ifdef USE_CHECKPOINT
+                checkpointFile = optarg;
+#else
+                exit_error("--checkpoint is not supported on this platform");
+#endif
+                break;
+            case 'U':
+                resumeScan = true;
+                break;
+            case 'W': {
+                char error[128];
+                whereFree(whereExpr);
+                if (!(whereExpr = whereCompile(optarg, error, sizeof(error)))) {
+                    fprintf(stderr, "Error: --where: %s\n", error);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'B': {
+                char error[128];
+                countByFree(countBy);
+                if (!(countBy = countByCreate(optarg, error, sizeof(error)))) {
+                    fprintf(stderr, "Error: --count-by: %s\n", error);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'L':
+                countByCsv = true;
+                break;
+            case 'D': {
+#if !defined _WIN32 && !defined UNDER_CE
+                char *end;
+                double value = strtod(optarg, &end);
+                if (*end == '%' && !end[1] && value > 0 && value <= 100) {
+                    sampleFraction = value / 100;
+                } else if (!*end && value >= 1 && value <= UINT32_MAX && value == (uint32_t)value) {
+                    sampleSize = value;
+                } else {
+                    exit_error("--sample expects a number of files or a percentage like 5%");
+                }
+#else
+                exit_error("--sample is not supported on this platform");
+#endif
+                break;
+            }
+            case 'T':
+#ifdef USE_PROFILE
+                traceOutFile = optarg;
+#else
+                exit_error("--trace is not available in this build");
+#endif
+                break;
+            case 'A': {
+                char *file = strchr(optarg, '=');
+                if (!file) exit_error("--api-version expects VERSION=FILE");
+                *file++ = '\0';
+                if (exportDbLoadVersion(optarg, file)) exit_perror("Failed to load API version");
+                apiVersionsLoaded = true;
+                break;
+            }
             default:
                 abort();
         }
     }
 
+    if (workerTimeout && !numberOfWorkers && !serveSocket) exit_error("--timeout requires --workers or --serve");
+    if (hashSections && !hashAlgorithms) exit_error("--hash-sections requires --hash");
+    /* Workers print to their parent and the server answers requests, neither has a place for the tables */
+    if (printProfile && (numberOfWorkers || serveSocket || buildExportDbDirectory)) exit_error("--profile can not be used with --workers, --serve or --build-export-db");
+    if (traceOutFile && (serveSocket || buildExportDbDirectory)) exit_error("--trace can not be used with --serve or --build-export-db");
+    if ((printProgress || metricsFile) && (serveSocket || buildExportDbDirectory)) exit_error("--progress and --metrics-file can not be used with --serve or --build-export-db");
+    if (whereExpr && (serveSocket || buildExportDbDirectory)) exit_error("--where can not be used with --serve or --build-export-db");
+    if (resumeScan && !checkpointFile) exit_error("--resume requires --checkpoint");
+    if ((sampleSize || sampleFraction) && !countBy) {
+        char error[128];
+        if (!(countBy = countByCreate("WCEArch,WCEVersion", error, sizeof(error)))) exit_error(error);
+    }
+    if (countByCsv && !countBy) exit_error("--csv requires --count-by or --sample");
+    if (countBy && (buildExportDbDirectory || resolveImports || clusterImports)) exit_error("--count-by and --sample can not be used with --build-export-db, --resolve or --cluster");
+    /* Reports over all files can't be resumed */
+    if (checkpointFile && (serveSocket || buildExportDbDirectory || resolveImports || clusterImports || countBy)) exit_error("--checkpoint can not be used with --serve, --build-export-db, --resolve, --cluster or --count-by");
+
+    if (indexOutFile) {
+        if (onlyBasicInfo) exit_error("--index-out needs the imports of every file, it can not be used with --basic");
+        if (numberOfWorkers || serveSocket) exit_error("--index-out can not be used with --workers or --serve");
+    }
+
+    if (buildExportDbDirectory) {
+        if (filterField || onlyBasicInfo || printJson || serveSocket || indexOutFile || hashAlgorithms || verifyChecksum || sectionEntropy) exit_error("--build-export-db can only be combined with --workers and --timeout");
+        if (optind < argc) exit_error("--build-export-db does not take files, it searches DIR for DLLs");
+        /* Header fields are collected in JSON and discarded, only the export lines are printed */
+        printJson = 1;
+        return;
+    }
+
+    if (resolveImports) {
+        if (filterField || onlyBasicInfo) exit_error("--resolve prints its own report, it can not be used with --field or --basic");
+        if (numberOfWorkers || serveSocket || indexOutFile || clusterImports) exit_error("--resolve can not be used with --workers, --serve, --index-out or --cluster");
+        if (optind == argc) usage(0);
+        infiles = argv + optind;
+        numberOfInfiles = argc - optind;
+        /* Imports and exports are collected in JSON, the report is printed after all files were examined */
+        resolveJson = printJson;
+        printJson = 1;
+        batchMode = true;
+        return;
+    }
+
+    if (clusterImports) {
+        if (filterField || onlyBasicInfo) exit_error("--cluster prints its own report, it can not be used with --field or --basic");
+        if (numberOfWorkers || serveSocket || indexOutFile) exit_error("--cluster can not be used with --workers, --serve or --index-out");
+        if (optind == argc) usage(0);
+        infiles = argv + optind;
+        numberOfInfiles = argc - optind;
+        clusterJson = printJson;
+        printJson = 1;
+        batchMode = true;
+        return;
+    }
+
+    if (countBy) {
+        if (filterField || onlyBasicInfo) exit_error("--count-by and --sample print their own report, they can not be used with --field or --basic");
+        if (serveSocket || indexOutFile || checkpointFile) exit_error("--count-by and --sample can not be used with --serve, --index-out or --checkpoint");
+        if (countByCsv && printJson) exit_error("--csv can not be used with --json");
+        if (optind == argc) usage(0);
+        infiles = argv + optind;
+        numberOfInfiles = argc - optind;
+        /* Fields are passed to the counts instead of printed */
+        countByJson = printJson;
+        printJson = 0;
+        batchMode = true;
+        return;
+    }
+
+    if (serveSocket) {
+        if (filterField || onlyBasicInfo) exit_error("--serve always answers with JSON, use the fields of a request instead of --field or --basic");
+        if (optind < argc) exit_error("--serve does not take files, they are passed in requests");
+        printJson = 1;
+        return;
+    }
+
     /* field option overrides json option */
     if ((filterField || onlyBasicInfo) && printJson) {
         exit_error("--json can not be set at the same time as --filter or --basic");
@@ -158,10 +628,10 @@ static void get_opts(int argc, char **argv) {
         onlyBasicInfo = 0;
     }
 
-    infile = "-";
-
     if (optind < argc) {
-        infile = argv[optind++];
+        infiles = argv + optind;
+        numberOfInfiles = argc - optind;
+        batchMode = numberOfInfiles > 1;
     } else {
         usage(0);
     }
@@ -364,7 +834,7 @@ const char *subsystemIdToName(uint16_t subSystemId) {
 
 const char *timestampToString(uint32_t timeStamp32) {
     const char *error = "INVALID TIME";
-    char *buffer = malloc(80);
+    static char buffer[80];
     time_t tempTime = timeStamp32;
     struct tm *tmp = localtime(&tempTime);
     if (tmp == NULL) {
@@ -439,10 +909,11 @@ cJSON *cjson_stack[CJSON_STACK_SIZE];
 int cjson_stack_idx = -1;
 
 cJSON *cjson_push(cJSON *item) {
-    cjson_stack[++cjson_stack_idx] = item;
-    if (cjson_stack_idx >= CJSON_STACK_SIZE) {
+    if (cjson_stack_idx + 1 >= CJSON_STACK_SIZE) {
+        cJSON_Delete(item);
         exit_error("cjson stack overflow");
     }
+    cjson_stack[++cjson_stack_idx] = item;
     return item;
 }
 
@@ -461,10 +932,19 @@ cJSON *cjson_get_current() {
 }
 
 void printFieldName(const char *fieldName) {
-    if (!filterField && fieldName) printf("%s: ", fieldName);
+    if (filterField) {
+        /* A bare value is ambiguous in batch mode, prefix it with the file it belongs to */
+        if (batchMode) printf("%s: ", currentFile);
+    } else if (fieldName) {
+        printf("%s: ", fieldName);
+    }
 }
 
 void printStringValue(const char *fieldName, const char *fieldNameJson, const char *value) {
+    if (fieldCapture) {
+        fieldCapture->field(fieldName, value);
+        return;
+    }
     if (filterField && strcmp(filterField, fieldName))
         return;
     if (printJson) {
@@ -488,8 +968,8 @@ void print16BitValue(const char *fieldName, const char *fieldNameJson, uint16_t
             const char *f = fieldNameJson ? fieldNameJson : fieldName;
             cJSON_AddNumberToObject(cjson_get_current(), f, value);
         } else {
-            printFieldName(fieldName);
-            printf("%u\n", value);
+            sprintf(valbuf, "%u", value);
+            printStringValue(fieldName, fieldNameJson, valbuf);
         }
     }
 }
@@ -506,6 +986,21 @@ void printBoolValue(const char *fieldName, const char *fieldNameJson, bool value
     }
 }
 
+void printDoubleValue(const char *fieldName, const char *fieldNameJson, double value) {
+    if (filterField && strcmp(filterField, fieldName))
+        return;
+
+    if (printJson) {
+        const char *f = fieldNameJson ? fieldNameJson : fieldName;
+        cJSON_AddNumberToObject(cjson_get_current(), f, value);
+    } else {
+        /* Through printStringValue, so --where sees the value */
+        char valbuf[64];
+        sprintf(valbuf, "%g", value);
+        printStringValue(fieldName, fieldNameJson, valbuf);
+    }
+}
+
 void print32BitValue(const char *fieldName, const char *fieldNameJson, uint32_t value, char hex) {
     if (filterField && strcmp(filterField, fieldName))
         return;
@@ -518,8 +1013,8 @@ void print32BitValue(const char *fieldName, const char *fieldNameJson, uint32_t
             const char *f = fieldNameJson ? fieldNameJson : fieldName;
             cJSON_AddNumberToObject(cjson_get_current(), f, value);
         } else {
-            printFieldName(fieldName);
-            printf("%u\n", value);
+            sprintf(valbuf, "%u", value);
+            printStringValue(fieldName, fieldNameJson, valbuf);
         }
     }
 }
@@ -537,11 +1032,11 @@ cJSON *jsonEndObject(const char *objectName) {
     }
 }
 
-void readNullTerminatedString(char *buffer, uint16_t maxSize, FILE *__stream) {
+void readNullTerminatedString(char *buffer, uint16_t maxSize, PE_FILE *pe) {
     char *idx = buffer;
     for (; (idx < (buffer + maxSize)); idx++) {
-        if (feof(__stream)) exit_error("Outside file bounds");
-        *idx = fgetc(__stream);
+        if (peEof(pe)) exit_error("Outside file bounds");
+        *idx = peGetc(pe);
         /* putc(*idx, stdout); */
         if (*idx == '\0')
             break;
@@ -599,125 +1094,237 @@ size_t align32Bit(size_t addr) {
     return addr2 + 4;
 }
 
-void falign32bit(FILE *fptr) {
-    size_t pos = ftell(fptr);
+void falign32bit(PE_FILE *pe) {
+    size_t pos = peTell(pe);
     if (pos == -1) exit_perror("ftell failed during align32bit");
-    pos = fseek(fptr, align32Bit(pos), SEEK_SET);
+    pos = peSeek(pe, align32Bit(pos), SEEK_SET);
     if (pos == -1) exit_perror("fseek failed during align32bit");
 }
 
-bool wc16sequals(const wchar_t *str1, const WCHAR *str2) {
-    uint8_t c1, c2;
-    for (int i = 0;; i++) {
-        /* print16BitValue("c1",0,str1[i],HEX); */
-        /* print16BitValue("c2",0,str2[i],HEX); */
-        if (str1[i] != str2[i])
-            return 0;
-        if (!str1[i] && !str2[i])
-            return 1;
-    }
-}
-
 /**
- * @brief Returns the strlen (in bytes) of a utf16 string, without counting the 2 null bytes
+ * @brief Get a table of the file, directly from the mapped file when possible
  *
- * @param utf16str utf16 string
- * @return size_t length of string in byes
+ * @param pe PE file
+ * @param offset File offset of the table
+ * @param size Size of the table
+ * @param copy Set to a copy that must be freed if the table is not mapped, otherwise NULL
+ * @return const uint8_t* Table
  */
-size_t strlenutf16(uint8_t *utf16str) {
-    size_t len = 0;
-    for (uint8_t *ptr = utf16str; *ptr | *(ptr + 1); ptr += 2) {
-        len += 2;
-    }
-    return len;
+static const uint8_t *mapTable(PE_FILE *pe, size_t offset, size_t size, uint8_t **copy) {
+    *copy = NULL;
+    const uint8_t *table = pePtr(pe, offset, size);
+    if (table) return table;
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    *copy = malloc(size ? size : 1);
+    if (!*copy) exit_perror("Error while allocating memory for table");
+    peSeek(pe, offset, SEEK_SET);
+    peRead(*copy, size, 1, pe);
+    return *copy;
 }
 
-size_t utf16toutf8(char *out, char *str, size_t out_len) {
-    size_t src_len = strlenutf16(str) + 2;
-    size_t dst_len = out_len;
-    int status = 0;
+/**
+ * @brief Convert a UTF-16LE string of bounded size to UTF-8. Conversion stops at the first null character.
+ *
+ * @param out Output buffer
+ * @param outSize Size of out, 3 bytes per UTF-16 character and the terminator are always enough
+ * @param str UTF-16LE string, does not need to be terminated or aligned
+ * @param size Size of str in bytes
+ * @return size_t Length of the UTF-8 string
+ */
+size_t utf16toutf8(char *out, size_t outSize, const uint8_t *str, size_t size) {
+    size_t length = 0;
+    while (length + 1 < size && (str[length] | str[length + 1])) length += 2;
+    if (!outSize) return 0;
+    PROFILE_COUNT(PROFILE_STRINGS_TRANSCODED, 1);
 #ifdef USE_ICONV
-    iconv_t icv = iconv_open("utf-8", "utf-16le");
-    if (icv == (void *)-1) exit_perror("Could not open iconv");
+    /* Opening a converter is expensive, keep it for the lifetime of the process */
+    static iconv_t icv = (iconv_t)-1;
+    if (icv == (iconv_t)-1) {
+        icv = iconv_open("utf-8", "utf-16le");
+        if (icv == (iconv_t)-1) exit_perror("Could not open iconv");
+    } else {
+        iconv(icv, NULL, NULL, NULL, NULL);
+    }
 
-    status = iconv(icv, &str, &src_len, &out, &dst_len);
-    // printf("len: %d", len);
-    iconv_close(icv);
+    char *in = (char *)str;
+    char *next = out;
+    size_t inLeft = length, outLeft = outSize - 1;
+    /* Invalid or truncated sequences end the string, what was converted up to there is kept */
+    iconv(icv, &in, &inLeft, &next, &outLeft);
+    *next = '\0';
+    return next - out;
 #else
-    for (int i = 0; i < src_len; i++) {
-        uint8_t lower = str[i * 2];
-        uint8_t upper = str[i * 2 + 1];
-        if (upper) {
-            out[i] = '?';
+    size_t used = 0;
+    for (size_t i = 0; i < length; i += 2) {
+        uint32_t c = str[i] | str[i + 1] << 8;
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < length) {
+            uint32_t low = str[i + 2] | str[i + 3] << 8;
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        if (c >= 0xD800 && c < 0xE000) c = '?';
+        size_t bytes = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+        if (used + bytes >= outSize) break;
+        if (bytes == 1) {
+            out[used++] = c;
+        } else if (bytes == 2) {
+            out[used++] = 0xC0 | c >> 6;
+            out[used++] = 0x80 | (c & 0x3F);
+        } else if (bytes == 3) {
+            out[used++] = 0xE0 | c >> 12;
+            out[used++] = 0x80 | (c >> 6 & 0x3F);
+            out[used++] = 0x80 | (c & 0x3F);
         } else {
-            out[i] = str[i * 2];
+            out[used++] = 0xF0 | c >> 18;
+            out[used++] = 0x80 | (c >> 12 & 0x3F);
+            out[used++] = 0x80 | (c >> 6 & 0x3F);
+            out[used++] = 0x80 | (c & 0x3F);
         }
     }
+    out[used] = '\0';
+    return used;
 #endif
-
-    return status;
 }
 
-void printutf16(const char *prefix, const uint8_t *str) {
-    printf("\n%s: ", prefix);
-    for (uint8_t *ptr = (uint8_t *)str; *ptr | *(ptr + 1); ptr += 2) {
-        printf("%02X_", *ptr);
-        printf("%02X ", *(ptr + 1));
+/**
+ * @brief Add a key to the keys of the version info that are printed. The key is stored as UTF-16LE, so the keys of the
+ * resource can be compared without converting them.
+ *
+ * @param keys Keys, created on first use
+ * @param name Key as UTF-8
+ */
+static void versionKeysAdd(VERSION_KEYS **keys, const char *name) {
+    if (!*keys && !(*keys = calloc(1, sizeof(VERSION_KEYS)))) exit_perror("Error while allocating memory for version info keys");
+    VERSION_KEYS *k = *keys;
+    uint8_t **newKeys = realloc(k->keys, (k->numberOfKeys + 1) * sizeof(uint8_t *));
+    if (!newKeys) exit_perror("Error while allocating memory for version info keys");
+    k->keys = newKeys;
+    size_t *newSizes = realloc(k->sizes, (k->numberOfKeys + 1) * sizeof(size_t));
+    if (!newSizes) exit_perror("Error while allocating memory for version info keys");
+    k->sizes = newSizes;
+
+    /* UTF-8 to UTF-16LE, characters outside of the BMP never appear in keys and can't match */
+    size_t length = strlen(name);
+    uint8_t *key = malloc(length * 2 + 1);
+    if (!key) exit_perror("Error while allocating memory for version info keys");
+    size_t size = 0;
+    for (const uint8_t *p = (const uint8_t *)name; *p;) {
+        uint32_t c = *p++;
+        if (c >= 0xE0 && p[0] && p[1]) {
+            c = (c & 0x0F) << 12 | (p[0] & 0x3F) << 6 | (p[1] & 0x3F);
+            p += 2;
+        } else if (c >= 0xC0 && p[0]) {
+            c = (c & 0x1F) << 6 | (p[0] & 0x3F);
+            p++;
+        }
+        key[size++] = c & 0xFF;
+        key[size++] = c >> 8;
     }
-    fputc('\n', stdout);
+    k->keys[k->numberOfKeys] = key;
+    k->sizes[k->numberOfKeys] = size;
+    k->numberOfKeys++;
 }
 
-#define MAX_UNSPECIFIED_UTF16_LENGTH_BYTES 256
 /**
- * @brief read UTF-16 string of specified or unspecified length from fp
+ * @brief Check whether a key of the version info is printed. ASCII letters are compared ignoring case, like field names
+ * of --where, callers check the exact name.
  *
- * @param fp File to read from
- * @param out output buffer, must be at least 2x the size in bytes of the input buffer
- * @param len number of bytes to read from fp
- * @return uint8_t Number of UTF-16 characters read or -1 if reading failed
+ * @param keys Printed keys, NULL for all keys
+ * @param key UTF-16LE key in the resource
+ * @param size Size of key in bytes without the terminator
  */
-uint8_t readutf16string(FILE *fp, char *out, int len) {
-    // printf("\n=== readutf16string ===\n");
-    uint8_t *temp;
-    int outlen;
-    if (len) {
-        // printf("len=%d\n", len);
-        temp = calloc(len, 1);
-        if (!temp) exit_perror("Error while allocating memory for temporary utf-16 buffer");
-        size_t bytes_read = fread(temp, 1, len, fp);
-        if (!bytes_read > 0) exit_perror("Error while reading utf16 string from file");
-        // printf("bytes_read=%ld\n", bytes_read);
-
-        outlen = len;
-    } else {
-        temp = calloc(MAX_UNSPECIFIED_UTF16_LENGTH_BYTES, 1);
-        if (!temp) exit_perror("Error while allocating memory for temporary utf-16 buffer");
-        uint8_t *ptr = temp;
-        // printf("Reading: ");
-        int i;
-        for (i = 0; i < MAX_UNSPECIFIED_UTF16_LENGTH_BYTES; i += 2) {
-            size_t bytes_read = fread(ptr, 1, 2, fp);
-            if (bytes_read != 2) exit_perror("Error while reading utf16 character from file");
-            // printf("%02X_", *ptr);
-            // printf("%02X ", *(ptr + 1));
-            if (*ptr == 0 && *(ptr + 1) == 0) break;
-            ptr += 2;
-        }
-        outlen = 2 * (i + 2);
-        // printf("\nRead %d bytes\n", i);
+static bool versionKeyWanted(const VERSION_KEYS *keys, const uint8_t *key, size_t size) {
+    if (!keys) return true;
+    for (int i = 0; i < keys->numberOfKeys; i++) {
+        if (keys->sizes[i] != size) continue;
+        const uint8_t *needle = keys->keys[i];
+        size_t j = 0;
+        while (j < size && key[j + 1] == needle[j + 1] && (key[j] == needle[j] || (!key[j + 1] && tolower(key[j]) == tolower(needle[j])))) j += 2;
+        if (j == size) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Select the version info keys that are printed by --field and used by --where and --count-by
+ */
+static void selectVersionKeys(void) {
+    if (filterField) {
+        versionKeysAdd(&outputVersionKeys, filterField);
+        if (indexOutFile) versionKeysAdd(&outputVersionKeys, "FileVersion");
+    }
+    const char *name;
+    for (uint32_t i = 0; whereExpr && (name = whereFieldName(whereExpr, i)); i++) versionKeysAdd(&whereVersionKeys, name);
+    for (int i = 0; countBy && (name = countByFieldName(countBy, i)); i++) versionKeysAdd(&countByVersionKeys, name);
+}
+
+/**
+ * @brief Check whether a field is a digest of --hash, like MD5 or ".text SHA1"
+ */
+static bool isDigestField(const char *name) {
+    const char *algorithmName = strrchr(name, ' ') ? strrchr(name, ' ') + 1 : name;
+    for (unsigned algorithm = HASH_MD5; algorithm <= HASH_SHA256; algorithm <<= 1) {
+        if (!strcmp(algorithmName, hashAlgorithmName(algorithm))) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Check whether a field is a section entropy of --entropy, like ".text Entropy"
+ */
+static bool isEntropyField(const char *name) {
+    return strrchr(name, ' ') && !strcmp(strrchr(name, ' ') + 1, "Entropy");
+}
+
+/**
+ * @brief Find out whether --where and --count-by use digests or entropy, so they are only computed for them if needed
+ */
+static void selectCapturedDigests(void) {
+    const char *name;
+    for (uint32_t i = 0; whereExpr && (name = whereFieldName(whereExpr, i)); i++) {
+        whereUsesDigests |= isDigestField(name);
+        whereUsesEntropy |= isEntropyField(name);
+    }
+    for (int i = 0; countBy && (name = countByFieldName(countBy, i)); i++) {
+        countByUsesDigests |= isDigestField(name);
+        countByUsesEntropy |= isEntropyField(name);
     }
-    // printutf16("temp", temp);
+}
+
+static uint16_t versionInfoWord(const uint8_t *data, size_t offset) {
+    return data[offset] | data[offset + 1] << 8;
+}
 
-    // printf("\nwcharstr: %lc (%d)", *temp, i);
-    // sprintf(out, "%ls", temp);
-    size_t iconv_status = utf16toutf8(out, (char *)temp, outlen);
-    if (iconv_status == -1) exit_perror("iconv failed for utf-16 to utf-8 conversion");
-    // free(temp);
-    //  printf("out: %s\n", out);
-    //  printf("___ readutf16string ___\n");
+/**
+ * @brief Find the end of the key of a version info structure
+ *
+ * @param data Version info resource
+ * @param offset Offset of the structure
+ * @param end End of the structure
+ * @return size_t Size of the key in bytes without the terminator, or end if the key is not terminated
+ */
+static size_t versionInfoKeySize(const uint8_t *data, size_t offset, size_t end) {
+    size_t key = offset + 6;
+    size_t pos = key;
+    while (pos + 1 < end && (data[pos] | data[pos + 1])) pos += 2;
+    return pos + 1 < end ? pos - key : end;
 }
 
-uint8_t parseVersionInfoSection(FILE *fp, size_t versionInfoSectionStart, size_t size) {
+/** Maximum size of the version info, the length of the root structure is 16 bit */
+#define MAX_VERSION_INFO_SIZE 0xFFFF
+
+/**
+ * @brief Print the strings of the version info. Keys are compared in place with the printed keys, only the values that
+ * are printed are converted to UTF-8.
+ *
+ * @param pe PE file
+ * @param versionInfoSectionStart File offset of the version info resource
+ * @param size Size of the resource
+ * @return uint8_t 1 if the file has version info
+ */
+uint8_t parseVersionInfoSection(PE_FILE *pe, size_t versionInfoSectionStart, size_t size) {
     verbose("=== VERSION INFO ===\n");
     if (!versionInfoSectionStart || !size) {
         verbose("No version info section\n");
@@ -726,163 +1333,100 @@ uint8_t parseVersionInfoSection(FILE *fp, size_t versionInfoSectionStart, size_t
     verbose("  versionInfoStart 0x%x\n", versionInfoSectionStart);
     verbose("  versionInfoSize  %lu\n", size);
 
+    const VERSION_KEYS *keys = fieldCapture ? *fieldCapture->versionKeys : outputVersionKeys;
+
     // JSON versionInfo start
     jsonStartObject();
-    fseek(fp, versionInfoSectionStart, SEEK_SET);
 
-    VS_VERSIONINFO versionInfoHeader;
-    fread(&versionInfoHeader, sizeof(VS_VERSIONINFO), 1, fp);
+    if (size > MAX_VERSION_INFO_SIZE) size = MAX_VERSION_INFO_SIZE;
+    if (size < sizeof(VS_VERSIONINFO)) exit_file_error("Version info is too small\n");
+    uint8_t *copy;
+    const uint8_t *data = mapTable(pe, versionInfoSectionStart, size, &copy);
 
     const char VS_VERSION_INFO[] = "V\0S\0_\0V\0E\0R\0S\0I\0O\0N\0_\0I\0N\0F\0O\0\0";
-
-    if (memcmp(VS_VERSION_INFO, versionInfoHeader.szKey, sizeof(VS_VERSION_INFO))) {
-        char *strbuf = calloc(1, 16);
-        utf16toutf8(strbuf, (char *)versionInfoHeader.szKey, 16);
-        fprintf(stderr, "szKey should be VS_VERSION_INFO but is \"%s\"\n", strbuf);
-        free(strbuf);
-        exit(EXIT_FAILURE);
-    }
-
-    /* print16BitValue("versionInfoHeader.wLength", 0, versionInfoHeader.wLength, HEX); */
-    /* print16BitValue("versionInfoHeader.wValueLength", 0, versionInfoHeader.wValueLength, HEX); */
-    /* print16BitValue("versionInfoHeader.wType", 0, versionInfoHeader.wType, HEX); */
-    /* printStringValue("versionInfoHeader.szKey", 0, strbuf); */
-    /* print32BitValue("versionInfoSectionEnd", 0, (versionInfoSectionStart + versionInfoHeader.wLength), HEX); */
-    /* print32BitValue("versionInfoHeader.szKey", 0, versionInfoHeader.szKey, HEX); */
-
-    /* Align file pointer to 32 bit */
-    falign32bit(fp);
-
-    VS_FIXEDFILEINFO fixedFileInfo;
-    if (versionInfoHeader.wValueLength) {
-        fread(&fixedFileInfo, versionInfoHeader.wValueLength, 1, fp);
-        if (versionInfoHeader.wValueLength != sizeof(VS_FIXEDFILEINFO)) {
-            exit_error("versionInfoHeader.wValueLength != sizeof(VS_FIXEDFILEINFO)");
-        }
+    const char STRING_FILE_INFO[] = "S\0t\0r\0i\0n\0g\0F\0i\0l\0e\0I\0n\0f\0o\0\0";
+    const char VAR_FILE_INFO[] = "V\0a\0r\0F\0i\0l\0e\0I\0n\0f\0o\0\0";
+
+    if (memcmp(VS_VERSION_INFO, data + offsetof(VS_VERSIONINFO, szKey), sizeof(VS_VERSION_INFO))) {
+        char strbuf[64];
+        utf16toutf8(strbuf, sizeof(strbuf), data + offsetof(VS_VERSIONINFO, szKey), sizeof(VS_VERSION_INFO));
+        free(copy);
+        exit_file_error("szKey should be VS_VERSION_INFO but is \"%s\"\n", strbuf);
     }
 
-    size_t pos = align32Bit(ftell(fp));
-    /* Align file pointer to 32 bit */
-    fseek(fp, pos, SEEK_SET);
+    /* Lengths of the structures are not trusted, every structure ends within its parent */
+    size_t versionInfoEnd = versionInfoWord(data, offsetof(VS_VERSIONINFO, wLength));
+    if (versionInfoEnd > size) versionInfoEnd = size;
+    size_t fixedFileInfoLength = versionInfoWord(data, offsetof(VS_VERSIONINFO, wValueLength));
+    if (fixedFileInfoLength && fixedFileInfoLength != sizeof(VS_FIXEDFILEINFO)) {
+        free(copy);
+        exit_error("versionInfoHeader.wValueLength != sizeof(VS_FIXEDFILEINFO)");
+    }
 
     /* Read all StringFileInfo and VarFileInfo structures */
-    VS_STRING_FILE_INFO_HEADER stringFileInfoHeader;
-    VS_VAR_FILE_INFO_HEADER varFileInfoHeader;
-    while (ftell(fp) < (versionInfoSectionStart + versionInfoHeader.wLength)) {
-        pos = ftell(fp);
-        fread(&stringFileInfoHeader, sizeof(VS_STRING_FILE_INFO_HEADER), 1, fp);
-        size_t stringFileInfoEndPosition = pos + stringFileInfoHeader.wLength;
-
-        if (wc16sequals(SZ_KEY_STRING_FILE_INFO, stringFileInfoHeader.szKey)) {
-            /* jsonStartObject("StringFileInfo"); */
-            /* print32BitValue("stringFileInfoEndPosition", 0, stringFileInfoEndPosition, HEX); */
-            /* Item is StringFileInfo */
-            /* printf("Item is StringFileInfo\n"); */
-
-            falign32bit(fp);
-
-            /* print32BitValue("stringtable addr", 0, ftell(fp), HEX); */
-            // wc16stoutf8(stringFileInfoHeader.szKey, strbuf, 15);
-            /* printStringValue("szKey", 0, strbuf); */
-
-            while (ftell(fp) < stringFileInfoEndPosition) {
-                /* Read string table header */
-                VS_STRING_TABLE_HEADER stringTableHeader;
-                pos = ftell(fp);
-                fread(&stringTableHeader, sizeof(VS_STRING_TABLE_HEADER), 1, fp);
+    size_t pos = align32Bit(align32Bit(sizeof(VS_VERSIONINFO)) + fixedFileInfoLength);
+    while (pos + 6 <= versionInfoEnd) {
+        size_t stringFileInfoEnd = pos + versionInfoWord(data, pos);
+        /* A length of zero would never advance */
+        if (stringFileInfoEnd < pos + 6) break;
+        if (stringFileInfoEnd > versionInfoEnd) stringFileInfoEnd = versionInfoEnd;
+        size_t keySize = versionInfoKeySize(data, pos, stringFileInfoEnd);
+
+        if (keySize + 2 == sizeof(STRING_FILE_INFO) && !memcmp(data + pos + 6, STRING_FILE_INFO, sizeof(STRING_FILE_INFO))) {
+            size_t tablePos = align32Bit(pos + 6 + sizeof(STRING_FILE_INFO));
+            while (tablePos + 6 <= stringFileInfoEnd) {
+                size_t stringTableEnd = tablePos + versionInfoWord(data, tablePos);
+                if (stringTableEnd < tablePos + 6) break;
+                if (stringTableEnd > stringFileInfoEnd) stringTableEnd = stringFileInfoEnd;
+                size_t tableKeySize = versionInfoKeySize(data, tablePos, stringTableEnd);
+                if (tableKeySize == stringTableEnd) break;
+
+                size_t stringPos = align32Bit(tablePos + 6 + tableKeySize + 2);
+                while (stringPos + 6 <= stringTableEnd) {
+                    size_t stringEnd = stringPos + versionInfoWord(data, stringPos);
+                    if (stringEnd < stringPos + 6) break;
+                    if (stringEnd > stringTableEnd) stringEnd = stringTableEnd;
+                    size_t valueLength = versionInfoWord(data, stringPos + 2);
+                    size_t stringKeySize = versionInfoKeySize(data, stringPos, stringEnd);
+
+                    /* Strings that are not printed are skipped without converting their key or value */
+                    const uint8_t *key = data + stringPos + 6;
+                    if (stringKeySize != stringEnd && valueLength && versionKeyWanted(keys, key, stringKeySize)) {
+                        size_t valuePos = align32Bit(stringPos + 6 + stringKeySize + 2);
+                        size_t valueSize = valuePos < stringEnd ? stringEnd - valuePos : 0;
+                        if (valueSize > valueLength * 2) valueSize = valueLength * 2;
+
+                        static char keyBuffer[MAX_VERSION_INFO_SIZE / 2 * 3 + 1];
+                        static char valueBuffer[MAX_VERSION_INFO_SIZE / 2 * 3 + 1];
+                        utf16toutf8(keyBuffer, sizeof(keyBuffer), key, stringKeySize);
+                        utf16toutf8(valueBuffer, sizeof(valueBuffer), data + valuePos, valueSize);
 
-                /* jsonStartObject("StringTable"); */
-                /* print32BitValue("pos", 0, pos, HEX); */
-
-                /* print32BitValue("wLength", 0, stringTableHeader.wLength, HEX); */
-
-                size_t stringTableEndPosition = pos + stringTableHeader.wLength;
-
-                /* print32BitValue("stringTableEndPosition", 0, stringTableEndPosition, HEX); */
-
-                falign32bit(fp);
-
-                /* print32BitValue("addr", 0, ftell(fp), HEX); */
-                while (ftell(fp) < stringTableEndPosition) {
-                    pos = ftell(fp);
-
-                    VS_STRING_HEADER stringHeader;
-                    /* printf("String\n"); */
-                    /* print32BitValue("addr",0,ftell(fp),HEX); */
-
-                    fread(&stringHeader, sizeof(VS_STRING_HEADER), 1, fp);
-                    size_t stringHeaderEndPosition = pos + stringHeader.wLength;
-
-                    /* jsonStartObject("String"); */
-
-                    // print16BitValue("wLength", 0, stringHeader.wLength, DEC);
-                    // print16BitValue("wValueLength", 0, stringHeader.wValueLength, DEC);
-                    /* print32BitValue("stringHeaderStaPosition", 0, pos, HEX); */
-                    /* print32BitValue("stringHeaderEndPosition", 0, stringHeaderEndPosition, HEX); */
-
-                    // printf("\n================== KEY ==================");
-                    char *keyBuffer = calloc(256, sizeof(char));
-                    readutf16string(fp, keyBuffer, 0);
-                    // printf("Key: %s\n", keyBuffer);
-
-                    /* printStringValue("key", 0, keyBuffer); */
-
-                    falign32bit(fp);
-
-                    char *valueBuffer = calloc(stringHeader.wValueLength * 2, sizeof(char));
-                    if (stringHeader.wValueLength) {
-                        // printf("\n================== VAL ==================");
-
-                        readutf16string(fp, valueBuffer, 0);
-                        // printutf16("Value", valueBuffer);
-
-                        /* printStringValue("value", 0, valueBuffer); */
                         printStringValue(keyBuffer, 0, valueBuffer);
+                        if (scanIndex && !strcmp(keyBuffer, "FileVersion") && scanIndexSetFileVersion(scanIndex, valueBuffer)) {
+                            free(copy);
+                            exit_error("Error while adding to the index");
+                        }
                     }
-                    free(valueBuffer);
-
-                    /* fseek(fp, stringHeaderEndPosition, SEEK_SET); */
-
-                    //if (ftell(fp) > stringHeaderEndPosition){
-                        //fprintf(stderr, "ftell(fp)> stringHeaderEndPosition");
-                    //}
-
-                    /* Align to 32Bit after each string */
-                    falign32bit(fp);
-
-                    /* exit(0); */
-
-                    /* jsonEndObject(); */
+                    stringPos = align32Bit(stringEnd);
                 }
-                /* jsonEndObject(); */
+                tablePos = align32Bit(stringTableEnd);
             }
-            /* jsonEndObject(); */
-        } else if (wc16sequals(SZ_KEY_VAR_FILE_INFO, stringFileInfoHeader.szKey)) {
-            /* Item is a VarFileInfo */
-            /* Re-read section as VarFileInfo */
-            fseek(fp, pos, SEEK_SET);
-            /* fread(&varFileInfoHeader, sizeof(VS_VAR_FILE_INFO_HEADER), 1, fp); */
-
-            /* Align to 32 bit */
-            /* pos = align32Bit(ftell(fp)); */
-            /* fseek(fp, pos, SEEK_SET); */
-
-            /* Skip this section */
-            fseek(fp, stringFileInfoHeader.wLength, SEEK_CUR);
-        } else {
-            char *strbuf = calloc(1, 128);
-            utf16toutf8(strbuf, (char *)stringFileInfoHeader.szKey, 16);
-            fprintf(stderr, "szKey should be \"StringFileInfo\" or \"VarFileInfo\" but is \"%s\"\n", strbuf);
-            free(strbuf);
-            exit(EXIT_FAILURE);
+        } else if (keySize + 2 != sizeof(VAR_FILE_INFO) || memcmp(data + pos + 6, VAR_FILE_INFO, sizeof(VAR_FILE_INFO))) {
+            /* VarFileInfo is skipped, anything else is an error */
+            char strbuf[128];
+            utf16toutf8(strbuf, sizeof(strbuf), data + pos + 6, stringFileInfoEnd - pos - 6);
+            free(copy);
+            exit_file_error("szKey should be \"StringFileInfo\" or \"VarFileInfo\" but is \"%s\"\n", strbuf);
         }
+        pos = align32Bit(stringFileInfoEnd);
     }
+    free(copy);
     // JSON versionInfo end
     jsonEndObject("versionInfo");
     return 1;
 }
 
-void parseResourceDirectoryTableEntry(PE_RESOURCE_DATA_ENTRY *resourceDataEntry, size_t resourceSectionStartAddress, FILE *fp) {
+void parseResourceDirectoryTableEntry(PE_RESOURCE_DATA_ENTRY *resourceDataEntry) {
     /* print32BitValue("DataRVA", 0, resourceDataEntry->DataRVA, HEX); */
     /* print32BitValue("DataAddress", 0, RVAtoFileOffset(resourceDataEntry->DataRVA), HEX); */
     /* print32BitValue("Size", 0, resourceDataEntry->Size, DEC); */
@@ -896,12 +1440,13 @@ void parseResourceDirectoryTableEntry(PE_RESOURCE_DATA_ENTRY *resourceDataEntry,
 /**
  * Parse resource tree and get the version info. Ignore all other nodes
  */
-void parseResourceDirectoryTable(PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryTable, size_t resourceSectionStartAddress, FILE *fp, uint8_t level) {
+void parseResourceDirectoryTable(PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryTable, size_t resourceSectionStartAddress, PE_FILE *pe, uint8_t level) {
     /* jsonStartArray("resources"); */
     /* print32BitValue("NumberOfIdEntries", 0, resourceDirectoryTable->NumberOfIdEntries, DEC); */
     /* print32BitValue("NumberOfNameEntries", 0, resourceDirectoryTable->NumberOfNameEntries, DEC); */
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
     PE_RESOURCE_DIRECTORY_TABLE_ENTRY *resourceDirectoryTableNameEntries = malloc(sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY) * (resourceDirectoryTable->NumberOfNameEntries));
-    fread(resourceDirectoryTableNameEntries, sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY), resourceDirectoryTable->NumberOfNameEntries, fp);
+    peRead(resourceDirectoryTableNameEntries, sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY), resourceDirectoryTable->NumberOfNameEntries, pe);
 
     /* Ignore named entries
     for (uint8_t i = 0; i < resourceDirectoryTable->NumberOfNameEntries; i++)
@@ -915,11 +1460,11 @@ void parseResourceDirectoryTable(PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryT
             offset = (offset & 0x7FFFFFFF) + resourceSectionStartAddress;
             PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryTable2 = malloc(sizeof(PE_RESOURCE_DIRECTORY_TABLE));
 
-            fseek(fp, offset, SEEK_SET);
+            peSeek(pe, offset, SEEK_SET);
 
-            fread(resourceDirectoryTable2, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, fp);
+            peRead(resourceDirectoryTable2, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, pe);
 
-            parseResourceDirectoryTable(resourceDirectoryTable2, resourceSectionStartAddress, fp, level+1);
+            parseResourceDirectoryTable(resourceDirectoryTable2, resourceSectionStartAddress, pe, level+1);
         }
         else
         {
@@ -931,10 +1476,11 @@ void parseResourceDirectoryTable(PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryT
         jsonEndObject();
     }*/
 
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
     PE_RESOURCE_DIRECTORY_TABLE_ENTRY *resourceDirectoryTableIdEntries = malloc(sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY) * (resourceDirectoryTable->NumberOfIdEntries));
-    fread(resourceDirectoryTableIdEntries, sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY), resourceDirectoryTable->NumberOfIdEntries, fp);
+    peRead(resourceDirectoryTableIdEntries, sizeof(PE_RESOURCE_DIRECTORY_TABLE_ENTRY), resourceDirectoryTable->NumberOfIdEntries, pe);
 
-    for (uint8_t i = 0; i < resourceDirectoryTable->NumberOfIdEntries; i++) {
+    for (int i = 0; i < resourceDirectoryTable->NumberOfIdEntries; i++) {
         uint32_t id = resourceDirectoryTableIdEntries[i].NameOffsetOrIntegerID.IntegerID;
 
         /* Continue loop if this is not a version node */
@@ -955,106 +1501,549 @@ void parseResourceDirectoryTable(PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryT
             /* printBoolValue("IsSub", 0, 1); */
             offset = (offset & 0x7FFFFFFF) + resourceSectionStartAddress;
             /* print32BitValue("offset", 0, offset, 1); */
+            PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
             PE_RESOURCE_DIRECTORY_TABLE *resourceDirectoryTable2 = malloc(sizeof(PE_RESOURCE_DIRECTORY_TABLE));
 
-            fseek(fp, offset, SEEK_SET);
+            peSeek(pe, offset, SEEK_SET);
 
-            fread(resourceDirectoryTable2, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, fp);
+            peRead(resourceDirectoryTable2, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, pe);
 
-            parseResourceDirectoryTable(resourceDirectoryTable2, resourceSectionStartAddress, fp, level + 1);
+            parseResourceDirectoryTable(resourceDirectoryTable2, resourceSectionStartAddress, pe, level + 1);
+            free(resourceDirectoryTable2);
         } else {
             /* Entry points to a Resource Data Entry */
             offset = offset + resourceSectionStartAddress;
             /* printBoolValue("IsLeaf", 0, 1); */
             /* print32BitValue("ID", 0, id, HEX); */
             /* print32BitValue("offset", 0, offset, HEX); */
+            PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
             PE_RESOURCE_DATA_ENTRY *resourceDataEntry = malloc(sizeof(PE_RESOURCE_DATA_ENTRY));
 
-            fseek(fp, offset, SEEK_SET);
+            peSeek(pe, offset, SEEK_SET);
 
-            fread(resourceDataEntry, sizeof(PE_RESOURCE_DATA_ENTRY), 1, fp);
-            parseResourceDirectoryTableEntry(resourceDataEntry, resourceSectionStartAddress, fp);
+            peRead(resourceDataEntry, sizeof(PE_RESOURCE_DATA_ENTRY), 1, pe);
+            parseResourceDirectoryTableEntry(resourceDataEntry);
+            free(resourceDataEntry);
         }
         /* jsonEndObject(); */
     }
 
+    free(resourceDirectoryTableNameEntries);
+    free(resourceDirectoryTableIdEntries);
     /* jsonEndArray(); */
 }
 
-uint16_t freaduint16le(FILE *fptr) {
+uint16_t readuint16le(PE_FILE *pe) {
     uint8_t bytes[2];
-    if (fread(bytes, 2, 1, fptr) != -1) {
-        return ((bytes[0]) | (bytes[1] << 8));
-    }
-    exit_perror("Error while reading uint16le");
+    /* Bytes outside the file read as zero, the missing PE marker is reported by the caller */
+    peRead(bytes, 2, 1, pe);
+    return ((bytes[0]) | (bytes[1] << 8));
 }
 
-int main(int argc, char **argv) {
-    opterr = 0;
-
-    // Get options
-    get_opts(argc, argv);
-
-    /* If file name was provided, open, otherwise use stdin */
-    /* FILE *fp = strcmp(infile, "-") == 0 ? stdin : fopen(infile, "rb"); */
-    FILE *fp = fopen(infile, "rb");
-    if (!fp) exit_perror("Failed to open file");
-
-    /* Seek to 0x3C, where the location of the COFF header is stored */
-    fseek(fp, COFF_OFFSET, SEEK_SET);
-
-    /* Location of COFF header (16 bit since some weird PEs have a start address > 0xFF) */
-    uint16_t coff_start = freaduint16le(fp);
-
-    /* Seek to start of COFF header */
-    fseek(fp, coff_start, SEEK_SET);
+/**
+ * @brief Read a string at an RVA, truncated to fit the buffer
+ *
+ * @return bool false if the RVA is not in a section
+ */
+static bool readStringAtRVA(PE_FILE *pe, uint32_t RVA, char *buffer, size_t size) {
+    uint32_t offset = RVAtoFileOffset(RVA);
+    buffer[0] = '\0';
+    if (!offset) return false;
+    peSeek(pe, offset, SEEK_SET);
+    size_t i = 0;
+    for (; i < size - 1 && !peEof(pe); i++) {
+        int c = peGetc(pe);
+        if (c <= 0) break;
+        buffer[i] = c;
+    }
+    buffer[i] = '\0';
+    return true;
+}
 
-    /* Read PE Headers */
-    fread(&imageHeaders, sizeof(IMAGE_NT_HEADERS32), 1, fp);
+/**
+ * @brief Parse the export directory. In JSON mode the exports are added as "Exports". With --build-export-db the
+ * named exports are printed as DLL ORDINAL NAME lines instead.
+ *
+ * The name pointer table is only used to find out which entries of the export address table have a name, the names
+ * themselves are read when an entry is printed.
+ *
+ * @param pe PE file
+ */
+static void parseExportDirectory(PE_FILE *pe) {
+    IMAGE_DATA_DIRECTORY *directory = &(imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT]);
+    if (!directory->VirtualAddress) return;
+
+    verbose("=== DLL EXPORTS ===\n");
+    uint32_t directoryOffset = RVAtoFileOffset(directory->VirtualAddress);
+    if (!directoryOffset) {
+        verbose("Warning: Export directory is outside all sections\n");
+        return;
+    }
+    IMAGE_EXPORT_DIRECTORY exportDirectory;
+    peSeek(pe, directoryOffset, SEEK_SET);
+    peRead(&exportDirectory, sizeof(IMAGE_EXPORT_DIRECTORY), 1, pe);
 
-    /* Check for PE\0\0 Marker */
-    if (feof(fp)) {
-        fprintf(stderr, "error: PE Marker at %#010x is outside file bounds.\n", coff_start);
-        exit(EXIT_FAILURE);
+    /* Ordinals are 16 bit, a larger table is damaged */
+    if (exportDirectory.NumberOfFunctions > 0x10000) {
+        verbose("Warning: Export directory has %u functions\n", exportDirectory.NumberOfFunctions);
+        return;
     }
-    if (imageHeaders.Signature != 0x00004550) {
-        fprintf(stderr, "error: File does not have a PE marker at location %#02x.\n", coff_start);
-        exit(EXIT_FAILURE);
+    uint32_t numberOfFunctions = exportDirectory.NumberOfFunctions;
+    uint32_t functionsOffset = RVAtoFileOffset(exportDirectory.AddressOfFunctions);
+    if (numberOfFunctions && !functionsOffset) {
+        verbose("Warning: Export address table is outside all sections\n");
+        return;
     }
-    if (imageHeaders.OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC) {
-        fprintf(stderr, "error: IMAGE_NT_OPTIONAL_HDR_MAGIC is not 0x010B.\n");
-        exit(EXIT_FAILURE);
+    /* Every function has at most one name that is used, names beyond that are damaged */
+    uint32_t numberOfNames = exportDirectory.NumberOfNames;
+    if (numberOfNames > numberOfFunctions) {
+        verbose("Warning: Export directory has %u functions and %u names\n", numberOfFunctions, numberOfNames);
+        numberOfNames = numberOfFunctions;
     }
-    if (sizeof(IMAGE_OPTIONAL_HEADER) != imageHeaders.FileHeader.SizeOfOptionalHeader) {
-        fprintf(stderr, "error: Size of optional header should be %u for a PE file, but is %u. PE+ files are not supported.\n", (uint32_t)sizeof(IMAGE_OPTIONAL_HEADER), imageHeaders.FileHeader.SizeOfOptionalHeader);
-        exit(EXIT_FAILURE);
+    uint32_t namesOffset = RVAtoFileOffset(exportDirectory.AddressOfNames);
+    uint32_t nameOrdinalsOffset = RVAtoFileOffset(exportDirectory.AddressOfNameOrdinals);
+    if (numberOfNames && (!namesOffset || !nameOrdinalsOffset)) {
+        verbose("Warning: Export name table is outside all sections, exports are listed without names\n");
+        numberOfNames = 0;
     }
 
-    /* Start JSON block */
-    peJson = jsonStartObject();
+    /* Name RVA of every entry of the export address table, 0 if it has no name */
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
+    uint32_t *nameRVAs = calloc(numberOfFunctions + 1, sizeof(uint32_t));
+    if (!nameRVAs) exit_perror("Error while allocating memory for export table");
+    uint8_t *namesCopy, *nameOrdinalsCopy;
+    const uint8_t *names = mapTable(pe, namesOffset, numberOfNames * sizeof(uint32_t), &namesCopy);
+    const uint8_t *nameOrdinals = mapTable(pe, nameOrdinalsOffset, numberOfNames * sizeof(uint16_t), &nameOrdinalsCopy);
+    for (uint32_t i = 0; i < numberOfNames; i++) {
+        uint32_t nameRVA;
+        uint16_t index;
+        /* The tables are not necessarily aligned */
+        memcpy(&nameRVA, names + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&index, nameOrdinals + i * sizeof(uint16_t), sizeof(uint16_t));
+        if (index < numberOfFunctions && !nameRVAs[index]) nameRVAs[index] = nameRVA;
+    }
+    free(namesCopy);
+    free(nameOrdinalsCopy);
+
+    cJSON *exportsObject = NULL;
+    cJSON *functionsArray = NULL;
+    char nameBuffer[512];
+    if (!exportDbDllName) {
+        exportsObject = cJSON_CreateObject();
+        readStringAtRVA(pe, exportDirectory.Name, nameBuffer, sizeof(nameBuffer));
+        cJSON_AddStringToObject(exportsObject, "dllName", nameBuffer);
+        cJSON_AddNumberToObject(exportsObject, "ordinalBase", exportDirectory.Base);
+        functionsArray = cJSON_AddArrayToObject(exportsObject, "functions");
+    }
 
-    /* True if arch is one of the non-x86 WinCE architectures */
-    uint8_t isWinCEArch = (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_ARM) ||
-                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_R4000) ||
-                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_SH3) ||
-                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_SH4) ||
-                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_THUMB);
+    uint8_t *functionsCopy;
+    const uint8_t *functions = mapTable(pe, functionsOffset, numberOfFunctions * sizeof(uint32_t), &functionsCopy);
+    for (uint32_t i = 0; i < numberOfFunctions; i++) {
+        uint32_t address;
+        memcpy(&address, functions + i * sizeof(uint32_t), sizeof(uint32_t));
+        /* Unused ordinals */
+        if (!address) continue;
+        uint16_t ordinal = exportDirectory.Base + i;
+
+        if (exportDbDllName) {
+            if (nameRVAs[i] && readStringAtRVA(pe, nameRVAs[i], nameBuffer, sizeof(nameBuffer)) && nameBuffer[0]) {
+                printf("%s %u %s\n", exportDbDllName, ordinal, nameBuffer);
+            }
+            continue;
+        }
 
-    /* Guess subsystem doesn't mean much for early CE apps */
-    uint8_t isWinCEApp = (imageHeaders.OptionalHeader.Subsystem == IMAGE_SUBSYSTEM_WINDOWS_CE_GUI) || (imageHeaders.OptionalHeader.Subsystem == IMAGE_SUBSYSTEM_WINDOWS_GUI && isWinCEArch);
+        cJSON *function = cJSON_CreateObject();
+        cJSON_AddNumberToObject(function, "ordinal", ordinal);
+        bool named = nameRVAs[i] && readStringAtRVA(pe, nameRVAs[i], nameBuffer, sizeof(nameBuffer));
+        if (named) cJSON_AddStringToObject(function, "name", nameBuffer);
+        verbose("  Ordinal %u: %s\n", ordinal, named ? nameBuffer : "");
+        if (depGraph && depGraphAddExport(depGraph, named ? nameBuffer : NULL, ordinal)) exit_error("Error while adding to the dependency graph");
+        /* An address inside the export directory points to the name of the function it is forwarded to */
+        if (address >= directory->VirtualAddress && address - directory->VirtualAddress < directory->Size) {
+            readStringAtRVA(pe, address, nameBuffer, sizeof(nameBuffer));
+            cJSON_AddStringToObject(function, "forwarder", nameBuffer);
+        } else {
+            char addressBuffer[16];
+            sprintf(addressBuffer, "0x%08X", address);
+            cJSON_AddStringToObject(function, "address", addressBuffer);
+        }
+        cJSON_AddItemToArray(functionsArray, function);
+    }
+    free(functionsCopy);
+    free(nameRVAs);
 
-    /** True if subsystem is 9 (Windows CE GUI) or subsystem is 2 and arch is a non-x86 WinCE arch */
-    printBoolValue("WCEApp", 0, isWinCEApp);
+    if (exportsObject) cJSON_AddItemToObject(cjson_get_current(), "Exports", exportsObject);
+}
 
-    char wceVersionString[16];
+/**
+ * @brief Length of a DLL name without a .dll, .ocx or .sys extension, as used in ImpHash
+ */
+static size_t impHashDllStem(const char *dllName) {
+    size_t length = strlen(dllName);
+    if (length <= 4 || dllName[length - 4] != '.') return length;
+    char extension[4];
+    for (int i = 0; i < 3; i++) extension[i] = tolower((unsigned char)dllName[length - 3 + i]);
+    extension[3] = '\0';
+    if (!strcmp(extension, "dll") || !strcmp(extension, "ocx") || !strcmp(extension, "sys")) length -= 4;
+    return length;
+}
 
-    /* The windows CE version is encoded in subsystem version, except for CE1.0 software, which often has subsystem version 4.0
-     * Problem is, Windows CE 4.0 apps also have version 4.0.
-     * As a compromise, if subsystem version is 4.0, check if the PE file was compiled before 2000 and has arch MIPS/SH3. If so, assume it is for CE1.0 */
+/**
+ * @brief Add an import to ImpHash, the MD5 of all imports as comma separated dll.function entries in lower case, with
+ * ordinals as ord followed by the number. This is the imphash of pefile, except that pefile names some wsock32.dll
+ * and oleaut32.dll ordinals.
+ *
+ * @param context MD5 context
+ * @param index Number of entries added before
+ * @param dllName Name of the DLL
+ * @param dllStemLength Length of the name without extension
+ * @param function Name of the function, NULL if imported by ordinal
+ * @param ordinal Ordinal if function is NULL
+ */
+static void addImpHashEntry(HASH_CONTEXT *context, size_t index, const char *dllName, size_t dllStemLength, const char *function, uint16_t ordinal) {
+    char entry[2 * 256 + 8];
+    size_t length = 0;
+    if (index) entry[length++] = ',';
+    for (size_t i = 0; i < dllStemLength && i < 256; i++) entry[length++] = tolower((unsigned char)dllName[i]);
+    entry[length++] = '.';
+    if (function) {
+        for (size_t i = 0; function[i] && i < 256; i++) entry[length++] = tolower((unsigned char)function[i]);
+    } else {
+        length += sprintf(entry + length, "ord%u", ordinal);
+    }
+    hashUpdate(context, (const uint8_t *)entry, length);
+}
+
+/**
+ * @brief Number of bytes from an RVA to the end of the raw data of its section, limited to the end of the file
+ *
+ * @return size_t Number of bytes, 0 if the RVA is not in a section
+ */
+static size_t sectionBytesAt(PE_FILE *pe, uint32_t RVA) {
+    for (int i = 0; i < imageHeaders.FileHeader.NumberOfSections; i++) {
+        IMAGE_SECTION_HEADER *section = &imageSectionHeaders[i];
+        if (RVA < section->VirtualAddress || RVA - section->VirtualAddress >= section->Misc.VirtualSize) continue;
+        size_t offset = (size_t)section->PointerToRawData + (RVA - section->VirtualAddress);
+        size_t end = (size_t)section->PointerToRawData + section->SizeOfRawData;
+        if (end > pe->size) end = pe->size;
+        return offset < end ? end - offset : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse the delay load import directory. In JSON mode the imports are added as "DelayImports", in the same
+ * format as "DLLImports". The imports are also added to the index and the dependency graph, and the DLL names are
+ * passed to --where and --count-by.
+ *
+ * The descriptors and every import name table are mapped as a whole, so only the function names are read separately.
+ *
+ * @param pe PE file
+ */
+static void parseDelayImportDirectory(PE_FILE *pe) {
+    IMAGE_DATA_DIRECTORY *directory = &(imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT]);
+    if (!directory->VirtualAddress) return;
+
+    verbose("=== DELAY LOAD IMPORTS ===\n");
+    uint32_t directoryOffset = RVAtoFileOffset(directory->VirtualAddress);
+    size_t directoryBytes = sectionBytesAt(pe, directory->VirtualAddress);
+    if (!directoryOffset || !directoryBytes) {
+        verbose("Warning: Delay import directory is outside all sections\n");
+        return;
+    }
+    /* The size of the directory is not reliable, the descriptors end with an empty one */
+    size_t numberOfDescriptors = directoryBytes / sizeof(IMAGE_DELAYLOAD_DESCRIPTOR);
+    uint8_t *descriptorsCopy;
+    const uint8_t *descriptors = mapTable(pe, directoryOffset, numberOfDescriptors * sizeof(IMAGE_DELAYLOAD_DESCRIPTOR), &descriptorsCopy);
+
+    cJSON *delayImportArray = cJSON_CreateArray();
+    char dllNameBuffer[256];
+    char functionNameBuffer[256];
+    for (size_t i = 0; i < numberOfDescriptors; i++) {
+        IMAGE_DELAYLOAD_DESCRIPTOR descriptor;
+        memcpy(&descriptor, descriptors + i * sizeof(IMAGE_DELAYLOAD_DESCRIPTOR), sizeof(IMAGE_DELAYLOAD_DESCRIPTOR));
+        if (!descriptor.DllNameRVA) break;
+        /* Descriptors of Visual C++ 6 hold virtual addresses */
+        uint32_t bias = (descriptor.Attributes & IMAGE_DELAYLOAD_RVA_BASED) ? 0 : imageHeaders.OptionalHeader.ImageBase;
+
+        readStringAtRVA(pe, descriptor.DllNameRVA - bias, dllNameBuffer, sizeof(dllNameBuffer));
+        verbose("  DLL: %s\n", dllNameBuffer);
+        if (fieldCapture) fieldCapture->field("DelayImports", dllNameBuffer);
+        if (scanIndex && dllNameBuffer[0] && scanIndexAddImport(scanIndex, dllNameBuffer)) exit_error("Error while adding to the index");
+        const EXPORT_TABLE *exportTable = exportDbFind(dllNameBuffer);
+
+        cJSON *dllImportObject = cJSON_CreateObject();
+        cJSON_AddStringToObject(dllImportObject, "dllName", dllNameBuffer);
+        cJSON *dllImportFunctionsArray = cJSON_AddArrayToObject(dllImportObject, "functions");
+        cJSON_AddItemToArray(delayImportArray, dllImportObject);
+
+        uint32_t nameTableRVA = descriptor.ImportNameTableRVA - bias;
+        uint32_t nameTableOffset = RVAtoFileOffset(nameTableRVA);
+        size_t numberOfThunks = sectionBytesAt(pe, nameTableRVA) / sizeof(IMAGE_THUNK_DATA);
+        if (!nameTableOffset || !numberOfThunks) continue;
+        uint8_t *thunksCopy;
+        const uint8_t *thunks = mapTable(pe, nameTableOffset, numberOfThunks * sizeof(IMAGE_THUNK_DATA), &thunksCopy);
+        for (size_t j = 0; j < numberOfThunks; j++) {
+            IMAGE_THUNK_DATA thunkData;
+            memcpy(&thunkData, thunks + j * sizeof(IMAGE_THUNK_DATA), sizeof(IMAGE_THUNK_DATA));
+            if (!thunkData.u1.AddressOfData) break;
+            if (thunkData.u1.Ordinal & 0x80000000) {
+                uint16_t ordinal = (uint16_t)thunkData.u1.Ordinal;
+                const char *exportName = exportTable ? exportDbName(exportTable, ordinal) : NULL;
+                verbose("    Ordinal:  %x %s\n", ordinal, exportName ? exportName : "");
+                if (scanIndex && dllNameBuffer[0] && scanIndexAddFunction(scanIndex, dllNameBuffer, NULL, ordinal)) {
+                    exit_error("Error while adding to the index");
+                }
+                if (depGraph && dllNameBuffer[0] && depGraphAddImport(depGraph, dllNameBuffer, NULL, ordinal)) {
+                    exit_error("Error while adding to the dependency graph");
+                }
+                cJSON_AddItemToArray(dllImportFunctionsArray, exportName ? cJSON_CreateString(exportName) : cJSON_CreateNumber(ordinal));
+            } else {
+                /* Skip the hint */
+                readStringAtRVA(pe, thunkData.u1.AddressOfData - bias + 2, functionNameBuffer, sizeof(functionNameBuffer));
+                verbose("    Function: %s\n", functionNameBuffer);
+                if (!functionNameBuffer[0]) continue;
+                cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateString(functionNameBuffer));
+                if (scanIndex && dllNameBuffer[0] && scanIndexAddFunction(scanIndex, dllNameBuffer, functionNameBuffer, 0)) {
+                    exit_error("Error while adding to the index");
+                }
+                if (depGraph && dllNameBuffer[0] && depGraphAddImport(depGraph, dllNameBuffer, functionNameBuffer, 0)) {
+                    exit_error("Error while adding to the dependency graph");
+                }
+            }
+        }
+        free(thunksCopy);
+    }
+    free(descriptorsCopy);
+
+    if (printJson) {
+        cJSON_AddItemToObject(cjson_get_current(), "DelayImports", delayImportArray);
+    } else {
+        cJSON_Delete(delayImportArray);
+    }
+}
+
+/**
+ * @brief Copy a name of the bound import directory, truncated at the end of the directory or the buffer
+ */
+static void copyBoundName(const uint8_t *directory, size_t directorySize, uint16_t offset, char *buffer, size_t size) {
+    size_t i = 0;
+    for (; offset + i < directorySize && directory[offset + i] && i < size - 1; i++) buffer[i] = directory[offset + i];
+    buffer[i] = '\0';
+}
+
+/**
+ * @brief Parse the bound import directory, which lists the date/time stamps of the DLLs the imports were bound to. In
+ * JSON mode the DLLs are added as "BoundImports".
+ *
+ * @param pe PE file
+ */
+static void parseBoundImportDirectory(PE_FILE *pe) {
+    IMAGE_DATA_DIRECTORY *directory = &(imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT]);
+    if (!directory->VirtualAddress || !directory->Size) return;
+
+    verbose("=== BOUND IMPORTS ===\n");
+    /* The directory is usually placed in the headers, where RVAs are file offsets */
+    size_t directoryOffset = directory->VirtualAddress < imageHeaders.OptionalHeader.SizeOfHeaders ? directory->VirtualAddress : RVAtoFileOffset(directory->VirtualAddress);
+    if (!directoryOffset || directoryOffset >= pe->size) {
+        verbose("Warning: Bound import directory is outside the file\n");
+        return;
+    }
+    size_t directorySize = directory->Size;
+    if (directorySize > pe->size - directoryOffset) directorySize = pe->size - directoryOffset;
+    uint8_t *entriesCopy;
+    const uint8_t *entries = mapTable(pe, directoryOffset, directorySize, &entriesCopy);
+
+    cJSON *boundImportArray = cJSON_CreateArray();
+    char dllNameBuffer[256];
+    size_t position = 0;
+    /* Descriptors and forwarder references have the same size and layout up to the name */
+    while (position + sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR) <= directorySize) {
+        IMAGE_BOUND_IMPORT_DESCRIPTOR descriptor;
+        memcpy(&descriptor, entries + position, sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR));
+        position += sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR);
+        if (!descriptor.TimeDateStamp && !descriptor.OffsetModuleName) break;
+
+        cJSON *boundImportObject = cJSON_CreateObject();
+        cJSON_AddItemToArray(boundImportArray, boundImportObject);
+        copyBoundName(entries, directorySize, descriptor.OffsetModuleName, dllNameBuffer, sizeof(dllNameBuffer));
+        verbose("  DLL: %s\n", dllNameBuffer);
+        cJSON_AddStringToObject(boundImportObject, "dllName", dllNameBuffer);
+        cJSON_AddNumberToObject(boundImportObject, "timestamp", descriptor.TimeDateStamp);
+
+        cJSON *forwarderArray = cJSON_AddArrayToObject(boundImportObject, "forwarders");
+        for (int i = 0; i < descriptor.NumberOfModuleForwarderRefs && position + sizeof(IMAGE_BOUND_FORWARDER_REF) <= directorySize; i++) {
+            IMAGE_BOUND_FORWARDER_REF forwarder;
+            memcpy(&forwarder, entries + position, sizeof(IMAGE_BOUND_FORWARDER_REF));
+            position += sizeof(IMAGE_BOUND_FORWARDER_REF);
+            copyBoundName(entries, directorySize, forwarder.OffsetModuleName, dllNameBuffer, sizeof(dllNameBuffer));
+            verbose("    Forwarder: %s\n", dllNameBuffer);
+            cJSON *forwarderObject = cJSON_CreateObject();
+            cJSON_AddStringToObject(forwarderObject, "dllName", dllNameBuffer);
+            cJSON_AddNumberToObject(forwarderObject, "timestamp", forwarder.TimeDateStamp);
+            cJSON_AddItemToArray(forwarderArray, forwarderObject);
+        }
+    }
+    free(entriesCopy);
+
+    cJSON_AddItemToObject(cjson_get_current(), "BoundImports", boundImportArray);
+}
+
+static void printDigests(HASH_CONTEXT *context, const char *prefix) {
+    char hex[HASH_MAX_HEX];
+    char fieldName[32];
+    for (unsigned algorithm = HASH_MD5; algorithm <= HASH_SHA256; algorithm <<= 1) {
+        if (!(hashAlgorithms & algorithm)) continue;
+        hashFinal(context, algorithm, hex);
+        /* In text output, section digests are prefixed with the section name */
+        snprintf(fieldName, sizeof(fieldName), "%s%s", prefix, hashAlgorithmName(algorithm));
+        printStringValue(fieldName, hashAlgorithmName(algorithm), hex);
+    }
+}
+
+/**
+ * @brief Print the digests of --hash as "Hashes", with --hash-sections also those of the raw data of every section as
+ * "SectionHashes", by section name
+ *
+ * @param pe PE file
+ */
+static void printHashes(PE_FILE *pe) {
+    /* Streams are read as a whole for --hash, digests over the zeroes of skipped parts would be wrong */
+    const uint8_t *data = pePtr(pe, 0, pe->size);
+    if (!data) exit_file_error("error: File is not in memory as a whole, the digests can't be computed.\n");
+
+    HASH_CONTEXT context;
+    hashInit(&context, hashAlgorithms);
+    hashUpdate(&context, data, pe->size);
+    jsonStartObject();
+    printDigests(&context, "");
+    jsonEndObject("Hashes");
+
+    if (!hashSections) return;
+    jsonStartObject();
+    for (int i = 0; i < imageHeaders.FileHeader.NumberOfSections; i++) {
+        IMAGE_SECTION_HEADER *section = &imageSectionHeaders[i];
+        char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+        memcpy(name, section->Name, IMAGE_SIZEOF_SHORT_NAME);
+        name[IMAGE_SIZEOF_SHORT_NAME] = '\0';
+
+        size_t offset = section->PointerToRawData < pe->size ? section->PointerToRawData : pe->size;
+        size_t size = section->SizeOfRawData < pe->size - offset ? section->SizeOfRawData : pe->size - offset;
+        hashInit(&context, hashAlgorithms);
+        hashUpdate(&context, data + offset, size);
+
+        char prefix[IMAGE_SIZEOF_SHORT_NAME + 2];
+        sprintf(prefix, "%s ", name);
+        jsonStartObject();
+        printDigests(&context, prefix);
+        jsonEndObject(name);
+    }
+    jsonEndObject("SectionHashes");
+}
+
+/**
+ * @brief Print the entropy of the raw data of every section as "SectionEntropy", by section name
+ *
+ * @param pe PE file
+ */
+static void printSectionEntropy(PE_FILE *pe) {
+    /* Like the digests, entropy over the zeroes of skipped parts of a stream would be wrong */
+    const uint8_t *data = pePtr(pe, 0, pe->size);
+    if (!data) exit_file_error("error: File is not in memory as a whole, the entropy can't be computed.\n");
+
+    jsonStartObject();
+    for (int i = 0; i < imageHeaders.FileHeader.NumberOfSections; i++) {
+        IMAGE_SECTION_HEADER *section = &imageSectionHeaders[i];
+        char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+        memcpy(name, section->Name, IMAGE_SIZEOF_SHORT_NAME);
+        name[IMAGE_SIZEOF_SHORT_NAME] = '\0';
+
+        size_t offset = section->PointerToRawData < pe->size ? section->PointerToRawData : pe->size;
+        size_t size = section->SizeOfRawData < pe->size - offset ? section->SizeOfRawData : pe->size - offset;
+        uint64_t counts[256] = {0};
+        entropyCount(counts, data + offset, size);
+
+        /* Four decimals tell packed or encrypted data (near 8) from code (around 6) */
+        char fieldName[IMAGE_SIZEOF_SHORT_NAME + 10];
+        sprintf(fieldName, "%s Entropy", name);
+        printDoubleValue(fieldName, name, round(entropyOf(counts) * 10000) / 10000);
+    }
+    jsonEndObject("SectionEntropy");
+}
+
+/**
+ * @brief End of a part of the file while it is examined without output
+ *
+ * @return bool True if the rest of the file can be skipped
+ */
+static bool captureComplete(void) {
+    return fieldCapture && fieldCapture->endStage();
+}
+
+/**
+ * @brief Parse a PE file and print its information
+ *
+ * @param pe PE file
+ */
+static void parsePEFile(PE_FILE *pe) {
+    PROFILE_PHASE(PROFILE_HEADERS);
+
+    /* Seek to 0x3C, where the location of the COFF header is stored */
+    peSeek(pe, COFF_OFFSET, SEEK_SET);
+
+    /* Location of COFF header (16 bit since some weird PEs have a start address > 0xFF) */
+    uint16_t coff_start = readuint16le(pe);
+
+    /* Seek to start of COFF header */
+    peSeek(pe, coff_start, SEEK_SET);
+
+    /* Read PE Headers */
+    peRead(&imageHeaders, sizeof(IMAGE_NT_HEADERS32), 1, pe);
+
+    /* Check for PE\0\0 Marker */
+    if (peEof(pe)) {
+        exit_file_error("error: PE Marker at %#010x is outside file bounds.\n", coff_start);
+    }
+    if (imageHeaders.Signature != 0x00004550) {
+        exit_file_error("error: File does not have a PE marker at location %#02x.\n", coff_start);
+    }
+    if (imageHeaders.OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC) {
+        exit_file_error("error: IMAGE_NT_OPTIONAL_HDR_MAGIC is not 0x010B.\n");
+    }
+    if (sizeof(IMAGE_OPTIONAL_HEADER) != imageHeaders.FileHeader.SizeOfOptionalHeader) {
+        exit_file_error("error: Size of optional header should be %u for a PE file, but is %u. PE+ files are not supported.\n", (uint32_t)sizeof(IMAGE_OPTIONAL_HEADER), imageHeaders.FileHeader.SizeOfOptionalHeader);
+    }
+
+    /* Start JSON block */
+    peJson = jsonStartObject();
+
+    if (batchMode) printStringValue("File", 0, currentFile);
+
+    /* True if arch is one of the non-x86 WinCE architectures */
+    uint8_t isWinCEArch = (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_ARM) ||
+                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_R4000) ||
+                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_SH3) ||
+                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_SH4) ||
+                          (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_THUMB);
+
+    /* Guess subsystem doesn't mean much for early CE apps */
+    uint8_t isWinCEApp = (imageHeaders.OptionalHeader.Subsystem == IMAGE_SUBSYSTEM_WINDOWS_CE_GUI) || (imageHeaders.OptionalHeader.Subsystem == IMAGE_SUBSYSTEM_WINDOWS_GUI && isWinCEArch);
+
+    /** True if subsystem is 9 (Windows CE GUI) or subsystem is 2 and arch is a non-x86 WinCE arch */
+    printBoolValue("WCEApp", 0, isWinCEApp);
+
+    char wceVersionString[16];
+    /** WCEVersion as printed, NULL if it is unknown */
+    const char *wceVersion = NULL;
+
+    /* The windows CE version is encoded in subsystem version, except for CE1.0 software, which often has subsystem version 4.0
+     * Problem is, Windows CE 4.0 apps also have version 4.0.
+     * As a compromise, if subsystem version is 4.0, check if the PE file was compiled before 2000 and has arch MIPS/SH3. If so, assume it is for CE1.0 */
     if (imageHeaders.OptionalHeader.MajorSubsystemVersion == 4 && imageHeaders.OptionalHeader.MinorSubsystemVersion == 0) {
         // File was compiled before 2000 and is SH3/MIPS
         if (imageHeaders.FileHeader.TimeDateStamp < 946684800 && (imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_R4000 || imageHeaders.FileHeader.Machine == CE_IMAGE_FILE_MACHINE_SH3)) {
-            printStringValue("WCEVersion", 0, "1.0");
+            wceVersion = "1.0";
+            printStringValue("WCEVersion", 0, wceVersion);
         }
     } else {
         if (imageHeaders.OptionalHeader.MinorSubsystemVersion == 0) {
@@ -1062,14 +2051,15 @@ int main(int argc, char **argv) {
         } else {
             sprintf(wceVersionString, "%d.%02d", imageHeaders.OptionalHeader.MajorSubsystemVersion, imageHeaders.OptionalHeader.MinorSubsystemVersion);
         }
-        printStringValue("WCEVersion", 0, wceVersionString);
+        wceVersion = wceVersionString;
+        printStringValue("WCEVersion", 0, wceVersion);
     }
 
     printStringValue("WCEArch", 0, machineCodeToWindowsCEArch(imageHeaders.FileHeader.Machine));
 
     if (onlyBasicInfo) {
         fputc('\n', stdout);
-        exit(EXIT_SUCCESS);
+        return;
     }
 
     /** Windows CE arch */
@@ -1147,6 +2137,13 @@ int main(int argc, char **argv) {
     print32BitValue("SizeOfImage", 0, imageHeaders.OptionalHeader.SizeOfImage, DEC);
     print32BitValue("SizeOfHeaders", 0, imageHeaders.OptionalHeader.SizeOfHeaders, DEC);
     print32BitValue("CheckSum", 0, imageHeaders.OptionalHeader.CheckSum, DEC);
+    if (verifyChecksum) {
+        const uint8_t *data = pePtr(pe, 0, pe->size);
+        if (!data) exit_file_error("error: File is not in memory as a whole, the checksum can't be computed.\n");
+        uint32_t checkSum = peImageChecksum(data, pe->size, coff_start + offsetof(IMAGE_NT_HEADERS32, OptionalHeader.CheckSum));
+        print32BitValue("ComputedCheckSum", 0, checkSum, DEC);
+        printBoolValue("CheckSumValid", 0, checkSum == imageHeaders.OptionalHeader.CheckSum);
+    }
     print32BitValue("Subsystem", 0, imageHeaders.OptionalHeader.Subsystem, DEC);
     print32BitValue("DllCharacteristics", 0, imageHeaders.OptionalHeader.DllCharacteristics, DEC);
     print32BitValue("SizeOfStackReserve", 0, imageHeaders.OptionalHeader.SizeOfStackReserve, DEC);
@@ -1155,21 +2152,26 @@ int main(int argc, char **argv) {
     print32BitValue("SizeOfHeapCommit", 0, imageHeaders.OptionalHeader.SizeOfHeapCommit, DEC);
     print32BitValue("LoaderFlags", 0, imageHeaders.OptionalHeader.LoaderFlags, DEC);
     print32BitValue("NumberOfRvaAndSizes", 0, imageHeaders.OptionalHeader.NumberOfRvaAndSizes, DEC);
+    if (captureComplete()) return;
 
     /* Section headers */
 
+    PROFILE_PHASE(PROFILE_SECTIONS);
+    PROFILE_COUNT(PROFILE_ALLOCATIONS, 1);
     imageSectionHeaders = malloc(imageHeaders.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
 
-    fread(imageSectionHeaders, sizeof(IMAGE_SECTION_HEADER), imageHeaders.FileHeader.NumberOfSections, fp);
+    peRead(imageSectionHeaders, sizeof(IMAGE_SECTION_HEADER), imageHeaders.FileHeader.NumberOfSections, pe);
 
     /* get offset to first section headeer */
     size_t sectionLocation = (size_t)(&imageHeaders) + sizeof(uint32_t) + (size_t)(sizeof(IMAGE_FILE_HEADER)) + (size_t)imageHeaders.FileHeader.SizeOfOptionalHeader;
     size_t sectionSize = sizeof(IMAGE_SECTION_HEADER);
 
     if (verbose_enabled) {
+        PROFILE_PHASE(PROFILE_DIRECTORIES);
         verbose("\n=== DIRECTORY ENTRIES ===\n");
         for (int i = 1; i < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; i++) {
-            char *name;
+            /* Entry 15 is reserved */
+            char *name = "Reserved";
             switch (i) {
                 case IMAGE_DIRECTORY_ENTRY_EXPORT:
                     name = "Export Directory";
@@ -1226,6 +2228,7 @@ int main(int argc, char **argv) {
             }
         }
         verbose("\n");
+        PROFILE_PHASE(PROFILE_SECTIONS);
     }
 
     /* get offset to the import directory RVA */
@@ -1237,7 +2240,7 @@ int main(int argc, char **argv) {
 
     verbose("\n=== SECTION HEADERS ===\n");
     /* Find sections */
-    for (uint8_t i = 0; i < imageHeaders.FileHeader.NumberOfSections; i++) {
+    for (int i = 0; i < imageHeaders.FileHeader.NumberOfSections; i++) {
         IMAGE_SECTION_HEADER *sectionHeader = &(imageSectionHeaders[i]);
         if (verbose_enabled) {
             verbose("Section Header: %s\n", sectionHeader->Name);
@@ -1264,63 +2267,74 @@ int main(int argc, char **argv) {
         }
     }
 
-    /* Resources */
-
-    verbose("=== RESOURCE SECTION ===\n");
-    if (resourceSection) {
-        size_t resourceSectionRawOffset = resourceSection->PointerToRawData;
-        size_t resourceSectionStartAddress = (resourceSectionRawOffset + (resourceDirectoryRVA - resourceSection->VirtualAddress));
-
-        verbose("  Resource section offset        0x%x\n", resourceSectionStartAddress);
-        verbose("  Resource section size          0x%x\n", resourceSection->SizeOfRawData);
-        verbose("  Resource section start address 0x%x\n", resourceSectionStartAddress);
-
-        PE_RESOURCE_DIRECTORY_TABLE resourceDirectoryTable;
-        fseek(fp, resourceSectionStartAddress, SEEK_SET);
-        fread(&resourceDirectoryTable, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, fp);
+    PROFILE_PHASE(PROFILE_DIGESTS);
+    /* The pass of --where only computes them if the expression tests them, they are computed again for the output */
+    if (hashAlgorithms && (!fieldCapture || *fieldCapture->usesDigests)) printHashes(pe);
+    if (sectionEntropy && (!fieldCapture || *fieldCapture->usesEntropy)) printSectionEntropy(pe);
+    if (captureComplete()) return;
 
-        parseResourceDirectoryTable(&resourceDirectoryTable, resourceSectionStartAddress, fp, 0);
-    } else {
-        verbose("Warning: No Resource section found\n");
+    /* --build-export-db only needs the exports */
+    if (exportDbDllName) {
+        parseExportDirectory(pe);
+        return;
     }
 
     /* DLL Imports */
 
-    if (printJson) {
+    PROFILE_PHASE(PROFILE_IMPORTS);
+    /* Text output leaves out the imports, and only lists ImpHash with -f ImpHash or --hash */
+    bool printImpHash = printJson || fieldCapture || (filterField ? !strcmp(filterField, "ImpHash") : hashAlgorithms != 0);
+    if ((printJson || scanIndex || apiVersionsLoaded || fieldCapture || clusterMap || printImpHash) && importSection) {
         verbose("=== DLL IMPORTS ===\n");
         size_t importSectionRawOffset = importSection->PointerToRawData;
         /* Pointer to import descriptor's file offset. Note that the formula for calculating file offset is: imageBaseAddress + pointerToRawDataOfTheSectionContainingRVAofInterest + (RVAofInterest - SectionContainingRVAofInterest.VirtualAddress) */
         size_t importDescriptorsStartAddress = (importSectionRawOffset + (imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress - importSection->VirtualAddress));
 
         /** Theoretical upper limit of import descriptors based on the size of the data directory */
-        int maxImportDescriptors = imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
+        size_t maxImportDescriptors = imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
         // verbose("sizeImportDescriptors: %u\n", imageHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size);
 
-        fseek(fp, importDescriptorsStartAddress, SEEK_SET);
-
-        IMAGE_IMPORT_DESCRIPTOR *importDescriptors = malloc(maxImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+        /* The size of the directory is not trusted, the descriptors can't extend past the import section */
+        size_t importSectionDescriptors = sectionBytesAt(pe, importDirectoryRVA) / sizeof(IMAGE_IMPORT_DESCRIPTOR);
+        if (maxImportDescriptors > importSectionDescriptors) maxImportDescriptors = importSectionDescriptors;
 
-        fread(importDescriptors, sizeof(IMAGE_IMPORT_DESCRIPTOR), maxImportDescriptors, fp);
+        uint8_t *importDescriptorsCopy;
+        const uint8_t *importDescriptors = mapTable(pe, importDescriptorsStartAddress, maxImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR), &importDescriptorsCopy);
 
         char dllNameBuffer[256];
+        char functionNameBuffer[256];
 
         cJSON *dllImportArray = cJSON_CreateArray();
-
-        for (int i = 0; i < (maxImportDescriptors - 1); i++) {
-            IMAGE_IMPORT_DESCRIPTOR *importDescriptor = &(importDescriptors[i]);
+        /* Versions exporting all imports seen so far, of DLLs in any loaded version */
+        uint32_t importVersions = UINT32_MAX;
+        bool importVersionsKnown = false;
+        HASH_CONTEXT impHash;
+        size_t numberOfImpHashEntries = 0;
+        hashInit(&impHash, HASH_MD5);
+
+        for (size_t i = 0; i + 1 < maxImportDescriptors; i++) {
+            IMAGE_IMPORT_DESCRIPTOR descriptor;
+            memcpy(&descriptor, importDescriptors + i * sizeof(IMAGE_IMPORT_DESCRIPTOR), sizeof(IMAGE_IMPORT_DESCRIPTOR));
+            IMAGE_IMPORT_DESCRIPTOR *importDescriptor = &descriptor;
 
             // If the first 4 bytes are zero, the inportdescriptors list is terminated
             if (!importDescriptor->Characteristics) break;
 
             /* imported dll modules */
             size_t stringAddress = (importSectionRawOffset + (importDescriptor->Name - importSection->VirtualAddress));
-            fseek(fp, stringAddress, SEEK_SET);
-            readNullTerminatedString(dllNameBuffer, 64, fp);
+            peSeek(pe, stringAddress, SEEK_SET);
+            readNullTerminatedString(dllNameBuffer, 64, pe);
+            if (fieldCapture) fieldCapture->field("DLLImports", dllNameBuffer);
+            if (scanIndex && dllNameBuffer[0] && scanIndexAddImport(scanIndex, dllNameBuffer)) exit_error("Error while adding to the index");
 
             // jsonStartObject(0);
             cJSON *dllImportObject = cJSON_CreateObject();
             cJSON_AddStringToObject(dllImportObject, "dllName", dllNameBuffer);
             verbose("  DLL: %s\n", dllNameBuffer);
+            const EXPORT_TABLE *exportTable = exportDbFind(dllNameBuffer);
+            const EXPORT_VERSIONS *versionTable = apiVersionsLoaded ? exportDbFindVersions(dllNameBuffer) : NULL;
+            if (versionTable) importVersionsKnown = true;
+            size_t dllStemLength = impHashDllStem(dllNameBuffer);
 
             IMAGE_THUNK_DATA thunkData;
             size_t thunk = importDescriptor->OriginalFirstThunk == 0 ? importDescriptor->FirstThunk : importDescriptor->OriginalFirstThunk;
@@ -1332,8 +2346,8 @@ int main(int argc, char **argv) {
 
             do {
                 /* Read thunk data block */
-                fseek(fp, thunkAddress, SEEK_SET);
-                fread(&thunkData, sizeof(IMAGE_THUNK_DATA), 1, fp);
+                peSeek(pe, thunkAddress, SEEK_SET);
+                peRead(&thunkData, sizeof(IMAGE_THUNK_DATA), 1, pe);
 
                 if (!thunkData.u1.AddressOfData) {
                     break;
@@ -1341,36 +2355,784 @@ int main(int argc, char **argv) {
                 /* a cheap and probably non-reliable way of checking if the function is imported via its ordinal number ¯\_(ツ)_/¯ */
                 if (thunkData.u1.AddressOfData > 0x80000000) {
                     /* show lower bits of the value to get the ordinal ¯\_(ツ)_/¯ */
-                    verbose("    Ordinal:  %x\n", (uint16_t)thunkData.u1.Ordinal);
-                    cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateNumber((uint16_t)thunkData.u1.Ordinal));
+                    const char *exportName = exportTable ? exportDbName(exportTable, (uint16_t)thunkData.u1.Ordinal) : NULL;
+                    verbose("    Ordinal:  %x %s\n", (uint16_t)thunkData.u1.Ordinal, exportName ? exportName : "");
+                    if (scanIndex && dllNameBuffer[0] && scanIndexAddFunction(scanIndex, dllNameBuffer, NULL, (uint16_t)thunkData.u1.Ordinal)) {
+                        exit_error("Error while adding to the index");
+                    }
+                    if (depGraph && dllNameBuffer[0] && depGraphAddImport(depGraph, dllNameBuffer, NULL, (uint16_t)thunkData.u1.Ordinal)) {
+                        exit_error("Error while adding to the dependency graph");
+                    }
+                    if (versionTable) importVersions &= exportDbVersionMask(versionTable, NULL, (uint16_t)thunkData.u1.Ordinal);
+                    addImpHashEntry(&impHash, numberOfImpHashEntries++, dllNameBuffer, dllStemLength, NULL, (uint16_t)thunkData.u1.Ordinal);
+                    if (exportName) {
+                        cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateString(exportName));
+                    } else {
+                        cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateNumber((uint16_t)thunkData.u1.Ordinal));
+                    }
                 } else {
                     size_t stringAddress = importSectionRawOffset + (thunkData.u1.AddressOfData - importSection->VirtualAddress + 2);
-                    fseek(fp, stringAddress, SEEK_SET);
-                    readNullTerminatedString(dllNameBuffer, 64, fp);
-                    verbose("    Function: %s\n", dllNameBuffer);
-                    if (strlen(dllNameBuffer)) {
-                        cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateString(dllNameBuffer));
+                    peSeek(pe, stringAddress, SEEK_SET);
+                    readNullTerminatedString(functionNameBuffer, 64, pe);
+                    verbose("    Function: %s\n", functionNameBuffer);
+                    if (strlen(functionNameBuffer)) {
+                        cJSON_AddItemToArray(dllImportFunctionsArray, cJSON_CreateString(functionNameBuffer));
+                        if (scanIndex && dllNameBuffer[0] && scanIndexAddFunction(scanIndex, dllNameBuffer, functionNameBuffer, 0)) {
+                            exit_error("Error while adding to the index");
+                        }
+                        if (depGraph && dllNameBuffer[0] && depGraphAddImport(depGraph, dllNameBuffer, functionNameBuffer, 0)) {
+                            exit_error("Error while adding to the dependency graph");
+                        }
+                        if (versionTable) importVersions &= exportDbVersionMask(versionTable, functionNameBuffer, 0);
+                        addImpHashEntry(&impHash, numberOfImpHashEntries++, dllNameBuffer, dllStemLength, functionNameBuffer, 0);
                     }
                 }
             } while (thunkAddress += sizeof(IMAGE_THUNK_DATA));
             cJSON_AddItemToObject(dllImportObject, "functions", dllImportFunctionsArray);
             cJSON_AddItemToArray(dllImportArray, dllImportObject);
         }
+        free(importDescriptorsCopy);
 
-        cJSON_AddItemToObject(cjson_get_current(), "DLLImports", dllImportArray);
+        if (printJson) {
+            cJSON_AddItemToObject(cjson_get_current(), "DLLImports", dllImportArray);
+        } else {
+            cJSON_Delete(dllImportArray);
+        }
+
+        if (numberOfImpHashEntries) {
+            hashFinal(&impHash, HASH_MD5, fileImpHash);
+            if (printImpHash) printStringValue("ImpHash", 0, fileImpHash);
+        }
+
+        if (importVersionsKnown) {
+            const char *minVersion = exportDbMinVersion(importVersions);
+            if (minVersion) {
+                printStringValue("WCEMinVersionByImports", 0, minVersion);
+            } else {
+                verbose("Warning: No loaded API version exports all imports\n");
+            }
+        }
+    }
+
+    if (printJson || scanIndex || fieldCapture) parseDelayImportDirectory(pe);
+    if (printJson) parseBoundImportDirectory(pe);
+    if (printJson) parseExportDirectory(pe);
+    if (captureComplete()) return;
+
+    /* Resources, only the version info is used */
+
+    PROFILE_PHASE(PROFILE_RESOURCES);
+    verbose("=== RESOURCE SECTION ===\n");
+    if (resourceSection) {
+        size_t resourceSectionRawOffset = resourceSection->PointerToRawData;
+        size_t resourceSectionStartAddress = (resourceSectionRawOffset + (resourceDirectoryRVA - resourceSection->VirtualAddress));
+
+        verbose("  Resource section offset        0x%x\n", resourceSectionStartAddress);
+        verbose("  Resource section size          0x%x\n", resourceSection->SizeOfRawData);
+        verbose("  Resource section start address 0x%x\n", resourceSectionStartAddress);
+
+        PE_RESOURCE_DIRECTORY_TABLE resourceDirectoryTable;
+        peSeek(pe, resourceSectionStartAddress, SEEK_SET);
+        peRead(&resourceDirectoryTable, sizeof(PE_RESOURCE_DIRECTORY_TABLE), 1, pe);
+
+        parseResourceDirectoryTable(&resourceDirectoryTable, resourceSectionStartAddress, pe, 0);
+    } else {
+        verbose("Warning: No Resource section found\n");
+    }
+
+    PROFILE_PHASE(PROFILE_VERSION_INFO);
+    parseVersionInfoSection(pe, versionInfoSectionStart, versionInfoSize);
+
+    if (scanIndex) {
+        SCAN_INDEX_FILE file = {
+            imageHeaders.FileHeader.Machine,
+            imageHeaders.OptionalHeader.Subsystem,
+            imageHeaders.OptionalHeader.MajorSubsystemVersion,
+            imageHeaders.OptionalHeader.MinorSubsystemVersion,
+            imageHeaders.FileHeader.Characteristics,
+            imageHeaders.FileHeader.TimeDateStamp,
+            isWinCEApp,
+            wceVersion};
+        if (scanIndexEndFile(scanIndex, currentFile, &file)) exit_error("Error while adding to the index");
+    }
+    if (depGraph && depGraphEndFile(depGraph, currentFile)) exit_error("Error while adding to the dependency graph");
+    if (clusterMap && fileImpHash[0] && clusterAdd(clusterMap, fileImpHash, currentFile)) exit_error("Error while adding to the clusters");
+}
+
+/**
+ * @brief Parse a single PE file. Errors in the file only stop this file, not the whole run. In JSON mode the result is
+ * left in peJson.
+ *
+ * @param pe PE file
+ * @param label Name of the file in output and error messages
+ * @return int 0 on success, 1 if the file could not be parsed
+ */
+static int examinePE(PE_FILE *pe, const char *label) {
+    jmp_buf errorHandler;
+
+    currentFile = label;
+    cjson_stack_idx = -1;
+    peJson = NULL;
+    imageSectionHeaders = NULL;
+    versionInfoSectionStart = 0;
+    versionInfoSize = 0;
+    fileErrorMessage[0] = '\0';
+    workerSetLabel(label);
+    if (scanIndex) scanIndexStartFile(scanIndex);
+    if (depGraph) depGraphStartFile(depGraph);
+    fileImpHash[0] = '\0';
+
+    int failed = setjmp(errorHandler);
+    if (!failed) {
+        fileErrorHandler = &errorHandler;
+        parsePEFile(pe);
     }
+    fileErrorHandler = NULL;
+
+    if (failed) {
+        /* Nested objects are only attached to their parent once they are complete */
+        for (int i = 1; i <= cjson_stack_idx; i++) cJSON_Delete(cjson_stack[i]);
+        cJSON_Delete(peJson);
+        peJson = NULL;
+    }
+    free(imageSectionHeaders);
+    imageSectionHeaders = NULL;
+    return failed;
+}
+
+static void whereCaptureField(const char *name, const char *value) {
+    whereField(whereExpr, name, value);
+}
+
+static bool whereCaptureEndStage(void) {
+    return whereEndStage(whereExpr, false) != WHERE_UNKNOWN;
+}
+
+static const FIELD_CAPTURE whereCapture = {whereCaptureField, whereCaptureEndStage, &whereVersionKeys, &whereUsesDigests, &whereUsesEntropy};
+
+static void countByCaptureField(const char *name, const char *value) {
+    countByField(countBy, name, value);
+}
+
+static bool countByCaptureEndStage(void) {
+    return countByComplete(countBy);
+}
+
+static const FIELD_CAPTURE countByCapture = {countByCaptureField, countByCaptureEndStage, &countByVersionKeys, &countByUsesDigests, &countByUsesEntropy};
+
+/**
+ * @brief Parse a file only as far as needed by capture, without printing anything
+ *
+ * @param pe PE file
+ * @param label Name of the file in output and error messages
+ * @param capture Receives the fields
+ * @return int 0 on success, 1 if the file could not be parsed
+ */
+static int examineCaptured(PE_FILE *pe, const char *label, const FIELD_CAPTURE *capture) {
+    int savedPrintJson = printJson, savedOnlyBasicInfo = onlyBasicInfo;
+    bool savedVerbose = verbose_enabled;
+    char *savedFilterField = filterField;
+    SCAN_INDEX_WRITER *savedScanIndex = scanIndex;
+    DEP_GRAPH *savedDepGraph = depGraph;
+    CLUSTER_MAP *savedClusterMap = clusterMap;
+
+    /* Nothing is printed or collected */
+    printJson = onlyBasicInfo = 0;
+    verbose_enabled = false;
+    filterField = NULL;
+    scanIndex = NULL;
+    depGraph = NULL;
+    clusterMap = NULL;
+    fieldCapture = capture;
+    capture->field("File", label);
+
+    int failed = examinePE(pe, label);
+
+    fieldCapture = NULL;
+    printJson = savedPrintJson;
+    onlyBasicInfo = savedOnlyBasicInfo;
+    verbose_enabled = savedVerbose;
+    filterField = savedFilterField;
+    scanIndex = savedScanIndex;
+    depGraph = savedDepGraph;
+    clusterMap = savedClusterMap;
+    return failed;
+}
 
-    parseVersionInfoSection(fp, versionInfoSectionStart, versionInfoSize);
+/**
+ * @brief Examine a single PE file and print the result
+ *
+ * @param pe PE file
+ * @param label Name of the file in output and error messages
+ * @return int 0 on success, 1 if the file could not be parsed
+ */
+static int printPEInfo(PE_FILE *pe, const char *label) {
+    int failed = 0;
+    if (whereExpr) {
+        /* Files that don't match are only parsed as far as needed to decide, matching files are examined again */
+        whereReset(whereExpr);
+        failed = examineCaptured(pe, label, &whereCapture);
+        if (!failed && whereEndStage(whereExpr, true) != WHERE_TRUE) {
+            PROFILE_END_FILE(label);
+            currentFile = NULL;
+            return 0;
+        }
+    }
+    if (failed) {
+        /* Reported by the --where pass */
+    } else if (countBy) {
+        countByStartFile(countBy);
+        failed = examineCaptured(pe, label, &countByCapture);
+        if (!failed && countByEndFile(countBy)) exit_perror("Error while allocating memory for the counts");
+    } else {
+        failed = examinePE(pe, label);
+    }
 
     /** Stringified JSON Object */
-    if (printJson) {
+    if (depGraph || clusterMap || countBy) {
+        /* Only the report of --resolve, --cluster or --count-by is printed */
+    } else if (printJson && !failed) {
         verbose("=== JSON OUTPUT ===");
-        const char *stringJson = cJSON_Print(peJson);
+        PROFILE_PHASE(PROFILE_JSON);
+        /* In batch mode every file is printed on a single line (NDJSON) */
+        char *stringJson = batchMode ? cJSON_PrintUnformatted(peJson) : cJSON_Print(peJson);
         if (stringJson == NULL) exit_error("Failed to print json.");
         // Print JSON
+        PROFILE_PHASE(PROFILE_OUTPUT);
         puts(stringJson);
+        free(stringJson);
+    } else if (batchMode && !failed && !filterField && !onlyBasicInfo) {
+        /* Separate files by an empty line, --basic already ends with one */
+        fputc('\n', stdout);
+    }
+
+    cJSON_Delete(peJson);
+    peJson = NULL;
+    PROFILE_END_FILE(label);
+    currentFile = NULL;
+    return failed;
+}
+
+#ifdef USE_SERVE
+/**
+ * @brief Examine a file for a --serve request
+ *
+ * @param pe PE file
+ * @param label Name of the file
+ * @param error Set to the reason if the file could not be examined
+ * @return cJSON* JSON object of the file, owned by the caller, or NULL on error
+ */
+static cJSON *serveExamine(PE_FILE *pe, const char *label, const char **error) {
+    int failed = examinePE(pe, label);
+    currentFile = NULL;
+    if (failed) {
+        *error = fileErrorMessage[0] ? fileErrorMessage : "File could not be examined";
+        return NULL;
+    }
+    cJSON *result = peJson;
+    peJson = NULL;
+    return result;
+}
+#endif
+
+typedef struct
+{
+    const char *archiveName;
+    int failures;
+} ARCHIVE_SCAN;
+
+static void printArchiveMember(const char *memberName, const uint8_t *data, size_t size, void *context) {
+    ARCHIVE_SCAN *scan = context;
+
+    char *label = malloc(strlen(scan->archiveName) + strlen(memberName) + 2);
+    if (!label) exit_perror("Error while allocating memory for archive member name");
+    sprintf(label, "%s!%s", scan->archiveName, memberName);
+
+    PE_FILE member;
+    peOpenMemory(&member, data, size);
+    scan->failures += printPEInfo(&member, label);
+    peClose(&member);
+    free(label);
+}
+
+/**
+ * @brief Examine a file given on the command line. Archives are searched for executables.
+ *
+ * @param path Path of the file, or "-" for stdin
+ * @return int Number of files that could not be examined
+ */
+static int scanInput(const char *path) {
+    PE_FILE peFile;
+    PE_FILE *pe = &peFile;
+    PROFILE_START_FILE();
+    metricsStartInput();
+
+    /* If file name is "-", read from stdin. stdin can't seek, so only the parts needed later are buffered. */
+    bool fromStdin = strcmp(path, "-") == 0;
+    /* Digests, entropy and the checksum need every byte and --where reads the file twice, then the whole stream is
+     * kept. This also applies to pipes and FIFOs given by path. */
+    bool whole = hashAlgorithms || verifyChecksum || sectionEntropy || whereExpr;
+    int status;
+    if (fromStdin) {
+        status = whole ? peOpenStreamWhole(pe, stdin, maxStreamBuffer) : peOpenStream(pe, stdin, maxStreamBuffer);
+    } else {
+        status = peOpenFile(pe, path, maxStreamBuffer, whole);
+    }
+    currentFile = path;
+    if (status) {
+        const char *message = fromStdin ? "Failed to read PE file from stdin" : "Failed to open file";
+        if (!batchMode) exit_perror(message);
+        print_perror(message);
+        currentFile = NULL;
+        metricsEndInput(0, 1);
+        metricsTick();
+        return 1;
+    }
+
+    int failures;
+    ARCHIVE_TYPE type = archiveType(pe);
+    if (type != ARCHIVE_NONE) {
+        batchMode = true;
+        ARCHIVE_SCAN scan = {path, 0};
+        if (archiveForEachMember(pe, type, maxStreamBuffer, printArchiveMember, &scan)) {
+            fprintf(stderr, "Error: %s: %s\n", path, fromStdin ? "archives can't be read from stdin" : "archive is damaged or incomplete");
+            scan.failures++;
+        }
+        failures = scan.failures;
+    } else {
+        failures = printPEInfo(pe, path);
+    }
+
+    /* Worker processes pass their counts to the parent after every input */
+    if (countBy && numberOfWorkers && countByFlush(countBy)) exit_perror("Failed to write output");
+
+    metricsEndInput(pe->size, failures);
+    peClose(pe);
+    metricsTick();
+    return failures;
+}
+
+/**
+ * @brief Print the named exports of a DLL for --build-export-db
+ *
+ * @param path Path of the DLL
+ * @return int Number of files that could not be examined
+ */
+static int printExportDbLines(const char *path) {
+    PE_FILE pe;
+    batchMode = true;
+    currentFile = path;
+    if (peOpenFile(&pe, path, maxStreamBuffer, false)) {
+        print_perror("Failed to open file");
+        currentFile = NULL;
+        return 1;
     }
 
-    if (ferror(fp))
-        fprintf(stderr, "I/O error when reading");
+    const char *baseName = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char dllName[256];
+    size_t i = 0;
+    for (; baseName[i] && i < sizeof(dllName) - 1; i++) dllName[i] = tolower((unsigned char)baseName[i]);
+    dllName[i] = '\0';
+
+    exportDbDllName = dllName;
+    int failed = examinePE(&pe, path);
+    exportDbDllName = NULL;
+    cJSON_Delete(peJson);
+    peJson = NULL;
+    currentFile = NULL;
+    peClose(&pe);
+    return failed;
+}
+
+#if !defined _WIN32 && !defined UNDER_CE
+typedef struct
+{
+    char **paths;
+    int numberOfPaths;
+    int capacity;
+    /** Number of paths added, with --sample only a uniform sample of them is kept */
+    uint64_t numberOfSeen;
+} PATH_LIST;
+
+static const char *const dllExtensions[] = {".dll", NULL};
+static const char *const executableExtensions[] = {".exe", ".dll", ".cpl", NULL};
+
+static bool hasExtension(const char *name, const char *const *extensions) {
+    size_t length = strlen(name);
+    for (; *extensions; extensions++) {
+        size_t extensionLength = strlen(*extensions);
+        if (length > extensionLength && !strcasecmp(name + length - extensionLength, *extensions)) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Random number for --sample
+ *
+ * @return double Uniformly distributed in [0, 1)
+ */
+static double sampleRandom(void) {
+    /* xorshift64*, seeded once per run */
+    static uint64_t state = 0;
+    if (!state) state = ((uint64_t)time(NULL) << 32 ^ (uint64_t)getpid()) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ((state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void addPath(PATH_LIST *list, char *path) {
+    list->numberOfSeen++;
+    if (sampleFraction && sampleRandom() >= sampleFraction) {
+        /* The number of files is not known while the directories are searched, every file is kept with the same chance */
+        free(path);
+        return;
+    }
+    if (sampleSize && list->numberOfPaths == (int)sampleSize) {
+        /* Reservoir sampling: the n-th file replaces a kept one with probability sampleSize / n */
+        uint64_t slot = sampleRandom() * list->numberOfSeen;
+        if (slot < sampleSize) {
+            free(list->paths[slot]);
+            list->paths[slot] = path;
+        } else {
+            free(path);
+        }
+        return;
+    }
+    if (list->numberOfPaths == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+        if (!list->paths) exit_perror("Error while allocating memory for file names");
+    }
+    list->paths[list->numberOfPaths++] = path;
+}
+
+/**
+ * @brief Add all files below a directory with one of the given extensions to a list
+ */
+static void findFiles(const char *directory, const char *const *extensions, PATH_LIST *list) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "Error: %s: %s\n", directory, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        char *path = malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        if (!path) exit_perror("Error while allocating memory for file name");
+        sprintf(path, "%s/%s", directory, entry->d_name);
+
+        struct stat st;
+        if (stat(path, &st)) {
+            free(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            findFiles(path, extensions, list);
+            free(path);
+        } else if (S_ISREG(st.st_mode) && hasExtension(entry->d_name, extensions)) {
+            addPath(list, path);
+        } else {
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+static int compareDllPaths(const void *a, const void *b) {
+    const char *path1 = *(char *const *)a, *path2 = *(char *const *)b;
+    int cmp = strcasecmp(strrchr(path1, '/') + 1, strrchr(path2, '/') + 1);
+    return cmp ? cmp : strcmp(path1, path2);
+}
+
+static int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Replace the inputs with a sample of the files and the executables below the directories, for --sample
+ */
+static void sampleInputs(void) {
+    PATH_LIST list = {0};
+    for (int i = 0; i < numberOfInfiles; i++) {
+        struct stat st;
+        if (!stat(infiles[i], &st) && S_ISDIR(st.st_mode)) {
+            findFiles(infiles[i], executableExtensions, &list);
+            continue;
+        }
+        char *path = strdup(infiles[i]);
+        if (!path) exit_perror("Error while allocating memory for file name");
+        addPath(&list, path);
+    }
+    qsort(list.paths, list.numberOfPaths, sizeof(char *), comparePaths);
+    infiles = list.paths;
+    numberOfInfiles = list.numberOfPaths;
+    countBySetPopulation(countBy, list.numberOfSeen);
+}
+#endif
+
+/**
+ * @brief Implementation of --build-export-db: print the exports of all DLLs below a directory, sorted by DLL and ordinal
+ *
+ * @param directory Directory to search
+ * @return int Number of files that could not be examined
+ */
+static int buildExportDb(const char *directory) {
+#if !defined _WIN32 && !defined UNDER_CE
+    PATH_LIST list = {0};
+    findFiles(directory, dllExtensions, &list);
+    qsort(list.paths, list.numberOfPaths, sizeof(char *), compareDllPaths);
+
+    int failures = 0;
+    if (numberOfWorkers) {
+        failures = workerPoolRun(numberOfWorkers, workerTimeout, list.paths, list.numberOfPaths, printExportDbLines, NULL, NULL, NULL);
+        if (failures == -1) exit_perror("Failed to start worker processes");
+    } else {
+        for (int i = 0; i < list.numberOfPaths; i++) failures += printExportDbLines(list.paths[i]);
+    }
+    for (int i = 0; i < list.numberOfPaths; i++) free(list.paths[i]);
+    free(list.paths);
+    return failures;
+#else
+    exit_error("--build-export-db is not supported on this platform");
+    return 1;
+#endif
+}
+
+/**
+ * @brief Examine all files given on the command line, directories are searched for executables
+ *
+ * @return int Number of files that could not be examined
+ */
+static int scanInputsAndDirectories(void) {
+    int failures = 0;
+    for (int i = 0; i < numberOfInfiles; i++) {
+#if !defined _WIN32 && !defined UNDER_CE
+        struct stat st;
+        if (!stat(infiles[i], &st) && S_ISDIR(st.st_mode)) {
+            PATH_LIST list = {0};
+            findFiles(infiles[i], executableExtensions, &list);
+            qsort(list.paths, list.numberOfPaths, sizeof(char *), comparePaths);
+            for (int j = 0; j < list.numberOfPaths; j++) {
+                failures += scanInput(list.paths[j]);
+                free(list.paths[j]);
+            }
+            free(list.paths);
+            continue;
+        }
+#endif
+        failures += scanInput(infiles[i]);
+    }
+    return failures;
+}
+
+/**
+ * @brief Implementation of --resolve: examine all files, then print whether the imports of every file can be resolved
+ *
+ * @return int Number of files that could not be examined or have unresolved imports
+ */
+static int resolveDependencies(void) {
+    if (!(depGraph = depGraphCreate())) exit_perror("Error while allocating memory for the dependency graph");
+    int failures = scanInputsAndDirectories();
+    int unresolved = depGraphResolve(depGraph, resolveJson);
+    if (unresolved == -1) exit_perror("Error while resolving imports");
+    depGraphFree(depGraph);
+    depGraph = NULL;
+    return failures + unresolved;
+}
+
+/**
+ * @brief Implementation of --cluster: examine all files, then print the groups of files with the same ImpHash
+ *
+ * @return int Number of files that could not be examined
+ */
+static int clusterByImports(void) {
+    if (!(clusterMap = clusterCreate())) exit_perror("Error while allocating memory for the clusters");
+    int failures = scanInputsAndDirectories();
+    if (clusterPrint(clusterMap, clusterJson) == -1) exit_perror("Error while printing the clusters");
+    clusterFree(clusterMap);
+    clusterMap = NULL;
+    return failures;
+}
+
+#ifdef USE_CHECKPOINT
+/**
+ * @brief Open the journal of --checkpoint. With --resume, drop the inputs completed before and cut off the output
+ * written after the last commit, its inputs are examined again.
+ */
+static void startCheckpoint(void) {
+    if (checkpointOpen(checkpointFile, resumeScan)) exit_perror("Failed to open checkpoint");
+    if (!resumeScan) return;
+
+    int remaining = 0;
+    for (int i = 0; i < numberOfInfiles; i++) {
+        if (!checkpointDone(infiles[i])) infiles[remaining++] = infiles[i];
+    }
+    numberOfInfiles = remaining;
+
+    struct stat st;
+    uint64_t outputSize = checkpointOutputSize();
+    if (fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode)) return;
+    if ((uint64_t)st.st_size < outputSize) exit_error("The output is shorter than at the checkpoint, append to it with >> to resume");
+    if ((uint64_t)st.st_size > outputSize && ftruncate(STDOUT_FILENO, outputSize)) exit_perror("Failed to cut off the output after the checkpoint");
+}
+
+/**
+ * @brief Write the inputs completed since the last commit to the journal, once their output and the index are on disk
+ *
+ * @param force Commit even if the interval did not pass yet
+ */
+static void commitCheckpoint(bool force) {
+    if (!checkpointFile) return;
+    /* The index is saved as a whole, which is too slow to do every few seconds */
+    if (!force && !checkpointDue(scanIndex ? CHECKPOINT_INDEX_INTERVAL : CHECKPOINT_INTERVAL)) return;
+    if (fflush(stdout)) exit_perror("Failed to write output");
+    struct stat st;
+    uint64_t outputSize = !fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode) ? st.st_size : 0;
+    if (scanIndex && scanIndexSave(scanIndex, indexOutFile)) exit_perror("Failed to write index");
+    if (checkpointCommit(outputSize)) exit_perror("Failed to write checkpoint");
+}
+
+/**
+ * @brief Check whether a file in the index of an earlier run belongs to an input recorded in the journal
+ */
+static bool indexedBefore(const char *path) {
+    if (checkpointDone(path)) return true;
+    /* Members of archives are labeled ARCHIVE!MEMBER */
+    char archive[4096];
+    for (const char *separator = strchr(path, '!'); separator; separator = strchr(separator + 1, '!')) {
+        size_t length = separator - path;
+        if (length >= sizeof(archive)) break;
+        memcpy(archive, path, length);
+        archive[length] = '\0';
+        if (checkpointDone(archive)) return true;
+    }
+    return false;
+}
+#endif
+
+/**
+ * @brief Called for every input once its output was written
+ *
+ * @param input Index of the input in infiles
+ * @param reaped The worker examining the input crashed or timed out, so the input was not counted by the worker
+ */
+static void inputDone(int input, bool reaped) {
+    if (reaped) metricsFailedInput();
+#ifdef USE_CHECKPOINT
+    if (!checkpointFile) return;
+    if (checkpointAdd(infiles[input])) exit_perror("Error while allocating memory for the checkpoint");
+    commitCheckpoint(false);
+#endif
+}
+
+/**
+ * @brief Add the counts flushed by a worker process after an input
+ */
+static void addWorkerCounts(const char *data, size_t length) {
+    if (countByAddLines(countBy, data, length)) exit_error("Failed to add the counts of a worker");
+}
+
+/**
+ * @brief Called about every second while worker processes examine the inputs
+ */
+static void workerTick(void) {
+    metricsTick();
+#ifdef USE_CHECKPOINT
+    commitCheckpoint(false);
+#endif
+}
+
+int main(int argc, char **argv) {
+    opterr = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "query")) return scanIndexQuery(argc - 2, argv + 2, machineCodeToWindowsCEArch);
+    if (argc > 1 && !strcmp(argv[1], "lookup")) return scanIndexLookup(argc - 2, argv + 2);
+
+    // Get options
+    get_opts(argc, argv);
+    selectVersionKeys();
+    selectCapturedDigests();
+
+    if (exportDbFile && exportDbLoad(exportDbFile)) exit_perror("Failed to load export names");
+
+#ifdef USE_PROFILE
+    if (printProfile) profileEnable();
+    if (traceOutFile && profileTraceOpen(traceOutFile)) exit_perror("Failed to open trace file");
+#endif
+
+#ifdef USE_CHECKPOINT
+    if (checkpointFile) startCheckpoint();
+#endif
+#if !defined _WIN32 && !defined UNDER_CE
+    if (sampleSize || sampleFraction) sampleInputs();
+#endif
+
+    /* Directories of --resolve and --cluster are only expanded later, the number of files is unknown */
+    if ((printProgress || metricsFile) && metricsInit(printProgress, metricsFile, resolveImports || clusterImports ? 0 : numberOfInfiles)) {
+        exit_perror("Failed to set up metrics");
+    }
+
+    if (buildExportDbDirectory) return buildExportDb(buildExportDbDirectory) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (resolveImports) {
+        int status = resolveDependencies();
+        metricsFinish();
+        return status ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (clusterImports) {
+        int status = clusterByImports();
+        metricsFinish();
+        return status ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (serveSocket) {
+#ifdef USE_SERVE
+        if (serve(serveSocket, numberOfWorkers ? numberOfWorkers : 1, workerTimeout, maxStreamBuffer, hashAlgorithms || verifyChecksum || sectionEntropy, serveExamine)) exit_perror("Failed to serve on socket");
+        return EXIT_SUCCESS;
+#else
+        exit_error("--serve is not supported on this platform");
+#endif
+    }
+
+    int failures = 0;
+    if (numberOfWorkers) {
+#ifdef USE_WORKER_POOL
+        failures = workerPoolRun(numberOfWorkers, workerTimeout, infiles, numberOfInfiles, scanInput, workerTick, inputDone, countBy ? addWorkerCounts : NULL);
+        if (failures == -1) exit_perror("Failed to start worker processes");
+#else
+        exit_error("--workers is not supported on this platform");
+#endif
+    } else {
+        if (indexOutFile && !(scanIndex = scanIndexCreate())) exit_perror("Error while allocating memory for the index");
+#ifdef USE_CHECKPOINT
+        /* Files the journal does not know about are examined again */
+        if (scanIndex && resumeScan && !access(indexOutFile, F_OK) && scanIndexLoad(scanIndex, indexOutFile, indexedBefore)) {
+            exit_error("Failed to resume the index of --index-out");
+        }
+#endif
+        for (int i = 0; i < numberOfInfiles; i++) {
+            failures += scanInput(infiles[i]);
+            inputDone(i, false);
+        }
+    }
+
+    metricsFinish();
+
+    if (scanIndex) {
+        if (scanIndexSave(scanIndex, indexOutFile)) exit_perror("Failed to write index");
+        scanIndexFree(scanIndex);
+        scanIndex = NULL;
+    }
+    if (countBy) {
+        if (countByPrint(countBy, countByJson ? COUNT_BY_JSON : countByCsv ? COUNT_BY_CSV : COUNT_BY_TABLE)) exit_perror("Error while printing the counts");
+        countByFree(countBy);
+        countBy = NULL;
+    }
+#ifdef USE_CHECKPOINT
+    /* The index is complete at this point, the last commit only needs the output */
+    commitCheckpoint(true);
+#endif
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,448 @@
+/*
+ * Expressions of --where, like WCEArch==SH3 && WCEVersion<3.0 && Imports~aygshell
+ *
+ * An expression is compiled once into a postfix program over a list of tests. While a file is parsed every printed
+ * field is passed to whereField, which only updates the tests on that field. At the end of each part of the file the
+ * program is evaluated with three-valued logic: tests on fields that were not seen yet are unknown, so the rest of the
+ * file is only parsed if the result still depends on them.
+ */
+#include "where.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Longest field name or value */
+#define WHERE_MAX_WORD 256
+
+typedef enum
+{
+    /** Bare field name, true unless the value is empty, 0 or false */
+    WHERE_TRUTHY,
+    WHERE_EQUAL,
+    WHERE_LESS,
+    WHERE_LESS_EQUAL,
+    WHERE_GREATER,
+    WHERE_GREATER_EQUAL,
+    /** Substring, ignoring case */
+    WHERE_CONTAINS
+} WHERE_OPERATOR;
+
+typedef struct
+{
+    char *field;
+    WHERE_OPERATOR operator;
+    /** != and !~ are true if no value of the field matches */
+    bool negate;
+    char *value;
+    double number;
+    bool isNumber;
+    /** The field was printed for the current file */
+    bool seen;
+    /** A value of the field matched */
+    bool matched;
+    /** All values of the field were seen */
+    bool closed;
+} WHERE_TEST;
+
+typedef enum
+{
+    WHERE_OP_TEST,
+    WHERE_OP_NOT,
+    WHERE_OP_AND,
+    WHERE_OP_OR
+} WHERE_OPCODE;
+
+typedef struct
+{
+    WHERE_OPCODE opcode;
+    /** Index into tests for WHERE_OP_TEST */
+    uint32_t test;
+} WHERE_INSTRUCTION;
+
+struct WHERE_EXPR
+{
+    WHERE_TEST *tests;
+    uint32_t numberOfTests;
+    WHERE_INSTRUCTION *program;
+    uint32_t programLength;
+    WHERE_RESULT *stack;
+};
+
+typedef enum
+{
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_NOT,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+    TOKEN_EQUAL,
+    TOKEN_NOT_EQUAL,
+    TOKEN_LESS,
+    TOKEN_LESS_EQUAL,
+    TOKEN_GREATER,
+    TOKEN_GREATER_EQUAL,
+    TOKEN_CONTAINS,
+    TOKEN_NOT_CONTAINS,
+    TOKEN_ERROR
+} TOKEN;
+
+typedef struct
+{
+    const char *next;
+    /** Start of the current token, for error messages */
+    const char *start;
+    TOKEN token;
+    char word[WHERE_MAX_WORD];
+    /** Reason of TOKEN_ERROR */
+    const char *tokenError;
+    WHERE_EXPR *expr;
+    char *error;
+    size_t errorSize;
+} PARSER;
+
+static bool equalsIgnoreCase(const char *a, const char *b) {
+    for (; *a && tolower((unsigned char)*a) == tolower((unsigned char)*b); a++, b++);
+    return *a == *b;
+}
+
+static int compareIgnoreCase(const char *a, const char *b) {
+    for (; *a && tolower((unsigned char)*a) == tolower((unsigned char)*b); a++, b++);
+    return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+}
+
+static bool containsIgnoreCase(const char *string, const char *part) {
+    for (; *string; string++) {
+        size_t i = 0;
+        while (part[i] && tolower((unsigned char)string[i]) == tolower((unsigned char)part[i])) i++;
+        if (!part[i]) return true;
+    }
+    return !*part;
+}
+
+/**
+ * @brief Parse a whole string as number, decimal or hexadecimal with 0x prefix
+ */
+static bool parseNumber(const char *string, double *number) {
+    char *end;
+    if (!*string) return false;
+    *number = strtod(string, &end);
+    return !*end;
+}
+
+static bool isWordCharacter(char c) {
+    return c && !isspace((unsigned char)c) && !strchr("()!=<>~&|\"", c);
+}
+
+/**
+ * @brief Read the next token into parser->token, words into parser->word
+ */
+static void nextToken(PARSER *parser) {
+    const char *p = parser->next;
+    while (isspace((unsigned char)*p)) p++;
+    parser->start = p;
+
+    static const struct
+    {
+        const char *text;
+        TOKEN token;
+    } operators[] = {{"&&", TOKEN_AND}, {"||", TOKEN_OR}, {"==", TOKEN_EQUAL}, {"!=", TOKEN_NOT_EQUAL}, {"!~", TOKEN_NOT_CONTAINS}, {"<=", TOKEN_LESS_EQUAL}, {">=", TOKEN_GREATER_EQUAL}, {"=", TOKEN_EQUAL}, {"<", TOKEN_LESS}, {">", TOKEN_GREATER}, {"~", TOKEN_CONTAINS}, {"!", TOKEN_NOT}, {"(", TOKEN_OPEN}, {")", TOKEN_CLOSE}};
+
+    if (!*p) {
+        parser->token = TOKEN_END;
+        parser->next = p;
+        return;
+    }
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        size_t length = strlen(operators[i].text);
+        if (!strncmp(p, operators[i].text, length)) {
+            parser->token = operators[i].token;
+            parser->next = p + length;
+            return;
+        }
+    }
+
+    size_t length = 0;
+    if (*p == '"') {
+        /* Quoted values may contain spaces and operators */
+        for (p++; *p && *p != '"'; p++) {
+            if (length + 1 >= WHERE_MAX_WORD) break;
+            parser->word[length++] = *p;
+        }
+        if (*p != '"') {
+            parser->token = TOKEN_ERROR;
+            parser->tokenError = length + 1 >= WHERE_MAX_WORD ? "Value is too long" : "Missing closing quote";
+            return;
+        }
+        p++;
+    } else {
+        for (; isWordCharacter(*p); p++) {
+            if (length + 1 >= WHERE_MAX_WORD) {
+                parser->token = TOKEN_ERROR;
+                parser->tokenError = "Value is too long";
+                return;
+            }
+            parser->word[length++] = *p;
+        }
+        if (!length) {
+            parser->token = TOKEN_ERROR;
+            parser->tokenError = "Unexpected character";
+            return;
+        }
+    }
+    parser->word[length] = '\0';
+    parser->token = TOKEN_WORD;
+    parser->next = p;
+}
+
+static bool parseError(PARSER *parser, const char *message) {
+    if (parser->token == TOKEN_ERROR) message = parser->tokenError;
+    if (*parser->start) {
+        snprintf(parser->error, parser->errorSize, "%s at \"%.32s\"", message, parser->start);
+    } else {
+        snprintf(parser->error, parser->errorSize, "%s at the end", message);
+    }
+    return false;
+}
+
+static void emit(PARSER *parser, WHERE_OPCODE opcode, uint32_t test) {
+    WHERE_INSTRUCTION *instruction = &parser->expr->program[parser->expr->programLength++];
+    instruction->opcode = opcode;
+    instruction->test = test;
+}
+
+static bool parseOr(PARSER *parser);
+
+/**
+ * @brief Parse FIELD or FIELD OPERATOR VALUE
+ */
+static bool parseTest(PARSER *parser) {
+    if (parser->token != TOKEN_WORD) return parseError(parser, "Expected a field name");
+
+    WHERE_TEST *test = &parser->expr->tests[parser->expr->numberOfTests];
+    /* Shorter name for the DLL names of the import table */
+    test->field = strdup(equalsIgnoreCase(parser->word, "Imports") ? "DLLImports" : parser->word);
+    test->value = NULL;
+    if (!test->field) return parseError(parser, "Out of memory");
+    parser->expr->numberOfTests++;
+    nextToken(parser);
+
+    switch (parser->token) {
+        case TOKEN_EQUAL: test->operator = WHERE_EQUAL; break;
+        case TOKEN_NOT_EQUAL: test->operator = WHERE_EQUAL; test->negate = true; break;
+        case TOKEN_LESS: test->operator = WHERE_LESS; break;
+        case TOKEN_LESS_EQUAL: test->operator = WHERE_LESS_EQUAL; break;
+        case TOKEN_GREATER: test->operator = WHERE_GREATER; break;
+        case TOKEN_GREATER_EQUAL: test->operator = WHERE_GREATER_EQUAL; break;
+        case TOKEN_CONTAINS: test->operator = WHERE_CONTAINS; break;
+        case TOKEN_NOT_CONTAINS: test->operator = WHERE_CONTAINS; test->negate = true; break;
+        default:
+            test->operator = WHERE_TRUTHY;
+            emit(parser, WHERE_OP_TEST, parser->expr->numberOfTests - 1);
+            return true;
+    }
+
+    nextToken(parser);
+    if (parser->token != TOKEN_WORD) return parseError(parser, "Expected a value");
+    if (!(test->value = strdup(parser->word))) return parseError(parser, "Out of memory");
+    test->isNumber = parseNumber(test->value, &test->number);
+    emit(parser, WHERE_OP_TEST, parser->expr->numberOfTests - 1);
+    nextToken(parser);
+    return true;
+}
+
+static bool parseUnary(PARSER *parser) {
+    if (parser->token == TOKEN_NOT) {
+        nextToken(parser);
+        if (!parseUnary(parser)) return false;
+        emit(parser, WHERE_OP_NOT, 0);
+        return true;
+    }
+    if (parser->token == TOKEN_OPEN) {
+        nextToken(parser);
+        if (!parseOr(parser)) return false;
+        if (parser->token != TOKEN_CLOSE) return parseError(parser, "Expected )");
+        nextToken(parser);
+        return true;
+    }
+    return parseTest(parser);
+}
+
+static bool parseAnd(PARSER *parser) {
+    if (!parseUnary(parser)) return false;
+    while (parser->token == TOKEN_AND) {
+        nextToken(parser);
+        if (!parseUnary(parser)) return false;
+        emit(parser, WHERE_OP_AND, 0);
+    }
+    return true;
+}
+
+static bool parseOr(PARSER *parser) {
+    if (!parseAnd(parser)) return false;
+    while (parser->token == TOKEN_OR) {
+        nextToken(parser);
+        if (!parseAnd(parser)) return false;
+        emit(parser, WHERE_OP_OR, 0);
+    }
+    return true;
+}
+
+/**
+ * @brief Compile an expression of --where
+ *
+ * @param text Expression
+ * @param error Set to the reason if the expression is invalid
+ * @param errorSize Size of error
+ * @return WHERE_EXPR* Compiled expression, or NULL if it is invalid
+ */
+WHERE_EXPR *whereCompile(const char *text, char *error, size_t errorSize) {
+    /* Every test, operator and parenthesis takes at least one character */
+    size_t maxLength = strlen(text) + 1;
+    WHERE_EXPR *expr = calloc(1, sizeof(WHERE_EXPR));
+    if (!expr || !(expr->tests = calloc(maxLength, sizeof(WHERE_TEST))) || !(expr->program = calloc(maxLength, sizeof(WHERE_INSTRUCTION))) ||
+        !(expr->stack = calloc(maxLength, sizeof(WHERE_RESULT)))) {
+        snprintf(error, errorSize, "Out of memory");
+        whereFree(expr);
+        return NULL;
+    }
+
+    PARSER parser = {text, text, TOKEN_END, {0}, NULL, expr, error, errorSize};
+    nextToken(&parser);
+    if (!parseOr(&parser) || (parser.token != TOKEN_END && !parseError(&parser, "Expected && or ||"))) {
+        whereFree(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+/**
+ * @brief Forget the fields of the previous file
+ */
+void whereReset(WHERE_EXPR *expr) {
+    for (uint32_t i = 0; i < expr->numberOfTests; i++) {
+        expr->tests[i].seen = false;
+        expr->tests[i].matched = false;
+        expr->tests[i].closed = false;
+    }
+}
+
+static bool testValue(const WHERE_TEST *test, const char *value) {
+    if (test->operator == WHERE_TRUTHY) return *value && strcmp(value, "0") && strcmp(value, "false");
+    if (test->operator == WHERE_CONTAINS) return containsIgnoreCase(value, test->value);
+
+    double number;
+    int cmp;
+    if (test->isNumber && parseNumber(value, &number)) {
+        cmp = (number > test->number) - (number < test->number);
+    } else {
+        cmp = compareIgnoreCase(value, test->value);
+    }
+    switch (test->operator) {
+        case WHERE_EQUAL: return cmp == 0;
+        case WHERE_LESS: return cmp < 0;
+        case WHERE_LESS_EQUAL: return cmp <= 0;
+        case WHERE_GREATER: return cmp > 0;
+        case WHERE_GREATER_EQUAL: return cmp >= 0;
+        default: return false;
+    }
+}
+
+/**
+ * @brief Pass a printed field of the current file. Fields with several values, like the DLL names of DLLImports, are
+ * passed once per value.
+ *
+ * @param expr Expression
+ * @param name Field name
+ * @param value Value as printed
+ */
+void whereField(WHERE_EXPR *expr, const char *name, const char *value) {
+    for (uint32_t i = 0; i < expr->numberOfTests; i++) {
+        WHERE_TEST *test = &expr->tests[i];
+        if (test->matched || test->closed || !equalsIgnoreCase(test->field, name)) continue;
+        test->seen = true;
+        if (testValue(test, value)) test->matched = true;
+    }
+}
+
+/**
+ * @brief Evaluate the expression at the end of a part of the file. Each field is printed in a single part, so fields
+ * seen so far have all their values.
+ *
+ * @param expr Expression
+ * @param last True after the last part, fields that were not seen are missing
+ * @return WHERE_RESULT WHERE_UNKNOWN if the result depends on fields of later parts
+ */
+WHERE_RESULT whereEndStage(WHERE_EXPR *expr, bool last) {
+    for (uint32_t i = 0; i < expr->numberOfTests; i++) {
+        if (last || expr->tests[i].seen) expr->tests[i].closed = true;
+    }
+
+    WHERE_RESULT *stack = expr->stack;
+    uint32_t depth = 0;
+    for (uint32_t i = 0; i < expr->programLength; i++) {
+        const WHERE_INSTRUCTION *instruction = &expr->program[i];
+        switch (instruction->opcode) {
+            case WHERE_OP_TEST: {
+                const WHERE_TEST *test = &expr->tests[instruction->test];
+                if (test->matched) {
+                    stack[depth++] = test->negate ? WHERE_FALSE : WHERE_TRUE;
+                } else if (test->closed) {
+                    stack[depth++] = test->negate ? WHERE_TRUE : WHERE_FALSE;
+                } else {
+                    stack[depth++] = WHERE_UNKNOWN;
+                }
+                break;
+            }
+            case WHERE_OP_NOT:
+                if (stack[depth - 1] != WHERE_UNKNOWN) stack[depth - 1] = stack[depth - 1] == WHERE_TRUE ? WHERE_FALSE : WHERE_TRUE;
+                break;
+            case WHERE_OP_AND:
+                depth--;
+                if (stack[depth - 1] == WHERE_FALSE || stack[depth] == WHERE_FALSE) {
+                    stack[depth - 1] = WHERE_FALSE;
+                } else if (stack[depth - 1] != WHERE_TRUE || stack[depth] != WHERE_TRUE) {
+                    stack[depth - 1] = WHERE_UNKNOWN;
+                }
+                break;
+            case WHERE_OP_OR:
+                depth--;
+                if (stack[depth - 1] == WHERE_TRUE || stack[depth] == WHERE_TRUE) {
+                    stack[depth - 1] = WHERE_TRUE;
+                } else if (stack[depth - 1] != WHERE_FALSE || stack[depth] != WHERE_FALSE) {
+                    stack[depth - 1] = WHERE_UNKNOWN;
+                }
+                break;
+        }
+    }
+    return stack[0];
+}
+
+/**
+ * @brief Get the name of a field the expression tests, a field may be returned more than once
+ *
+ * @param expr Expression
+ * @param index Index of the test
+ * @return const char* Field name, NULL if index is past the last test
+ */
+const char *whereFieldName(const WHERE_EXPR *expr, uint32_t index) {
+    return index < expr->numberOfTests ? expr->tests[index].field : NULL;
+}
+
+void whereFree(WHERE_EXPR *expr) {
+    if (!expr) return;
+    if (expr->tests) {
+        for (uint32_t i = 0; i < expr->numberOfTests; i++) {
+            free(expr->tests[i].field);
+            free(expr->tests[i].value);
+        }
+    }
+    free(expr->tests);
+    free(expr->program);
+    free(expr->stack);
+    free(expr);
+}
@@ -0,0 +1,26 @@
+#ifndef WHERE_H
+#define WHERE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Compiled expression of --where */
+typedef struct WHERE_EXPR WHERE_EXPR;
+
+/** Value of an expression while a file is only partly parsed */
+typedef enum
+{
+    WHERE_UNKNOWN,
+    WHERE_FALSE,
+    WHERE_TRUE
+} WHERE_RESULT;
+
+WHERE_EXPR *whereCompile(const char *text, char *error, size_t errorSize);
+void whereReset(WHERE_EXPR *expr);
+void whereField(WHERE_EXPR *expr, const char *name, const char *value);
+WHERE_RESULT whereEndStage(WHERE_EXPR *expr, bool last);
+const char *whereFieldName(const WHERE_EXPR *expr, uint32_t index);
+void whereFree(WHERE_EXPR *expr);
+
+#endif
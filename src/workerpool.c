@@ -0,0 +1,567 @@
+/*
+ * Pool of pre-forked worker processes, so a file that crashes the parser or makes it hang only costs that file.
+ *
+ * Every worker is connected to the parent by a socket pair. The parent sends the next input, optionally with an open
+ * descriptor, the worker examines it with its stdout redirected to the socket, and ends the output with a NUL byte
+ * followed by the number of failures. Workers that crash, exit or exceed the timeout are reported with the file they were examining and
+ * replaced. Output is printed in input order; the parent only runs ahead of the oldest unfinished input by a bounded
+ * window, so memory use does not depend on the number of inputs. A pool can be kept between runs, so a server does
+ * not pay for forking the workers with every batch of requests.
+ */
+#include "workerpool.h"
+
+#include <stddef.h>
+
+#include "profile.h"
+
+#ifdef USE_WORKER_POOL
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Inputs dispatched ahead of the oldest unfinished one, per worker */
+#define WORKER_WINDOW_PER_WORKER 16
+#define WORKER_LABEL_SIZE 1024
+#define WORKER_READ_SIZE 65536
+/** Bytes following the NUL that ends the output of an input */
+#define WORKER_TRAILER_SIZE 4
+
+typedef struct
+{
+    pid_t pid;
+    /** Parent side of the socket pair, -1 if the worker is not running */
+    int socket;
+    /** Index of the input being examined, -1 if idle */
+    int input;
+    struct timespec started;
+    /** Label of the file being examined, shared with the worker */
+    char *label;
+} WORKER;
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    /** Bytes already searched for the end of the output */
+    size_t scanned;
+    bool done;
+    int failures;
+    /** The worker crashed or timed out while examining the input */
+    bool reaped;
+} WORKER_RESULT;
+
+struct WORKER_POOL
+{
+    int numberOfWorkers;
+    unsigned timeout;
+    WORKER_CALLBACK callback;
+    WORKER_INIT init;
+    WORKER *workers;
+    /** Results of the inputs in the window, by input index modulo window */
+    WORKER_RESULT *results;
+    int window;
+    struct pollfd *fds;
+    int *owners;
+    /** Label slots of all workers, shared with them */
+    char *labels;
+};
+
+/** Label slot of this process if it is a worker */
+static char *workerLabel = NULL;
+/** Descriptor passed with the input being examined, -1 if there is none */
+static int workerDescriptor = -1;
+
+/**
+ * @brief Publish the label of the file being examined, so it can be reported if the worker crashes
+ *
+ * @param label Name of the file, NULL when done
+ */
+void workerSetLabel(const char *label) {
+    if (!workerLabel) return;
+    /* Output of the previous archive member must reach the parent before this one can crash */
+    fflush(stdout);
+    if (label) {
+        strncpy(workerLabel, label, WORKER_LABEL_SIZE - 1);
+        workerLabel[WORKER_LABEL_SIZE - 1] = '\0';
+    } else {
+        workerLabel[0] = '\0';
+    }
+}
+
+/**
+ * @brief Descriptor the parent passed together with the input being examined
+ *
+ * @return int The descriptor, which the worker closes after the input, or -1 if none was passed
+ */
+int workerInputDescriptor(void) {
+    return workerDescriptor;
+}
+
+static int writeAll(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size) {
+        ssize_t written = write(fd, p, size);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int readAll(int fd, void *data, size_t size) {
+    uint8_t *p = data;
+    while (size) {
+        ssize_t bytesRead = read(fd, p, size);
+        if (bytesRead == -1 && errno == EINTR) continue;
+        if (bytesRead <= 0) return -1;
+        p += bytesRead;
+        size -= bytesRead;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send an input to a worker as its length followed by the text, with the descriptor attached if there is one
+ *
+ * @return int 0 on success, -1 if the worker is gone
+ */
+static int sendInput(int socket, const char *input, int fd) {
+    uint32_t length = strlen(input);
+    struct iovec iov[2] = {{&length, sizeof(length)}, {(char *)input, length}};
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    while ((sent = sendmsg(socket, &message, 0)) == -1 && errno == EINTR) {
+    }
+    if (sent == -1) return -1;
+    /* The descriptor went with the first byte, the rest of a partial send is written as it is */
+    size_t total = sizeof(length) + length;
+    if ((size_t)sent == total) return 0;
+    if ((size_t)sent < sizeof(length)) {
+        if (writeAll(socket, (uint8_t *)&length + sent, sizeof(length) - sent)) return -1;
+        sent = sizeof(length);
+    }
+    return writeAll(socket, input + (sent - sizeof(length)), total - sent);
+}
+
+/**
+ * @brief Receive the next input and its descriptor in a worker
+ *
+ * @return char* The input, valid until the next call, or NULL when the parent closed the socket
+ */
+static char *receiveInput(int socket) {
+    static char *input = NULL;
+    static size_t capacity = 0;
+
+    uint32_t length;
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {&length, sizeof(length)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    ssize_t received;
+    while ((received = recvmsg(socket, &message, 0)) == -1 && errno == EINTR) {
+    }
+    if (received <= 0) return NULL;
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        memcpy(&workerDescriptor, CMSG_DATA(header), sizeof(int));
+    }
+    if ((size_t)received < sizeof(length) && readAll(socket, (uint8_t *)&length + received, sizeof(length) - received)) return NULL;
+
+    if (length + 1 > capacity) {
+        char *grown = realloc(input, length + 1);
+        if (!grown) return NULL;
+        input = grown;
+        capacity = length + 1;
+    }
+    if (readAll(socket, input, length)) return NULL;
+    input[length] = '\0';
+    return input;
+}
+
+static void workerMain(int fd, char *label, WORKER_CALLBACK callback) {
+    workerLabel = label;
+    if (dup2(fd, STDOUT_FILENO) == -1) _exit(EXIT_FAILURE);
+    setvbuf(stdout, NULL, _IOFBF, WORKER_READ_SIZE);
+
+    char *input;
+    while ((input = receiveInput(fd))) {
+        uint32_t failures = callback(input);
+        workerSetLabel(NULL);
+        fflush(stdout);
+        if (workerDescriptor != -1) {
+            close(workerDescriptor);
+            workerDescriptor = -1;
+        }
+
+        uint8_t trailer[1 + WORKER_TRAILER_SIZE];
+        trailer[0] = '\0';
+        memcpy(trailer + 1, &failures, WORKER_TRAILER_SIZE);
+        if (writeAll(fd, trailer, sizeof(trailer))) break;
+    }
+    /* _exit skips the atexit handlers */
+    PROFILE_TRACE_FLUSH();
+    _exit(EXIT_SUCCESS);
+}
+
+static int spawnWorker(WORKER_POOL *pool, WORKER *worker) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) return -1;
+
+    /* Unwritten output would be printed by both processes */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        for (int i = 0; i < pool->numberOfWorkers; i++) {
+            if (pool->workers[i].socket != -1) close(pool->workers[i].socket);
+        }
+        if (pool->init) pool->init();
+        workerMain(fds[1], worker->label, pool->callback);
+    }
+
+    close(fds[1]);
+    worker->pid = pid;
+    worker->socket = fds[0];
+    worker->input = -1;
+    worker->label[0] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Stop a worker and wait for it, killing it if force is set
+ *
+ * @return int Exit status of the worker as returned by waitpid
+ */
+static int stopWorker(WORKER *worker, bool force) {
+    if (force) kill(worker->pid, SIGKILL);
+    close(worker->socket);
+    worker->socket = -1;
+
+    int status = 0;
+    while (waitpid(worker->pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    return status;
+}
+
+static long elapsedMilliseconds(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * @brief Stop a worker that crashed or timed out, report the file it was examining and discard its partial output
+ */
+static void reapWorker(WORKER *worker, WORKER_RESULT *result, const char *input, const char *reason) {
+    int status = stopWorker(worker, reason != NULL);
+
+    const char *label = worker->label[0] ? worker->label : input;
+    if (reason) {
+        fprintf(stderr, "Error: %s: %s\n", label, reason);
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Error: %s: worker crashed with signal %d\n", label, WTERMSIG(status));
+    } else {
+        fprintf(stderr, "Error: %s: worker exited with status %d\n", label, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+
+    /* Keep the complete lines, they belong to files examined before the crash */
+    while (result->length && result->data[result->length - 1] != '\n') result->length--;
+    result->done = true;
+    result->failures++;
+    result->reaped = true;
+    worker->input = -1;
+}
+
+/**
+ * @brief Append data from a worker to the result of its input and check whether the output is complete
+ *
+ * @return int 1 if the output is complete, 0 if more is expected, -1 if the worker hung up or failed
+ */
+static int receiveFromWorker(WORKER *worker, WORKER_RESULT *result) {
+    if (result->capacity - result->length < WORKER_READ_SIZE) {
+        size_t capacity = result->capacity ? result->capacity * 2 : WORKER_READ_SIZE * 2;
+        char *data = realloc(result->data, capacity);
+        if (!data) return -1;
+        result->data = data;
+        result->capacity = capacity;
+    }
+
+    ssize_t received = read(worker->socket, result->data + result->length, WORKER_READ_SIZE);
+    if (received == -1 && errno == EINTR) return 0;
+    if (received <= 0) return -1;
+    result->length += received;
+
+    char *end = memchr(result->data + result->scanned, '\0', result->length - result->scanned);
+    if (!end) {
+        result->scanned = result->length;
+        return 0;
+    }
+    size_t outputLength = end - result->data;
+    if (result->length < outputLength + 1 + WORKER_TRAILER_SIZE) return 0;
+
+    uint32_t failures;
+    memcpy(&failures, end + 1, WORKER_TRAILER_SIZE);
+    result->failures = failures;
+    result->length = outputLength;
+    result->done = true;
+    return 1;
+}
+
+/**
+ * @brief Fork a pool of worker processes that stays until workerPoolStop. Workers that crash or time out are
+ * replaced when they are needed again.
+ *
+ * @param numberOfWorkers Number of worker processes
+ * @param timeout Seconds a worker may spend on one input, 0 for no limit
+ * @param callback Called in a worker for every input
+ * @param init Called in every new worker process before its first input, or NULL
+ * @return WORKER_POOL* The pool, or NULL if the workers could not be started
+ */
+WORKER_POOL *workerPoolStart(int numberOfWorkers, unsigned timeout, WORKER_CALLBACK callback, WORKER_INIT init) {
+    WORKER_POOL *pool = calloc(1, sizeof(WORKER_POOL));
+    if (!pool) return NULL;
+    pool->numberOfWorkers = numberOfWorkers;
+    pool->timeout = timeout;
+    pool->callback = callback;
+    pool->init = init;
+    pool->window = numberOfWorkers * WORKER_WINDOW_PER_WORKER;
+    pool->workers = calloc(numberOfWorkers, sizeof(WORKER));
+    pool->results = calloc(pool->window, sizeof(WORKER_RESULT));
+    pool->fds = calloc(numberOfWorkers, sizeof(struct pollfd));
+    pool->owners = calloc(numberOfWorkers, sizeof(int));
+    pool->labels = mmap(NULL, (size_t)numberOfWorkers * WORKER_LABEL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!pool->workers || !pool->results || !pool->fds || !pool->owners || pool->labels == MAP_FAILED) {
+        free(pool->workers);
+        free(pool->results);
+        free(pool->fds);
+        free(pool->owners);
+        if (pool->labels != MAP_FAILED) munmap(pool->labels, (size_t)numberOfWorkers * WORKER_LABEL_SIZE);
+        free(pool);
+        return NULL;
+    }
+
+    /* A worker that died while we send it work is handled like a crash */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < numberOfWorkers; i++) {
+        pool->workers[i].socket = -1;
+        pool->workers[i].label = pool->labels + (size_t)i * WORKER_LABEL_SIZE;
+    }
+    for (int i = 0; i < numberOfWorkers; i++) {
+        if (spawnWorker(pool, &pool->workers[i])) {
+            int savedErrno = errno;
+            workerPoolStop(pool);
+            errno = savedErrno;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * @brief Stop the workers of a pool and free it
+ */
+void workerPoolStop(WORKER_POOL *pool) {
+    /* Workers exit when their socket is closed */
+    for (int i = 0; i < pool->numberOfWorkers; i++) {
+        if (pool->workers[i].socket != -1) stopWorker(&pool->workers[i], false);
+    }
+    for (int i = 0; i < pool->window; i++) free(pool->results[i].data);
+    munmap(pool->labels, (size_t)pool->numberOfWorkers * WORKER_LABEL_SIZE);
+    free(pool->workers);
+    free(pool->results);
+    free(pool->fds);
+    free(pool->owners);
+    free(pool);
+}
+
+/**
+ * @brief Hand an input to an idle worker, replacing the worker if it is not running. A worker that died while it was
+ * idle is replaced once without counting it as a crash.
+ *
+ * @return int 0 if the input was sent or reported as failed, -1 if no worker could be started
+ */
+static int dispatchInput(WORKER_POOL *pool, WORKER *worker, WORKER_RESULT *result, int index, const char *input, int fd) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (worker->socket == -1 && spawnWorker(pool, worker)) return -1;
+        worker->input = index;
+        clock_gettime(CLOCK_MONOTONIC, &worker->started);
+        if (!sendInput(worker->socket, input, fd)) return 0;
+        if (!attempt) stopWorker(worker, false);
+    }
+    reapWorker(worker, result, input, NULL);
+    return 0;
+}
+
+/**
+ * @brief Examine inputs in the workers of a pool and wait until all of them are done
+ *
+ * @param pool Pool of workerPoolStart
+ * @param inputs Inputs to examine, passed to the callback in a worker
+ * @param fds Descriptor passed to the worker together with every input, or NULL
+ * @param numberOfInputs Number of inputs
+ * @param tick Called in the parent about every second, or NULL
+ * @param done Called in the parent with the index of every input after its output was printed, and whether its
+ * worker crashed or timed out, or NULL
+ * @param output Called in the parent with the output of every input in input order, or NULL to write it to stdout
+ * @return int Number of failures, or -1 if a worker could not be started
+ */
+int workerPoolExamine(WORKER_POOL *pool, char **inputs, const int *fds, int numberOfInputs, WORKER_TICK tick, WORKER_DONE done, WORKER_OUTPUT output) {
+    int status = 0;
+    int failures = 0;
+    int next = 0, printed = 0;
+    while (status == 0 && printed < numberOfInputs) {
+        /* Hand out inputs to idle workers */
+        for (int i = 0; i < pool->numberOfWorkers; i++) {
+            WORKER *worker = &pool->workers[i];
+            if (worker->input != -1 || next >= numberOfInputs || next >= printed + pool->window) continue;
+            WORKER_RESULT *result = &pool->results[next % pool->window];
+            result->length = 0;
+            result->scanned = 0;
+            result->done = false;
+            result->failures = 0;
+            result->reaped = false;
+
+            if (dispatchInput(pool, worker, result, next, inputs[next], fds ? fds[next] : -1)) {
+                status = -1;
+                break;
+            }
+            next++;
+        }
+
+        int n = 0;
+        int wait = -1;
+        for (int i = 0; i < pool->numberOfWorkers; i++) {
+            if (pool->workers[i].input == -1) continue;
+            pool->fds[n].fd = pool->workers[i].socket;
+            pool->fds[n].events = POLLIN;
+            pool->owners[n++] = i;
+            if (pool->timeout) {
+                long left = (long)pool->timeout * 1000 - elapsedMilliseconds(&pool->workers[i].started);
+                if (left < 0) left = 0;
+                if (wait == -1 || left < wait) wait = left;
+            }
+        }
+
+        if (tick && (wait == -1 || wait > 1000)) wait = 1000;
+        if (n && poll(pool->fds, n, wait) == -1 && errno != EINTR) {
+            status = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            WORKER *worker = &pool->workers[pool->owners[i]];
+            int input = worker->input;
+            WORKER_RESULT *result = &pool->results[input % pool->window];
+            if (pool->fds[i].revents) {
+                int received = receiveFromWorker(worker, result);
+                if (received == 1) {
+                    worker->input = -1;
+                } else if (received == -1) {
+                    reapWorker(worker, result, inputs[input], NULL);
+                }
+            }
+            if (worker->input != -1 && pool->timeout && elapsedMilliseconds(&worker->started) >= (long)pool->timeout * 1000) {
+                reapWorker(worker, result, inputs[input], "timed out");
+            }
+        }
+
+        /* Print finished results in input order */
+        while (printed < next && pool->results[printed % pool->window].done) {
+            WORKER_RESULT *result = &pool->results[printed % pool->window];
+            if (output) {
+                output(result->data, result->length);
+            } else {
+                fwrite(result->data, 1, result->length, stdout);
+            }
+            failures += result->failures;
+            if (done) done(printed, result->reaped);
+            printed++;
+        }
+        fflush(stdout);
+        if (tick) tick();
+    }
+    return status ? -1 : failures;
+}
+
+/**
+ * @brief Examine inputs in a pool of worker processes that is started for them and stopped afterwards
+ *
+ * @param numberOfWorkers Number of worker processes
+ * @param timeout Seconds a worker may spend on one input, 0 for no limit
+ * @param inputs Inputs to examine, passed to callback in a worker
+ * @param numberOfInputs Number of inputs
+ * @param callback Called in a worker for every input
+ * @param tick Called in the parent about every second, or NULL
+ * @param done Called in the parent with the index of every input after its output was printed, and whether its
+ * worker crashed or timed out, or NULL
+ * @param output Called in the parent with the output of every input in input order, or NULL to write it to stdout
+ * @return int Number of failures, or -1 if the workers could not be started
+ */
+int workerPoolRun(int numberOfWorkers, unsigned timeout, char **inputs, int numberOfInputs, WORKER_CALLBACK callback, WORKER_TICK tick, WORKER_DONE done, WORKER_OUTPUT output) {
+    WORKER_POOL *pool = workerPoolStart(numberOfWorkers, timeout, callback, NULL);
+    if (!pool) return -1;
+    int failures = workerPoolExamine(pool, inputs, NULL, numberOfInputs, tick, done, output);
+    workerPoolStop(pool);
+    return failures;
+}
+
+#else
+
+void workerSetLabel(const char *label) {
+}
+
+int workerInputDescriptor(void) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if !defined _WIN32 && !defined UNDER_CE
+#define USE_WORKER_POOL
+#endif
+
+/** Examine one input inside a worker process, printing to stdout. Returns the number of failures. */
+typedef int (*WORKER_CALLBACK)(const char *input);
+/** Called in the parent about every second while the pool runs */
+typedef void (*WORKER_TICK)(void);
+/** Called in the parent for every input after its output was printed, reaped if its worker crashed or timed out */
+typedef void (*WORKER_DONE)(int input, bool reaped);
+/** Called in the parent with the output of every input instead of writing it to stdout */
+typedef void (*WORKER_OUTPUT)(const char *data, size_t length);
+/** Called in every new worker process, to close what the worker must not hold open */
+typedef void (*WORKER_INIT)(void);
+
+#ifdef USE_WORKER_POOL
+typedef struct WORKER_POOL WORKER_POOL;
+
+int workerPoolRun(int numberOfWorkers, unsigned timeout, char **inputs, int numberOfInputs, WORKER_CALLBACK callback, WORKER_TICK tick, WORKER_DONE done, WORKER_OUTPUT output);
+WORKER_POOL *workerPoolStart(int numberOfWorkers, unsigned timeout, WORKER_CALLBACK callback, WORKER_INIT init);
+int workerPoolExamine(WORKER_POOL *pool, char **inputs, const int *fds, int numberOfInputs, WORKER_TICK tick, WORKER_DONE done, WORKER_OUTPUT output);
+void workerPoolStop(WORKER_POOL *pool);
+#endif
+void workerSetLabel(const char *label);
+int workerInputDescriptor(void);
+
+#endif
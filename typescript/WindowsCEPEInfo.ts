@@ -32,6 +32,8 @@ export const MachineNames = [
 export type MachineName = typeof MachineNames[number];
 
 export type WinCEPEInfo = {
+  /** Name of the examined file, only present when more than one file is examined. Archive members are named ARCHIVE!MEMBER */
+  File?: string,
   /** True if subsystem is 9 (Windows CE GUI) */
   WCEApp: boolean,
   /** Windows CE arch */
@@ -139,6 +141,10 @@ export type WinCEPEInfo = {
   SizeOfHeaders: number,
   /** The image file checksum. The algorithm for computing the checksum is incorporated into IMAGHELP.DLL. The following are checked for validation at load time: all drivers, any DLL loaded at boot time, and any DLL that is loaded into a critical Windows process */
   CheckSum: number,
+  /** Image checksum computed from the file, only present with --verify-checksum */
+  ComputedCheckSum?: number,
+  /** True if CheckSum matches ComputedCheckSum, only present with --verify-checksum */
+  CheckSumValid?: boolean,
   /** The subsystem that is required to run this image. For more information, see Windows Subsystem */
   Subsystem: number,
   /** For more information, see DLL Characteristics later in this specification */
@@ -155,8 +161,23 @@ export type WinCEPEInfo = {
   LoaderFlags: number,
   /** The number of data-directory entries in the remainder of the optional header. Each describes a location and size */
   NumberOfRvaAndSizes: number,
+  /** Digests of the whole file, only present with --hash */
+  Hashes?: Hashes,
+  /** Digests of the raw data of every section by section name, only present with --hash-sections */
+  SectionHashes?: { [sectionName: string]: Hashes },
+  SectionEntropy?: { [sectionName: string]: number },
   /** DLL Imports */
   DLLImports: DLLImport[],
+  /** MD5 of the imports as comma separated lower case dll.function entries, like the imphash of pefile. Only present if the file has imports */
+  ImpHash?: string,
+  /** Lowest version loaded with --api-version that exports all imports of DLLs in any loaded version */
+  WCEMinVersionByImports?: string,
+  /** DLLs loaded on the first call of one of their functions, only present if the file has a delay import directory */
+  DelayImports?: DLLImport[],
+  /** DLLs the imports were bound to, only present if the file has a bound import directory */
+  BoundImports?: BoundImport[],
+  /** DLL Exports, only present if the file has an export directory */
+  Exports?: DLLExports,
   /** Version info from the versionInfo resource */
   versionInfo?: VersionInfo;
 };
@@ -211,4 +232,38 @@ export type DllOrdinal = number;
 export type DLLImport = {
   dllName: string,
   functions: (string | DllOrdinal)[];
+};
+
+/** Lower case hex digests of the algorithms selected with --hash */
+export type Hashes = {
+  MD5?: string,
+  SHA1?: string,
+  SHA256?: string,
+};
+
+export type BoundImport = {
+  dllName: string,
+  /** Date/time stamp of the DLL the imports were bound to */
+  timestamp: number,
+  /** DLLs the bound DLL forwards functions to */
+  forwarders: { dllName: string, timestamp: number }[];
+};
+
+export type DLLExports = {
+  /** Name of the DLL from the export directory */
+  dllName: string,
+  /** Ordinal of the first entry of the export address table */
+  ordinalBase: number,
+  /** Exported functions, unused ordinals are left out */
+  functions: DLLExport[];
+};
+
+export type DLLExport = {
+  ordinal: DllOrdinal,
+  /** Name, not present if the function is only exported by ordinal */
+  name?: string,
+  /** Relative virtual address of the function as hex string, not present for forwarded functions */
+  address?: string,
+  /** Function the export is forwarded to, as DLL.FUNCTION or DLL.#ORDINAL */
+  forwarder?: string,
 };
\ No newline at end of file